@@ -1,13 +1,37 @@
-#include "hashdict.h"
+#include "hashdict_private.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 static struct hd_entry*
-hd_lookup_entry(struct hd_hashdict* dict, const char* key);
+hd_lookup_entry(struct hd_hashdict* dict, const char* key,
+                unsigned int* probes);
+
+/* Probe count of lookups served by a storage backend, which aren't
+ * sampled*/
+#define HD_PROBES_UNKNOWN UINT_MAX
+
+struct hd_entry hd_moved_marker;
+char hd_counter_marker[] = "";
+
+#ifdef HD_HAVE_SDT
+HD_TRACE_SEMAPHORE(lookup__entry);
+HD_TRACE_SEMAPHORE(lookup__return);
+HD_TRACE_SEMAPHORE(insert__entry);
+HD_TRACE_SEMAPHORE(insert__return);
+HD_TRACE_SEMAPHORE(update__entry);
+HD_TRACE_SEMAPHORE(update__return);
+HD_TRACE_SEMAPHORE(remove__entry);
+HD_TRACE_SEMAPHORE(remove__return);
+HD_TRACE_SEMAPHORE(resize__entry);
+HD_TRACE_SEMAPHORE(resize__return);
+HD_TRACE_SEMAPHORE(free__entry);
+HD_TRACE_SEMAPHORE(free__return);
+#endif /* HD_HAVE_SDT */
 
 /**
  * @brief Hash function for strings
@@ -16,9 +40,10 @@ hd_lookup_entry(struct hd_hashdict* dict, const char* key);
  * good distribution and speed for string keys.
  *
  * @param key The string to hash
- * @return unsigned int The hash value (modulo HASHSIZE)
+ * @return unsigned long The full hash value, masked to a bucket index by the
+ * caller
  */
-static unsigned int
+unsigned long
 hd_hash(const char* key) {
 	unsigned long hash = 5381; // Magic starting number
 	int c;
@@ -27,48 +52,267 @@ hd_hash(const char* key) {
 		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
 	}
 
-	return hash % HASHSIZE;
+	return hash;
+}
+
+unsigned int
+hd_table_size(size_t n) {
+	unsigned int size = HASHSIZE;
+
+	while ((size < n) && (size <= UINT_MAX / 2)) {
+		size *= 2;
+	}
+	return size;
+}
+
+/**
+ * @brief Seeded 64 bit hash for strings of known length
+ *
+ * MurmurHash64A by Austin Appleby (public domain). Used where djb2 isn't
+ * good enough, e.g. to build perfect hash functions which need independent
+ * hashes for different seeds.
+ */
+uint64_t
+hd_hash64(const char* key, size_t len, uint64_t seed) {
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	const unsigned char* data = (const unsigned char*)key;
+	const unsigned char* end = data + (len & ~(size_t)7);
+	uint64_t h = seed ^ (len * m);
+
+	while (data != end) {
+		uint64_t k;
+		memcpy(&k, data, sizeof(k));
+		data += sizeof(k);
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7) {
+		case 7:
+			h ^= (uint64_t)data[6] << 48;
+			/* fall through */
+		case 6:
+			h ^= (uint64_t)data[5] << 40;
+			/* fall through */
+		case 5:
+			h ^= (uint64_t)data[4] << 32;
+			/* fall through */
+		case 4:
+			h ^= (uint64_t)data[3] << 24;
+			/* fall through */
+		case 3:
+			h ^= (uint64_t)data[2] << 16;
+			/* fall through */
+		case 2:
+			h ^= (uint64_t)data[1] << 8;
+			/* fall through */
+		case 1:
+			h ^= (uint64_t)data[0];
+			h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
+const char*
+hd_hash_name(enum hd_hash_func func) {
+	switch (func) {
+		case HD_HASH_DJB2:
+			return "djb2";
+		case HD_HASH_MURMUR64:
+			return "murmur64a";
+		default:
+			return NULL;
+	}
+}
+
+uint64_t
+hd_hash_key(enum hd_hash_func func, const char* key, size_t len,
+            uint64_t seed) {
+	if (key == NULL) {
+		return 0;
+	}
+
+	switch (func) {
+		case HD_HASH_DJB2:
+			return hd_hash(key);
+		case HD_HASH_MURMUR64:
+			return hd_hash64(key, len, seed);
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Returns the bucket a hash belongs to
+ *
+ * Follows the forwarding marker into next_entries if the bucket in the old
+ * array was already migrated.
+ *
+ * @return struct hd_entry** The bucket, or NULL if no bucket array exists yet
+ */
+static struct hd_entry**
+hd_bucket(struct hd_hashdict* dict, unsigned long hash) {
+	if (dict->entries == NULL) {
+		return NULL;
+	}
+
+	struct hd_entry** bucket = &(dict->entries[hash & (dict->size - 1)]);
+	if (*bucket == HD_MOVED) {
+		bucket = &(dict->next_entries[hash & (dict->next_size - 1)]);
+	}
+	return bucket;
+}
+
+/**
+ * @brief Index of the bucket of key within its array, for the probes
+ */
+static inline unsigned int
+hd_trace_bucket(struct hd_hashdict* dict, const char* key) {
+	if ((dict == NULL) || (key == NULL) || (dict->backend != NULL)) {
+		return 0;
+	}
+
+	struct hd_entry** bucket = hd_bucket(dict, hd_hash(key));
+	if (bucket == NULL) {
+		return 0;
+	}
+	if ((bucket >= dict->entries) && (bucket < dict->entries + dict->size)) {
+		return bucket - dict->entries;
+	}
+	return bucket - dict->next_entries;
+}
+
+static inline size_t
+hd_trace_len(const char* key) {
+	return (key != NULL) ? strlen(key) : 0;
+}
+
+/**
+ * @brief Migrates up to HD_REHASH_STEP buckets into next_entries
+ *
+ * Empty buckets are cheap to skip but still bounded, so a sparse table can't
+ * make a single step walk the whole array. Once the last bucket is migrated
+ * the old array is released and next_entries takes its place.
+ */
+static void
+hd_rehash_step(struct hd_hashdict* dict) {
+	unsigned int moved = 0;
+	unsigned int empty_visits = HD_REHASH_STEP * 10;
+
+	while ((moved < HD_REHASH_STEP) && (dict->rehash_idx < dict->size)) {
+		struct hd_entry* entry = dict->entries[dict->rehash_idx];
+		dict->entries[dict->rehash_idx++] = HD_MOVED;
+
+		if (entry == NULL) {
+			if (--empty_visits == 0) {
+				break;
+			}
+			continue;
+		}
+
+		while (entry != NULL) {
+			struct hd_entry* next = entry->next;
+			struct hd_entry** bucket =
+			    &(dict->next_entries[hd_hash(entry->key) &
+			                         (dict->next_size - 1)]);
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+		moved++;
+	}
+
+	if (dict->rehash_idx == dict->size) {
+		free(dict->entries);
+		dict->entries = dict->next_entries;
+		dict->size = dict->next_size;
+		dict->next_entries = NULL;
+		dict->next_size = 0;
+		dict->rehash_idx = 0;
+		if (HD_TRACE_ENABLED(resize__return)) {
+			HD_TRACE1(resize__return, dict->size);
+		}
+	}
+}
+
+/**
+ * @brief Starts growing the bucket array once the load factor reaches 1
+ *
+ * Only allocates the new array, the entries are moved by later calls to
+ * hd_rehash_step(). If the allocation fails the dictionary keeps working
+ * with longer chains and retries on the next insert.
+ */
+static void
+hd_maybe_grow(struct hd_hashdict* dict) {
+	if ((dict->next_entries != NULL) || (dict->num_entries < dict->size) ||
+	    (dict->size > UINT_MAX / 2)) {
+		return;
+	}
+
+	dict->next_entries =
+	    calloc((size_t)dict->size * 2, sizeof(struct hd_entry*));
+	if (dict->next_entries == NULL) {
+		return;
+	}
+	dict->next_size = dict->size * 2;
+	dict->rehash_idx = 0;
+	hd_count(dict, HD_OP_RESIZE);
+	if (HD_TRACE_ENABLED(resize__entry)) {
+		HD_TRACE3(resize__entry, dict->size, dict->next_size,
+		          dict->num_entries);
+	}
 }
 
 struct hd_hashdict
 hd_create(void) {
-	struct hd_hashdict dict = {.num_entries = 0,
-#ifdef DEBUG
-	                           .collisions = 0,
-	                           .alloced_bytes = 0
-#endif /* DEBUG */
-	};
-
-	memset(dict.entries, 0, sizeof(dict.entries));
+	struct hd_hashdict dict = {.entries = NULL,
+	                           .size = 0,
+	                           .next_entries = NULL,
+	                           .next_size = 0,
+	                           .rehash_idx = 0,
+	                           .num_entries = 0,
+	                           .backend = NULL,
+	                           .wal = NULL,
+	                           .dirty = NULL,
+	                           .repl = NULL,
+	                           .latency = NULL,
+	                           .count_ops = 0};
+
 	return dict;
 }
 
 /**
  * @brief Free single-linked list of `hd_entry`s
  *
- * Recursively frees allocated memory of linked `hd_entry`s and sets the
- * pointers to NULL.
- * @sideeffects Modifies entry->key, entry->value, entry->next,
- * dict->num_entries
+ * Frees allocated memory of linked `hd_entry`s. The list is walked
+ * iteratively so long chains can't exhaust the stack.
+ * @sideeffects Modifies dict->num_entries
  */
-static void
+void
 hd_free_entry_list(struct hd_entry* entry, struct hd_hashdict* dict) {
 	/* assert here as were in trouble if this fails as we cant handle that error
 	 * case.*/
 	assert(dict != NULL);
 	assert(entry != NULL);
-	if (entry->next != NULL) {
-		hd_free_entry_list(entry->next, dict);
-		entry->next = NULL;
-	}
-#ifdef DEBUG
-	dict->alloced_bytes -=
-	    sizeof(entry->key) + sizeof(entry->value) + sizeof(struct hd_entry);
-#endif /* DEBUG */
-	free(entry->key);
-	free(entry->value);
-	free(entry);
-	dict->num_entries--;
+	while (entry != NULL) {
+		struct hd_entry* next = entry->next;
+		free(entry->key);
+		if (!HD_IS_COUNTER(entry)) {
+			free(entry->value);
+		}
+		free(entry);
+		dict->num_entries--;
+		entry = next;
+	}
 }
 
 /**
@@ -81,208 +325,713 @@ hd_free(struct hd_hashdict* dict) {
 		return;
 	}
 
-	for (int i = 0; i < HASHSIZE; i++) {
-		if (dict->entries[i] != NULL) {
+	if (HD_TRACE_ENABLED(free__entry)) {
+		HD_TRACE2(free__entry, dict->size + dict->next_size,
+		          dict->num_entries);
+	}
+
+	if (dict->backend != NULL) {
+		dict->backend->ops->free(dict->backend);
+		dict->backend = NULL;
+		dict->num_entries = 0;
+		if (HD_TRACE_ENABLED(free__return)) {
+			HD_TRACE0(free__return);
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < dict->size; i++) {
+		if ((dict->entries[i] != NULL) && (dict->entries[i] != HD_MOVED)) {
 			hd_free_entry_list(dict->entries[i], dict);
-			dict->entries[i] = NULL;
 		}
 	}
-#ifdef DEBUG
-	printf("Allocated bytes after free: %d\nRemaining entries: %d\n",
-	       dict->alloced_bytes, dict->num_entries);
-#endif
+	for (unsigned int i = 0; i < dict->next_size; i++) {
+		if (dict->next_entries[i] != NULL) {
+			hd_free_entry_list(dict->next_entries[i], dict);
+		}
+	}
+	free(dict->entries);
+	free(dict->next_entries);
+	dict->entries = NULL;
+	dict->next_entries = NULL;
+	dict->size = 0;
+	dict->next_size = 0;
+	dict->rehash_idx = 0;
+	if (HD_TRACE_ENABLED(free__return)) {
+		HD_TRACE0(free__return);
+	}
 }
 
 /**
  * @brief Allocates memory for and copies str into it
  */
-static char*
+char*
 hd_stralloc(const char* str) {
 	unsigned int str_len = strlen(str) + 1; // +1 for null terminator
 	char* mem = malloc(str_len);
+	if (mem == NULL) {
+		return NULL;
+	}
 	memcpy(mem, str, str_len);
 	return mem;
 }
 
 int
-hd_entry_insert(struct hd_hashdict* dict, const char* key, const char* value) {
-	if ((dict == NULL) || (key == NULL) ||
-	    (hd_lookup_entry(dict, key) != NULL)) {
-		return -EINVAL;
+hd_reserve(struct hd_hashdict* dict, size_t n) {
+	if ((dict->entries != NULL) || (dict->backend != NULL)) {
+		return 0;
+	}
+
+	unsigned int size = hd_table_size(n);
+	dict->entries = calloc(size, sizeof(struct hd_entry*));
+	if (dict->entries == NULL) {
+		return -ENOMEM;
+	}
+	dict->size = size;
+	return 0;
+}
+
+/**
+ * @brief Makes sure a bucket array exists and helps a pending resize
+ *
+ * Called by every insert before it allocates its entry.
+ *
+ * @return int 0 on success, -ENOMEM if the bucket array can't be allocated
+ */
+static int
+hd_prepare_insert(struct hd_hashdict* dict) {
+	if (hd_reserve(dict, 0) != 0) {
+		return -ENOMEM;
+	}
+
+	if (dict->next_entries != NULL) {
+		hd_rehash_step(dict);
 	}
-	unsigned int hash = hd_hash(key);
+	return 0;
+}
+
+/**
+ * @brief Links a fully initialised entry into its bucket
+ *
+ * The caller must have checked that the key doesn't exist yet.
+ *
+ * @return unsigned int Number of entries walked to reach the end of the
+ * chain
+ */
+static unsigned int
+hd_link_entry(struct hd_hashdict* dict, struct hd_entry* entry) {
+	unsigned int steps = 0;
+
+	entry->next = NULL;
 
 	/* entry_ptr is a pointer to the address where the hd_entry should be
-	 * allocated to in the end.*/
-	struct hd_entry** entry_ptr = &(dict->entries[hash]);
+	 * linked to in the end.*/
+	struct hd_entry** entry_ptr = hd_bucket(dict, hd_hash(entry->key));
 	/* In case of a hash collision we iterate down the singly linked list to
 	 * find a free spot*/
 	if (*entry_ptr != NULL) {
-#ifdef DEBUG
-		dict->collisions++;
-#endif /* DEBUG */
-		while ((*entry_ptr)->next != NULL) {
+		hd_count(dict, HD_OP_COLLISION);
+		while (*entry_ptr != NULL) {
 			entry_ptr = &((*entry_ptr)->next);
+			steps++;
 		}
-		/* Finally malloc hd_entry to its spot in hd_dict. */
-		(*entry_ptr)->next = malloc(sizeof(struct hd_entry));
-		entry_ptr = &((*entry_ptr)->next);
-	} else {
-		/* Simply allocate entry directly into hashlist if there is no
-		 * collision*/
-		dict->entries[hash] = malloc(sizeof(struct hd_entry));
-		entry_ptr = &(dict->entries[hash]);
 	}
+	*entry_ptr = entry;
+	dict->num_entries++;
 
-	if (*entry_ptr == NULL) {
+	hd_maybe_grow(dict);
+	return steps;
+}
+
+/**
+ * @brief Implements hd_entry_insert(), setting *steps for the probes
+ */
+static int
+hd_insert(struct hd_hashdict* dict, const char* key, const char* value,
+          unsigned int* steps) {
+	if ((dict == NULL) || (key == NULL) || (value == NULL) ||
+	    (hd_lookup_entry(dict, key, NULL) != NULL)) {
+		return -EINVAL;
+	}
+
+	if (dict->backend != NULL) {
+		return (dict->backend->ops->insert != NULL)
+		           ? hd_counted(dict, HD_OP_INSERT,
+		                        dict->backend->ops->insert(dict, key, value))
+		           : -EROFS;
+	}
+
+	if ((dict->wal != NULL) && (hd_wal_error(dict->wal) != 0)) {
+		return hd_wal_error(dict->wal);
+	}
+
+	if (hd_prepare_insert(dict) != 0) {
 		return -ENOMEM;
 	}
 
-	(*entry_ptr)->key = hd_stralloc(key);
+	struct hd_entry* entry = malloc(sizeof(struct hd_entry));
 
-	if ((*entry_ptr)->key == NULL) {
+	if (entry == NULL) {
+		return -ENOMEM;
+	}
+
+	entry->key = hd_stralloc(key);
+
+	if (entry->key == NULL) {
 		goto err_keyalloc;
 	}
 
-	(*entry_ptr)->value = hd_stralloc(value);
+	entry->value = hd_stralloc(value);
 
-	if ((*entry_ptr)->value == NULL) {
+	if (entry->value == NULL) {
 		goto err_valalloc;
 	}
 
-	(*entry_ptr)->next = NULL;
-	dict->num_entries++;
-
-#ifdef DEBUG
-	/* Only increase alloced_bytes if we know all allocs were successfull.
-	 */
-	dict->alloced_bytes += strlen((*entry_ptr)->key) + 1 +
-	                       strlen((*entry_ptr)->value) + 1 +
-	                       sizeof(struct hd_entry);
-#endif /*DEBUG*/
+	*steps = hd_link_entry(dict, entry);
+	hd_count(dict, HD_OP_INSERT);
 
+	if (dict->dirty != NULL) {
+		hd_dirty_mark(dict->dirty, key);
+	}
+	if (dict->repl != NULL) {
+		hd_repl_log(dict->repl, HD_WAL_SET, key, value, 0);
+	}
+	if (dict->wal != NULL) {
+		return hd_wal_log(dict->wal, HD_WAL_SET, key, value, 0);
+	}
 	return 0;
 err_valalloc:
-	free((*entry_ptr)->key);
+	free(entry->key);
 err_keyalloc:
-	free(*entry_ptr);
+	free(entry);
 	return -ENOMEM;
 }
 
 int
-hd_entry_remove(struct hd_hashdict* dict, const char* key) {
+hd_entry_insert(struct hd_hashdict* dict, const char* key, const char* value) {
+	unsigned long long start = hd_latency_begin(dict);
+	unsigned int steps = 0;
+
+	if (HD_TRACE_ENABLED(insert__entry)) {
+		HD_TRACE2(insert__entry, key, hd_trace_len(key));
+	}
+
+	int ret = hd_insert(dict, key, value, &steps);
+	hd_latency_end(dict, HD_LAT_INSERT, start);
+
+	if (HD_TRACE_ENABLED(insert__return)) {
+		HD_TRACE4(insert__return, hd_trace_len(key),
+		          hd_trace_bucket(dict, key), steps, ret);
+	}
+	return ret;
+}
+
+/**
+ * @brief Implements hd_entry_remove(), setting *steps for the probes
+ */
+static int
+hd_remove(struct hd_hashdict* dict, const char* key, unsigned int* steps) {
 	if ((dict == NULL) || (key == NULL)) {
 		return -EINVAL;
 	}
 
+	if (dict->backend != NULL) {
+		return (dict->backend->ops->remove != NULL)
+		           ? hd_counted(dict, HD_OP_REMOVE,
+		                        dict->backend->ops->remove(dict, key))
+		           : -EROFS;
+	}
+
+	if ((dict->wal != NULL) && (hd_wal_error(dict->wal) != 0)) {
+		return hd_wal_error(dict->wal);
+	}
+
 	if (dict->num_entries == 0) {
 		return -EINVAL;
 	}
 
-	unsigned int hash = hd_hash(key);
+	if (dict->next_entries != NULL) {
+		hd_rehash_step(dict);
+	}
 
-	struct hd_entry** entry_ptr = &(dict->entries[hash]);
+	struct hd_entry** bucket = hd_bucket(dict, hd_hash(key));
 
 	/*Check if key exists in dict*/
-	if (*entry_ptr == NULL) {
+	if (*bucket == NULL) {
 		return -EINVAL;
 	}
 	/* Store previous entry if entry is in a linked list because of hash
 	 * collision if entry is at the beginning prev entry stays NULL.*/
 	struct hd_entry* prev_entry = NULL;
-	while (strcmp(key, (*entry_ptr)->key)) {
-		if ((*entry_ptr)->next == NULL) {
+	struct hd_entry* entry = *bucket;
+	*steps = 1;
+	while (strcmp(key, entry->key)) {
+		if (entry->next == NULL) {
 			return -EINVAL;
 		}
-		prev_entry = *entry_ptr;
-		entry_ptr = &((*entry_ptr)->next);
+		prev_entry = entry;
+		entry = entry->next;
+		(*steps)++;
 	}
 
 	if (prev_entry == NULL) {
 		/* If entry has a linked entry in next it will put in first place in
-		 * entries if it doesn't it will be set to NULL so both cases are
+		 * the bucket if it doesn't it will be set to NULL so both cases are
 		 * covered in this expression.*/
-		dict->entries[hash] = (*entry_ptr)->next;
+		*bucket = entry->next;
 	} else {
 		/* Here we use the same replacement mechanism to fixup the linked list
 		 * as above.*/
-		prev_entry->next = (*entry_ptr)->next;
+		prev_entry->next = entry->next;
 	}
 
 	dict->num_entries--;
-#ifdef DEBUG
-	dict->alloced_bytes -= strlen((*entry_ptr)->key) +
-	                       strlen((*entry_ptr)->value) +
-	                       sizeof(struct hd_entry);
-#endif /*DEBUG*/
-
-	free((*entry_ptr)->key);
-	free((*entry_ptr)->value);
-	free(*entry_ptr);
+
+	free(entry->key);
+	if (!HD_IS_COUNTER(entry)) {
+		free(entry->value);
+	}
+	free(entry);
+	hd_count(dict, HD_OP_REMOVE);
+
+	if (dict->dirty != NULL) {
+		hd_dirty_mark(dict->dirty, key);
+	}
+	if (dict->repl != NULL) {
+		hd_repl_log(dict->repl, HD_WAL_REMOVE, key, NULL, 0);
+	}
+	if (dict->wal != NULL) {
+		return hd_wal_log(dict->wal, HD_WAL_REMOVE, key, NULL, 0);
+	}
 	return 0;
 }
 
+int
+hd_entry_remove(struct hd_hashdict* dict, const char* key) {
+	unsigned long long start = hd_latency_begin(dict);
+	unsigned int steps = 0;
+
+	if (HD_TRACE_ENABLED(remove__entry)) {
+		HD_TRACE2(remove__entry, key, hd_trace_len(key));
+	}
+
+	/* The bucket is looked up first, the key is gone afterwards.*/
+	unsigned int bucket = 0;
+	if (HD_TRACE_ENABLED(remove__return)) {
+		bucket = hd_trace_bucket(dict, key);
+	}
+
+	int ret = hd_remove(dict, key, &steps);
+	hd_latency_end(dict, HD_LAT_REMOVE, start);
+
+	if (HD_TRACE_ENABLED(remove__return)) {
+		HD_TRACE4(remove__return, hd_trace_len(key), bucket, steps, ret);
+	}
+	return ret;
+}
+
+/**
+ * @brief Finds the entry of key
+ *
+ * If probes isn't NULL it receives the number of keys compared.
+ */
 static struct hd_entry*
-hd_lookup_entry(struct hd_hashdict* dict, const char* key) {
+hd_lookup_entry(struct hd_hashdict* dict, const char* key,
+                unsigned int* probes) {
+	if (probes != NULL) {
+		*probes = 0;
+	}
+
 	if ((dict == NULL) || (key == NULL)) {
 		return NULL;
 	}
 
-	if (dict->num_entries == 0) {
+	if ((dict->num_entries == 0) || (dict->backend != NULL)) {
 		return NULL;
 	}
 
-	unsigned int hash = hd_hash(key);
-
-	struct hd_entry** entry_ptr = &(dict->entries[hash]);
+	struct hd_entry** entry_ptr = hd_bucket(dict, hd_hash(key));
 
 	/*Check if key exists in dict*/
-	if (*entry_ptr == NULL) {
+	if ((entry_ptr == NULL) || (*entry_ptr == NULL)) {
 		return NULL;
 	}
 
 	/* Check if current entrys key is actually the one we look for.
 	 * If not, iterate over linked list in hashlist position.*/
+	unsigned int compared = 1;
 	while (strcmp(key, (*entry_ptr)->key)) {
 		if ((*entry_ptr)->next == NULL) {
 			/*Key has a hash which has entries but is not actually in the
 			 * list.*/
+			if (probes != NULL) {
+				*probes = compared;
+			}
 			return NULL;
 		}
 		entry_ptr = &((*entry_ptr)->next);
+		compared++;
+	}
+	if (probes != NULL) {
+		*probes = compared;
 	}
 	return (*entry_ptr);
 }
 
+/**
+ * @brief Counts a lookup and samples its probe count
+ *
+ * Every HD_PROBE_SAMPLE-th lookup adds its probe count to the histogram
+ * of hits or misses. The lookup counter doubles as the sampling clock, so
+ * sampling costs no extra atomic operation.
+ */
+static void
+hd_count_lookup(struct hd_hashdict* dict, int found, unsigned int probes) {
+	if (!dict->count_ops) {
+		return;
+	}
+
+	unsigned long long n = atomic_fetch_add_explicit(
+	    &dict->op_counts[HD_OP_LOOKUP], 1, memory_order_relaxed);
+	if (!found) {
+		hd_count(dict, HD_OP_LOOKUP_MISS);
+	}
+	if ((probes != HD_PROBES_UNKNOWN) && (n % HD_PROBE_SAMPLE == 0)) {
+		if (probes >= HD_HIST_SIZE) {
+			probes = HD_HIST_SIZE - 1;
+		}
+		atomic_fetch_add_explicit(&dict->probe_counts[!found][probes], 1,
+		                          memory_order_relaxed);
+	}
+}
+
 const char*
 hd_lookup(struct hd_hashdict* dict, const char* key) {
-	struct hd_entry* entry = hd_lookup_entry(dict, key);
-	return entry ? entry->value : NULL;
+	unsigned long long start = hd_latency_begin(dict);
+	const char* value = NULL;
+	unsigned int probes = HD_PROBES_UNKNOWN;
+
+	if (HD_TRACE_ENABLED(lookup__entry)) {
+		HD_TRACE2(lookup__entry, key, hd_trace_len(key));
+	}
+
+	if ((dict != NULL) && (key != NULL) && (dict->backend != NULL)) {
+		value = dict->backend->ops->lookup(dict->backend, key);
+	} else {
+		struct hd_entry* entry = hd_lookup_entry(dict, key, &probes);
+		value = (entry && !HD_IS_COUNTER(entry)) ? entry->value : NULL;
+	}
+
+	if (dict != NULL) {
+		hd_latency_end(dict,
+		               (value != NULL) ? HD_LAT_LOOKUP_HIT : HD_LAT_LOOKUP_MISS,
+		               start);
+		hd_count_lookup(dict, value != NULL, probes);
+	}
+
+	if (HD_TRACE_ENABLED(lookup__return)) {
+		HD_TRACE4(lookup__return, hd_trace_len(key),
+		          hd_trace_bucket(dict, key),
+		          (probes != HD_PROBES_UNKNOWN) ? probes : 0, value != NULL);
+	}
+	return value;
 }
 
 int
-hd_entry_update(struct hd_hashdict* dict, const char* key, const char* value) {
-	struct hd_entry* entry = hd_lookup_entry(dict, key);
+hd_lookup_copy(struct hd_hashdict* dict, const char* key, char* buf,
+               size_t size) {
+	if ((dict == NULL) || (key == NULL) || (buf == NULL)) {
+		return -EINVAL;
+	}
 
-	if (entry == NULL) {
+	/* Shared storage takes its read lock again inside hd_lookup(), which it
+	 * allows.*/
+	hd_read_begin(dict);
+	const char* value = hd_lookup(dict, key);
+	int ret = 0;
+
+	if (value == NULL) {
+		ret = -EINVAL;
+	} else {
+		size_t len = strlen(value);
+		if (len >= size) {
+			ret = -ERANGE;
+		} else {
+			memcpy(buf, value, len + 1);
+		}
+	}
+	hd_read_end(dict);
+	return ret;
+}
+
+/**
+ * @brief Implements hd_entry_update(), setting *steps for the probes
+ */
+static int
+hd_update(struct hd_hashdict* dict, const char* key, const char* value,
+          unsigned int* steps) {
+	if ((dict != NULL) && (dict->backend != NULL)) {
+		if ((key == NULL) || (value == NULL)) {
+			return -EINVAL;
+		}
+		return (dict->backend->ops->update != NULL)
+		           ? hd_counted(dict, HD_OP_UPDATE,
+		                        dict->backend->ops->update(dict, key, value))
+		           : -EROFS;
+	}
+
+	struct hd_entry* entry = hd_lookup_entry(dict, key, steps);
+
+	if ((entry == NULL) || HD_IS_COUNTER(entry) || (value == NULL)) {
 		return -EINVAL;
 	}
 
+	if ((dict->wal != NULL) && (hd_wal_error(dict->wal) != 0)) {
+		return hd_wal_error(dict->wal);
+	}
+
+	if (dict->next_entries != NULL) {
+		hd_rehash_step(dict);
+	}
+
 	char* new_value = hd_stralloc(value);
 
 	if (new_value == NULL) {
 		return -ENOMEM;
 	}
 
-#ifdef DEBUG
-	/*Update allocated bytes with the difference of the new value and the old
-	 * value*/
-	dict->alloced_bytes += (strlen(new_value) - strlen(entry->value));
-#endif /* DEBUG */
-
 	free(entry->value);
 	entry->value = new_value;
+	hd_count(dict, HD_OP_UPDATE);
 
+	if (dict->dirty != NULL) {
+		hd_dirty_mark(dict->dirty, key);
+	}
+	if (dict->repl != NULL) {
+		hd_repl_log(dict->repl, HD_WAL_SET, key, value, 0);
+	}
+	if (dict->wal != NULL) {
+		return hd_wal_log(dict->wal, HD_WAL_SET, key, value, 0);
+	}
+	return 0;
+}
+
+int
+hd_entry_update(struct hd_hashdict* dict, const char* key, const char* value) {
+	unsigned long long start = hd_latency_begin(dict);
+	unsigned int steps = 0;
+
+	if (HD_TRACE_ENABLED(update__entry)) {
+		HD_TRACE2(update__entry, key, hd_trace_len(key));
+	}
+
+	int ret = hd_update(dict, key, value, &steps);
+	hd_latency_end(dict, HD_LAT_UPDATE, start);
+
+	if (HD_TRACE_ENABLED(update__return)) {
+		HD_TRACE4(update__return, hd_trace_len(key),
+		          hd_trace_bucket(dict, key), steps, ret);
+	}
+	return ret;
+}
+
+int
+hd_add(struct hd_hashdict* dict, const char* key, long long delta,
+       long long* result) {
+	if ((dict == NULL) || (key == NULL)) {
+		return -EINVAL;
+	}
+
+	if (dict->backend != NULL) {
+		return (dict->backend->ops->add != NULL)
+		           ? hd_counted(dict, HD_OP_ADD,
+		                        dict->backend->ops->add(dict, key, delta,
+		                                                result))
+		           : -EROFS;
+	}
+
+	if ((dict->wal != NULL) && (hd_wal_error(dict->wal) != 0)) {
+		return hd_wal_error(dict->wal);
+	}
+
+	struct hd_entry* entry = hd_lookup_entry(dict, key, NULL);
+	long long value;
+	int ret = 0;
+
+	if ((entry != NULL) && !HD_IS_COUNTER(entry)) {
+		return -EINVAL;
+	}
+
+	if ((entry != NULL) && (dict->repl != NULL)) {
+		/* The stream orders concurrent additions, and the log with it.*/
+		ret = hd_repl_log_add(dict->repl, dict->wal, (struct hd_counter*)entry,
+		                      delta, &value);
+	} else if ((entry != NULL) && (dict->wal != NULL)) {
+		/* The log orders concurrent additions to the same counter.*/
+		ret = hd_wal_log_add(dict->wal, (struct hd_counter*)entry, delta,
+		                     &value);
+	} else if (entry != NULL) {
+		/* Fast path: only the counter itself is written, the dictionary
+		 * stays untouched.*/
+		value = atomic_fetch_add_explicit(&((struct hd_counter*)entry)->value,
+		                                  delta, memory_order_relaxed) +
+		        delta;
+	} else {
+		if (hd_prepare_insert(dict) != 0) {
+			return -ENOMEM;
+		}
+
+		struct hd_counter* counter = malloc(sizeof(struct hd_counter));
+
+		if (counter == NULL) {
+			return -ENOMEM;
+		}
+
+		counter->entry.key = hd_stralloc(key);
+
+		if (counter->entry.key == NULL) {
+			free(counter);
+			return -ENOMEM;
+		}
+
+		counter->entry.value = HD_COUNTER_VALUE;
+		atomic_init(&counter->value, delta);
+		hd_link_entry(dict, &counter->entry);
+		value = delta;
+
+		if (dict->repl != NULL) {
+			hd_repl_log(dict->repl, HD_WAL_COUNTER, key, NULL, value);
+		}
+		if (dict->wal != NULL) {
+			ret = hd_wal_log(dict->wal, HD_WAL_COUNTER, key, NULL, value);
+		}
+	}
+
+	hd_count(dict, HD_OP_ADD);
+
+	/* Marked after the change, so a delta written in between still
+	 * finds the key dirty for the next one.*/
+	if (dict->dirty != NULL) {
+		hd_dirty_mark(dict->dirty, key);
+	}
+
+	if (result != NULL) {
+		*result = value;
+	}
+	return ret;
+}
+
+int
+hd_incr(struct hd_hashdict* dict, const char* key, long long delta) {
+	return hd_add(dict, key, delta, NULL);
+}
+
+int
+hd_counter_get(struct hd_hashdict* dict, const char* key, long long* value) {
+	unsigned long long start = hd_latency_begin(dict);
+	unsigned int probes = HD_PROBES_UNKNOWN;
+	int ret = 0;
+
+	if ((dict != NULL) && (key != NULL) && (value != NULL) &&
+	    (dict->backend != NULL)) {
+		ret = dict->backend->ops->counter_get(dict->backend, key, value);
+	} else {
+		struct hd_entry* entry = hd_lookup_entry(dict, key, &probes);
+
+		if ((entry == NULL) || !HD_IS_COUNTER(entry) || (value == NULL)) {
+			ret = -EINVAL;
+		} else {
+			*value = atomic_load_explicit(
+			    &((struct hd_counter*)entry)->value, memory_order_relaxed);
+		}
+	}
+
+	if (dict != NULL) {
+		hd_latency_end(dict,
+		               (ret == 0) ? HD_LAT_LOOKUP_HIT : HD_LAT_LOOKUP_MISS,
+		               start);
+		hd_count_lookup(dict, ret == 0, probes);
+	}
+	return ret;
+}
+
+int
+hd_foreach_entry(struct hd_hashdict* dict,
+                 int (*fn)(struct hd_entry* entry, void* ctx), void* ctx) {
+	for (unsigned int i = 0; i < dict->size + dict->next_size; i++) {
+		struct hd_entry* entry = (i < dict->size)
+		                             ? dict->entries[i]
+		                             : dict->next_entries[i - dict->size];
+		if (entry == HD_MOVED) {
+			continue;
+		}
+		while (entry != NULL) {
+			struct hd_entry* next = entry->next;
+			int ret = fn(entry, ctx);
+			if (ret != 0) {
+				return ret;
+			}
+			entry = next;
+		}
+	}
+	return 0;
+}
+
+size_t
+hd_read_begin(struct hd_hashdict* dict) {
+	if ((dict->backend != NULL) && (dict->backend->ops->read_begin != NULL)) {
+		return dict->backend->ops->read_begin(dict->backend);
+	}
+	return dict->num_entries;
+}
+
+void
+hd_read_end(struct hd_hashdict* dict) {
+	if ((dict->backend != NULL) && (dict->backend->ops->read_end != NULL)) {
+		dict->backend->ops->read_end(dict->backend);
+	}
+}
+
+int
+hd_foreach_record(struct hd_hashdict* dict,
+                  int (*fn)(const struct hd_record* rec, void* ctx),
+                  void* ctx) {
+	if (dict->backend != NULL) {
+		return dict->backend->ops->foreach(dict->backend, fn, ctx);
+	}
+
+	/* While growing, entries live in both bucket arrays. Buckets already
+	 * migrated hold the forwarding marker and are skipped.*/
+	for (unsigned int i = 0; i < dict->size + dict->next_size; i++) {
+		struct hd_entry* entry = (i < dict->size)
+		                             ? dict->entries[i]
+		                             : dict->next_entries[i - dict->size];
+		if (entry == HD_MOVED) {
+			continue;
+		}
+		for (; entry != NULL; entry = entry->next) {
+			struct hd_record rec = {
+			    .key = entry->key,
+			    .key_len = strlen(entry->key),
+			    .value = NULL,
+			    .value_len = 0,
+			    .counter = 0,
+			    .bucket = (i < dict->size) ? i : i - dict->size};
+			if (HD_IS_COUNTER(entry)) {
+				rec.counter =
+				    atomic_load_explicit(&((struct hd_counter*)entry)->value,
+				                         memory_order_relaxed);
+			} else {
+				rec.value = entry->value;
+				rec.value_len = strlen(entry->value);
+			}
+
+			int ret = fn(&rec, ctx);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+	}
 	return 0;
 }
 
@@ -293,20 +1042,24 @@ hd_print(struct hd_hashdict* dict) {
 		return;
 	}
 
-	// Fixed column widths
-	const unsigned int key_width = 13;
-	const unsigned int val_width = 48;
-	const unsigned int idx_width = 6;
-
 	// Print header with dictionary information
 	printf("┌────────────────────────────────────────────────────────────┐\n");
 	printf("│ Dictionary Statistics                                      │\n");
 	printf("├────────────────────────────────────────────────────────────┤\n");
 	printf("│ Total entries: %43u │\n", dict->num_entries);
-#ifdef DEBUG
-	printf("│ Collisions:    %43u │\n", dict->collisions);
-	printf("│ Memory used:   %43d │\n", dict->alloced_bytes);
-#endif /* DEBUG */
+	struct hd_stats stats;
+	if (hd_get_stats(dict, &stats) == 0) {
+		if (stats.buckets > 0) {
+			printf("│ Buckets:       %43zu │\n", stats.buckets);
+			printf("│ Load factor:   %43.2f │\n", stats.load_factor);
+			printf("│ Longest chain: %43zu │\n", stats.max_chain);
+		}
+		printf("│ Memory used:   %43zu │\n", stats.total_bytes);
+		if (stats.counting) {
+			printf("│ Collisions:    %43llu │\n",
+			       stats.ops[HD_OP_COLLISION]);
+		}
+	}
 	printf(
 	    "└────────────────────────────────────────────────────────────┘\n\n");
 
@@ -315,71 +1068,5 @@ hd_print(struct hd_hashdict* dict) {
 		return;
 	}
 
-	// Calculate total table width
-	int table_width =
-	    idx_width + key_width + val_width + 10; // 10 for borders and spaces
-
-	// Print table header
-	printf("┌");
-	for (int i = 0; i < table_width - 2; i++)
-		printf("─");
-	printf("┐\n");
-
-	printf("│ %-*s │ %-*s │ %-*s │\n", idx_width, "Bucket", key_width, "Key",
-	       val_width, "Value");
-
-	printf("├");
-	for (unsigned int i = 0; i < idx_width + 2; i++)
-		printf("─");
-	printf("┼");
-	for (unsigned int i = 0; i < key_width + 2; i++)
-		printf("─");
-	printf("┼");
-	for (unsigned int i = 0; i < val_width + 2; i++)
-		printf("─");
-	printf("┤\n");
-
-	// Print table contents
-	char key_buf[key_width + 1];
-	char val_buf[val_width + 1];
-
-	for (int i = 0; i < HASHSIZE; i++) {
-		struct hd_entry* entry = dict->entries[i];
-		if (entry != NULL) {
-			while (entry != NULL) {
-				// Format key (truncate if needed)
-				if (strlen(entry->key) > key_width - 4) {
-					strncpy(key_buf, entry->key, key_width - 4);
-					strcpy(key_buf + key_width - 4, "...");
-				} else {
-					strcpy(key_buf, entry->key);
-				}
-
-				// Format value (truncate if needed)
-				if (strlen(entry->value) > val_width - 4) {
-					strncpy(val_buf, entry->value, val_width - 4);
-					strcpy(val_buf + val_width - 4, "...");
-				} else {
-					strcpy(val_buf, entry->value);
-				}
-
-				printf("│ %-*d │ %-*s │ %-*s │\n", idx_width, i, key_width,
-				       key_buf, val_width, val_buf);
-
-				entry = entry->next;
-			}
-		}
-	}
-
-	// Print table footer
-	printf("└");
-	for (unsigned int i = 0; i < idx_width + 2; i++)
-		printf("─");
-	printf("┴");
-	for (unsigned int i = 0; i < key_width + 2; i++)
-		printf("─");
-	printf("┴");
-	for (unsigned int i = 0; i < val_width + 2; i++)
-		printf("─");
-	printf("┘\n");
+	hd_export(dict, stdout, HD_EXPORT_TABLE, 0);
 }
@@ -20,9 +20,21 @@
 #ifndef HASHDICT_H
 #define HASHDICT_H
 
-#define HASHSIZE 1024 /**< Number of hash buckets in the table */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HASHSIZE 1024 /**< Initial number of hash buckets in the table */
+#define HD_HIST_SIZE 16 /**< Bins of struct hd_histogram, the last is open */
+#define HD_PROBE_SAMPLE 64 /**< Lookups per probe count sampled */
+
+struct hd_backend;
+struct hd_wal;
+struct hd_dirty;
+struct hd_repl;
+struct hd_latency;
+struct hd_repl_follower;
 
-#define DEBUG
 /**
  * @brief Hash table entry structure
  *
@@ -35,19 +47,55 @@ struct hd_entry {
 	char* value; /**< String value (dynamically allocated copy) */
 };
 
+/**
+ * @brief Operations counted while hd_stats_enable() is on
+ */
+enum hd_op {
+	HD_OP_LOOKUP, /**< hd_lookup() and hd_counter_get() calls */
+	HD_OP_LOOKUP_MISS, /**< Lookups that found nothing */
+	HD_OP_INSERT, /**< Successful hd_entry_insert() calls */
+	HD_OP_UPDATE, /**< Successful hd_entry_update() calls */
+	HD_OP_REMOVE, /**< Successful hd_entry_remove() calls */
+	HD_OP_ADD, /**< Successful hd_add() calls */
+	HD_OP_COLLISION, /**< New entries linked into a non-empty bucket */
+	HD_OP_RESIZE, /**< Bucket arrays grown */
+	HD_NUM_OPS,
+};
+
 /**
  * @brief Hash dictionary structure
  *
  * Contains the hash table (array of entry pointers), entry count,
- * and optional debug information.
+ * and optional operation counters.
+ *
+ * The bucket array is allocated on first insert and doubles once the load
+ * factor reaches 1. Growing is incremental: a second bucket array is
+ * allocated and every write (insert, update, remove) migrates a few
+ * buckets into it, so no single call pays for a full rehash.
+ * Migrated buckets in the old array hold a forwarding marker which tells
+ * lookups to continue in the new array. Lookups never migrate, so they stay
+ * free of side effects and may run concurrently with each other.
  */
 struct hd_hashdict {
-	struct hd_entry* entries[HASHSIZE]; /**< Array of hash buckets */
+	struct hd_entry** entries; /**< Array of hash buckets */
+	unsigned int size; /**< Number of buckets in entries (power of two) */
+	struct hd_entry** next_entries; /**< Array being grown into, or NULL */
+	unsigned int next_size; /**< Number of buckets in next_entries */
+	unsigned int rehash_idx; /**< Next bucket of entries to migrate */
 	unsigned int num_entries; /**< Total number of entries in dictionary */
-#ifdef DEBUG
-	unsigned int collisions; /**< Number of hash collisions (debug only) */
-	int alloced_bytes; /**< Total memory allocated (debug only) */
-#endif /* DEBUG */
+	struct hd_backend* backend; /**< Storage replacing the bucket arrays,
+	                               e.g. a mapped snapshot or a shared
+	                               memory region, or NULL */
+	struct hd_wal* wal; /**< Log receiving every write, or NULL */
+	struct hd_dirty* dirty; /**< Keys written since the last delta
+	                           snapshot, or NULL */
+	struct hd_repl* repl; /**< Change stream to a follower, or NULL */
+	struct hd_latency* latency; /**< Latency histograms, or NULL */
+	int count_ops; /**< op_counts is updated, see hd_stats_enable() */
+	/** Operation counts, indexed by enum hd_op */
+	_Atomic unsigned long long op_counts[HD_NUM_OPS];
+	/** Sampled probe counts of hits [0] and misses [1] */
+	_Atomic unsigned long long probe_counts[2][HD_HIST_SIZE];
 };
 
 /**
@@ -61,7 +109,13 @@ hd_create(void);
 /**
  * @brief Free all memory associated with a dictionary
  *
- * Releases all entries, keys, and values, setting all freed pointers to NULL.
+ * Releases all entries, keys, values and bucket arrays, setting all freed
+ * pointers to NULL. The dictionary is left empty and can be reused.
+ *
+ * Freeing doesn't log removals, so an attached log must be closed with
+ * hd_wal_close() first, or recovering it brings every freed key back. The
+ * same goes for hd_delta_untrack() and hd_repl_stop(). Attachments are left
+ * in place either way.
  *
  * @param dict Pointer to the dictionary to free
  */
@@ -78,7 +132,8 @@ hd_free(struct hd_hashdict* dict);
  * @param key String key to insert (must not be NULL)
  * @param value String value to associate with the key
  * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out of
- * memory
+ * memory, -EROFS if the dictionary is read-only or a negative errno value
+ * if writing the log failed, see hd_wal_open()
  */
 int
 hd_entry_insert(struct hd_hashdict* dict, const char* key, const char* value);
@@ -90,7 +145,9 @@ hd_entry_insert(struct hd_hashdict* dict, const char* key, const char* value);
  *
  * @param dict Pointer to the dictionary
  * @param key Key to remove
- * @return int 0 on success, -EINVAL if key not found or invalid parameters
+ * @return int 0 on success, -EINVAL if key not found or invalid parameters,
+ * -EROFS if the dictionary is read-only or a negative errno value if writing
+ * the log failed
  */
 int
 hd_entry_remove(struct hd_hashdict* dict, const char* key);
@@ -101,21 +158,85 @@ hd_entry_remove(struct hd_hashdict* dict, const char* key);
  * @param dict Pointer to the dictionary
  * @param key Key to look up
  * @return const char* The value associated with the key, or NULL if not found
+ * or the key holds a counter
  */
 const char*
 hd_lookup(struct hd_hashdict* dict, const char* key);
 
+/**
+ * @brief Look up a value by key and copy it into buf
+ *
+ * Unlike hd_lookup() the value is copied while the dictionary can't change,
+ * so this is the way to read a dictionary other processes write to, see
+ * hd_shm_create().
+ *
+ * @param dict Pointer to the dictionary
+ * @param key Key to look up
+ * @param buf Buffer receiving the NUL terminated value
+ * @param size Size of buf in bytes
+ * @return int 0 on success, -EINVAL if key not found, holds a counter or
+ * invalid parameters, -ERANGE if the value and its NUL don't fit into size
+ * bytes
+ */
+int
+hd_lookup_copy(struct hd_hashdict* dict, const char* key, char* buf,
+               size_t size);
+
 /**
  * @brief Update the value associated with a key
  *
  * @param dict Pointer to the dictionary
  * @param key Key to update (must exist)
  * @param value New value to associate with the key
- * @return int 0 on success, -EINVAL if key not found, -ENOMEM if out of memory
+ * @return int 0 on success, -EINVAL if key not found or holds a counter,
+ * -ENOMEM if out of memory, -EROFS if the dictionary is read-only or a
+ * negative errno value if writing the log failed
  */
 int
 hd_entry_update(struct hd_hashdict* dict, const char* key, const char* value);
 
+/**
+ * @brief Add delta to the counter stored under key
+ *
+ * Counters are entries holding a 64 bit integer instead of a string. The
+ * counter is created with value delta if the key doesn't exist yet.
+ *
+ * Adding to an existing counter is a lookup followed by an atomic fetch-add
+ * and doesn't modify the dictionary itself, so it may run concurrently with
+ * lookups and other hd_add() calls on existing counters. Creating a counter
+ * is an insert and needs the same exclusive access as hd_entry_insert().
+ *
+ * @param dict Pointer to the dictionary
+ * @param key Key of the counter
+ * @param delta Value to add, may be negative
+ * @param result If not NULL, receives the counter value after the addition
+ * @return int 0 on success, -EINVAL for invalid parameters or if key holds a
+ * string, -ENOMEM if out of memory, -EROFS if the dictionary is read-only or
+ * a negative errno value if writing the log failed
+ */
+int
+hd_add(struct hd_hashdict* dict, const char* key, long long delta,
+       long long* result);
+
+/**
+ * @brief Add delta to the counter stored under key
+ *
+ * Shorthand for hd_add() when the new value isn't needed.
+ */
+int
+hd_incr(struct hd_hashdict* dict, const char* key, long long delta);
+
+/**
+ * @brief Read the counter stored under key
+ *
+ * @param dict Pointer to the dictionary
+ * @param key Key of the counter
+ * @param value Receives the counter value
+ * @return int 0 on success, -EINVAL if key not found or holds a string
+ */
+int
+hd_counter_get(struct hd_hashdict* dict, const char* key, long long* value);
+
 /**
  * @brief Print a formatted representation of the dictionary
  *
@@ -128,4 +249,1096 @@ hd_entry_update(struct hd_hashdict* dict, const char* key, const char* value);
 void
 hd_print(struct hd_hashdict* dict);
 
+/**
+ * @brief Formats of hd_export()
+ */
+enum hd_export_format {
+	HD_EXPORT_TSV, /**< key, tab, value or counter, newline. Tabs,
+	                  newlines, carriage returns and backslashes are
+	                  escaped as \t, \n, \r and \\ */
+	HD_EXPORT_JSONL, /**< One JSON object per line, {"key":...,"value":...}
+	                    or {"key":...,"counter":...} */
+	HD_EXPORT_TABLE, /**< The table of hd_print(), truncating long keys and
+	                    values */
+};
+
+/**
+ * @brief Write the entries of the dictionary to a stream
+ *
+ * Rows are formatted into a large internal buffer without printf() and
+ * handed to out in blocks, which makes this suitable for dictionaries of
+ * millions of entries. Entries are written in bucket order.
+ *
+ * @param dict Pointer to the dictionary
+ * @param out Stream open for writing
+ * @param format Output format
+ * @param max_rows Stop after this many entries, 0 for all
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out of
+ * memory or a negative errno value of a failed write
+ */
+int
+hd_export(struct hd_hashdict* dict, FILE* out, enum hd_export_format format,
+          size_t max_rows);
+
+/**
+ * @brief Size, memory use and shape of a dictionary
+ *
+ * Byte counts are what the dictionary asked the allocator for, without the
+ * allocator's own overhead, except alloc_bytes. Bucket and chain figures are
+ * 0 for dictionaries with a storage backend, e.g. after hd_freeze() or
+ * hd_shm_create(), which only report entries and key and value bytes.
+ */
+struct hd_stats {
+	size_t entries; /**< Number of entries */
+	size_t buckets; /**< Buckets of both arrays while growing */
+	size_t used_buckets; /**< Buckets holding at least one entry */
+	double load_factor; /**< entries / buckets */
+	size_t max_chain; /**< Entries in the longest chain */
+	double mean_chain; /**< Mean number of entries of used buckets */
+	int growing; /**< Entries are being migrated to a grown array */
+	size_t entry_bytes; /**< Entry and counter structures */
+	size_t key_bytes; /**< Keys, terminators included */
+	size_t value_bytes; /**< String values, terminators included */
+	size_t bucket_bytes; /**< Bucket arrays */
+	size_t total_bytes; /**< Sum of the above */
+	size_t alloc_bytes; /**< What the allocator reserved for total_bytes,
+	                       from malloc_usable_size() with glibc, else 0 */
+	int counting; /**< Operations are being counted */
+	unsigned long long ops[HD_NUM_OPS]; /**< Operation counts, indexed by
+	                                       enum hd_op */
+};
+
+/**
+ * @brief Get size, memory use and operation counts of the dictionary
+ *
+ * Walks all buckets and entries, so the figures are exact but take time
+ * linear in the size of the dictionary. Counts as a reader: it may run
+ * concurrently with lookups, but not with writes.
+ *
+ * @param dict Pointer to the dictionary
+ * @param stats Receives the statistics
+ * @return int 0 on success, -EINVAL for invalid parameters
+ */
+int
+hd_get_stats(struct hd_hashdict* dict, struct hd_stats* stats);
+
+/**
+ * @brief Turn counting of operations on or off
+ *
+ * While off, which is the default, every operation only pays a predictable
+ * branch. While on, every counted operation adds one relaxed atomic
+ * increment. Counts are kept while counting is off and survive hd_free(),
+ * so counting can be paused; hd_stats_reset() clears them. Needs the same
+ * exclusive access as hd_entry_insert().
+ *
+ * @param dict Pointer to the dictionary
+ * @param enable Non-zero to count, 0 to stop
+ * @return int 0 on success, -EINVAL for invalid parameters
+ */
+int
+hd_stats_enable(struct hd_hashdict* dict, int enable);
+
+/**
+ * @brief Set all operation counts and sampled probe counts to 0
+ *
+ * @param dict Pointer to the dictionary
+ * @return int 0 on success, -EINVAL for invalid parameters
+ */
+int
+hd_stats_reset(struct hd_hashdict* dict);
+
+/**
+ * @brief Distribution of chain lengths and of probes done by lookups
+ *
+ * Bin i of chains counts buckets holding i entries, bin i of the probe
+ * histograms counts lookups that compared i keys. The last bin also counts
+ * everything beyond it. For a good hash function chain lengths follow a
+ * Poisson distribution with the load factor as mean, a long tail points to
+ * clustering keys, a high load factor to a table that should grow.
+ */
+struct hd_histogram {
+	size_t entries; /**< Number of entries */
+	size_t buckets; /**< Buckets of both arrays while growing */
+	double load_factor; /**< entries / buckets */
+	size_t max_chain; /**< Entries in the longest chain */
+	size_t chains[HD_HIST_SIZE]; /**< Buckets by number of entries */
+	unsigned int sample_every; /**< One lookup in this many is sampled */
+	unsigned long long probes_hit[HD_HIST_SIZE]; /**< Sampled lookups that
+	                                                found their key */
+	unsigned long long probes_miss[HD_HIST_SIZE]; /**< Sampled lookups that
+	                                                 didn't */
+};
+
+/**
+ * @brief Get the chain length and probe histograms of the dictionary
+ *
+ * Chain lengths are counted by walking all buckets, like hd_get_stats().
+ * Probe counts are sampled by hd_lookup() and hd_counter_get() while
+ * hd_stats_enable() is on, one in HD_PROBE_SAMPLE lookups. Dictionaries
+ * with a storage backend report neither, only their number of entries.
+ *
+ * @param dict Pointer to the dictionary
+ * @param hist Receives the histograms
+ * @return int 0 on success, -EINVAL for invalid parameters
+ */
+int
+hd_histogram(struct hd_hashdict* dict, struct hd_histogram* hist);
+
+/**
+ * @brief Write histograms from hd_histogram() as one line of JSON
+ *
+ * The object has the fields of struct hd_histogram, with the bins as
+ * arrays. For a FILE*, fflush() it and pass fileno().
+ *
+ * @param hist Histograms to write
+ * @param fd File descriptor open for writing
+ * @return int 0 on success, -EINVAL for invalid parameters or a negative
+ * errno value of a failed write
+ */
+int
+hd_histogram_dump(const struct hd_histogram* hist, int fd);
+
+/**
+ * @brief Hash functions of the library
+ */
+enum hd_hash_func {
+	HD_HASH_DJB2, /**< Buckets of the table, shared memory and snapshots */
+	HD_HASH_MURMUR64, /**< Seeded MurmurHash64A of hd_freeze() */
+	HD_NUM_HASH_FUNCS,
+};
+
+/**
+ * @brief Get the name of a hash function
+ *
+ * @param func Hash function
+ * @return const char* The name, or NULL for an unknown function
+ */
+const char*
+hd_hash_name(enum hd_hash_func func);
+
+/**
+ * @brief Hash a key with one of the library's hash functions
+ *
+ * Gives the same values the dictionary computes internally, so tools can
+ * judge how a set of keys spreads over buckets, which take the low bits.
+ * djb2 hashes up to the terminating NUL and ignores len and seed.
+ *
+ * @param func Hash function
+ * @param key Key to hash, NUL terminated at len
+ * @param len Length of key
+ * @param seed Seed of HD_HASH_MURMUR64
+ * @return uint64_t The hash value, 0 for an unknown function or a NULL key
+ */
+uint64_t
+hd_hash_key(enum hd_hash_func func, const char* key, size_t len,
+            uint64_t seed);
+
+#define HD_LAT_SUB_BITS 5 /**< Bins per power of two: 32, about 3% apart */
+#define HD_LAT_BINS 1024 /**< Covers up to 2^36 ns (68 s), then clamps */
+
+/**
+ * @brief Operations timed by hd_latency_start()
+ */
+enum hd_lat_op {
+	HD_LAT_LOOKUP_HIT, /**< hd_lookup() or hd_counter_get() finding the key */
+	HD_LAT_LOOKUP_MISS, /**< hd_lookup() or hd_counter_get() not finding it */
+	HD_LAT_INSERT, /**< hd_entry_insert() */
+	HD_LAT_UPDATE, /**< hd_entry_update() */
+	HD_LAT_REMOVE, /**< hd_entry_remove() */
+	HD_LAT_NUM_OPS,
+};
+
+/**
+ * @brief Sampling of hd_latency_start()
+ */
+struct hd_latency_config {
+	unsigned int sample_every; /**< Time one operation in this many per
+	                              thread, 0 for 64 */
+	int use_tsc; /**< Read the time stamp counter instead of
+	                CLOCK_MONOTONIC, x86-64 with an invariant TSC only */
+};
+
+/**
+ * @brief Latency histogram of one operation
+ *
+ * Bins are log-linear like HdrHistogram: values below 32 ns have a bin of
+ * their own, above that every power of two is split into 32 bins. See
+ * hd_latency_bin_ns() for the range of a bin.
+ */
+struct hd_latency_hist {
+	unsigned long long count; /**< Sampled operations */
+	unsigned long long sum_ns; /**< Sum of their latencies */
+	unsigned long long min_ns; /**< 0 if count is 0 */
+	unsigned long long max_ns;
+	unsigned long long bins[HD_LAT_BINS];
+};
+
+/**
+ * @brief Latency histograms of all threads since start or the last reset
+ *
+ * About 48 KiB, better not placed on small stacks.
+ */
+struct hd_latency_snapshot {
+	unsigned int sample_every; /**< One operation in this many was timed */
+	unsigned int threads; /**< Threads whose samples are included */
+	struct hd_latency_hist ops[HD_LAT_NUM_OPS]; /**< Indexed by enum
+	                                               hd_lat_op */
+};
+
+/**
+ * @brief Start timing operations into per-thread latency histograms
+ *
+ * Every thread records into histograms of its own, so recording doesn't
+ * contend. They are merged by hd_latency_snapshot(). Histograms of threads
+ * that exit are merged into a shared one first. While no operation is
+ * sampled, an operation only looks up its thread's histograms and counts
+ * down there, so dictionaries sharing a thread are sampled independently.
+ * Stays attached across hd_free(). Needs the same exclusive access as
+ * hd_entry_insert().
+ *
+ * @param dict Pointer to the dictionary
+ * @param config Sampling, NULL for the defaults
+ * @return int 0 on success, -EINVAL for invalid parameters or if already
+ * started, -ENOTSUP if use_tsc is set on other machines, -ENOMEM if out of
+ * memory
+ */
+int
+hd_latency_start(struct hd_hashdict* dict,
+                 const struct hd_latency_config* config);
+
+/**
+ * @brief Stop timing and free the histograms
+ *
+ * No operation on dict may run concurrently.
+ *
+ * @param dict Pointer to the dictionary
+ * @return int 0 on success, -EINVAL if timing isn't started
+ */
+int
+hd_latency_stop(struct hd_hashdict* dict);
+
+/**
+ * @brief Merge the histograms of all threads
+ *
+ * May run concurrently with any operation. Samples recorded meanwhile may
+ * or may not be included.
+ *
+ * @param dict Pointer to the dictionary
+ * @param snap Receives the merged histograms
+ * @return int 0 on success, -EINVAL if timing isn't started
+ */
+int
+hd_latency_snapshot(struct hd_hashdict* dict,
+                    struct hd_latency_snapshot* snap);
+
+/**
+ * @brief Discard all samples recorded so far
+ *
+ * May run concurrently with any operation. Threads clear their own
+ * histograms when they next record, until then snapshots skip them.
+ *
+ * @param dict Pointer to the dictionary
+ * @return int 0 on success, -EINVAL if timing isn't started
+ */
+int
+hd_latency_reset(struct hd_hashdict* dict);
+
+/**
+ * @brief Latency below which the given share of operations completed
+ *
+ * @param hist Histogram of one operation
+ * @param percentile Between 0 and 100, e.g. 99.9
+ * @return unsigned long long Latency in ns, the middle of the bin holding
+ * the percentile and at most max_ns, or 0 if the histogram is empty
+ */
+unsigned long long
+hd_latency_percentile(const struct hd_latency_hist* hist, double percentile);
+
+/**
+ * @brief Lowest latency in ns counted in a bin
+ *
+ * The bin ends where the next one starts.
+ */
+unsigned long long
+hd_latency_bin_ns(unsigned int bin);
+
+/**
+ * @brief Write the dictionary to a snapshot file for hd_snapshot_open()
+ *
+ * The file holds its own bucket array of offsets and all keys and values
+ * packed inline, so it can be used directly from a read-only mapping. It is
+ * written to path.tmp and renamed to path once complete, so readers never
+ * see a partial snapshot. The format uses host byte order.
+ *
+ * @param dict Pointer to the dictionary
+ * @param path File to write
+ * @return int 0 on success, -EINVAL for invalid parameters, -EFBIG if a key
+ * or value is too long, -ENOMEM if out of memory, -ENOSPC if the file
+ * system has no room for the snapshot or a negative errno value of a failed
+ * file operation
+ */
+int
+hd_snapshot_write(struct hd_hashdict* dict, const char* path);
+
+/**
+ * @brief Serve a dictionary from a mapped snapshot file
+ *
+ * The file is mapped read-only and shared, so opening is constant time and
+ * processes opening the same file share its pages. hd_lookup() and
+ * hd_counter_get() read straight from the mapping, writes fail with -EROFS.
+ * Returned values stay valid until hd_free() unmaps the file.
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param path Snapshot written by hd_snapshot_write()
+ * @return int 0 on success, -EINVAL for invalid parameters or if the file is
+ * not a valid snapshot, -ENOMEM if out of memory or a negative errno value
+ * of a failed file operation
+ */
+int
+hd_snapshot_open(struct hd_hashdict* dict, const char* path);
+
+/**
+ * @brief Outcome of a snapshot written by hd_snapshot_background()
+ */
+struct hd_snapshot_report {
+	int status; /**< Result of hd_snapshot_write() in the child */
+	unsigned long long pause_ns; /**< Time the caller was blocked in fork() */
+	unsigned long long duration_ns; /**< Time from the fork until the
+	                                   snapshot was renamed into place */
+	unsigned long long cow_bytes; /**< Memory copied on write while the
+	                                 snapshot was written, 0 if unknown */
+};
+
+/**
+ * @brief Snapshot written by a child process, see hd_snapshot_background()
+ */
+struct hd_snapshot_job;
+
+/**
+ * @brief Write a snapshot of the dictionary without blocking writers
+ *
+ * Forks a child which writes the dictionary with hd_snapshot_write() while
+ * the caller carries on. The child sees the dictionary as it was at the
+ * time of the fork, the kernel copies pages the caller modifies afterwards.
+ * The caller only pauses for fork() itself, which copies the page tables.
+ * Memory use grows by the pages written while the child runs, reported as
+ * cow_bytes.
+ *
+ * The dictionary must not be modified by other threads during this call.
+ * Only the calling thread exists in the child, so other threads must not
+ * hold locks the snapshot needs, e.g. inside malloc() on non-glibc
+ * systems.
+ *
+ * @param dict Pointer to the dictionary
+ * @param path File to write
+ * @param job Receives the job to pass to hd_snapshot_wait()
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out
+ * of memory or a negative errno value of a failed fork() or pipe()
+ */
+int
+hd_snapshot_background(struct hd_hashdict* dict, const char* path,
+                       struct hd_snapshot_job** job);
+
+/**
+ * @brief Wait for a background snapshot to finish and free the job
+ *
+ * @param job Job returned by hd_snapshot_background()
+ * @param report If not NULL, receives the outcome
+ * @return int The status of the snapshot, -ECHILD if the child died without
+ * reporting it or a negative errno value of a failed wait
+ */
+int
+hd_snapshot_wait(struct hd_snapshot_job* job,
+                 struct hd_snapshot_report* report);
+
+/**
+ * @brief Write all entries of the dictionary to a file descriptor
+ *
+ * The stream starts with a header holding the number of entries, followed
+ * by blocks of length-prefixed records, each block protected by a CRC-32C.
+ * Entries are streamed block by block, so memory use doesn't depend on the
+ * size of the dictionary. Keys and values are written in full. fd can be
+ * a file, pipe or socket. For a FILE*, fflush() it and pass fileno().
+ *
+ * @param dict Pointer to the dictionary
+ * @param fd File descriptor open for writing
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out of
+ * memory or a negative errno value of a failed write
+ */
+int
+hd_dump(struct hd_hashdict* dict, int fd);
+
+/**
+ * @brief Read a stream written by hd_dump() into an empty dictionary
+ *
+ * The bucket array is sized from the entry count in the header before the
+ * first entry is inserted. Every block is checked against its checksum
+ * before its entries are inserted. On error the dictionary is left empty.
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param fd File descriptor open for reading
+ * @return int 0 on success, -EINVAL for invalid parameters, -EBADMSG if the
+ * stream is corrupt or truncated, -ENOTSUP for an unknown format version,
+ * -ENOMEM if out of memory or a negative errno value of a failed read
+ */
+int
+hd_load(struct hd_hashdict* dict, int fd);
+
+/**
+ * @brief Tuning of the file I/O of hd_dump_file() and hd_load_file()
+ *
+ * Files are read and written through queue_depth buffers of buffer_size
+ * bytes which are in flight at the same time, submitted through io_uring
+ * where the kernel supports it and with pread()/pwrite() otherwise. A zero
+ * initialised config selects the defaults.
+ */
+struct hd_io_config {
+	unsigned int queue_depth; /**< Buffers in flight, 0 for 4 */
+	size_t buffer_size; /**< Bytes per buffer, rounded up to 4 KiB, 0 for
+	                       1 MiB */
+	int direct; /**< Bypass the page cache with O_DIRECT, if the file
+	               system supports it */
+	int no_uring; /**< Use pread()/pwrite() even if io_uring works */
+	int compress; /**< hd_dump_file() compresses every block with LZ4 */
+	unsigned int threads; /**< hd_load_file() reads, decompresses and
+	                         inserts blocks on this many threads, 0 or 1
+	                         loads sequentially */
+};
+
+/**
+ * @brief Write all entries of the dictionary to a file in hd_dump() format
+ *
+ * The dump is written to path.tmp, synced and renamed to path, so path
+ * always holds a complete dump.
+ *
+ * Unlike hd_dump(), the file ends with an index of its blocks, which lets
+ * hd_load_file() load them in parallel. Blocks are compressed
+ * independently of each other if config->compress is set.
+ *
+ * @param dict Pointer to the dictionary
+ * @param path File to write
+ * @param config I/O tuning, NULL for the defaults
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out of
+ * memory or a negative errno value of a failed file operation
+ */
+int
+hd_dump_file(struct hd_hashdict* dict, const char* path,
+             const struct hd_io_config* config);
+
+/**
+ * @brief Read a file written by hd_dump_file() into an empty dictionary
+ *
+ * With config->threads above 1, the whole file is decompressed into memory
+ * by that many threads and the table is then built with
+ * hd_build_parallel(). Dictionaries that already have a bucket array are
+ * loaded sequentially.
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param path File to read
+ * @param config I/O tuning, NULL for the defaults
+ * @return int 0 on success or an error as returned by hd_load()
+ */
+int
+hd_load_file(struct hd_hashdict* dict, const char* path,
+             const struct hd_io_config* config);
+
+/**
+ * @brief Turn the dictionary into an immutable one with perfect hashing
+ *
+ * Builds a minimal perfect hash function over all keys and copies keys and
+ * values into one contiguous array ordered by the slots it computes. A
+ * lookup is then one hash, one slot read and one key comparison, with no
+ * chains to follow. Only every 8th record's offset is stored, so a lookup
+ * skips up to 7 neighbouring records, mostly on the same cache lines. The
+ * hash function takes about 4.5 bits per key and the offsets 4 bits, every
+ * record adds varint lengths and the NUL terminators to its key and value.
+ *
+ * The chained storage is freed afterwards. Like a mapped snapshot, the
+ * frozen dictionary is read-only and writes fail with -EROFS.
+ *
+ * @param dict Pointer to the dictionary
+ * @return int 0 on success, -EINVAL for invalid parameters or if keys can't
+ * be told apart by the hash function, -ENOMEM if out of memory
+ */
+int
+hd_freeze(struct hd_hashdict* dict);
+
+/**
+ * @brief Move the dictionary into a shared memory region
+ *
+ * Creates a region of size bytes, copies all entries into it and frees the
+ * chained storage. Other processes attach to the region with hd_shm_open()
+ * or hd_shm_attach() and all of them share one copy of the entries, reading
+ * and writing it through the usual functions. Children forked afterwards
+ * can use the dictionary as it is.
+ *
+ * Entries are linked by offsets, so the region can be mapped at any
+ * address. A process-shared rwlock serialises writers against readers,
+ * while hd_add() on an existing counter only takes it for reading and adds
+ * atomically. A process dying while it writes leaves the lock held.
+ *
+ * The region doesn't grow, writes fail with -ENOSPC once it is full. All
+ * of its size is allocated up front, so it should not be much larger than
+ * the entries need. Strings returned by hd_lookup() point into the region
+ * and another process updating or removing the key may overwrite them at
+ * any time, so read values with hd_lookup_copy() unless no other process
+ * writes. dict->num_entries is refreshed by writes through dict only. The
+ * region lives until it is unlinked with shm_unlink() and the last process
+ * unmapped it.
+ *
+ * @param dict Pointer to the dictionary, without a log
+ * @param name Name for shm_open() starting with '/', or NULL for an
+ * anonymous region only reachable through hd_shm_fd()
+ * @param size Size of the region in bytes
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOSPC if
+ * the entries don't fit or the region can't be allocated, -EFBIG if a key or value is too long, -ENOMEM if
+ * out of memory or a negative errno value of a failed system call, e.g.
+ * -EEXIST if name is taken
+ */
+int
+hd_shm_create(struct hd_hashdict* dict, const char* name, size_t size);
+
+/**
+ * @brief Attach to a region created by hd_shm_create() by its name
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param name Name passed to hd_shm_create()
+ * @return int 0 on success, -EINVAL for invalid parameters or if the region
+ * is not ready, -ENOMEM if out of memory or a negative errno value of a
+ * failed system call
+ */
+int
+hd_shm_open(struct hd_hashdict* dict, const char* name);
+
+/**
+ * @brief Attach to a region through a file descriptor from hd_shm_fd()
+ *
+ * fd is duplicated, the caller keeps ownership of it. Use this for
+ * anonymous regions passed over a Unix socket or inherited across exec().
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param fd File descriptor of the region
+ * @return int 0 on success or an error as returned by hd_shm_open()
+ */
+int
+hd_shm_attach(struct hd_hashdict* dict, int fd);
+
+/**
+ * @brief File descriptor of the region of a shared dictionary
+ *
+ * The descriptor is closed by hd_free() and has FD_CLOEXEC set.
+ *
+ * @param dict Pointer to the dictionary
+ * @return int The descriptor, or -EINVAL if dict is not shared
+ */
+int
+hd_shm_fd(struct hd_hashdict* dict);
+
+/**
+ * @brief Build a dictionary from arrays of keys and values using threads
+ *
+ * Equivalent to calling hd_entry_insert() for every pair, but the bucket
+ * array is sized for n entries upfront and the work is spread over nthreads
+ * threads. Every thread hashes a slice of the input and groups its indices
+ * by the thread owning their bucket, then links the keys falling into its
+ * own range of buckets, so threads never touch the same bucket and need no
+ * synchronisation. If threads can't be created the work is done on the
+ * calling thread instead.
+ *
+ * On error the dictionary is left empty.
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param keys Array of n keys (none may be NULL)
+ * @param values Array of n values, values[i] is associated with keys[i]
+ * (none may be NULL)
+ * @param n Number of key-value pairs
+ * @param nthreads Number of threads to use, 0 is treated as 1
+ * @return int 0 on success, -EINVAL for invalid parameters or duplicate
+ * keys, -ENOMEM if out of memory
+ */
+int
+hd_build_parallel(struct hd_hashdict* dict, const char* const* keys,
+                  const char* const* values, size_t n, unsigned int nthreads);
+
+/**
+ * @brief Free all memory associated with a dictionary using threads
+ *
+ * Like hd_free(), but the buckets are split across nthreads threads which
+ * free their chains concurrently. 0 is treated as 1.
+ *
+ * @param dict Pointer to the dictionary to free
+ * @param nthreads Number of threads to use
+ */
+void
+hd_free_parallel(struct hd_hashdict* dict, unsigned int nthreads);
+
+/**
+ * @brief Hand a dictionary over to a background thread for freeing
+ *
+ * The contents of dict are moved to a queue served by a reclaimer thread
+ * and dict is reset to an empty dictionary, so the call returns in constant
+ * time regardless of the size of the dictionary. If the reclaimer can't be
+ * started the dictionary is freed on the calling thread.
+ *
+ * Like hd_free(), a log, dirty tracker or change stream stays attached to
+ * dict and has to be detached first.
+ *
+ * @param dict Pointer to the dictionary to free
+ */
+void
+hd_free_async(struct hd_hashdict* dict);
+
+/**
+ * @brief Wait until all dictionaries passed to hd_free_async() are freed
+ */
+void
+hd_free_async_wait(void);
+
+/**
+ * @brief Flush policy of an aggregator
+ *
+ * A thread's buffer is flushed once any enabled limit is reached. With all
+ * limits disabled, deltas are only flushed explicitly or on thread exit.
+ */
+struct hd_agg_config {
+	unsigned int flush_ops; /**< Flush after this many adds, 0 disables */
+	unsigned long long max_staleness_ns; /**< Max age of a pending delta in
+	                                        nanoseconds, 0 disables */
+	unsigned int max_keys; /**< Free buffered keys on flush when a buffer
+	                          holds more than this many, 0 keeps them */
+	int flush_on_read; /**< Flush all buffers in hd_agg_get() */
+};
+
+/**
+ * @brief Write-combining front end for counters in a shared dictionary
+ *
+ * Every thread adds its deltas to a small dictionary of its own and merges
+ * them into the shared one in batches, so hot keys don't bounce a cache line
+ * between cores on every increment. Reads of the shared dictionary may lag
+ * behind by up to the configured staleness bound.
+ */
+struct hd_aggregator;
+
+/**
+ * @brief Create an aggregator flushing into dict
+ *
+ * While the aggregator exists, dict must only be accessed through it.
+ *
+ * @param dict Shared dictionary receiving the counters
+ * @param config Flush policy, NULL disables all automatic flushing
+ * @return struct hd_aggregator* The aggregator, or NULL if out of memory
+ */
+struct hd_aggregator*
+hd_agg_create(struct hd_hashdict* dict, const struct hd_agg_config* config);
+
+/**
+ * @brief Flush all pending deltas and free the aggregator
+ *
+ * Threads using the aggregator must not call into it anymore. Deltas which
+ * still can't be added to the shared dictionary are lost, call
+ * hd_agg_flush_all() first to find out.
+ */
+void
+hd_agg_destroy(struct hd_aggregator* agg);
+
+/**
+ * @brief Add delta to the counter key in the calling thread's buffer
+ *
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out of
+ * memory
+ */
+int
+hd_agg_add(struct hd_aggregator* agg, const char* key, long long delta);
+
+/**
+ * @brief Flush the calling thread's buffer into the shared dictionary
+ *
+ * Deltas which can't be added stay pending and are retried by the next
+ * flush. This also holds for a thread's buffer flushed on thread exit.
+ *
+ * @return int 0 on success, -EINVAL for invalid parameters, else the first
+ * error of hd_incr()
+ */
+int
+hd_agg_flush(struct hd_aggregator* agg);
+
+/**
+ * @brief Flush the buffers of all threads into the shared dictionary
+ *
+ * @return int 0 on success, -EINVAL for invalid parameters, else the first
+ * error of hd_incr()
+ */
+int
+hd_agg_flush_all(struct hd_aggregator* agg);
+
+/**
+ * @brief Read a counter from the shared dictionary
+ *
+ * Buffers holding deltas older than the staleness bound are flushed first,
+ * or all buffers if flush_on_read is set.
+ *
+ * @return int 0 on success, -EINVAL if key not found or holds a string
+ */
+int
+hd_agg_get(struct hd_aggregator* agg, const char* key, long long* value);
+
+/**
+ * @brief When the write-ahead log forces its records to disk
+ */
+enum hd_wal_sync {
+	HD_WAL_SYNC_NONE, /**< Never fsync, the kernel writes the log back */
+	HD_WAL_SYNC_GROUP, /**< fsync once per commit window */
+	HD_WAL_SYNC_ALWAYS, /**< fsync before every write returns */
+};
+
+/**
+ * @brief Group commit policy of a write-ahead log
+ *
+ * Records are collected in a buffer and written together, so a batch of
+ * writes shares one write() and, with HD_WAL_SYNC_GROUP, one fsync. A crash
+ * loses at most the writes of the last commit window.
+ */
+struct hd_wal_config {
+	enum hd_wal_sync sync; /**< fsync policy */
+	unsigned long long commit_window_ns; /**< Max age of a record before it
+	                                        is written (and synced), 0
+	                                        commits every record at once,
+	                                        like HD_WAL_SYNC_ALWAYS does */
+	size_t buffer_size; /**< Write the buffer once it holds this many
+	                       bytes, 0 for the default of 64 KiB */
+	struct hd_io_config io; /**< I/O of hd_wal_checkpoint(), no_uring also
+	                           applies to the log, which never uses
+	                           O_DIRECT */
+};
+
+/**
+ * @brief Log every write to the dictionary to an append-only file
+ *
+ * From now on hd_entry_insert(), hd_entry_update(), hd_entry_remove() and
+ * hd_add() append a record holding the change to the log, counters are
+ * logged with their resulting value. Records are checksummed, so a record
+ * torn by a crash ends the log instead of corrupting it. An existing log is
+ * appended to, after cutting off such a torn tail.
+ *
+ * Unless every record is committed at once, a background thread writes
+ * (and syncs) the buffer once per commit window, so writes only wait for
+ * the disk if they fill the buffer faster than it can be written. If
+ * writing the log fails, the change that hit the error still took effect in
+ * memory but all following writes fail with the same error until the log
+ * is closed or hd_wal_checkpoint() succeeds.
+ *
+ * hd_add() calls on an existing counter are serialised on the log, so
+ * records are in the same order as the additions they log.
+ * hd_build_parallel() fails with -EINVAL while a log is attached, and it
+ * must be closed with hd_wal_close() before hd_free().
+ *
+ * @param dict Pointer to the dictionary
+ * @param path Log file, created if it doesn't exist
+ * @param config Group commit policy, NULL for HD_WAL_SYNC_GROUP with a
+ * 10 ms window
+ * @return int 0 on success, -EINVAL for invalid parameters or if a log is
+ * already attached, -EBADMSG if path isn't a log, -ENOMEM if out of memory
+ * or a negative errno value of a failed file operation
+ */
+int
+hd_wal_open(struct hd_hashdict* dict, const char* path,
+            const struct hd_wal_config* config);
+
+/**
+ * @brief Write and fsync all buffered log records, regardless of policy
+ *
+ * @return int 0 on success, -EINVAL if no log is attached or a negative
+ * errno value of a failed write
+ */
+int
+hd_wal_sync(struct hd_hashdict* dict);
+
+/**
+ * @brief Sync and detach the log of the dictionary
+ *
+ * The log is detached even if the final sync fails.
+ *
+ * @return int 0 on success, -EINVAL if no log is attached or a negative
+ * errno value of a failed write
+ */
+int
+hd_wal_close(struct hd_hashdict* dict);
+
+/**
+ * @brief Dump the dictionary to a file and empty its log
+ *
+ * The dump is written with hd_dump_file(), then the log is truncated.
+ * Should the process die in between, replaying the old log over the new
+ * dump yields the same dictionary, as every record overwrites its key.
+ *
+ * @param dict Pointer to a dictionary with a log attached
+ * @param dump_path File receiving the dump
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out
+ * of memory or a negative errno value of a failed file operation
+ */
+int
+hd_wal_checkpoint(struct hd_hashdict* dict, const char* dump_path);
+
+/**
+ * @brief Apply all complete records of a log to the dictionary
+ *
+ * Replay stops at the first torn or corrupt record, which is what a crash
+ * leaves at the end of a log. The dictionary must not have a log attached.
+ *
+ * @param dict Pointer to the dictionary
+ * @param path Log file written by a dictionary with hd_wal_open()
+ * @return int 0 on success, -EINVAL for invalid parameters, -EBADMSG if path
+ * isn't a log, -ENOTSUP for an unknown format version, -ENOMEM if out of
+ * memory or a negative errno value of a failed read
+ */
+int
+hd_wal_replay(struct hd_hashdict* dict, const char* path);
+
+/**
+ * @brief Rebuild a dictionary from its last checkpoint and log
+ *
+ * Loads dump_path with hd_load_file() and replays wal_path over it. Either file
+ * may be NULL or missing, e.g. before the first checkpoint. Afterwards the
+ * log can be attached again with hd_wal_open().
+ *
+ * @param dict Pointer to an empty dictionary, e.g. from hd_create()
+ * @param dump_path Dump written by hd_wal_checkpoint() or hd_dump_file()
+ * @param wal_path Log file
+ * @return int 0 on success or an error of hd_load() or hd_wal_replay(), in
+ * which case the dictionary is left empty
+ */
+int
+hd_recover(struct hd_hashdict* dict, const char* dump_path,
+           const char* wal_path);
+
+/**
+ * @brief Start recording which keys are written, for delta snapshots
+ *
+ * Every key inserted, updated, removed or added to from now on is marked
+ * dirty until the next hd_snapshot_delta() writes it. Call this right
+ * before writing the base snapshot, e.g. with hd_dump_file(), so no write
+ * between the base and the first delta is missed. A key marked before the
+ * base was taken is written to the delta again, which is harmless.
+ *
+ * Marking takes a mutex per write, so hd_add() calls on existing counters
+ * from several threads are serialised on it. Calling this again on a
+ * tracked dictionary forgets the dirty keys and starts over from base_id.
+ * Tracking must be stopped with hd_delta_untrack() before hd_free().
+ *
+ * @param dict Pointer to a chained dictionary
+ * @param base_id Id of the base snapshot, chosen by the caller
+ * @return int 0 on success, -EINVAL for invalid parameters or a dictionary
+ * with a different backend, -ENOMEM if out of memory
+ */
+int
+hd_delta_track(struct hd_hashdict* dict, uint64_t base_id);
+
+/**
+ * @brief Stop recording dirty keys and forget the ones recorded
+ *
+ * @return int 0 on success, -EINVAL if the dictionary isn't tracked
+ */
+int
+hd_delta_untrack(struct hd_hashdict* dict);
+
+/**
+ * @brief Write the keys changed since the last snapshot to a delta file
+ *
+ * The delta holds the current value of every dirty key, or a tombstone for
+ * removed ones, and gets the id base_id + 1, which is the base_id of the
+ * next delta. Writes may continue while the delta is written; keys written
+ * meanwhile go into the next delta, possibly in this one as well. The file
+ * is written to path.tmp, synced and renamed, so path is either the
+ * complete delta or untouched. On failure the keys stay dirty.
+ *
+ * @param dict Pointer to a dictionary tracked with hd_delta_track()
+ * @param base_id Id of the previous snapshot in the chain
+ * @param path File receiving the delta
+ * @return int 0 on success, -EINVAL for invalid parameters, -ESTALE if
+ * base_id isn't the id of the last snapshot, -ENOMEM if out of memory, also
+ * if a key couldn't be marked since tracking started, in which case the
+ * chain has to be restarted from a new base, or a negative errno value of a
+ * failed file operation
+ */
+int
+hd_snapshot_delta(struct hd_hashdict* dict, uint64_t base_id,
+                  const char* path);
+
+/**
+ * @brief Apply a delta written by hd_snapshot_delta() to the dictionary
+ *
+ * Deltas have to be applied in order onto the base they were taken from;
+ * a delta applies to the snapshot whose id is its base_id. On error the
+ * dictionary may hold part of the delta.
+ *
+ * @param dict Pointer to the dictionary
+ * @param path Delta file
+ * @param base_id Receives the id of the snapshot the delta applies to, may
+ * be NULL
+ * @param id Receives the id of the delta, may be NULL
+ * @return int 0 on success, -EINVAL for invalid parameters, -EBADMSG if
+ * path isn't a delta or is corrupt, -ENOTSUP for an unknown format version,
+ * -ENOMEM if out of memory or a negative errno value of a failed read
+ */
+int
+hd_delta_apply(struct hd_hashdict* dict, const char* path,
+               uint64_t* base_id, uint64_t* id);
+
+/**
+ * @brief Buffering of the change stream sent to a follower
+ */
+struct hd_repl_config {
+	size_t backlog_size; /**< Bytes of records kept for followers that
+	                        reconnect, also the most a follower may fall
+	                        behind, 0 for the default of 4 MiB */
+	unsigned long long flush_window_ns; /**< Max age of a record before it
+	                                       is sent, 0 for 1 ms */
+	unsigned long long heartbeat_ns; /**< Interval of empty frames while
+	                                    idle, 0 for 100 ms */
+};
+
+/**
+ * @brief State of the change stream on the leader
+ */
+struct hd_repl_leader_stats {
+	uint64_t seq; /**< Sequence number of the last change */
+	uint64_t first_seq; /**< Oldest change still in the backlog */
+	uint64_t sent_seq; /**< Last change sent to the follower */
+	size_t backlog_bytes; /**< Size of the backlog */
+	unsigned long long bytes_sent; /**< Total bytes sent to followers */
+	int connected; /**< A follower is connected */
+	int error; /**< Why the last follower was dropped, 0 if it wasn't */
+};
+
+/**
+ * @brief State of a follower
+ */
+struct hd_repl_follower_stats {
+	uint64_t applied_seq; /**< Sequence number of the last applied change */
+	uint64_t leader_seq; /**< Last change on the leader when the latest
+	                        batch was sent */
+	unsigned long long lag_ns; /**< Time between sending and applying the
+	                              latest batch */
+	unsigned long long applied; /**< Changes applied since creation */
+	unsigned long long batches; /**< Batches received, heartbeats
+	                               included */
+	double ops_per_sec; /**< Changes applied per second, measured over
+	                       about one second */
+};
+
+/**
+ * @brief Stream every write to the dictionary to a follower process
+ *
+ * From now on hd_entry_insert(), hd_entry_update(), hd_entry_remove() and
+ * hd_add() number their change and append it to a backlog, counters with
+ * their resulting value. A background thread sends new changes to the
+ * follower connected with hd_repl_connect() once per flush window, as a
+ * batch in the same record format the write-ahead log uses.
+ *
+ * Writes never wait for the follower. One that falls more than backlog_size
+ * bytes behind, or whose connection fails, is dropped and has to reconnect.
+ * hd_add() calls on an existing counter are serialised on the stream, so
+ * changes are sent in the order they were applied. hd_build_parallel()
+ * fails with -EINVAL while a stream is attached, and it must be stopped
+ * with hd_repl_stop() before hd_free().
+ *
+ * @param dict Pointer to a chained dictionary, usually holding what a
+ * follower can load first, e.g. empty or just loaded from a dump
+ * @param seq Sequence number of the current state, the first change gets
+ * seq + 1
+ * @param config Buffering, NULL for the defaults
+ * @return int 0 on success, -EINVAL for invalid parameters, a dictionary
+ * with a different backend or one already streaming, -ENOMEM if out of
+ * memory or -EAGAIN if the sender thread couldn't be started
+ */
+int
+hd_repl_start(struct hd_hashdict* dict, uint64_t seq,
+              const struct hd_repl_config* config);
+
+/**
+ * @brief Send the change stream to a follower, replacing the previous one
+ *
+ * Sending resumes after the change numbered seq, which the follower applied
+ * last. The descriptor is duplicated and may be a stream socket or the
+ * write end of a pipe. A process writing to a pipe should ignore SIGPIPE,
+ * sockets are written with MSG_NOSIGNAL.
+ *
+ * @param dict Pointer to a dictionary streaming with hd_repl_start()
+ * @param fd Connection to the follower
+ * @param seq Last change the follower has
+ * @return int 0 on success, -EINVAL for invalid parameters, -ERANGE if the
+ * changes after seq aren't in the backlog anymore or seq is newer than the
+ * last change, in which case the follower has to start over from a dump,
+ * or a negative errno value if fd couldn't be duplicated
+ */
+int
+hd_repl_connect(struct hd_hashdict* dict, int fd, uint64_t seq);
+
+/**
+ * @brief Send the remaining changes, then detach the change stream
+ *
+ * @return int 0 on success, -EINVAL if no stream is attached or the error
+ * that dropped the last follower
+ */
+int
+hd_repl_stop(struct hd_hashdict* dict);
+
+/**
+ * @brief Get the state of the change stream
+ *
+ * @return int 0 on success, -EINVAL for invalid parameters
+ */
+int
+hd_repl_leader_stats(struct hd_hashdict* dict,
+                     struct hd_repl_leader_stats* stats);
+
+/**
+ * @brief Create a follower receiving a change stream on fd
+ *
+ * @param follower Receives the follower, free it with
+ * hd_repl_follower_free()
+ * @param fd Read end of the connection, duplicated
+ * @param seq Last change the follower's dictionary already holds, 0 if
+ * it started out like the leader's
+ * @return int 0 on success, -EINVAL for invalid parameters, -ENOMEM if out
+ * of memory or a negative errno value if fd couldn't be duplicated
+ */
+int
+hd_repl_follower_create(struct hd_repl_follower** follower, int fd,
+                        uint64_t seq);
+
+/**
+ * @brief Close the connection and free the follower
+ */
+void
+hd_repl_follower_free(struct hd_repl_follower* follower);
+
+/**
+ * @brief Receive changes and apply them to the dictionary
+ *
+ * Waits up to timeout_ms for data, reads what is available and applies
+ * every complete batch. Changes the dictionary already holds are skipped.
+ * Applying takes the same exclusive access as hd_entry_insert(), so
+ * readers have to be kept out while this runs.
+ *
+ * @param follower Pointer to the follower
+ * @param dict Pointer to the follower's dictionary
+ * @param timeout_ms Time to wait for data, -1 to wait forever
+ * @return int Number of changes applied, 0 on timeout, -EPIPE if the
+ * leader closed the connection, -EBADMSG for a corrupt stream, -ERANGE if
+ * changes are missing, -ENOMEM if out of memory or a negative errno value
+ * of a failed read. After an error other than -EPIPE the follower has to
+ * reconnect, see hd_repl_connect().
+ */
+int
+hd_repl_receive(struct hd_repl_follower* follower, struct hd_hashdict* dict,
+                int timeout_ms);
+
+/**
+ * @brief Get the state of a follower
+ */
+void
+hd_repl_follower_stats(const struct hd_repl_follower* follower,
+                       struct hd_repl_follower_stats* stats);
+
 #endif /* HASHDICT_H */
\ No newline at end of file
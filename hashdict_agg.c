@@ -0,0 +1,339 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * @brief Per thread write-combining buffer
+ *
+ * Only the owning thread adds to local, but other threads may flush it, so
+ * every access happens under lock. The lock is uncontended unless a flush of
+ * all buffers is running.
+ */
+struct hd_agg_buffer {
+	struct hd_agg_buffer* next;
+	struct hd_aggregator* agg;
+	pthread_mutex_t lock;
+	struct hd_hashdict local; /**< Deltas not yet flushed, as counters */
+	unsigned int pending_ops; /**< hd_agg_add() calls since the last flush */
+	unsigned long long oldest_ns; /**< Time of the oldest pending delta */
+};
+
+struct hd_aggregator {
+	struct hd_hashdict* dict;
+	struct hd_agg_config config;
+	pthread_key_t key; /**< Buffer of the calling thread */
+	/* Lock order is list_lock, then a buffer lock, then dict_lock.*/
+	pthread_mutex_t list_lock; /**< Protects buffers */
+	pthread_mutex_t dict_lock; /**< Protects dict */
+	struct hd_agg_buffer* buffers;
+};
+
+static unsigned long long
+hd_agg_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief State of one hd_agg_flush_locked() run
+ */
+struct hd_agg_flush_ctx {
+	struct hd_hashdict* dict;
+	int error; /**< First error of hd_incr() */
+};
+
+/**
+ * @brief Adds one pending delta to the shared dictionary and clears it
+ */
+static int
+hd_agg_flush_entry(struct hd_entry* entry, void* arg) {
+	struct hd_agg_flush_ctx* ctx = arg;
+	struct hd_counter* counter = (struct hd_counter*)entry;
+	long long delta =
+	    atomic_load_explicit(&counter->value, memory_order_relaxed);
+
+	if (delta == 0) {
+		return 0;
+	}
+
+	int ret = hd_incr(ctx->dict, entry->key, delta);
+	if (ret == 0) {
+		atomic_store_explicit(&counter->value, 0, memory_order_relaxed);
+	} else if (ctx->error == 0) {
+		ctx->error = ret;
+	}
+	/* Keep going on errors, the delta stays pending and is retried with the
+	 * next flush.*/
+	return 0;
+}
+
+/**
+ * @brief Flushes buf into the shared dictionary, buf->lock must be held
+ *
+ * If any delta can't be added the buffer stays pending, so the flush policy
+ * retries it.
+ *
+ * @return int 0 on success, else the first error of hd_incr()
+ */
+static int
+hd_agg_flush_locked(struct hd_agg_buffer* buf) {
+	struct hd_aggregator* agg = buf->agg;
+	struct hd_agg_flush_ctx ctx = {.dict = agg->dict, .error = 0};
+
+	if (buf->pending_ops == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&agg->dict_lock);
+	hd_foreach_entry(&buf->local, hd_agg_flush_entry, &ctx);
+	pthread_mutex_unlock(&agg->dict_lock);
+
+	if (ctx.error != 0) {
+		return ctx.error;
+	}
+
+	/* Keys are kept zeroed so hot keys don't get reallocated on every
+	 * flush, unless the buffer has collected too many of them.*/
+	if ((agg->config.max_keys != 0) &&
+	    (buf->local.num_entries > agg->config.max_keys)) {
+		hd_free_parallel(&buf->local, 1);
+	}
+	buf->pending_ops = 0;
+	buf->oldest_ns = 0;
+	return 0;
+}
+
+static void
+hd_agg_buffer_destroy(void* arg) {
+	struct hd_agg_buffer* buf = arg;
+	struct hd_aggregator* agg = buf->agg;
+
+	pthread_mutex_lock(&agg->list_lock);
+	pthread_mutex_lock(&buf->lock);
+	int ret = hd_agg_flush_locked(buf);
+	pthread_mutex_unlock(&buf->lock);
+
+	if (ret != 0) {
+		/* The buffer stays in the list without an owner, its deltas are
+		 * retried by flushes of all buffers and hd_agg_destroy().*/
+		pthread_mutex_unlock(&agg->list_lock);
+		return;
+	}
+
+	for (struct hd_agg_buffer** it = &agg->buffers; *it != NULL;
+	     it = &((*it)->next)) {
+		if (*it == buf) {
+			*it = buf->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&agg->list_lock);
+
+	hd_free_parallel(&buf->local, 1);
+	pthread_mutex_destroy(&buf->lock);
+	free(buf);
+}
+
+/**
+ * @brief Returns the calling thread's buffer, creating it on first use
+ */
+static struct hd_agg_buffer*
+hd_agg_buffer_get(struct hd_aggregator* agg) {
+	struct hd_agg_buffer* buf = pthread_getspecific(agg->key);
+
+	if (buf != NULL) {
+		return buf;
+	}
+
+	buf = calloc(1, sizeof(*buf));
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	buf->agg = agg;
+	buf->local = hd_create();
+	pthread_mutex_init(&buf->lock, NULL);
+
+	if (pthread_setspecific(agg->key, buf) != 0) {
+		pthread_mutex_destroy(&buf->lock);
+		free(buf);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&agg->list_lock);
+	buf->next = agg->buffers;
+	agg->buffers = buf;
+	pthread_mutex_unlock(&agg->list_lock);
+	return buf;
+}
+
+struct hd_aggregator*
+hd_agg_create(struct hd_hashdict* dict, const struct hd_agg_config* config) {
+	if (dict == NULL) {
+		return NULL;
+	}
+
+	struct hd_aggregator* agg = calloc(1, sizeof(*agg));
+	if (agg == NULL) {
+		return NULL;
+	}
+
+	if (pthread_key_create(&agg->key, hd_agg_buffer_destroy) != 0) {
+		free(agg);
+		return NULL;
+	}
+
+	agg->dict = dict;
+	if (config != NULL) {
+		agg->config = *config;
+	}
+	pthread_mutex_init(&agg->list_lock, NULL);
+	pthread_mutex_init(&agg->dict_lock, NULL);
+	return agg;
+}
+
+void
+hd_agg_destroy(struct hd_aggregator* agg) {
+	if (agg == NULL) {
+		return;
+	}
+
+	/* Remaining buffers belong to threads still alive. Their deltas are
+	 * flushed and the buffers freed here, the thread specific values are
+	 * orphaned by deleting the key so the destructor doesn't run later.*/
+	pthread_key_delete(agg->key);
+
+	struct hd_agg_buffer* buf = agg->buffers;
+	while (buf != NULL) {
+		struct hd_agg_buffer* next = buf->next;
+		pthread_mutex_lock(&buf->lock);
+		hd_agg_flush_locked(buf);
+		pthread_mutex_unlock(&buf->lock);
+		hd_free_parallel(&buf->local, 1);
+		pthread_mutex_destroy(&buf->lock);
+		free(buf);
+		buf = next;
+	}
+
+	pthread_mutex_destroy(&agg->list_lock);
+	pthread_mutex_destroy(&agg->dict_lock);
+	free(agg);
+}
+
+int
+hd_agg_add(struct hd_aggregator* agg, const char* key, long long delta) {
+	if ((agg == NULL) || (key == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_agg_buffer* buf = hd_agg_buffer_get(agg);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&buf->lock);
+	int ret = hd_incr(&buf->local, key, delta);
+
+	if (ret == 0) {
+		buf->pending_ops++;
+
+		unsigned long long now = 0;
+		if (agg->config.max_staleness_ns != 0) {
+			now = hd_agg_now_ns();
+			if (buf->oldest_ns == 0) {
+				buf->oldest_ns = now;
+			}
+		}
+
+		if (((agg->config.flush_ops != 0) &&
+		     (buf->pending_ops >= agg->config.flush_ops)) ||
+		    ((agg->config.max_staleness_ns != 0) &&
+		     (now - buf->oldest_ns >= agg->config.max_staleness_ns))) {
+			hd_agg_flush_locked(buf);
+		}
+	}
+	pthread_mutex_unlock(&buf->lock);
+	return ret;
+}
+
+int
+hd_agg_flush(struct hd_aggregator* agg) {
+	if (agg == NULL) {
+		return -EINVAL;
+	}
+
+	struct hd_agg_buffer* buf = pthread_getspecific(agg->key);
+	if (buf == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&buf->lock);
+	int ret = hd_agg_flush_locked(buf);
+	pthread_mutex_unlock(&buf->lock);
+	return ret;
+}
+
+/**
+ * @brief Flushes the buffers of all threads
+ *
+ * @param stale_only Only flush buffers holding deltas older than the
+ * configured staleness bound
+ * @return int 0 on success, else the first error of any buffer
+ */
+static int
+hd_agg_flush_buffers(struct hd_aggregator* agg, int stale_only) {
+	unsigned long long now = stale_only ? hd_agg_now_ns() : 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&agg->list_lock);
+	for (struct hd_agg_buffer* buf = agg->buffers; buf != NULL;
+	     buf = buf->next) {
+		pthread_mutex_lock(&buf->lock);
+		if (!stale_only ||
+		    ((buf->oldest_ns != 0) &&
+		     (now - buf->oldest_ns >= agg->config.max_staleness_ns))) {
+			int err = hd_agg_flush_locked(buf);
+			if (ret == 0) {
+				ret = err;
+			}
+		}
+		pthread_mutex_unlock(&buf->lock);
+	}
+	pthread_mutex_unlock(&agg->list_lock);
+	return ret;
+}
+
+int
+hd_agg_flush_all(struct hd_aggregator* agg) {
+	if (agg == NULL) {
+		return -EINVAL;
+	}
+	return hd_agg_flush_buffers(agg, 0);
+}
+
+int
+hd_agg_get(struct hd_aggregator* agg, const char* key, long long* value) {
+	if ((agg == NULL) || (key == NULL) || (value == NULL)) {
+		return -EINVAL;
+	}
+
+	/* Deltas failing to flush stay pending, the read still reports what
+	 * the shared dictionary holds.*/
+	if (agg->config.flush_on_read) {
+		(void)hd_agg_flush_buffers(agg, 0);
+	} else if (agg->config.max_staleness_ns != 0) {
+		/* Threads which stopped adding never hit the bound themselves.*/
+		(void)hd_agg_flush_buffers(agg, 1);
+	}
+
+	pthread_mutex_lock(&agg->dict_lock);
+	int ret = hd_counter_get(agg->dict, key, value);
+	pthread_mutex_unlock(&agg->dict_lock);
+	return ret;
+}
@@ -0,0 +1,920 @@
+/**
+ * @file hashdict_bench.c
+ * @brief Throughput and latency of the basic operations
+ *
+ * For every combination of table size, key length distribution and access
+ * pattern, a fresh dictionary is filled with generated keys and each
+ * operation is run over it in turn:
+ *
+ *   insert  all keys, in random order, into an empty dictionary
+ *   hit     lookups of existing keys
+ *   miss    lookups of keys that aren't in the dictionary
+ *   update  replacing the value of existing keys
+ *   remove  all keys, in random order, until the dictionary is empty
+ *
+ * hit, miss and update pick their keys uniformly or following a Zipf
+ * distribution, with the hottest keys spread over the key set. Key indices
+ * are generated before timing starts. Throughput comes from the time of
+ * the whole run, latency percentiles from every sample_every-th operation,
+ * timed on its own with the cost of reading the clock subtracted.
+ *
+ * With -p, hardware counters are read around each run through Linux
+ * perf_event and reported per operation: instructions, cycles, cache
+ * misses, last level cache load misses, branch misses and data TLB load
+ * misses. Only user space is counted. Counters the kernel refuses, e.g.
+ * because of kernel.perf_event_paranoid or in a VM without a PMU, are
+ * reported as unavailable and the benchmark runs on without them.
+ *
+ * With -w, every dictionary logs its writes to a write-ahead log in the
+ * given directory with the default policy, so insert, update and remove
+ * include the cost of logging. The log is deleted after each run.
+ *
+ * Results are written as an aligned table, CSV or JSON, one row per
+ * operation. This is the baseline performance changes are judged against.
+ *
+ * Usage: hashdict_bench [-s sizes] [-k key_dists] [-a access] [-n ops]
+ *                       [-z theta] [-l sample_every] [-r seed] [-p]
+ *                       [-w dir] [-f table|csv|json] [-o file]
+ *
+ *   -s  comma separated table sizes, default 1000,100000,1000000; sizes up
+ *       to 100M work given the memory, keys are kept twice (hits and
+ *       misses) next to the dictionary
+ *   -k  comma separated key lengths: short (8), medium (24), long (100) or
+ *       mixed (uniform 8-64), default medium
+ *   -a  comma separated access patterns: uniform, zipf, default both
+ *   -n  operations of the hit, miss and update runs, default 1000000
+ *   -z  Zipf exponent, default 0.99
+ *   -l  time every n-th operation for the percentiles, default 8
+ *   -r  seed of the key and access generators, default 1
+ *   -p  read hardware performance counters
+ *   -w  log writes to a write-ahead log in dir
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _GNU_SOURCE /* syscall() */
+
+#include "hashdict.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HD_HAVE_PERF_EVENT
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif /* HD_HAVE_PERF_EVENT */
+
+#define DEFAULT_SIZES "1000,100000,1000000"
+#define DEFAULT_KEY_DISTS "medium"
+#define DEFAULT_ACCESS "uniform,zipf"
+#define DEFAULT_OPS 1000000
+#define DEFAULT_THETA 0.99
+#define DEFAULT_SAMPLE_EVERY 8
+#define MAX_SIZE 100000000
+#define INDEX_CHARS 6 /**< Base 36 digits making each key unique */
+#define MAX_PATH 4096
+
+enum bench_op {
+	OP_INSERT,
+	OP_HIT,
+	OP_MISS,
+	OP_UPDATE,
+	OP_REMOVE,
+	NUM_OPS,
+};
+
+static const char* const op_names[NUM_OPS] = {"insert", "hit", "miss",
+                                              "update", "remove"};
+
+/**
+ * @brief Length distribution of the generated keys
+ */
+struct key_dist {
+	const char* name;
+	size_t min_len;
+	size_t max_len;
+};
+
+static const struct key_dist key_dists[] = {
+    {"short", 8, 8},
+    {"medium", 24, 24},
+    {"long", 100, 100},
+    {"mixed", 8, 64},
+};
+
+enum access { ACCESS_UNIFORM, ACCESS_ZIPF };
+
+static const char* const access_names[] = {"uniform", "zipf"};
+
+enum format { FORMAT_TABLE, FORMAT_CSV, FORMAT_JSON };
+
+enum perf_counter {
+	PERF_INSTRUCTIONS,
+	PERF_CYCLES,
+	PERF_CACHE_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_DTLB_MISSES,
+	NUM_PERF,
+};
+
+static const char* const perf_names[NUM_PERF] = {
+    "instructions", "cycles",        "cache_misses",
+    "llc_misses",   "branch_misses", "dtlb_misses"};
+
+/** Column headers of the table format */
+static const char* const perf_columns[NUM_PERF] = {"instr", "cycles", "cache",
+                                                   "llc",   "branch", "dtlb"};
+
+/**
+ * @brief Keys stored back to back, key i starting at offsets[i]
+ */
+struct keyset {
+	char* arena;
+	size_t* offsets;
+	size_t n;
+};
+
+/**
+ * @brief One measured run of an operation
+ */
+struct result {
+	size_t size;
+	const char* keys;
+	const char* access;
+	enum bench_op op;
+	size_t ops;
+	unsigned long long elapsed_ns;
+	unsigned long long p50;
+	unsigned long long p99;
+	unsigned long long p999;
+	double perf[NUM_PERF]; /**< Counts per operation, negative if the
+	                          counter is unavailable */
+};
+
+struct bench {
+	struct hd_hashdict dict;
+	struct keyset hits;
+	struct keyset misses;
+	size_t* order; /**< Random permutation for insert and remove */
+	size_t* access; /**< Key indices for hit, miss and update */
+	size_t num_access;
+	unsigned long long* samples;
+	unsigned int sample_every;
+	unsigned long long clock_cost; /**< Subtracted from every sample */
+};
+
+static FILE* out;
+static enum format format = FORMAT_TABLE;
+static size_t rows_written;
+static int perf_enabled;
+static int perf_fds[NUM_PERF];
+static const char* wal_dir; /**< Log writes to a log in here, or NULL */
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+splitmix64(uint64_t* state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * @brief Uniform double in [0, 1)
+ */
+static double
+rand01(uint64_t* state) {
+	return (splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+cmp_ull(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns the p-th percentile of a sorted sample array
+ */
+static unsigned long long
+percentile(const unsigned long long* sorted, size_t n, double p) {
+	if (n == 0) {
+		return 0;
+	}
+	size_t idx = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+	return sorted[idx];
+}
+
+/**
+ * @brief Smallest time between two clock reads, the overhead in a sample
+ */
+static unsigned long long
+clock_cost(void) {
+	unsigned long long best = ~0ULL;
+	for (int i = 0; i < 1000; i++) {
+		unsigned long long start = now_ns();
+		unsigned long long elapsed = now_ns() - start;
+		if (elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+static inline const char*
+key_at(const struct keyset* set, size_t i) {
+	return set->arena + set->offsets[i];
+}
+
+static void
+keyset_free(struct keyset* set) {
+	free(set->arena);
+	free(set->offsets);
+	memset(set, 0, sizeof(*set));
+}
+
+/**
+ * @brief Generates n unique keys of the given length distribution
+ *
+ * Keys are random characters ending in the base 36 key index, which makes
+ * them unique. Keys of the miss set start with a character the hit set
+ * never uses, so none of them is in the dictionary.
+ */
+static int
+keyset_generate(struct keyset* set, size_t n, const struct key_dist* dist,
+                int miss, uint64_t seed) {
+	static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	uint64_t state = seed;
+	size_t span = dist->max_len - dist->min_len + 1;
+
+	set->n = n;
+	set->offsets = malloc(n * sizeof(*set->offsets));
+	set->arena = malloc(n * (dist->max_len + 1));
+	if ((set->offsets == NULL) || (set->arena == NULL)) {
+		keyset_free(set);
+		return -ENOMEM;
+	}
+
+	char* p = set->arena;
+	for (size_t i = 0; i < n; i++) {
+		size_t len = dist->min_len + splitmix64(&state) % span;
+		size_t idx = i;
+
+		set->offsets[i] = p - set->arena;
+		for (size_t j = 0; j < len - INDEX_CHARS; j++) {
+			p[j] = charset[splitmix64(&state) % 36];
+		}
+		for (size_t j = len; j > len - INDEX_CHARS; j--) {
+			p[j - 1] = charset[idx % 36];
+			idx /= 36;
+		}
+		if (miss) {
+			p[0] = '#';
+		}
+		p[len] = '\0';
+		p += len + 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Normalisation constant of a Zipf distribution over n ranks
+ */
+static double
+zeta(size_t n, double theta) {
+	double sum = 0.0;
+	for (size_t i = 1; i <= n; i++) {
+		sum += 1.0 / pow((double)i, theta);
+	}
+	return sum;
+}
+
+/**
+ * @brief Fills access with key indices picked uniformly or Zipf
+ * distributed
+ *
+ * Zipf ranks are drawn with the method of Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases", and mapped to keys by multiplying
+ * with a large prime, so popular keys aren't neighbours in insertion
+ * order.
+ */
+static void
+generate_access(size_t* access, size_t num, size_t n, enum access pattern,
+                double theta, double zetan, uint64_t seed) {
+	uint64_t state = seed;
+
+	if (pattern == ACCESS_UNIFORM) {
+		for (size_t i = 0; i < num; i++) {
+			access[i] = splitmix64(&state) % n;
+		}
+		return;
+	}
+
+	double alpha = 1.0 / (1.0 - theta);
+	double zeta2 = 1.0 + pow(0.5, theta);
+	double eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) /
+	             (1.0 - zeta2 / zetan);
+
+	for (size_t i = 0; i < num; i++) {
+		double u = rand01(&state);
+		double uz = u * zetan;
+		uint64_t rank;
+
+		if (uz < 1.0) {
+			rank = 0;
+		} else if (uz < zeta2) {
+			rank = 1;
+		} else {
+			rank = (uint64_t)((double)n * pow(eta * u - eta + 1.0, alpha));
+		}
+		if (rank >= n) {
+			rank = n - 1;
+		}
+		access[i] = (size_t)((rank * 2654435761ULL) % n);
+	}
+}
+
+/**
+ * @brief Runs one operation on the key with index idx
+ *
+ * @return int 0 if the operation had the expected outcome
+ */
+static inline int
+run_op(struct bench* b, enum bench_op op, size_t idx, size_t i) {
+	static const char* const values[] = {"value-0123456789",
+	                                     "value-abcdefghij"};
+
+	switch (op) {
+		case OP_INSERT:
+			return hd_entry_insert(&b->dict, key_at(&b->hits, idx), values[0]);
+		case OP_HIT:
+			return (hd_lookup(&b->dict, key_at(&b->hits, idx)) != NULL) ? 0
+			                                                          : -1;
+		case OP_MISS:
+			return (hd_lookup(&b->dict, key_at(&b->misses, idx)) == NULL) ? 0
+			                                                            : -1;
+		case OP_UPDATE:
+			return hd_entry_update(&b->dict, key_at(&b->hits, idx),
+			                       values[i & 1]);
+		case OP_REMOVE:
+			return hd_entry_remove(&b->dict, key_at(&b->hits, idx));
+		default:
+			return -1;
+	}
+}
+
+#ifdef HD_HAVE_PERF_EVENT
+
+/**
+ * @brief Opens the hardware counters, each on its own
+ *
+ * Counters aren't grouped, so one the CPU lacks doesn't take the others
+ * down with it. The kernel multiplexes them if there are more than
+ * hardware counters, and perf_stop() scales the counts accordingly.
+ */
+static void
+perf_open(void) {
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[NUM_PERF] = {
+	    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	    {PERF_TYPE_HW_CACHE,
+	     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	    {PERF_TYPE_HW_CACHE,
+	     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	};
+	int opened = 0;
+	int error = 0;
+
+	for (int i = 0; i < NUM_PERF; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format =
+		    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf_fds[i] >= 0) {
+			opened++;
+		} else if (error == 0) {
+			error = errno;
+		}
+	}
+
+	if (opened < NUM_PERF) {
+		fprintf(stderr,
+		        "%d of %d performance counters unavailable: %s%s\n",
+		        NUM_PERF - opened, NUM_PERF, strerror(error),
+		        ((error == EACCES) || (error == EPERM))
+		            ? ", see /proc/sys/kernel/perf_event_paranoid"
+		            : "");
+	}
+}
+
+static void
+perf_start(void) {
+	for (int i = 0; i < NUM_PERF; i++) {
+		if (perf_fds[i] >= 0) {
+			ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/**
+ * @brief Stops the counters and stores their counts per operation in res
+ */
+static void
+perf_stop(struct result* res, size_t ops) {
+	for (int i = 0; i < NUM_PERF; i++) {
+		uint64_t values[3]; /* value, time enabled, time running */
+
+		res->perf[i] = -1.0;
+		if (perf_fds[i] < 0) {
+			continue;
+		}
+		ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if ((read(perf_fds[i], values, sizeof(values)) == sizeof(values)) &&
+		    (values[2] > 0) && (ops > 0)) {
+			res->perf[i] = (double)values[0] * ((double)values[1] /
+			                                    (double)values[2]) /
+			               (double)ops;
+		}
+	}
+}
+
+static void
+perf_close(void) {
+	for (int i = 0; i < NUM_PERF; i++) {
+		if (perf_fds[i] >= 0) {
+			close(perf_fds[i]);
+		}
+	}
+}
+
+#else /* HD_HAVE_PERF_EVENT */
+
+static void
+perf_open(void) {
+	for (int i = 0; i < NUM_PERF; i++) {
+		perf_fds[i] = -1;
+	}
+	fprintf(stderr, "Performance counters aren't supported on this "
+	                "platform\n");
+}
+
+static void
+perf_start(void) {
+}
+
+static void
+perf_stop(struct result* res, size_t ops) {
+	(void)ops;
+	for (int i = 0; i < NUM_PERF; i++) {
+		res->perf[i] = -1.0;
+	}
+}
+
+static void
+perf_close(void) {
+}
+
+#endif /* HD_HAVE_PERF_EVENT */
+
+/**
+ * @brief Times op over the keys picked by indices
+ */
+static int
+measure(struct bench* b, enum bench_op op, const size_t* indices, size_t n,
+        struct result* res) {
+	size_t num_samples = 0;
+	int failed = 0;
+
+	if (perf_enabled) {
+		perf_start();
+	}
+	unsigned long long start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		if (i % b->sample_every == 0) {
+			unsigned long long t = now_ns();
+			failed |= run_op(b, op, indices[i], i);
+			t = now_ns() - t;
+			b->samples[num_samples++] = (t > b->clock_cost) ? t - b->clock_cost
+			                                                : 0;
+		} else {
+			failed |= run_op(b, op, indices[i], i);
+		}
+	}
+	res->elapsed_ns = now_ns() - start;
+	if (perf_enabled) {
+		perf_stop(res, n);
+	}
+
+	if (failed) {
+		fprintf(stderr, "%s: an operation failed\n", op_names[op]);
+		return 1;
+	}
+
+	qsort(b->samples, num_samples, sizeof(*b->samples), cmp_ull);
+	res->op = op;
+	res->ops = n;
+	res->p50 = percentile(b->samples, num_samples, 50.0);
+	res->p99 = percentile(b->samples, num_samples, 99.0);
+	res->p999 = percentile(b->samples, num_samples, 99.9);
+	return 0;
+}
+
+static void
+print_header(void) {
+	switch (format) {
+		case FORMAT_TABLE:
+			fprintf(out, "%10s %-7s %-8s %-7s %10s %10s %8s %8s %8s %8s",
+			        "size", "keys", "access", "op", "ops", "Mops/s", "ns/op",
+			        "p50", "p99", "p99.9");
+			for (int i = 0; perf_enabled && (i < NUM_PERF); i++) {
+				fprintf(out, " %8s", perf_columns[i]);
+			}
+			fprintf(out, "\n");
+			break;
+		case FORMAT_CSV:
+			fprintf(out, "size,keys,access,op,ops,seconds,ops_per_sec,"
+			             "ns_per_op,p50_ns,p99_ns,p999_ns");
+			for (int i = 0; perf_enabled && (i < NUM_PERF); i++) {
+				fprintf(out, ",%s_per_op", perf_names[i]);
+			}
+			fprintf(out, "\n");
+			break;
+		case FORMAT_JSON:
+			fprintf(out, "[");
+			break;
+	}
+}
+
+/**
+ * @brief Appends the counts per operation to the current row, empty, "-"
+ * or null for unavailable counters
+ */
+static void
+print_perf(const struct result* res) {
+	for (int i = 0; perf_enabled && (i < NUM_PERF); i++) {
+		double v = res->perf[i];
+
+		switch (format) {
+			case FORMAT_TABLE:
+				if (v < 0.0) {
+					fprintf(out, " %8s", "-");
+				} else {
+					fprintf(out, " %8.2f", v);
+				}
+				break;
+			case FORMAT_CSV:
+				if (v < 0.0) {
+					fprintf(out, ",");
+				} else {
+					fprintf(out, ",%.4f", v);
+				}
+				break;
+			case FORMAT_JSON:
+				if (v < 0.0) {
+					fprintf(out, ", \"%s_per_op\": null", perf_names[i]);
+				} else {
+					fprintf(out, ", \"%s_per_op\": %.4f", perf_names[i], v);
+				}
+				break;
+		}
+	}
+}
+
+static void
+print_result(const struct result* res) {
+	double secs = res->elapsed_ns / 1e9;
+	double ops_per_sec = (secs > 0.0) ? res->ops / secs : 0.0;
+	double ns_per_op = res->ops ? (double)res->elapsed_ns / res->ops : 0.0;
+
+	switch (format) {
+		case FORMAT_TABLE:
+			fprintf(out,
+			        "%10zu %-7s %-8s %-7s %10zu %10.2f %8.1f %8llu %8llu "
+			        "%8llu",
+			        res->size, res->keys, res->access, op_names[res->op],
+			        res->ops, ops_per_sec / 1e6, ns_per_op, res->p50,
+			        res->p99, res->p999);
+			break;
+		case FORMAT_CSV:
+			fprintf(out, "%zu,%s,%s,%s,%zu,%.6f,%.0f,%.2f,%llu,%llu,%llu",
+			        res->size, res->keys, res->access, op_names[res->op],
+			        res->ops, secs, ops_per_sec, ns_per_op, res->p50,
+			        res->p99, res->p999);
+			break;
+		case FORMAT_JSON:
+			fprintf(out,
+			        "%s\n  {\"size\": %zu, \"keys\": \"%s\", \"access\": "
+			        "\"%s\", \"op\": \"%s\", \"ops\": %zu, \"seconds\": %.6f, "
+			        "\"ops_per_sec\": %.0f, \"ns_per_op\": %.2f, "
+			        "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu",
+			        rows_written ? "," : "", res->size, res->keys,
+			        res->access, op_names[res->op], res->ops, secs,
+			        ops_per_sec, ns_per_op, res->p50, res->p99, res->p999);
+			break;
+	}
+	print_perf(res);
+	fprintf(out, (format == FORMAT_JSON) ? "}" : "\n");
+	rows_written++;
+	fflush(out);
+}
+
+static void
+print_footer(void) {
+	if (format == FORMAT_JSON) {
+		fprintf(out, "\n]\n");
+	}
+}
+
+/**
+ * @brief Runs all operations for one size, key distribution and access
+ * pattern
+ */
+static int
+run(struct bench* b, const struct key_dist* dist, enum access pattern,
+    double theta, double zetan, uint64_t seed) {
+	size_t n = b->hits.n;
+	struct result res = {.size = n,
+	                     .keys = dist->name,
+	                     .access = access_names[pattern]};
+
+	generate_access(b->access, b->num_access, n, pattern, theta, zetan,
+	                seed ^ 0x5bd1e995);
+	b->dict = hd_create();
+
+	char wal_path[MAX_PATH];
+	int ret = 0;
+	if (wal_dir != NULL) {
+		snprintf(wal_path, sizeof(wal_path), "%s/hashdict_bench.%ld.wal",
+		         wal_dir, (long)getpid());
+		ret = hd_wal_open(&b->dict, wal_path, NULL);
+		if (ret != 0) {
+			fprintf(stderr, "%s: %s\n", wal_path, strerror(-ret));
+			hd_free(&b->dict);
+			return 1;
+		}
+	}
+
+	for (enum bench_op op = OP_INSERT; (ret == 0) && (op < NUM_OPS); op++) {
+		/* insert and remove go over every key once.*/
+		int all_keys = (op == OP_INSERT) || (op == OP_REMOVE);
+
+		ret = measure(b, op, all_keys ? b->order : b->access,
+		              all_keys ? n : b->num_access, &res);
+		if (ret == 0) {
+			print_result(&res);
+		}
+	}
+
+	if (wal_dir != NULL) {
+		hd_wal_close(&b->dict);
+		unlink(wal_path);
+	}
+	hd_free(&b->dict);
+	return ret;
+}
+
+/**
+ * @brief Looks up the comma separated names of list in names
+ *
+ * @return int Number of names found, stored in indices, or -1 for an
+ * unknown name
+ */
+static int
+parse_names(const char* list, const char* const* names, size_t num_names,
+            size_t* indices, size_t max) {
+	int count = 0;
+	const char* p = list;
+
+	while (*p != '\0') {
+		size_t len = strcspn(p, ",");
+		size_t i;
+
+		for (i = 0; i < num_names; i++) {
+			if ((strlen(names[i]) == len) && !strncmp(p, names[i], len)) {
+				break;
+			}
+		}
+		if ((i == num_names) || ((size_t)count == max)) {
+			return -1;
+		}
+		indices[count++] = i;
+		p += len + (p[len] == ',');
+	}
+	return count;
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr,
+	        "Usage: %s [-s sizes] [-k key_dists] [-a access] [-n ops]\n"
+	        "       [-z theta] [-l sample_every] [-r seed] [-p]\n"
+	        "       [-w dir] [-f table|csv|json] [-o file]\n",
+	        prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	const char* sizes_arg = DEFAULT_SIZES;
+	const char* keys_arg = DEFAULT_KEY_DISTS;
+	const char* access_arg = DEFAULT_ACCESS;
+	const char* out_path = NULL;
+	size_t num_ops = DEFAULT_OPS;
+	double theta = DEFAULT_THETA;
+	unsigned int sample_every = DEFAULT_SAMPLE_EVERY;
+	uint64_t seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:k:a:n:z:l:r:pw:f:o:h")) != -1) {
+		switch (opt) {
+			case 's':
+				sizes_arg = optarg;
+				break;
+			case 'k':
+				keys_arg = optarg;
+				break;
+			case 'a':
+				access_arg = optarg;
+				break;
+			case 'n':
+				num_ops = strtoull(optarg, NULL, 10);
+				break;
+			case 'z':
+				theta = strtod(optarg, NULL);
+				break;
+			case 'l':
+				sample_every = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'p':
+				perf_enabled = 1;
+				break;
+			case 'w':
+				wal_dir = optarg;
+				break;
+			case 'f':
+				if (!strcmp(optarg, "csv")) {
+					format = FORMAT_CSV;
+				} else if (!strcmp(optarg, "json")) {
+					format = FORMAT_JSON;
+				} else if (!strcmp(optarg, "table")) {
+					format = FORMAT_TABLE;
+				} else {
+					usage(argv[0]);
+					return 2;
+				}
+				break;
+			case 'o':
+				out_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	const char* key_names[sizeof(key_dists) / sizeof(key_dists[0])];
+	for (size_t i = 0; i < sizeof(key_dists) / sizeof(key_dists[0]); i++) {
+		key_names[i] = key_dists[i].name;
+	}
+
+	size_t dist_idx[8];
+	size_t access_idx[2];
+	int num_dists = parse_names(keys_arg, key_names,
+	                            sizeof(key_names) / sizeof(key_names[0]),
+	                            dist_idx, 8);
+	int num_access = parse_names(access_arg, access_names, 2, access_idx, 2);
+
+	if ((num_dists <= 0) || (num_access <= 0) || (num_ops == 0) ||
+	    (sample_every == 0) || (theta <= 0.0) || (theta >= 1.0)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	out = stdout;
+	if ((out_path != NULL) && ((out = fopen(out_path, "w")) == NULL)) {
+		perror(out_path);
+		return 1;
+	}
+
+	struct bench b = {.sample_every = sample_every,
+	                  .clock_cost = clock_cost(),
+	                  .num_access = num_ops};
+	int ret = 0;
+
+	b.access = malloc(num_ops * sizeof(*b.access));
+	if (b.access == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	if (perf_enabled) {
+		perf_open();
+	}
+	print_header();
+
+	for (const char* p = sizes_arg; (ret == 0) && (*p != '\0');) {
+		char* end;
+		size_t n = strtoull(p, &end, 10);
+
+		if ((end == p) || (n == 0) || (n > MAX_SIZE)) {
+			fprintf(stderr, "Invalid size: %s\n", p);
+			ret = 2;
+			break;
+		}
+		p = end + (*end == ',');
+
+		size_t max_samples = ((n > num_ops) ? n : num_ops) / sample_every + 1;
+		b.order = malloc(n * sizeof(*b.order));
+		b.samples = malloc(max_samples * sizeof(*b.samples));
+		if ((b.order == NULL) || (b.samples == NULL)) {
+			fprintf(stderr, "Out of memory\n");
+			ret = 1;
+			break;
+		}
+
+		/* Random permutation of the keys, Fisher-Yates.*/
+		uint64_t state = seed;
+		for (size_t i = 0; i < n; i++) {
+			b.order[i] = i;
+		}
+		for (size_t i = n - 1; i > 0; i--) {
+			size_t j = splitmix64(&state) % (i + 1);
+			size_t tmp = b.order[i];
+			b.order[i] = b.order[j];
+			b.order[j] = tmp;
+		}
+
+		double zetan = 0.0;
+		for (int a = 0; a < num_access; a++) {
+			if (access_idx[a] == ACCESS_ZIPF) {
+				zetan = zeta(n, theta);
+			}
+		}
+
+		for (int d = 0; (ret == 0) && (d < num_dists); d++) {
+			const struct key_dist* dist = &key_dists[dist_idx[d]];
+
+			if ((keyset_generate(&b.hits, n, dist, 0, seed) != 0) ||
+			    (keyset_generate(&b.misses, n, dist, 1, seed + 1) != 0)) {
+				fprintf(stderr, "Out of memory\n");
+				ret = 1;
+			}
+			for (int a = 0; (ret == 0) && (a < num_access); a++) {
+				ret = run(&b, dist, access_idx[a], theta, zetan, seed);
+			}
+			keyset_free(&b.hits);
+			keyset_free(&b.misses);
+		}
+
+		free(b.order);
+		free(b.samples);
+		b.order = NULL;
+		b.samples = NULL;
+	}
+
+	print_footer();
+	if (perf_enabled) {
+		perf_close();
+	}
+	free(b.order);
+	free(b.samples);
+	free(b.access);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return ret;
+}
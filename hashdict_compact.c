@@ -0,0 +1,72 @@
+/**
+ * @file hashdict_compact.c
+ * @brief Merges a base dump and its delta snapshots into a new dump
+ *
+ * Loads the base with hd_load_file(), applies the deltas written by
+ * hd_snapshot_delta() in the given order and writes the result with
+ * hd_dump_file(). Each delta has to continue the chain, i.e. its base id
+ * has to be the id of the delta before it. The new dump can serve as the
+ * base of a new chain, with the id of the last delta.
+ *
+ * Usage: hashdict_compact <output> <base> [delta...]
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#include "hashdict.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+int
+main(int argc, char* argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <output> <base> [delta...]\n", argv[0]);
+		return 2;
+	}
+
+	struct hd_hashdict dict = hd_create();
+	int result = hd_load_file(&dict, argv[2], NULL);
+	if (result != 0) {
+		fprintf(stderr, "Error loading %s: %s\n", argv[2], strerror(-result));
+		return 1;
+	}
+
+	uint64_t last_id = 0;
+	for (int i = 3; i < argc; i++) {
+		uint64_t base_id;
+		uint64_t id;
+
+		result = hd_delta_apply(&dict, argv[i], &base_id, &id);
+		if (result != 0) {
+			fprintf(stderr, "Error applying %s: %s\n", argv[i],
+			        strerror(-result));
+			hd_free(&dict);
+			return 1;
+		}
+		if ((i > 3) && (base_id != last_id)) {
+			fprintf(stderr,
+			        "%s follows snapshot %" PRIu64 ", not %" PRIu64 "\n",
+			        argv[i], base_id, last_id);
+			hd_free(&dict);
+			return 1;
+		}
+		last_id = id;
+	}
+
+	result = hd_dump_file(&dict, argv[1], NULL);
+	if (result != 0) {
+		fprintf(stderr, "Error writing %s: %s\n", argv[1], strerror(-result));
+		hd_free(&dict);
+		return 1;
+	}
+
+	printf("%u entries from %d delta(s) written to %s\n", dict.num_entries,
+	       argc - 3, argv[1]);
+	if (argc > 3) {
+		printf("Last snapshot id: %" PRIu64 "\n", last_id);
+	}
+	hd_free(&dict);
+	return 0;
+}
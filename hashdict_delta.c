@@ -0,0 +1,329 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Delta file layout, all integers little endian:
+ *
+ *   header:  magic[8], u32 version, u32 reserved, u64 base_id, u64 id,
+ *            u64 num_records, u32 reserved, u32 crc32c of the preceding
+ *            44 bytes
+ *   records: num_records log records as written by hd_wal_encode(), with
+ *            seq set to id
+ *
+ * Every key written since the base holds one record with its current
+ * state: HD_WAL_SET or HD_WAL_COUNTER if it exists, HD_WAL_REMOVE as a
+ * tombstone if it doesn't. Like log records they are idempotent, so a key
+ * written while the delta is taken may appear in two deltas.
+ */
+
+#define HD_DELTA_MAGIC "HDDELTA"
+#define HD_DELTA_VERSION 1
+#define HD_DELTA_HEADER_SIZE 48
+#define HD_DELTA_BUFFER_SIZE (64 * 1024)
+
+/**
+ * @brief Keys written since the last delta, see hd_delta_track()
+ */
+struct hd_dirty {
+	pthread_mutex_t lock; /**< Protects everything below */
+	struct hd_hashdict keys; /**< Dirty keys, all with an empty value */
+	uint64_t id; /**< Id of the last snapshot */
+	int error; /**< A key couldn't be marked, deltas are incomplete */
+};
+
+void
+hd_dirty_mark(struct hd_dirty* dirty, const char* key) {
+	pthread_mutex_lock(&dirty->lock);
+	if ((dirty->error == 0) && (hd_lookup(&dirty->keys, key) == NULL)) {
+		int ret = hd_entry_insert(&dirty->keys, key, "");
+		if (ret != 0) {
+			dirty->error = ret;
+		}
+	}
+	pthread_mutex_unlock(&dirty->lock);
+}
+
+int
+hd_delta_track(struct hd_hashdict* dict, uint64_t base_id) {
+	if ((dict == NULL) || (dict->backend != NULL)) {
+		return -EINVAL;
+	}
+
+	if (dict->dirty != NULL) {
+		/* Restarting, e.g. after a new base was written.*/
+		struct hd_dirty* dirty = dict->dirty;
+
+		pthread_mutex_lock(&dirty->lock);
+		hd_free(&dirty->keys);
+		dirty->id = base_id;
+		dirty->error = 0;
+		pthread_mutex_unlock(&dirty->lock);
+		return 0;
+	}
+
+	struct hd_dirty* dirty = calloc(1, sizeof(*dirty));
+	if (dirty == NULL) {
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&dirty->lock, NULL);
+	dirty->keys = hd_create();
+	dirty->id = base_id;
+	dict->dirty = dirty;
+	return 0;
+}
+
+int
+hd_delta_untrack(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->dirty == NULL)) {
+		return -EINVAL;
+	}
+
+	hd_free(&dict->dirty->keys);
+	pthread_mutex_destroy(&dict->dirty->lock);
+	free(dict->dirty);
+	dict->dirty = NULL;
+	return 0;
+}
+
+/**
+ * @brief State of the delta being written, passed through
+ * hd_foreach_entry()
+ */
+struct hd_delta_writer {
+	struct hd_hashdict* dict;
+	int fd;
+	uint64_t id;
+	unsigned char* buf;
+	size_t cap;
+	size_t len;
+};
+
+/**
+ * @brief Appends the current state of the dirty key held by entry
+ */
+static int
+hd_delta_record(struct hd_entry* entry, void* ctx) {
+	struct hd_delta_writer* w = ctx;
+	struct hd_wal_record rec = {.seq = w->id,
+	                            .op = HD_WAL_REMOVE,
+	                            .key = entry->key,
+	                            .key_len = strlen(entry->key)};
+
+	if (hd_counter_get(w->dict, entry->key, &rec.counter) == 0) {
+		rec.op = HD_WAL_COUNTER;
+	} else if ((rec.value = hd_lookup(w->dict, entry->key)) != NULL) {
+		rec.op = HD_WAL_SET;
+		rec.value_len = strlen(rec.value);
+	}
+
+	size_t needed = hd_wal_record_size(rec.key_len, rec.value_len);
+	if (needed - HD_WAL_RECORD_HEADER_SIZE > HD_WAL_MAX_BODY) {
+		return -EFBIG;
+	}
+	if (w->len + needed > w->cap) {
+		int ret = hd_write_all(w->fd, w->buf, w->len);
+		if (ret != 0) {
+			return ret;
+		}
+		w->len = 0;
+	}
+	if (needed > w->cap) {
+		unsigned char* grown = realloc(w->buf, needed);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		w->buf = grown;
+		w->cap = needed;
+	}
+
+	w->len += hd_wal_encode(w->buf + w->len, &rec);
+	return 0;
+}
+
+/**
+ * @brief Writes the records of keys to path.tmp and renames it to path
+ */
+static int
+hd_delta_write(struct hd_hashdict* dict, struct hd_hashdict* keys,
+               uint64_t base_id, const char* path) {
+	unsigned char hdr[HD_DELTA_HEADER_SIZE] = {0};
+	memcpy(hdr, HD_DELTA_MAGIC, 8);
+	hd_put_le32(hdr + 8, HD_DELTA_VERSION);
+	hd_put_le64(hdr + 16, base_id);
+	hd_put_le64(hdr + 24, base_id + 1);
+	hd_put_le64(hdr + 32, keys->num_entries);
+	hd_put_le32(hdr + 44, hd_crc32c(0, hdr, 44));
+
+	size_t tmp_len = strlen(path) + sizeof(".tmp");
+	char* tmp_path = malloc(tmp_len);
+	struct hd_delta_writer w = {.dict = dict,
+	                            .id = base_id + 1,
+	                            .buf = malloc(HD_DELTA_BUFFER_SIZE),
+	                            .cap = HD_DELTA_BUFFER_SIZE};
+	int ret = 0;
+
+	if ((tmp_path == NULL) || (w.buf == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+	w.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w.fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = hd_write_all(w.fd, hdr, sizeof(hdr));
+	if (ret == 0) {
+		ret = hd_foreach_entry(keys, hd_delta_record, &w);
+	}
+	if (ret == 0) {
+		ret = hd_write_all(w.fd, w.buf, w.len);
+	}
+	if ((ret == 0) && (fsync(w.fd) != 0)) {
+		ret = -errno;
+	}
+	if ((close(w.fd) != 0) && (ret == 0)) {
+		ret = -errno;
+	}
+	if ((ret == 0) && (rename(tmp_path, path) != 0)) {
+		ret = -errno;
+	}
+	if (ret != 0) {
+		unlink(tmp_path);
+	}
+out:
+	free(tmp_path);
+	free(w.buf);
+	return ret;
+}
+
+/**
+ * @brief Marks the key held by entry again, after a failed delta
+ */
+static int
+hd_delta_remark(struct hd_entry* entry, void* ctx) {
+	hd_dirty_mark(ctx, entry->key);
+	return 0;
+}
+
+int
+hd_snapshot_delta(struct hd_hashdict* dict, uint64_t base_id,
+                  const char* path) {
+	if ((dict == NULL) || (path == NULL) || (dict->dirty == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_dirty* dirty = dict->dirty;
+
+	/* Take the dirty keys and start a new set, so counters can keep being
+	 * added to while the delta is written.*/
+	pthread_mutex_lock(&dirty->lock);
+	int ret = dirty->error;
+	if ((ret == 0) && (base_id != dirty->id)) {
+		ret = -ESTALE;
+	}
+	struct hd_hashdict keys = dirty->keys;
+	if (ret == 0) {
+		dirty->keys = hd_create();
+	}
+	pthread_mutex_unlock(&dirty->lock);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = hd_delta_write(dict, &keys, base_id, path);
+
+	pthread_mutex_lock(&dirty->lock);
+	if (ret == 0) {
+		dirty->id = base_id + 1;
+	}
+	pthread_mutex_unlock(&dirty->lock);
+	if (ret != 0) {
+		/* The keys still need to go into the next delta.*/
+		hd_foreach_entry(&keys, hd_delta_remark, dirty);
+	}
+	hd_free(&keys);
+	return ret;
+}
+
+int
+hd_delta_apply(struct hd_hashdict* dict, const char* path,
+               uint64_t* base_id, uint64_t* id) {
+	if ((dict == NULL) || (path == NULL)) {
+		return -EINVAL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if (st.st_size < HD_DELTA_HEADER_SIZE) {
+		close(fd);
+		return -EBADMSG;
+	}
+
+	unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -errno;
+	}
+
+	int ret = 0;
+	if (memcmp(map, HD_DELTA_MAGIC, 8) ||
+	    (hd_get_le32(map + 44) != hd_crc32c(0, map, 44))) {
+		ret = -EBADMSG;
+	} else if (hd_get_le32(map + 8) != HD_DELTA_VERSION) {
+		ret = -ENOTSUP;
+	}
+
+	uint64_t num_records = hd_get_le64(map + 32);
+	const unsigned char* p = map + HD_DELTA_HEADER_SIZE;
+	const unsigned char* end = map + st.st_size;
+
+	for (uint64_t i = 0; (ret == 0) && (i < num_records); i++) {
+		struct hd_wal_record rec;
+		ssize_t size = hd_wal_decode(p, end - p, &rec);
+
+		if (size <= 0) {
+			ret = -EBADMSG;
+			break;
+		}
+		ret = hd_wal_apply(dict, &rec);
+		p += size;
+	}
+	if ((ret == 0) && (p != end)) {
+		ret = -EBADMSG;
+	}
+
+	if (ret == 0) {
+		if (base_id != NULL) {
+			*base_id = hd_get_le64(map + 16);
+		}
+		if (id != NULL) {
+			*id = hd_get_le64(map + 24);
+		}
+	}
+	munmap(map, st.st_size);
+	return ret;
+}
@@ -0,0 +1,987 @@
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Dump stream layout, all integers little endian:
+ *
+ *   header:  magic[8], u32 version, u32 flags, u64 num_entries,
+ *            u32 reserved, u32 crc32c of the preceding 28 bytes
+ *   blocks:  u32 payload_len, u32 num_records, u32 crc32c of payload,
+ *            [u32 raw_len if HD_DUMP_FLAG_COMPRESSED], payload
+ *   end:     a block with payload_len and num_records 0
+ *   index:   if HD_DUMP_FLAG_INDEX, for every block u64 offset,
+ *            u32 payload_len, u32 raw_len, u32 num_records, followed by
+ *            u64 offset of the index, u32 num_blocks, u32 crc32c of the
+ *            index entries and magic[8]
+ *
+ * The payload holds num_records records, LZ4 compressed to payload_len
+ * bytes if it is shorter than raw_len, which is the size of the records.
+ * Records are u8 type, varint key_len, key, '\0' followed by
+ * varint value_len, value, '\0' for strings or a zigzag varint for
+ * counters. Keeping the terminators lets the loader use keys and values
+ * straight from the block buffer.
+ *
+ * Blocks are independent of each other, so with the index at the end of
+ * the file they can be read and decompressed by several threads.
+ */
+
+#define HD_DUMP_MAGIC "HDDUMP\0"
+#define HD_DUMP_VERSION 1
+#define HD_DUMP_HEADER_SIZE 32
+#define HD_DUMP_BLOCK_HEADER_SIZE 12
+#define HD_DUMP_ZBLOCK_HEADER_SIZE 16 /**< With HD_DUMP_FLAG_COMPRESSED */
+#define HD_DUMP_INDEX_MAGIC "HDINDEX"
+#define HD_DUMP_INDEX_ENTRY_SIZE 20
+#define HD_DUMP_TRAILER_SIZE 24
+#define HD_DUMP_BLOCK_SIZE (256 * 1024) /**< Target payload per block */
+#define HD_DUMP_MAX_PAYLOAD (1u << 30) /**< Larger blocks are corrupt */
+
+enum hd_dump_record_type {
+	HD_DUMP_STRING = 0,
+	HD_DUMP_COUNTER = 1,
+};
+
+enum hd_dump_flags {
+	HD_DUMP_FLAG_COMPRESSED = 1 << 0,
+	HD_DUMP_FLAG_INDEX = 1 << 1,
+};
+
+/**
+ * @brief Block currently being filled by hd_dump()
+ *
+ * buf starts with room for the block header, which is filled in once the
+ * block is complete.
+ */
+struct hd_dump_writer {
+	int fd;
+	struct hd_io_file* io; /**< Used instead of fd if not NULL */
+	uint32_t flags;
+	size_t header_size; /**< Size of the block header */
+	unsigned char* buf;
+	size_t cap;
+	size_t len;
+	uint32_t num_records;
+	unsigned char* zbuf; /**< Compressed block, same layout as buf */
+	size_t zcap;
+	uint64_t offset; /**< Bytes written so far */
+	unsigned char* index; /**< Index entries of the blocks written */
+	size_t index_len;
+	size_t index_cap;
+};
+
+/**
+ * @brief Writes to io if set, otherwise to fd
+ */
+static int
+hd_dump_write(int fd, struct hd_io_file* io, const void* buf, size_t len) {
+	return (io != NULL) ? hd_io_write(io, buf, len)
+	                    : hd_write_all(fd, buf, len);
+}
+
+/**
+ * @brief Reads from io if set, otherwise from fd
+ */
+static ssize_t
+hd_load_read(int fd, struct hd_io_file* io, void* buf, size_t len) {
+	return (io != NULL) ? hd_io_read(io, buf, len)
+	                    : hd_read_full(fd, buf, len);
+}
+
+/**
+ * @brief Adds the block about to be written to the index
+ */
+static int
+hd_dump_index_block(struct hd_dump_writer* w, uint32_t payload_len,
+                    uint32_t raw_len) {
+	if (w->index_len + HD_DUMP_INDEX_ENTRY_SIZE > w->index_cap) {
+		size_t cap = w->index_cap ? 2 * w->index_cap
+		                          : 64 * HD_DUMP_INDEX_ENTRY_SIZE;
+		unsigned char* grown = realloc(w->index, cap);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		w->index = grown;
+		w->index_cap = cap;
+	}
+
+	unsigned char* e = w->index + w->index_len;
+	hd_put_le64(e, w->offset);
+	hd_put_le32(e + 8, payload_len);
+	hd_put_le32(e + 12, raw_len);
+	hd_put_le32(e + 16, w->num_records);
+	w->index_len += HD_DUMP_INDEX_ENTRY_SIZE;
+	return 0;
+}
+
+static int
+hd_dump_flush_block(struct hd_dump_writer* w) {
+	size_t hs = w->header_size;
+	size_t raw_len = w->len - hs;
+	size_t payload_len = raw_len;
+	unsigned char* block = w->buf;
+
+	if ((w->flags & HD_DUMP_FLAG_COMPRESSED) && (raw_len > 0)) {
+		if (w->zcap < w->len) {
+			unsigned char* grown = realloc(w->zbuf, w->len);
+			if (grown == NULL) {
+				return -ENOMEM;
+			}
+			w->zbuf = grown;
+			w->zcap = w->len;
+		}
+		/* Blocks that don't shrink are stored as they are.*/
+		size_t z = hd_lz_compress(w->buf + hs, raw_len, w->zbuf + hs,
+		                          raw_len - 1);
+		if (z > 0) {
+			block = w->zbuf;
+			payload_len = z;
+		}
+	}
+
+	hd_put_le32(block, (uint32_t)payload_len);
+	hd_put_le32(block + 4, w->num_records);
+	hd_put_le32(block + 8, hd_crc32c(0, block + hs, payload_len));
+	if (hs == HD_DUMP_ZBLOCK_HEADER_SIZE) {
+		hd_put_le32(block + 12, (uint32_t)raw_len);
+	}
+
+	int ret = 0;
+	if ((w->flags & HD_DUMP_FLAG_INDEX) && (w->num_records > 0)) {
+		ret = hd_dump_index_block(w, payload_len, raw_len);
+	}
+	if (ret == 0) {
+		ret = hd_dump_write(w->fd, w->io, block, hs + payload_len);
+	}
+	w->offset += hs + payload_len;
+	w->len = hs;
+	w->num_records = 0;
+	return ret;
+}
+
+/**
+ * @brief Writes the block index and the trailer locating it
+ */
+static int
+hd_dump_write_index(struct hd_dump_writer* w) {
+	unsigned char trailer[HD_DUMP_TRAILER_SIZE];
+
+	hd_put_le64(trailer, w->offset);
+	hd_put_le32(trailer + 8,
+	            (uint32_t)(w->index_len / HD_DUMP_INDEX_ENTRY_SIZE));
+	hd_put_le32(trailer + 12, hd_crc32c(0, w->index, w->index_len));
+	memcpy(trailer + 16, HD_DUMP_INDEX_MAGIC, 8);
+
+	int ret = 0;
+	if (w->index_len > 0) {
+		ret = hd_dump_write(w->fd, w->io, w->index, w->index_len);
+	}
+	if (ret == 0) {
+		ret = hd_dump_write(w->fd, w->io, trailer, sizeof(trailer));
+	}
+	return ret;
+}
+
+static int
+hd_dump_record(const struct hd_record* rec, void* ctx) {
+	struct hd_dump_writer* w = ctx;
+	size_t needed =
+	    1 + 2 * HD_VARINT_MAX + rec->key_len + 1 + rec->value_len + 1;
+
+	if ((w->num_records > 0) &&
+	    (w->len + needed > w->header_size + HD_DUMP_BLOCK_SIZE)) {
+		int ret = hd_dump_flush_block(w);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if (w->len + needed > w->cap) {
+		if (needed > HD_DUMP_MAX_PAYLOAD) {
+			return -EFBIG;
+		}
+		unsigned char* buf = realloc(w->buf, w->len + needed);
+		if (buf == NULL) {
+			return -ENOMEM;
+		}
+		w->buf = buf;
+		w->cap = w->len + needed;
+	}
+
+	unsigned char* p = w->buf + w->len;
+	*p++ = (rec->value == NULL) ? HD_DUMP_COUNTER : HD_DUMP_STRING;
+	p = hd_put_varint(p, rec->key_len);
+	memcpy(p, rec->key, rec->key_len + 1);
+	p += rec->key_len + 1;
+
+	if (rec->value == NULL) {
+		/* Zigzag encoding keeps small negative counters short.*/
+		uint64_t v = rec->counter;
+		p = hd_put_varint(p, (v << 1) ^ (uint64_t)(rec->counter >> 63));
+	} else {
+		p = hd_put_varint(p, rec->value_len);
+		memcpy(p, rec->value, rec->value_len + 1);
+		p += rec->value_len + 1;
+	}
+
+	w->len = p - w->buf;
+	w->num_records++;
+	return 0;
+}
+
+/**
+ * @brief Writes the dump of dict to io, or to fd if io is NULL
+ */
+static int
+hd_dump_stream(struct hd_hashdict* dict, int fd, struct hd_io_file* io,
+               uint32_t flags) {
+	unsigned char hdr[HD_DUMP_HEADER_SIZE] = {0};
+	memcpy(hdr, HD_DUMP_MAGIC, 8);
+	hd_put_le32(hdr + 8, HD_DUMP_VERSION);
+	hd_put_le32(hdr + 12, flags);
+
+	size_t hs = (flags & HD_DUMP_FLAG_COMPRESSED)
+	                ? HD_DUMP_ZBLOCK_HEADER_SIZE
+	                : HD_DUMP_BLOCK_HEADER_SIZE;
+	struct hd_dump_writer w = {.fd = fd,
+	                           .io = io,
+	                           .flags = flags,
+	                           .header_size = hs,
+	                           .buf = malloc(hs + HD_DUMP_BLOCK_SIZE),
+	                           .cap = hs + HD_DUMP_BLOCK_SIZE,
+	                           .len = hs,
+	                           .offset = sizeof(hdr)};
+
+	if (w.buf == NULL) {
+		return -ENOMEM;
+	}
+
+	hd_put_le64(hdr + 16, hd_read_begin(dict));
+	hd_put_le32(hdr + 28, hd_crc32c(0, hdr, 28));
+
+	int ret = hd_dump_write(fd, io, hdr, sizeof(hdr));
+	if (ret == 0) {
+		ret = hd_foreach_record(dict, hd_dump_record, &w);
+	}
+	hd_read_end(dict);
+	if ((ret == 0) && (w.num_records > 0)) {
+		ret = hd_dump_flush_block(&w);
+	}
+	if (ret == 0) {
+		/* An empty block terminates the stream.*/
+		ret = hd_dump_flush_block(&w);
+	}
+	if ((ret == 0) && (flags & HD_DUMP_FLAG_INDEX)) {
+		ret = hd_dump_write_index(&w);
+	}
+
+	free(w.buf);
+	free(w.zbuf);
+	free(w.index);
+	return ret;
+}
+
+/**
+ * @brief A record as parsed from a block payload
+ */
+struct hd_load_record {
+	const char* key;
+	const char* value; /**< NULL for counters */
+	long long counter;
+};
+
+/**
+ * @brief Parses the record at p, which must end before end
+ *
+ * @return const unsigned char* The byte after the record, or NULL if it is
+ * malformed
+ */
+static const unsigned char*
+hd_load_parse(const unsigned char* p, const unsigned char* end,
+              struct hd_load_record* rec) {
+	uint64_t key_len;
+	uint64_t v;
+
+	if (p >= end) {
+		return NULL;
+	}
+	unsigned char type = *p++;
+
+	p = hd_get_varint(p, end, &key_len);
+	if ((p == NULL) || (key_len >= (uint64_t)(end - p)) || p[key_len]) {
+		return NULL;
+	}
+	rec->key = (const char*)p;
+	p += key_len + 1;
+
+	p = hd_get_varint(p, end, &v);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	if (type == HD_DUMP_STRING) {
+		if ((v >= (uint64_t)(end - p)) || p[v]) {
+			return NULL;
+		}
+		rec->value = (const char*)p;
+		return p + v + 1;
+	}
+	if (type == HD_DUMP_COUNTER) {
+		rec->value = NULL;
+		rec->counter = (long long)(v >> 1) ^ -(long long)(v & 1);
+		return p;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Adds a loaded counter, which must not exist yet
+ */
+static int
+hd_load_counter(struct hd_hashdict* dict, const char* key, long long counter) {
+	long long existing;
+	int ret = (hd_counter_get(dict, key, &existing) != 0)
+	              ? hd_add(dict, key, counter, NULL)
+	              : -EINVAL;
+
+	/* Duplicate keys can only come from a corrupt stream.*/
+	return (ret == -EINVAL) ? -EBADMSG : ret;
+}
+
+/**
+ * @brief Inserts the records of one verified block payload
+ *
+ * @return int 0 on success, -EBADMSG if the payload is malformed, -ENOMEM
+ * if out of memory
+ */
+static int
+hd_load_block(struct hd_hashdict* dict, const unsigned char* p,
+              const unsigned char* end, uint32_t num_records) {
+	for (uint32_t i = 0; i < num_records; i++) {
+		struct hd_load_record rec;
+		int ret;
+
+		p = hd_load_parse(p, end, &rec);
+		if (p == NULL) {
+			return -EBADMSG;
+		}
+
+		if (rec.value != NULL) {
+			ret = hd_entry_insert(dict, rec.key, rec.value);
+			ret = (ret == -EINVAL) ? -EBADMSG : ret;
+		} else {
+			ret = hd_load_counter(dict, rec.key, rec.counter);
+		}
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return (p == end) ? 0 : -EBADMSG;
+}
+
+/**
+ * @brief Checks a dump header and returns its flags
+ *
+ * @return int 0 on success, -EBADMSG if the header is corrupt, -ENOTSUP if
+ * it is of an unknown version or uses unknown flags
+ */
+static int
+hd_load_header(const unsigned char* hdr, uint32_t* flags,
+               uint64_t* num_entries) {
+	if (memcmp(hdr, HD_DUMP_MAGIC, 8) ||
+	    (hd_get_le32(hdr + 28) != hd_crc32c(0, hdr, 28))) {
+		return -EBADMSG;
+	}
+	*flags = hd_get_le32(hdr + 12);
+	if ((hd_get_le32(hdr + 8) != HD_DUMP_VERSION) ||
+	    (*flags & ~(uint32_t)(HD_DUMP_FLAG_COMPRESSED | HD_DUMP_FLAG_INDEX))) {
+		return -ENOTSUP;
+	}
+	*num_entries = hd_get_le64(hdr + 16);
+	return (*num_entries > UINT32_MAX) ? -EBADMSG : 0;
+}
+
+/**
+ * @brief Checks the index trailer and the index entries it locates
+ *
+ * @return int 0 on success, -EBADMSG if they are corrupt
+ */
+static int
+hd_load_check_index(const unsigned char* trailer, const unsigned char* index,
+                    uint32_t num_blocks) {
+	if (memcmp(trailer + 16, HD_DUMP_INDEX_MAGIC, 8) ||
+	    (hd_get_le32(trailer + 8) != num_blocks) ||
+	    (hd_get_le32(trailer + 12) !=
+	     hd_crc32c(0, index, (size_t)num_blocks * HD_DUMP_INDEX_ENTRY_SIZE))) {
+		return -EBADMSG;
+	}
+	return 0;
+}
+
+/**
+ * @brief Reads the index and trailer following the end block
+ */
+static int
+hd_load_stream_index(int fd, struct hd_io_file* io, uint64_t offset,
+                     uint32_t num_blocks) {
+	size_t len = (size_t)num_blocks * HD_DUMP_INDEX_ENTRY_SIZE;
+	unsigned char* index = malloc(len + HD_DUMP_TRAILER_SIZE);
+
+	if (index == NULL) {
+		return -ENOMEM;
+	}
+
+	ssize_t n = hd_load_read(fd, io, index, len + HD_DUMP_TRAILER_SIZE);
+	int ret = (n < 0) ? (int)n : 0;
+	if ((ret == 0) && ((size_t)n != len + HD_DUMP_TRAILER_SIZE)) {
+		ret = -EBADMSG;
+	}
+	if (ret == 0) {
+		ret = hd_load_check_index(index + len, index, num_blocks);
+	}
+	if ((ret == 0) && (hd_get_le64(index + len) != offset)) {
+		ret = -EBADMSG;
+	}
+	free(index);
+	return ret;
+}
+
+/**
+ * @brief Loads a dump from io, or from fd if io is NULL
+ */
+static int
+hd_load_stream(struct hd_hashdict* dict, int fd, struct hd_io_file* io) {
+	unsigned char hdr[HD_DUMP_HEADER_SIZE];
+	ssize_t n = hd_load_read(fd, io, hdr, sizeof(hdr));
+	uint32_t flags;
+	uint64_t num_entries;
+
+	if (n < 0) {
+		return n;
+	}
+	if (n != sizeof(hdr)) {
+		return -EBADMSG;
+	}
+	int ret = hd_load_header(hdr, &flags, &num_entries);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* Size the table for the whole stream upfront, so nothing is rehashed
+	 * while loading.*/
+	if (hd_reserve(dict, num_entries) != 0) {
+		return -ENOMEM;
+	}
+
+	size_t hs = (flags & HD_DUMP_FLAG_COMPRESSED)
+	                ? HD_DUMP_ZBLOCK_HEADER_SIZE
+	                : HD_DUMP_BLOCK_HEADER_SIZE;
+	unsigned char* buf = NULL;
+	size_t cap = 0;
+	unsigned char* raw = NULL;
+	size_t raw_cap = 0;
+	uint64_t offset = sizeof(hdr);
+	uint64_t loaded = 0;
+	uint32_t num_blocks = 0;
+
+	for (;;) {
+		unsigned char bhdr[HD_DUMP_ZBLOCK_HEADER_SIZE];
+
+		n = hd_load_read(fd, io, bhdr, hs);
+		if (n != (ssize_t)hs) {
+			ret = (n < 0) ? (int)n : -EBADMSG;
+			break;
+		}
+
+		uint32_t payload_len = hd_get_le32(bhdr);
+		uint32_t num_records = hd_get_le32(bhdr + 4);
+		uint32_t raw_len = (hs == HD_DUMP_ZBLOCK_HEADER_SIZE)
+		                       ? hd_get_le32(bhdr + 12)
+		                       : payload_len;
+
+		offset += hs + payload_len;
+		if ((payload_len == 0) && (num_records == 0) && (raw_len == 0)) {
+			ret = (loaded == num_entries) ? 0 : -EBADMSG;
+			break;
+		}
+		if ((raw_len > HD_DUMP_MAX_PAYLOAD) || (payload_len > raw_len) ||
+		    (num_records > raw_len)) {
+			ret = -EBADMSG;
+			break;
+		}
+
+		if (payload_len > cap) {
+			unsigned char* grown = realloc(buf, payload_len);
+			if (grown == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+			buf = grown;
+			cap = payload_len;
+		}
+
+		n = hd_load_read(fd, io, buf, payload_len);
+		if (n != payload_len) {
+			ret = (n < 0) ? (int)n : -EBADMSG;
+			break;
+		}
+		if (hd_get_le32(bhdr + 8) != hd_crc32c(0, buf, payload_len)) {
+			ret = -EBADMSG;
+			break;
+		}
+
+		const unsigned char* records = buf;
+		if (payload_len < raw_len) {
+			if (raw_len > raw_cap) {
+				unsigned char* grown = realloc(raw, raw_len);
+				if (grown == NULL) {
+					ret = -ENOMEM;
+					break;
+				}
+				raw = grown;
+				raw_cap = raw_len;
+			}
+			if (hd_lz_decompress(buf, payload_len, raw, raw_len) !=
+			    raw_len) {
+				ret = -EBADMSG;
+				break;
+			}
+			records = raw;
+		}
+
+		ret = hd_load_block(dict, records, records + raw_len, num_records);
+		if (ret != 0) {
+			break;
+		}
+		loaded += num_records;
+		num_blocks++;
+	}
+
+	if ((ret == 0) && (flags & HD_DUMP_FLAG_INDEX)) {
+		ret = hd_load_stream_index(fd, io, offset, num_blocks);
+	}
+
+	free(buf);
+	free(raw);
+	if (ret != 0) {
+		hd_free_parallel(dict, 1);
+	}
+	return ret;
+}
+
+/**
+ * @brief Blocks of an indexed dump, shared by the hd_load_parallel()
+ * workers
+ *
+ * Block i is decompressed into raw[i] and its records are parsed into
+ * keys, values and counters starting at first[i].
+ */
+struct hd_load_blocks {
+	int fd;
+	size_t header_size;
+	const unsigned char* index;
+	uint32_t num_blocks;
+	uint64_t* first;
+	unsigned char** raw;
+	const char** keys;
+	const char** values; /**< NULL for counters */
+	long long* counters;
+};
+
+/**
+ * @brief State of one hd_load_parallel() worker, which loads every nth
+ * block starting at block t
+ */
+struct hd_load_worker {
+	struct hd_load_blocks* blocks;
+	unsigned int t;
+	unsigned int n;
+	unsigned char* buf; /**< Compressed payload */
+	size_t cap;
+	size_t num_counters;
+	int error;
+};
+
+/**
+ * @brief Reads, verifies, decompresses and parses block i
+ */
+static int
+hd_load_worker_block(struct hd_load_worker* w, uint32_t i) {
+	struct hd_load_blocks* b = w->blocks;
+	const unsigned char* e = b->index + (size_t)i * HD_DUMP_INDEX_ENTRY_SIZE;
+	uint32_t payload_len = hd_get_le32(e + 8);
+	uint32_t raw_len = hd_get_le32(e + 12);
+	uint32_t num_records = hd_get_le32(e + 16);
+	size_t len = b->header_size + payload_len;
+
+	if (len > w->cap) {
+		unsigned char* grown = realloc(w->buf, len);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		w->buf = grown;
+		w->cap = len;
+	}
+
+	ssize_t n = hd_pread_full(b->fd, w->buf, len, hd_get_le64(e));
+	if (n != (ssize_t)len) {
+		return (n < 0) ? (int)n : -EBADMSG;
+	}
+
+	const unsigned char* payload = w->buf + b->header_size;
+	if ((hd_get_le32(w->buf) != payload_len) ||
+	    (hd_get_le32(w->buf + 4) != num_records) ||
+	    (hd_get_le32(w->buf + 8) != hd_crc32c(0, payload, payload_len)) ||
+	    ((b->header_size == HD_DUMP_ZBLOCK_HEADER_SIZE) &&
+	     (hd_get_le32(w->buf + 12) != raw_len))) {
+		return -EBADMSG;
+	}
+
+	unsigned char* raw = malloc(raw_len);
+	if (raw == NULL) {
+		return -ENOMEM;
+	}
+	b->raw[i] = raw;
+
+	if (payload_len < raw_len) {
+		if (hd_lz_decompress(payload, payload_len, raw, raw_len) !=
+		    raw_len) {
+			return -EBADMSG;
+		}
+	} else {
+		memcpy(raw, payload, raw_len);
+	}
+
+	const unsigned char* p = raw;
+	const unsigned char* end = raw + raw_len;
+	for (uint64_t r = b->first[i]; r < b->first[i] + num_records; r++) {
+		struct hd_load_record rec;
+
+		p = hd_load_parse(p, end, &rec);
+		if (p == NULL) {
+			return -EBADMSG;
+		}
+		b->keys[r] = rec.key;
+		b->values[r] = rec.value;
+		if (rec.value == NULL) {
+			b->counters[r] = rec.counter;
+			w->num_counters++;
+		}
+	}
+	return (p == end) ? 0 : -EBADMSG;
+}
+
+static void*
+hd_load_worker_run(void* arg) {
+	struct hd_load_worker* w = arg;
+
+	for (uint32_t i = w->t; (w->error == 0) && (i < w->blocks->num_blocks);
+	     i += w->n) {
+		w->error = hd_load_worker_block(w, i);
+	}
+	free(w->buf);
+	return NULL;
+}
+
+/**
+ * @brief Reads the index of an indexed dump at fd
+ *
+ * Checks that the blocks it lists are laid out back to back from the
+ * header to the end block, and hold num_entries records in total.
+ *
+ * @return int 0 on success, 1 if the dump has no index
+ */
+static int
+hd_load_read_index(int fd, size_t* header_size, unsigned char** index,
+                   uint32_t* num_blocks, uint64_t* num_entries) {
+	unsigned char hdr[HD_DUMP_HEADER_SIZE];
+	unsigned char trailer[HD_DUMP_TRAILER_SIZE];
+	uint32_t flags;
+
+	ssize_t n = hd_pread_full(fd, hdr, sizeof(hdr), 0);
+	if (n != sizeof(hdr)) {
+		return (n < 0) ? (int)n : -EBADMSG;
+	}
+	int ret = hd_load_header(hdr, &flags, num_entries);
+	if ((ret != 0) || !(flags & HD_DUMP_FLAG_INDEX)) {
+		return (ret != 0) ? ret : 1;
+	}
+	*header_size = (flags & HD_DUMP_FLAG_COMPRESSED)
+	                   ? HD_DUMP_ZBLOCK_HEADER_SIZE
+	                   : HD_DUMP_BLOCK_HEADER_SIZE;
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		return -errno;
+	}
+	if (size < HD_DUMP_HEADER_SIZE + HD_DUMP_TRAILER_SIZE) {
+		return -EBADMSG;
+	}
+	n = hd_pread_full(fd, trailer, sizeof(trailer), size - sizeof(trailer));
+	if (n != sizeof(trailer)) {
+		return (n < 0) ? (int)n : -EBADMSG;
+	}
+
+	/* The index must fill the space between the end block and the
+	 * trailer exactly.*/
+	uint64_t index_offset = hd_get_le64(trailer);
+	*num_blocks = hd_get_le32(trailer + 8);
+	size_t len = (size_t)*num_blocks * HD_DUMP_INDEX_ENTRY_SIZE;
+	if ((index_offset < HD_DUMP_HEADER_SIZE + *header_size) ||
+	    (index_offset + len + sizeof(trailer) != (uint64_t)size)) {
+		return -EBADMSG;
+	}
+
+	*index = malloc(len ? len : 1);
+	if (*index == NULL) {
+		return -ENOMEM;
+	}
+	n = hd_pread_full(fd, *index, len, index_offset);
+	ret = (n < 0) ? (int)n : 0;
+	if ((ret == 0) && ((size_t)n != len)) {
+		ret = -EBADMSG;
+	}
+	if (ret == 0) {
+		ret = hd_load_check_index(trailer, *index, *num_blocks);
+	}
+
+	uint64_t offset = HD_DUMP_HEADER_SIZE;
+	uint64_t records = 0;
+	for (uint32_t i = 0; (ret == 0) && (i < *num_blocks); i++) {
+		const unsigned char* e = *index + (size_t)i * HD_DUMP_INDEX_ENTRY_SIZE;
+		uint32_t payload_len = hd_get_le32(e + 8);
+		uint32_t raw_len = hd_get_le32(e + 12);
+		uint32_t num_records = hd_get_le32(e + 16);
+
+		if ((hd_get_le64(e) != offset) || (raw_len > HD_DUMP_MAX_PAYLOAD) ||
+		    (payload_len > raw_len) || (num_records == 0) ||
+		    (num_records > raw_len)) {
+			ret = -EBADMSG;
+		}
+		offset += *header_size + payload_len;
+		records += num_records;
+	}
+	if ((ret == 0) && ((offset + *header_size != index_offset) ||
+	                   (records != *num_entries))) {
+		ret = -EBADMSG;
+	}
+
+	if (ret != 0) {
+		free(*index);
+		*index = NULL;
+	}
+	return ret;
+}
+
+/**
+ * @brief Loads an indexed dump at fd on nthreads threads
+ *
+ * Workers decompress and parse the blocks in parallel, then the table is
+ * built from the parsed records by hd_build_parallel().
+ *
+ * @return int 0 on success, 1 if the dump has no index and must be loaded
+ * sequentially
+ */
+static int
+hd_load_parallel(struct hd_hashdict* dict, int fd, unsigned int nthreads) {
+	struct hd_load_blocks b = {.fd = fd};
+	uint64_t num_entries;
+
+	int ret = hd_load_read_index(fd, &b.header_size,
+	                             (unsigned char**)&b.index, &b.num_blocks,
+	                             &num_entries);
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (nthreads > b.num_blocks) {
+		nthreads = b.num_blocks ? b.num_blocks : 1;
+	}
+
+	size_t n = num_entries ? num_entries : 1;
+	b.first = malloc((b.num_blocks + 1) * sizeof(*b.first));
+	b.raw = calloc(b.num_blocks + 1, sizeof(*b.raw));
+	b.keys = malloc(n * sizeof(*b.keys));
+	b.values = malloc(n * sizeof(*b.values));
+	b.counters = malloc(n * sizeof(*b.counters));
+	struct hd_load_worker* workers = calloc(nthreads, sizeof(*workers));
+
+	if ((b.first == NULL) || (b.raw == NULL) || (b.keys == NULL) ||
+	    (b.values == NULL) || (b.counters == NULL) || (workers == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	uint64_t first = 0;
+	for (uint32_t i = 0; i < b.num_blocks; i++) {
+		b.first[i] = first;
+		first += hd_get_le32(b.index + (size_t)i * HD_DUMP_INDEX_ENTRY_SIZE +
+		                     16);
+	}
+
+	for (unsigned int t = 0; t < nthreads; t++) {
+		workers[t].blocks = &b;
+		workers[t].t = t;
+		workers[t].n = nthreads;
+	}
+
+	hd_run_parallel(hd_load_worker_run, workers, sizeof(*workers), nthreads);
+
+	size_t num_counters = 0;
+	for (unsigned int t = 0; t < nthreads; t++) {
+		if ((ret == 0) && (workers[t].error != 0)) {
+			ret = workers[t].error;
+		}
+		num_counters += workers[t].num_counters;
+	}
+	if (ret != 0) {
+		goto out;
+	}
+
+	/* Move the counters out of the way, hd_build_parallel() only takes
+	 * strings. Both compactions only ever move records to the front.*/
+	const char** counter_keys = NULL;
+	size_t num_strings = 0;
+	size_t c = 0;
+
+	if ((num_counters > 0) &&
+	    ((counter_keys = malloc(num_counters * sizeof(*counter_keys))) ==
+	     NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (size_t i = 0; i < num_entries; i++) {
+		if (b.values[i] != NULL) {
+			b.keys[num_strings] = b.keys[i];
+			b.values[num_strings++] = b.values[i];
+		} else {
+			counter_keys[c] = b.keys[i];
+			b.counters[c++] = b.counters[i];
+		}
+	}
+
+	ret = hd_build_parallel(dict, b.keys, b.values, num_strings, nthreads);
+	if (ret == -EINVAL) {
+		/* The dictionary was checked to be empty, so the keys repeat.*/
+		ret = -EBADMSG;
+	}
+	for (size_t i = 0; (ret == 0) && (i < num_counters); i++) {
+		ret = hd_load_counter(dict, counter_keys[i], b.counters[i]);
+	}
+	if (ret != 0) {
+		hd_free_parallel(dict, nthreads);
+	}
+	free(counter_keys);
+
+out:
+	for (uint32_t i = 0; (b.raw != NULL) && (i < b.num_blocks); i++) {
+		free(b.raw[i]);
+	}
+	free((void*)b.index);
+	free(b.first);
+	free(b.raw);
+	free(b.keys);
+	free(b.values);
+	free(b.counters);
+	free(workers);
+	return ret;
+}
+
+int
+hd_dump(struct hd_hashdict* dict, int fd) {
+	if ((dict == NULL) || (fd < 0)) {
+		return -EINVAL;
+	}
+	return hd_dump_stream(dict, fd, NULL, 0);
+}
+
+int
+hd_load(struct hd_hashdict* dict, int fd) {
+	if ((dict == NULL) || (fd < 0) || (dict->num_entries != 0) ||
+	    (dict->backend != NULL)) {
+		return -EINVAL;
+	}
+	return hd_load_stream(dict, fd, NULL);
+}
+
+int
+hd_dump_file(struct hd_hashdict* dict, const char* path,
+             const struct hd_io_config* config) {
+	if ((dict == NULL) || (path == NULL)) {
+		return -EINVAL;
+	}
+
+	size_t tmp_len = strlen(path) + sizeof(".tmp");
+	char* tmp_path = malloc(tmp_len);
+	if (tmp_path == NULL) {
+		return -ENOMEM;
+	}
+	snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+	struct hd_io_file* io;
+	int ret = hd_io_open(&io, tmp_path, O_WRONLY | O_CREAT | O_TRUNC, config);
+	if (ret != 0) {
+		free(tmp_path);
+		return ret;
+	}
+
+	uint32_t flags = HD_DUMP_FLAG_INDEX;
+	if ((config != NULL) && config->compress) {
+		flags |= HD_DUMP_FLAG_COMPRESSED;
+	}
+
+	ret = hd_dump_stream(dict, -1, io, flags);
+	int close_ret = hd_io_close(io, ret == 0);
+	if (ret == 0) {
+		ret = close_ret;
+	}
+	if ((ret == 0) && (rename(tmp_path, path) != 0)) {
+		ret = -errno;
+	}
+	if (ret != 0) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	return ret;
+}
+
+int
+hd_load_file(struct hd_hashdict* dict, const char* path,
+             const struct hd_io_config* config) {
+	if ((dict == NULL) || (path == NULL) || (dict->num_entries != 0) ||
+	    (dict->backend != NULL)) {
+		return -EINVAL;
+	}
+
+	int ret;
+
+	/* hd_build_parallel() needs a dictionary without a bucket array.*/
+	if ((config != NULL) && (config->threads > 1) && (dict->entries == NULL) &&
+	    (dict->wal == NULL) && (dict->dirty == NULL) &&
+	    (dict->repl == NULL)) {
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return -errno;
+		}
+		ret = hd_load_parallel(dict, fd, config->threads);
+		close(fd);
+		if (ret != 1) {
+			return ret;
+		}
+	}
+
+	struct hd_io_file* io;
+	ret = hd_io_open(&io, path, O_RDONLY, config);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = hd_load_stream(dict, -1, io);
+	hd_io_close(io, 0);
+	return ret;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file hashdict_dump_bench.c
+ * @brief Dump size and load time of plain and compressed dump files
+ *
+ * Fills a dictionary with keys and values that look like typical
+ * identifiers, then writes it with hd_dump_file() with and without block
+ * compression and times hd_load_file() on each file, sequentially and with
+ * the given number of threads. Files are read from the page cache after
+ * the first run, so the numbers show decoding cost more than disk speed.
+ *
+ * Usage: hashdict_dump_bench [num_entries] [threads] [path]
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of entries to insert if none is given on the command line
+#define DEFAULT_NUM_ENTRIES 1000000
+#define DEFAULT_THREADS 4
+#define DEFAULT_PATH "hashdict_dump_bench.dump"
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Loads path into a fresh dictionary and checks its size
+ *
+ * @return unsigned long long Load time in ns, 0 on failure
+ */
+static unsigned long long
+time_load(const char* path, const struct hd_io_config* config,
+          size_t num_entries) {
+	struct hd_hashdict dict = hd_create();
+	unsigned long long start = now_ns();
+	int result = hd_load_file(&dict, path, config);
+	unsigned long long elapsed = now_ns() - start;
+
+	if (result != 0) {
+		fprintf(stderr, "Error loading %s: %s\n", path, strerror(-result));
+		return 0;
+	}
+	if (dict.num_entries != num_entries) {
+		fprintf(stderr, "Loaded %u entries instead of %zu\n",
+		        dict.num_entries, num_entries);
+		elapsed = 0;
+	}
+	hd_free_parallel(&dict, config->threads);
+	return elapsed;
+}
+
+static int
+run(struct hd_hashdict* dict, const char* name, const char* path,
+    int compress, unsigned int threads) {
+	struct hd_io_config config = {.compress = compress};
+	struct stat st;
+
+	unsigned long long start = now_ns();
+	int result = hd_dump_file(dict, path, &config);
+	unsigned long long dump_ns = now_ns() - start;
+
+	if ((result != 0) || (stat(path, &st) != 0)) {
+		fprintf(stderr, "Error writing %s: %s\n", path,
+		        strerror(result ? -result : 0));
+		return 1;
+	}
+
+	unsigned long long seq_ns = time_load(path, &config, dict->num_entries);
+	config.threads = threads;
+	unsigned long long par_ns = time_load(path, &config, dict->num_entries);
+	unlink(path);
+
+	if ((seq_ns == 0) || (par_ns == 0)) {
+		return 1;
+	}
+
+	printf("%-12s %10.1f %10.1f %10.1f %10.1f %8.2f\n", name,
+	       (double)st.st_size / (1024.0 * 1024.0), dump_ns / 1e6,
+	       seq_ns / 1e6, par_ns / 1e6, (double)seq_ns / (double)par_ns);
+	return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+	size_t num_entries = DEFAULT_NUM_ENTRIES;
+	unsigned int threads = DEFAULT_THREADS;
+	const char* path = DEFAULT_PATH;
+
+	if (argc > 1) {
+		num_entries = strtoull(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		threads = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		path = argv[3];
+	}
+
+	struct hd_hashdict dict = hd_create();
+	char key_buffer[48];
+	char value_buffer[64];
+
+	for (size_t i = 0; i < num_entries; i++) {
+		snprintf(key_buffer, sizeof(key_buffer), "user:%08zu:session", i);
+		snprintf(value_buffer, sizeof(value_buffer),
+		         "{\"id\":%zu,\"state\":\"%s\",\"ttl\":%zu}", i,
+		         (i % 3) ? "active" : "idle", 60 * (i % 60));
+
+		int result = hd_entry_insert(&dict, key_buffer, value_buffer);
+		if (result != 0) {
+			fprintf(stderr, "Error inserting entry %zu: %s\n", i,
+			        strerror(-result));
+			return 1;
+		}
+	}
+
+	printf("%zu entries, %u threads for parallel loads\n\n", num_entries,
+	       threads);
+	printf("%-12s %10s %10s %10s %10s %8s\n", "format", "MiB", "dump ms",
+	       "load ms", "par ms", "speedup");
+
+	int ret = run(&dict, "plain", path, 0, threads);
+	if (ret == 0) {
+		ret = run(&dict, "compressed", path, 1, threads);
+	}
+
+	hd_free(&dict);
+	return ret;
+}
@@ -0,0 +1,327 @@
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HD_EXPORT_BUF_SIZE (64 * 1024)
+
+/* Fixed column widths of HD_EXPORT_TABLE*/
+#define HD_TABLE_KEY_WIDTH 13
+#define HD_TABLE_VAL_WIDTH 48
+#define HD_TABLE_IDX_WIDTH 6
+
+/**
+ * @brief Buffered writer of hd_export()
+ *
+ * Rows are assembled in buf and handed to stdio in large blocks, which
+ * avoids the formatting and locking of a printf() call per field.
+ */
+struct hd_export_writer {
+	FILE* out;
+	enum hd_export_format format;
+	size_t max_rows;
+	size_t rows;
+	int error;
+	size_t len;
+	char buf[HD_EXPORT_BUF_SIZE];
+};
+
+static void
+hd_export_flush(struct hd_export_writer* w) {
+	errno = 0;
+	if ((w->len > 0) && (w->error == 0) &&
+	    (fwrite(w->buf, 1, w->len, w->out) != w->len)) {
+		w->error = (errno != 0) ? -errno : -EIO;
+	}
+	w->len = 0;
+}
+
+static void
+hd_export_put(struct hd_export_writer* w, const char* s, size_t len) {
+	while (len > 0) {
+		if (w->len == sizeof(w->buf)) {
+			hd_export_flush(w);
+		}
+
+		size_t n = sizeof(w->buf) - w->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->buf + w->len, s, n);
+		w->len += n;
+		s += n;
+		len -= n;
+	}
+}
+
+static inline void
+hd_export_putc(struct hd_export_writer* w, char c) {
+	if (w->len == sizeof(w->buf)) {
+		hd_export_flush(w);
+	}
+	w->buf[w->len++] = c;
+}
+
+static void
+hd_export_puts(struct hd_export_writer* w, const char* s) {
+	hd_export_put(w, s, strlen(s));
+}
+
+/**
+ * @brief Writes a decimal number, returns the number of digits written
+ */
+static size_t
+hd_export_put_num(struct hd_export_writer* w, long long v) {
+	char digits[24];
+	size_t n = 0;
+	unsigned long long u = (unsigned long long)v;
+
+	if (v < 0) {
+		u = 0 - u;
+	}
+
+	do {
+		digits[sizeof(digits) - ++n] = (char)('0' + u % 10);
+		u /= 10;
+	} while (u > 0);
+	if (v < 0) {
+		digits[sizeof(digits) - ++n] = '-';
+	}
+	hd_export_put(w, digits + sizeof(digits) - n, n);
+	return n;
+}
+
+static void
+hd_export_pad(struct hd_export_writer* w, size_t n) {
+	while (n-- > 0) {
+		hd_export_putc(w, ' ');
+	}
+}
+
+/**
+ * @brief Writes s escaped for a TSV field
+ *
+ * Tabs, newlines, carriage returns and backslashes become \t, \n, \r and
+ * \\, so every record stays one line of two fields.
+ */
+static void
+hd_export_tsv_escaped(struct hd_export_writer* w, const char* s, size_t len) {
+	const char* run = s;
+	const char* end = s + len;
+
+	for (; s < end; s++) {
+		const char* esc = NULL;
+
+		switch (*s) {
+			case '\t':
+				esc = "\\t";
+				break;
+			case '\n':
+				esc = "\\n";
+				break;
+			case '\r':
+				esc = "\\r";
+				break;
+			case '\\':
+				esc = "\\\\";
+				break;
+			default:
+				continue;
+		}
+		hd_export_put(w, run, s - run);
+		hd_export_put(w, esc, 2);
+		run = s + 1;
+	}
+	hd_export_put(w, run, end - run);
+}
+
+/**
+ * @brief Writes s as a JSON string, quotes included
+ *
+ * Bytes from 0x80 on are copied as they are, keys and values are expected
+ * to be UTF-8.
+ */
+static void
+hd_export_json_string(struct hd_export_writer* w, const char* s, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const char* run = s;
+	const char* end = s + len;
+
+	hd_export_putc(w, '"');
+	for (; s < end; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+			continue;
+		}
+		hd_export_put(w, run, s - run);
+		run = s + 1;
+
+		hd_export_putc(w, '\\');
+		switch (c) {
+			case '"':
+			case '\\':
+				hd_export_putc(w, (char)c);
+				break;
+			case '\n':
+				hd_export_putc(w, 'n');
+				break;
+			case '\r':
+				hd_export_putc(w, 'r');
+				break;
+			case '\t':
+				hd_export_putc(w, 't');
+				break;
+			default:
+				hd_export_puts(w, "u00");
+				hd_export_putc(w, hex[c >> 4]);
+				hd_export_putc(w, hex[c & 0xf]);
+				break;
+		}
+	}
+	hd_export_put(w, run, end - run);
+	hd_export_putc(w, '"');
+}
+
+/**
+ * @brief Writes a column of HD_EXPORT_TABLE, truncated with an ellipsis
+ */
+static void
+hd_export_table_cell(struct hd_export_writer* w, const char* s, size_t len,
+                     size_t width) {
+	if (len > width - 4) {
+		hd_export_put(w, s, width - 4);
+		hd_export_puts(w, "...");
+		len = width - 1;
+	} else {
+		hd_export_put(w, s, len);
+	}
+	hd_export_pad(w, width - len);
+}
+
+/**
+ * @brief Writes a horizontal rule of HD_EXPORT_TABLE
+ */
+static void
+hd_export_table_rule(struct hd_export_writer* w, const char* left,
+                     const char* cross, const char* right) {
+	const size_t widths[] = {HD_TABLE_IDX_WIDTH, HD_TABLE_KEY_WIDTH,
+	                         HD_TABLE_VAL_WIDTH};
+
+	hd_export_puts(w, left);
+	for (size_t col = 0; col < 3; col++) {
+		if (col > 0) {
+			hd_export_puts(w, cross);
+		}
+		for (size_t i = 0; i < widths[col] + 2; i++) {
+			hd_export_puts(w, "─");
+		}
+	}
+	hd_export_puts(w, right);
+	hd_export_putc(w, '\n');
+}
+
+static int
+hd_export_record(const struct hd_record* rec, void* ctx) {
+	struct hd_export_writer* w = ctx;
+
+	if ((w->max_rows != 0) && (w->rows == w->max_rows)) {
+		return 1;
+	}
+	w->rows++;
+
+	switch (w->format) {
+		case HD_EXPORT_TSV:
+			hd_export_tsv_escaped(w, rec->key, rec->key_len);
+			hd_export_putc(w, '\t');
+			if (rec->value != NULL) {
+				hd_export_tsv_escaped(w, rec->value, rec->value_len);
+			} else {
+				hd_export_put_num(w, rec->counter);
+			}
+			hd_export_putc(w, '\n');
+			break;
+		case HD_EXPORT_JSONL:
+			hd_export_puts(w, "{\"key\":");
+			hd_export_json_string(w, rec->key, rec->key_len);
+			if (rec->value != NULL) {
+				hd_export_puts(w, ",\"value\":");
+				hd_export_json_string(w, rec->value, rec->value_len);
+			} else {
+				hd_export_puts(w, ",\"counter\":");
+				hd_export_put_num(w, rec->counter);
+			}
+			hd_export_puts(w, "}\n");
+			break;
+		case HD_EXPORT_TABLE:
+			hd_export_puts(w, "│ ");
+			size_t digits = hd_export_put_num(w, rec->bucket);
+			hd_export_pad(w, (digits < HD_TABLE_IDX_WIDTH)
+			                     ? HD_TABLE_IDX_WIDTH - digits
+			                     : 0);
+			hd_export_puts(w, " │ ");
+			hd_export_table_cell(w, rec->key, rec->key_len, HD_TABLE_KEY_WIDTH);
+			hd_export_puts(w, " │ ");
+			if (rec->value != NULL) {
+				hd_export_table_cell(w, rec->value, rec->value_len,
+				                     HD_TABLE_VAL_WIDTH);
+			} else {
+				/* At most 20 characters, never truncated.*/
+				digits = hd_export_put_num(w, rec->counter);
+				hd_export_pad(w, HD_TABLE_VAL_WIDTH - digits);
+			}
+			hd_export_puts(w, " │\n");
+			break;
+	}
+	return (w->error != 0) ? w->error : 0;
+}
+
+int
+hd_export(struct hd_hashdict* dict, FILE* out, enum hd_export_format format,
+          size_t max_rows) {
+	if ((dict == NULL) || (out == NULL) ||
+	    ((format != HD_EXPORT_TSV) && (format != HD_EXPORT_JSONL) &&
+	     (format != HD_EXPORT_TABLE))) {
+		return -EINVAL;
+	}
+
+	struct hd_export_writer* w = malloc(sizeof(*w));
+	if (w == NULL) {
+		return -ENOMEM;
+	}
+	w->out = out;
+	w->format = format;
+	w->max_rows = max_rows;
+	w->rows = 0;
+	w->error = 0;
+	w->len = 0;
+
+	if (format == HD_EXPORT_TABLE) {
+		hd_export_table_rule(w, "┌", "─", "┐");
+		hd_export_puts(w, "│ Bucket │ Key           │ Value");
+		hd_export_pad(w, HD_TABLE_VAL_WIDTH - 5);
+		hd_export_puts(w, " │\n");
+		hd_export_table_rule(w, "├", "┼", "┤");
+	}
+
+	hd_read_begin(dict);
+	int ret = hd_foreach_record(dict, hd_export_record, w);
+	hd_read_end(dict);
+
+	if (format == HD_EXPORT_TABLE) {
+		hd_export_table_rule(w, "└", "┴", "┘");
+	}
+	hd_export_flush(w);
+
+	if (ret > 0) {
+		/* Stopped at max_rows.*/
+		ret = 0;
+	}
+	if (w->error != 0) {
+		ret = w->error;
+	}
+	free(w);
+	return ret;
+}
@@ -0,0 +1,542 @@
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Frozen dictionaries use a minimal perfect hash function in the style of
+ * PTHash: keys are spread over buckets of about HD_FROZEN_BUCKET_KEYS keys,
+ * and every bucket gets a 16 bit pilot which displaces its keys onto free
+ * positions of a table slightly larger than the number of keys. Positions
+ * beyond the number of keys are remapped onto the holes left below it, so
+ * the final slot numbers are exactly 0 .. n-1 and index the records.
+ *
+ * Records are stored back to back in slot order. Only the offset of every
+ * HD_FROZEN_GROUP-th record is kept, a lookup skips the records before its
+ * own within the group. Every record is laid out as
+ *
+ *   varint key_len, varint tag, key, '\0', then value, '\0' if tag is
+ *   value_len + 1, or the counter as a zigzag varint if tag is 0
+ */
+
+#define HD_FROZEN_BUCKET_KEYS 4 /**< Average number of keys per bucket */
+#define HD_FROZEN_LOAD 98 /**< Percentage of positions holding a key */
+#define HD_FROZEN_MAX_SEEDS 16 /**< Seeds tried before giving up */
+#define HD_FROZEN_MAX_PILOT UINT16_MAX
+#define HD_FROZEN_GROUP 8 /**< Records per stored offset */
+
+/**
+ * @brief Backend of a frozen dictionary
+ */
+struct hd_frozen {
+	struct hd_backend backend;
+	uint64_t seed;
+	uint64_t num_keys;
+	uint64_t num_positions; /**< Table size the pilots displace into */
+	uint64_t num_buckets;
+	uint16_t* pilots; /**< Pilot of every bucket */
+	uint32_t* remap; /**< Slot of every position >= num_keys */
+	/** Offset of every HD_FROZEN_GROUP-th record, 32 bits wide if data is
+	 * below 4 GiB */
+	uint32_t* groups32;
+	uint64_t* groups64;
+	unsigned char* data; /**< All records, ordered by slot */
+	size_t data_size;
+};
+
+/**
+ * @brief A record of data, decoded
+ */
+struct hd_frozen_record {
+	const char* key;
+	uint64_t key_len;
+	const char* value; /**< NULL for counters */
+	uint64_t value_len;
+	long long counter;
+};
+
+/**
+ * @brief Key of the dictionary being frozen
+ */
+struct hd_frozen_key {
+	struct hd_record rec;
+	uint64_t hash;
+	uint64_t bucket;
+	uint64_t position;
+};
+
+/**
+ * @brief Collects the records of the dictionary being frozen
+ */
+struct hd_frozen_builder {
+	struct hd_frozen_key* keys;
+	size_t num_keys;
+	size_t data_size; /**< Upper bound, see hd_frozen_record_size() */
+};
+
+static uint64_t
+hd_frozen_bucket(const struct hd_frozen* frozen, uint64_t hash) {
+	return (hash >> 32) % frozen->num_buckets;
+}
+
+static uint64_t
+hd_frozen_position(const struct hd_frozen* frozen, uint64_t hash,
+                   uint16_t pilot) {
+	/* The pilot is mixed (splitmix64 finalizer) so consecutive pilots
+	 * displace keys to unrelated positions.*/
+	uint64_t x = pilot + frozen->seed;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (hash ^ x) % frozen->num_positions;
+}
+
+/**
+ * @brief Upper bound of the encoded size of rec
+ */
+static uint64_t
+hd_frozen_group(const struct hd_frozen* frozen, uint64_t group) {
+	return frozen->groups32 ? frozen->groups32[group]
+	                        : frozen->groups64[group];
+}
+
+static size_t
+hd_frozen_record_size(const struct hd_record* rec) {
+	return 3 * HD_VARINT_MAX + rec->key_len + 1 +
+	       ((rec->value == NULL) ? 0 : rec->value_len + 1);
+}
+
+/**
+ * @brief Encodes rec at p
+ *
+ * @return unsigned char* The byte after the record
+ */
+static unsigned char*
+hd_frozen_put_record(unsigned char* p, const struct hd_record* rec) {
+	p = hd_put_varint(p, rec->key_len);
+	p = hd_put_varint(p, (rec->value == NULL) ? 0 : rec->value_len + 1);
+	memcpy(p, rec->key, rec->key_len + 1);
+	p += rec->key_len + 1;
+	if (rec->value == NULL) {
+		uint64_t v = (uint64_t)rec->counter;
+		p = hd_put_varint(p, (v << 1) ^ (uint64_t)(rec->counter >> 63));
+	} else {
+		memcpy(p, rec->value, rec->value_len + 1);
+		p += rec->value_len + 1;
+	}
+	return p;
+}
+
+/**
+ * @brief Returns the record following the one at p
+ */
+static const unsigned char*
+hd_frozen_skip_record(const struct hd_frozen* frozen, const unsigned char* p) {
+	const unsigned char* end = frozen->data + frozen->data_size;
+	uint64_t key_len;
+	uint64_t tag;
+
+	p = hd_get_varint(p, end, &key_len);
+	p = hd_get_varint(p, end, &tag);
+	p += key_len + 1;
+	if (tag == 0) {
+		while (*p++ & 0x80) {
+		}
+		return p;
+	}
+	return p + tag;
+}
+
+/**
+ * @brief Decodes the record at p, which hd_frozen_put_record() wrote
+ *
+ * @return const unsigned char* The byte after the record
+ */
+static const unsigned char*
+hd_frozen_get_record(const struct hd_frozen* frozen, const unsigned char* p,
+                     struct hd_frozen_record* rec) {
+	const unsigned char* end = frozen->data + frozen->data_size;
+	uint64_t tag;
+
+	p = hd_get_varint(p, end, &rec->key_len);
+	p = hd_get_varint(p, end, &tag);
+	rec->key = (const char*)p;
+	p += rec->key_len + 1;
+	if (tag == 0) {
+		uint64_t v;
+		p = hd_get_varint(p, end, &v);
+		rec->value = NULL;
+		rec->value_len = 0;
+		rec->counter = (long long)((v >> 1) ^ (~(v & 1) + 1));
+	} else {
+		rec->value = (const char*)p;
+		rec->value_len = tag - 1;
+		rec->counter = 0;
+		p += tag;
+	}
+	return p;
+}
+
+static int
+hd_frozen_collect(const struct hd_record* rec, void* ctx) {
+	struct hd_frozen_builder* b = ctx;
+
+	b->keys[b->num_keys].rec = *rec;
+	b->num_keys++;
+	b->data_size += hd_frozen_record_size(rec);
+	return 0;
+}
+
+/**
+ * @brief Finds pilots placing every key on a distinct position
+ *
+ * Buckets are placed largest first while the table is still empty, the
+ * many small buckets at the end find free positions quickly.
+ *
+ * @return int 0 on success, -EAGAIN if a bucket can't be placed with this
+ * seed, -ENOMEM if out of memory
+ */
+static int
+hd_frozen_search(struct hd_frozen* frozen, struct hd_frozen_key* keys) {
+	uint64_t n = frozen->num_keys;
+	uint64_t nb = frozen->num_buckets;
+	uint64_t* bucket_start = calloc(nb + 1, sizeof(uint64_t));
+	uint64_t* order = malloc(nb * sizeof(uint64_t));
+	uint64_t* by_bucket = malloc(n * sizeof(uint64_t));
+	unsigned char* taken = calloc((frozen->num_positions + 7) / 8, 1);
+	uint64_t max_size = 0;
+	int ret = 0;
+
+	if ((bucket_start == NULL) || (order == NULL) || (by_bucket == NULL) ||
+	    (taken == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		keys[i].hash = hd_hash64(keys[i].rec.key, keys[i].rec.key_len,
+		                         frozen->seed);
+		keys[i].bucket = hd_frozen_bucket(frozen, keys[i].hash);
+		bucket_start[keys[i].bucket + 1]++;
+	}
+
+	/* Counting sort of the keys by bucket.*/
+	for (uint64_t b = 0; b < nb; b++) {
+		if (bucket_start[b + 1] > max_size) {
+			max_size = bucket_start[b + 1];
+		}
+		bucket_start[b + 1] += bucket_start[b];
+	}
+	{
+		uint64_t* fill = malloc(nb * sizeof(uint64_t));
+		if (fill == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(fill, bucket_start, nb * sizeof(uint64_t));
+		for (uint64_t i = 0; i < n; i++) {
+			by_bucket[fill[keys[i].bucket]++] = i;
+		}
+		free(fill);
+	}
+
+	/* Non-empty buckets by decreasing size, again with a counting sort:
+	 * size_start[s] becomes the position of the first bucket of size s.*/
+	uint64_t* size_start = calloc(max_size + 2, sizeof(uint64_t));
+	if (size_start == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (uint64_t b = 0; b < nb; b++) {
+		size_start[bucket_start[b + 1] - bucket_start[b]]++;
+	}
+	uint64_t pos = 0;
+	for (uint64_t size = max_size; size > 0; size--) {
+		uint64_t count = size_start[size];
+		size_start[size] = pos;
+		pos += count;
+	}
+	for (uint64_t b = 0; b < nb; b++) {
+		uint64_t size = bucket_start[b + 1] - bucket_start[b];
+		if (size > 0) {
+			order[size_start[size]++] = b;
+		}
+	}
+	free(size_start);
+
+	memset(frozen->pilots, 0, nb * sizeof(uint16_t));
+
+	for (uint64_t o = 0; o < pos; o++) {
+		uint64_t b = order[o];
+		uint64_t first = bucket_start[b];
+		uint64_t last = bucket_start[b + 1];
+		uint32_t pilot = 0;
+
+		for (; pilot <= HD_FROZEN_MAX_PILOT; pilot++) {
+			uint64_t k = first;
+			for (; k < last; k++) {
+				struct hd_frozen_key* key = &keys[by_bucket[k]];
+				key->position =
+				    hd_frozen_position(frozen, key->hash, (uint16_t)pilot);
+				if (taken[key->position / 8] & (1u << (key->position % 8))) {
+					break;
+				}
+				/* Mark right away so keys of the same bucket can't land on
+				 * the same position, undone below if the pilot fails.*/
+				taken[key->position / 8] |= 1u << (key->position % 8);
+			}
+			if (k == last) {
+				break;
+			}
+			while (k-- > first) {
+				uint64_t p = keys[by_bucket[k]].position;
+				taken[p / 8] &= ~(1u << (p % 8));
+			}
+		}
+
+		if (pilot > HD_FROZEN_MAX_PILOT) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		frozen->pilots[b] = (uint16_t)pilot;
+	}
+
+	/* Remap taken positions beyond the number of keys onto the free
+	 * positions below it.*/
+	uint64_t hole = 0;
+	for (uint64_t p = n; p < frozen->num_positions; p++) {
+		if (taken[p / 8] & (1u << (p % 8))) {
+			while (taken[hole / 8] & (1u << (hole % 8))) {
+				hole++;
+			}
+			frozen->remap[p - n] = (uint32_t)hole++;
+		}
+	}
+out:
+	free(bucket_start);
+	free(order);
+	free(by_bucket);
+	free(taken);
+	return ret;
+}
+
+static uint64_t
+hd_frozen_slot(const struct hd_frozen* frozen, uint64_t position) {
+	return (position < frozen->num_keys)
+	           ? position
+	           : frozen->remap[position - frozen->num_keys];
+}
+
+/**
+ * @brief Decodes the record of key into rec
+ *
+ * @return int 1 if key was found, else 0
+ */
+static int
+hd_frozen_find(const struct hd_frozen* frozen, const char* key,
+               struct hd_frozen_record* rec) {
+	if (frozen->num_keys == 0) {
+		return 0;
+	}
+
+	size_t key_len = strlen(key);
+	uint64_t hash = hd_hash64(key, key_len, frozen->seed);
+	uint16_t pilot = frozen->pilots[hd_frozen_bucket(frozen, hash)];
+	uint64_t slot =
+	    hd_frozen_slot(frozen, hd_frozen_position(frozen, hash, pilot));
+	const unsigned char* p =
+	    frozen->data + hd_frozen_group(frozen, slot / HD_FROZEN_GROUP);
+
+	for (uint64_t skip = slot % HD_FROZEN_GROUP; skip > 0; skip--) {
+		p = hd_frozen_skip_record(frozen, p);
+	}
+	hd_frozen_get_record(frozen, p, rec);
+
+	/* Keys which are not in the dictionary map to some slot as well, the
+	 * key comparison tells them apart.*/
+	return (rec->key_len == key_len) && (memcmp(rec->key, key, key_len) == 0);
+}
+
+static const char*
+hd_frozen_lookup(struct hd_backend* backend, const char* key) {
+	struct hd_frozen_record rec;
+
+	if (!hd_frozen_find((struct hd_frozen*)backend, key, &rec)) {
+		return NULL;
+	}
+	return rec.value;
+}
+
+static int
+hd_frozen_counter_get(struct hd_backend* backend, const char* key,
+                      long long* value) {
+	struct hd_frozen_record rec;
+
+	if (!hd_frozen_find((struct hd_frozen*)backend, key, &rec) ||
+	    (rec.value != NULL)) {
+		return -EINVAL;
+	}
+	*value = rec.counter;
+	return 0;
+}
+
+static int
+hd_frozen_foreach(struct hd_backend* backend,
+                  int (*fn)(const struct hd_record* rec, void* ctx),
+                  void* ctx) {
+	struct hd_frozen* frozen = (struct hd_frozen*)backend;
+	const unsigned char* p = frozen->data;
+
+	for (uint64_t slot = 0; slot < frozen->num_keys; slot++) {
+		struct hd_frozen_record frec;
+		p = hd_frozen_get_record(frozen, p, &frec);
+
+		struct hd_record rec = {.key = frec.key,
+		                        .key_len = frec.key_len,
+		                        .value = frec.value,
+		                        .value_len = frec.value_len,
+		                        .counter = frec.counter,
+		                        .bucket = (unsigned int)slot};
+		int ret = fn(&rec, ctx);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void
+hd_frozen_free(struct hd_backend* backend) {
+	struct hd_frozen* frozen = (struct hd_frozen*)backend;
+
+	free(frozen->pilots);
+	free(frozen->remap);
+	free(frozen->groups32);
+	free(frozen->groups64);
+	free(frozen->data);
+	free(frozen);
+}
+
+static const struct hd_backend_ops hd_frozen_ops = {
+    .lookup = hd_frozen_lookup,
+    .counter_get = hd_frozen_counter_get,
+    .foreach = hd_frozen_foreach,
+    .free = hd_frozen_free,
+};
+
+int
+hd_freeze(struct hd_hashdict* dict) {
+	if (dict == NULL) {
+		return -EINVAL;
+	}
+
+	/* The collected records point into the dictionary, which for shared
+	 * memory may change as soon as the read lock is dropped. It is held
+	 * until every key and value has been copied.*/
+	uint64_t n = hd_read_begin(dict);
+	struct hd_frozen* frozen = calloc(1, sizeof(*frozen));
+	struct hd_frozen_builder b = {
+	    .keys = malloc((n ? n : 1) * sizeof(struct hd_frozen_key)),
+	    .num_keys = 0,
+	    .data_size = 0};
+	int ret = 0;
+
+	if ((frozen == NULL) || (b.keys == NULL)) {
+		ret = -ENOMEM;
+	} else {
+		ret = hd_foreach_record(dict, hd_frozen_collect, &b);
+	}
+	if (ret != 0) {
+		goto err;
+	}
+
+	frozen->backend.ops = &hd_frozen_ops;
+	frozen->num_keys = n;
+	frozen->num_positions = n * 100 / HD_FROZEN_LOAD + 1;
+	frozen->num_buckets = n / HD_FROZEN_BUCKET_KEYS + 1;
+	frozen->pilots = malloc(frozen->num_buckets * sizeof(uint16_t));
+	/* Zeroed, a key which isn't in the dictionary may land on a position
+	 * no key took and must still map to a valid slot.*/
+	frozen->remap =
+	    calloc(frozen->num_positions - n + 1, sizeof(uint32_t));
+	frozen->data = malloc(b.data_size ? b.data_size : 1);
+	if (b.data_size <= UINT32_MAX) {
+		frozen->groups32 =
+		    malloc((n / HD_FROZEN_GROUP + 1) * sizeof(uint32_t));
+	} else {
+		frozen->groups64 =
+		    malloc((n / HD_FROZEN_GROUP + 1) * sizeof(uint64_t));
+	}
+
+	if ((frozen->pilots == NULL) || (frozen->remap == NULL) ||
+	    (frozen->data == NULL) ||
+	    ((frozen->groups32 == NULL) && (frozen->groups64 == NULL))) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/* A seed only fails if two keys of a bucket share their 64 bit hash or
+	 * by very bad luck, so a few retries are plenty.*/
+	ret = -EAGAIN;
+	for (uint64_t seed = 0; (ret == -EAGAIN) && (seed < HD_FROZEN_MAX_SEEDS);
+	     seed++) {
+		frozen->seed = seed * 0x9e3779b97f4a7c15ULL;
+		ret = hd_frozen_search(frozen, b.keys);
+	}
+	if (ret == -EAGAIN) {
+		ret = -EINVAL;
+	}
+	if (ret != 0) {
+		goto err;
+	}
+
+	/* Records are copied in slot order, so a lookup finds its record by
+	 * skipping at most HD_FROZEN_GROUP - 1 others after the group's
+	 * offset.*/
+	uint64_t* slot_key = malloc((n ? n : 1) * sizeof(uint64_t));
+	if (slot_key == NULL) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	for (uint64_t i = 0; i < n; i++) {
+		slot_key[hd_frozen_slot(frozen, b.keys[i].position)] = i;
+	}
+
+	unsigned char* p = frozen->data;
+	for (uint64_t slot = 0; slot < n; slot++) {
+		if ((slot % HD_FROZEN_GROUP == 0) && frozen->groups32) {
+			frozen->groups32[slot / HD_FROZEN_GROUP] =
+			    (uint32_t)(p - frozen->data);
+		} else if (slot % HD_FROZEN_GROUP == 0) {
+			frozen->groups64[slot / HD_FROZEN_GROUP] = p - frozen->data;
+		}
+		p = hd_frozen_put_record(p, &b.keys[slot_key[slot]].rec);
+	}
+	frozen->data_size = p - frozen->data;
+
+	/* Varint lengths are mostly shorter than reserved for.*/
+	unsigned char* data =
+	    realloc(frozen->data, frozen->data_size ? frozen->data_size : 1);
+	if (data != NULL) {
+		frozen->data = data;
+	}
+	free(slot_key);
+	free(b.keys);
+	hd_read_end(dict);
+
+	/* The records were copied, the old storage can go. num_entries stays.*/
+	hd_free_parallel(dict, 1);
+	dict->backend = &frozen->backend;
+	dict->num_entries = n;
+	return 0;
+err:
+	hd_read_end(dict);
+	free(b.keys);
+	if (frozen != NULL) {
+		hd_frozen_free(&frozen->backend);
+	}
+	return ret;
+}
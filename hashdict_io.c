@@ -0,0 +1,784 @@
+#define _GNU_SOURCE /* O_DIRECT, syscall() */
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HD_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif /* HD_HAVE_IO_URING */
+
+#define HD_IO_ALIGN 4096 /**< Buffer and O_DIRECT alignment */
+#define HD_IO_QUEUE_DEPTH 4
+#define HD_IO_BUFFER_SIZE (1024 * 1024)
+
+#define HD_CRC32C_POLY 0x82f63b78u /**< Castagnoli, bit reflected */
+
+static uint32_t hd_crc32c_table[8][256];
+static uint32_t hd_crc32c_x2n[32]; /**< x^(2^n) mod the polynomial */
+static pthread_once_t hd_crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Product of two polynomials modulo the Castagnoli polynomial
+ *
+ * Both are bit reflected like the CRC, so x^0 is the top bit.
+ */
+static uint32_t
+hd_crc32c_mult(uint32_t a, uint32_t b) {
+	uint32_t p = 0;
+
+	for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+		if (a & m) {
+			p ^= b;
+		}
+		b = (b >> 1) ^ ((b & 1) ? HD_CRC32C_POLY : 0);
+	}
+	return p;
+}
+
+/**
+ * @brief Builds the slicing-by-8 tables of the Castagnoli polynomial
+ */
+static void
+hd_crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? HD_CRC32C_POLY : 0);
+		}
+		hd_crc32c_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			uint32_t prev = hd_crc32c_table[t - 1][i];
+			hd_crc32c_table[t][i] =
+			    (prev >> 8) ^ hd_crc32c_table[0][prev & 0xff];
+		}
+	}
+
+	hd_crc32c_x2n[0] = 1u << 30;
+	for (int n = 1; n < 32; n++) {
+		hd_crc32c_x2n[n] =
+		    hd_crc32c_mult(hd_crc32c_x2n[n - 1], hd_crc32c_x2n[n - 1]);
+	}
+}
+
+uint32_t
+hd_crc32c(uint32_t crc, const void* buf, size_t len) {
+	const unsigned char* p = buf;
+
+	pthread_once(&hd_crc32c_once, hd_crc32c_init);
+
+	crc = ~crc;
+	/* Eight bytes per step, read byte-wise so the result is the same on
+	 * every byte order.*/
+	while (len >= 8) {
+		uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		                     (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		crc = hd_crc32c_table[7][lo & 0xff] ^
+		      hd_crc32c_table[6][(lo >> 8) & 0xff] ^
+		      hd_crc32c_table[5][(lo >> 16) & 0xff] ^
+		      hd_crc32c_table[4][lo >> 24] ^ hd_crc32c_table[3][p[4]] ^
+		      hd_crc32c_table[2][p[5]] ^ hd_crc32c_table[1][p[6]] ^
+		      hd_crc32c_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = (crc >> 8) ^ hd_crc32c_table[0][(crc ^ *p++) & 0xff];
+	}
+	return ~crc;
+}
+
+uint32_t
+hd_crc32c_shift(size_t len) {
+	uint32_t p = 1u << 31;
+
+	pthread_once(&hd_crc32c_once, hd_crc32c_init);
+
+	/* x^(8 len), from the squares of x matching the bits of 8 len.*/
+	for (int n = 3; len != 0; len >>= 1, n++) {
+		if (len & 1) {
+			p = hd_crc32c_mult(hd_crc32c_x2n[n & 31], p);
+		}
+	}
+	return p;
+}
+
+uint32_t
+hd_crc32c_combine(uint32_t crc1, uint32_t crc2, uint32_t shift) {
+	return hd_crc32c_mult(shift, crc1) ^ crc2;
+}
+
+int
+hd_write_all(int fd, const void* buf, size_t len) {
+	const unsigned char* p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+ssize_t
+hd_read_full(int fd, void* buf, size_t len) {
+	unsigned char* p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = read(fd, p + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+#ifdef HD_HAVE_IO_URING
+
+struct hd_uring {
+	int fd;
+	unsigned int entries;
+	unsigned int to_submit; /**< Requests queued but not yet submitted */
+	_Atomic unsigned int* sq_head;
+	_Atomic unsigned int* sq_tail;
+	unsigned int sq_mask;
+	unsigned int* sq_array;
+	_Atomic unsigned int* cq_head;
+	_Atomic unsigned int* cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_map;
+	size_t sq_map_size;
+	void* cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+};
+
+int
+hd_uring_create(struct hd_uring** ring, unsigned int entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0) {
+		return -errno;
+	}
+	/* Appends rely on offset -1 meaning the current file position.*/
+	if (!(p.features & IORING_FEAT_RW_CUR_POS) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		close(fd);
+		return -ENOSYS;
+	}
+
+	struct hd_uring* r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	r->fd = fd;
+	r->entries = p.sq_entries;
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_size =
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single && (r->cq_map_size > r->sq_map_size)) {
+		r->sq_map_size = r->cq_map_size;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	r->cq_map = single ? r->sq_map
+	                   : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+	                          MAP_SHARED, fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	               fd, IORING_OFF_SQES);
+	if ((r->sq_map == MAP_FAILED) || (r->cq_map == MAP_FAILED) ||
+	    (r->sqes == MAP_FAILED)) {
+		int ret = -errno;
+		hd_uring_free(r);
+		return ret;
+	}
+
+	unsigned char* sq = r->sq_map;
+	unsigned char* cq = r->cq_map;
+	r->sq_head = (_Atomic unsigned int*)(sq + p.sq_off.head);
+	r->sq_tail = (_Atomic unsigned int*)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	r->cq_head = (_Atomic unsigned int*)(cq + p.cq_off.head);
+	r->cq_tail = (_Atomic unsigned int*)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	*ring = r;
+	return 0;
+}
+
+void
+hd_uring_free(struct hd_uring* ring) {
+	if (ring == NULL) {
+		return;
+	}
+	if ((ring->sqes != NULL) && (ring->sqes != MAP_FAILED)) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if ((ring->cq_map != NULL) && (ring->cq_map != MAP_FAILED) &&
+	    (ring->cq_map != ring->sq_map)) {
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	if ((ring->sq_map != NULL) && (ring->sq_map != MAP_FAILED)) {
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+	close(ring->fd);
+	free(ring);
+}
+
+/**
+ * @brief Queues a request, the caller makes sure the ring has room
+ */
+static void
+hd_uring_queue(struct hd_uring* ring, unsigned char opcode, int fd,
+               const void* buf, size_t len, uint64_t offset,
+               uint64_t user_data, unsigned char flags) {
+	unsigned int tail = atomic_load_explicit(ring->sq_tail,
+	                                         memory_order_relaxed);
+	unsigned int idx = tail & ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	if (opcode == IORING_OP_FSYNC) {
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	}
+
+	ring->sq_array[idx] = idx;
+	atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+	ring->to_submit++;
+}
+
+/**
+ * @brief Submits all queued requests and waits for min_complete
+ * completions
+ */
+static int
+hd_uring_enter(struct hd_uring* ring, unsigned int min_complete) {
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+		                min_complete,
+		                min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n >= 0) {
+			ring->to_submit -= n;
+			return 0;
+		}
+		if (errno != EINTR) {
+			return -errno;
+		}
+	}
+}
+
+/**
+ * @brief Takes the next completion, waiting for it if there is none yet
+ */
+static int
+hd_uring_wait(struct hd_uring* ring, uint64_t* user_data, int* res) {
+	for (;;) {
+		unsigned int head =
+		    atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+		unsigned int tail =
+		    atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+
+		if (head != tail) {
+			struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			atomic_store_explicit(ring->cq_head, head + 1,
+			                      memory_order_release);
+			return 0;
+		}
+
+		int ret = hd_uring_enter(ring, 1);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+}
+
+int
+hd_uring_append(struct hd_uring* ring, int fd, const void* buf, size_t len,
+                int sync) {
+	if (len > UINT32_MAX / 2) {
+		int ret = hd_write_all(fd, buf, len);
+		return ((ret == 0) && sync && (fdatasync(fd) != 0)) ? -errno : ret;
+	}
+
+	/* The link makes the fsync wait for the write, and cancels it if the
+	 * write fails or comes up short.*/
+	hd_uring_queue(ring, IORING_OP_WRITE, fd, buf, len, (uint64_t)-1, 0,
+	               sync ? IOSQE_IO_LINK : 0);
+	if (sync) {
+		hd_uring_queue(ring, IORING_OP_FSYNC, fd, NULL, 0, 0, 1, 0);
+	}
+
+	int ret = hd_uring_enter(ring, sync ? 2 : 1);
+	ssize_t written = 0;
+	int synced = !sync;
+
+	for (int i = 0; (ret == 0) && (i < (sync ? 2 : 1)); i++) {
+		uint64_t user_data;
+		int res;
+
+		ret = hd_uring_wait(ring, &user_data, &res);
+		if (ret != 0) {
+			break;
+		}
+		if (user_data == 0) {
+			written = res;
+		} else {
+			synced = (res == 0);
+		}
+	}
+	if (ret != 0) {
+		return ret;
+	}
+	if (written < 0) {
+		return (int)written;
+	}
+
+	if ((size_t)written < len) {
+		ret = hd_write_all(fd, (const unsigned char*)buf + written,
+		                   len - written);
+	}
+	if ((ret == 0) && !synced && (fdatasync(fd) != 0)) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+#else /* HD_HAVE_IO_URING */
+
+struct hd_uring {
+	int unused;
+};
+
+int
+hd_uring_create(struct hd_uring** ring, unsigned int entries) {
+	(void)ring;
+	(void)entries;
+	return -ENOSYS;
+}
+
+void
+hd_uring_free(struct hd_uring* ring) {
+	(void)ring;
+}
+
+int
+hd_uring_append(struct hd_uring* ring, int fd, const void* buf, size_t len,
+                int sync) {
+	(void)ring;
+	int ret = hd_write_all(fd, buf, len);
+	return ((ret == 0) && sync && (fdatasync(fd) != 0)) ? -errno : ret;
+}
+
+#endif /* HD_HAVE_IO_URING */
+
+/**
+ * @brief One buffer of an hd_io_file
+ */
+struct hd_io_slot {
+	unsigned char* buf;
+	size_t len; /**< Bytes filled (writing) or read (reading) */
+	size_t pos; /**< Bytes already returned by hd_io_read() */
+	off_t offset; /**< File offset of the buffer */
+	size_t io_len; /**< Bytes requested from the kernel */
+	int busy; /**< A request for the buffer is in flight */
+};
+
+struct hd_io_file {
+	int fd;
+	int writing;
+	int direct; /**< fd is open with O_DIRECT */
+	struct hd_uring* ring; /**< NULL to use pread()/pwrite() */
+	size_t buffer_size;
+	unsigned int depth;
+	struct hd_io_slot* slots;
+	unsigned char* mem; /**< Backing memory of all buffers */
+	unsigned int cur; /**< Buffer being filled or consumed */
+	off_t offset; /**< Offset of the next buffer to submit */
+	unsigned int inflight;
+	int eof; /**< A read came up short, nothing more to submit */
+	int error; /**< First failed request */
+};
+
+/**
+ * @brief Writes len bytes at offset, retrying short writes
+ *
+ * @param align 1, or HD_IO_ALIGN for O_DIRECT descriptors: a short write is
+ * then continued from the block boundary below where it stopped, since
+ * O_DIRECT can't write from an unaligned offset
+ */
+static int
+hd_pwrite_all(int fd, const unsigned char* p, size_t len, off_t offset,
+              size_t align) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if ((size_t)n < len) {
+			n &= ~(ssize_t)(align - 1);
+			if (n == 0) {
+				/* Not even one block went through.*/
+				return -EIO;
+			}
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+ssize_t
+hd_pread_full(int fd, void* buf, size_t len, off_t offset) {
+	unsigned char* p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, p + done, len - done, offset + done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * @brief Records the result of the request for slot
+ *
+ * Short writes are finished with pwrite(), for O_DIRECT from the block
+ * boundary below where they stopped. A short read means end of file.
+ */
+static void
+hd_io_complete(struct hd_io_file* io, struct hd_io_slot* slot, ssize_t res) {
+	slot->busy = 0;
+
+	if (res < 0) {
+		if (io->error == 0) {
+			io->error = (int)res;
+		}
+		return;
+	}
+
+	if (io->writing) {
+		if ((size_t)res < slot->io_len) {
+			size_t align = io->direct ? HD_IO_ALIGN : 1;
+			size_t done = (size_t)res & ~(align - 1);
+			int ret = hd_pwrite_all(io->fd, slot->buf + done,
+			                        slot->io_len - done, slot->offset + done,
+			                        align);
+			if ((ret != 0) && (io->error == 0)) {
+				io->error = ret;
+			}
+		}
+		slot->len = 0;
+	} else {
+		slot->len = res;
+		slot->pos = 0;
+		if ((size_t)res < slot->io_len) {
+			io->eof = 1;
+		}
+	}
+}
+
+/**
+ * @brief Waits for one request and completes its slot
+ */
+static int
+hd_io_reap(struct hd_io_file* io) {
+#ifdef HD_HAVE_IO_URING
+	uint64_t user_data;
+	int res;
+	int ret = hd_uring_wait(io->ring, &user_data, &res);
+
+	if (ret != 0) {
+		return ret;
+	}
+	io->inflight--;
+	hd_io_complete(io, &io->slots[user_data], res);
+	return 0;
+#else
+	(void)io;
+	return -ENOSYS;
+#endif /* HD_HAVE_IO_URING */
+}
+
+/**
+ * @brief Submits the read or write of slot at the next offset
+ */
+static void
+hd_io_submit(struct hd_io_file* io, struct hd_io_slot* slot) {
+	slot->offset = io->offset;
+	slot->io_len = io->writing ? slot->len : io->buffer_size;
+
+	if (io->writing && io->direct) {
+		/* O_DIRECT writes whole blocks, the padding of the last buffer
+		 * is cut off again by hd_io_close().*/
+		size_t padded =
+		    (slot->len + HD_IO_ALIGN - 1) & ~(size_t)(HD_IO_ALIGN - 1);
+		memset(slot->buf + slot->len, 0, padded - slot->len);
+		slot->io_len = padded;
+	}
+	io->offset += io->writing ? slot->len : io->buffer_size;
+
+#ifdef HD_HAVE_IO_URING
+	if (io->ring != NULL) {
+		hd_uring_queue(io->ring,
+		               io->writing ? IORING_OP_WRITE : IORING_OP_READ, io->fd,
+		               slot->buf, slot->io_len, slot->offset,
+		               slot - io->slots, 0);
+		slot->busy = 1;
+		io->inflight++;
+		int ret = hd_uring_enter(io->ring, 0);
+		if ((ret != 0) && (io->error == 0)) {
+			io->error = ret;
+		}
+		return;
+	}
+#endif /* HD_HAVE_IO_URING */
+
+	ssize_t res;
+	if (io->writing) {
+		res = hd_pwrite_all(io->fd, slot->buf, slot->io_len, slot->offset,
+		                    io->direct ? HD_IO_ALIGN : 1);
+		res = (res == 0) ? (ssize_t)slot->io_len : res;
+	} else {
+		res = hd_pread_full(io->fd, slot->buf, slot->io_len, slot->offset);
+	}
+	hd_io_complete(io, slot, res);
+}
+
+int
+hd_io_open(struct hd_io_file** io, const char* path, int flags,
+           const struct hd_io_config* config) {
+	struct hd_io_config defaults = {0};
+	if (config == NULL) {
+		config = &defaults;
+	}
+
+	struct hd_io_file* f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		return -ENOMEM;
+	}
+
+	f->writing = (flags & O_ACCMODE) != O_RDONLY;
+	f->depth = config->queue_depth ? config->queue_depth : HD_IO_QUEUE_DEPTH;
+	f->buffer_size = config->buffer_size ? config->buffer_size
+	                                     : HD_IO_BUFFER_SIZE;
+	f->buffer_size = (f->buffer_size + HD_IO_ALIGN - 1) &
+	                 ~(size_t)(HD_IO_ALIGN - 1);
+
+	f->fd = -1;
+	if (config->direct) {
+		f->fd = open(path, flags | O_DIRECT, 0644);
+		f->direct = (f->fd >= 0);
+	}
+	/* File systems without O_DIRECT support fail the open with EINVAL.*/
+	if ((f->fd < 0) && (!config->direct || (errno == EINVAL))) {
+		f->fd = open(path, flags, 0644);
+	}
+	if (f->fd < 0) {
+		int ret = -errno;
+		free(f);
+		return ret;
+	}
+
+	f->slots = calloc(f->depth, sizeof(*f->slots));
+	if ((f->slots == NULL) ||
+	    (posix_memalign((void**)&f->mem, HD_IO_ALIGN,
+	                    f->depth * f->buffer_size) != 0)) {
+		close(f->fd);
+		free(f->slots);
+		free(f);
+		return -ENOMEM;
+	}
+	for (unsigned int i = 0; i < f->depth; i++) {
+		f->slots[i].buf = f->mem + i * f->buffer_size;
+	}
+
+	if (!config->no_uring && (hd_uring_create(&f->ring, f->depth) != 0)) {
+		f->ring = NULL;
+	}
+
+	if (!f->writing) {
+		/* Read ahead into every buffer right away.*/
+		for (unsigned int i = 0; i < f->depth; i++) {
+			hd_io_submit(f, &f->slots[i]);
+		}
+	}
+
+	*io = f;
+	return 0;
+}
+
+int
+hd_io_write(struct hd_io_file* io, const void* buf, size_t len) {
+	const unsigned char* p = buf;
+
+	while ((len > 0) && (io->error == 0)) {
+		struct hd_io_slot* slot = &io->slots[io->cur];
+
+		while (slot->busy && (io->error == 0)) {
+			int ret = hd_io_reap(io);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+		if (io->error != 0) {
+			/* The buffer may still be in flight.*/
+			break;
+		}
+
+		size_t n = io->buffer_size - slot->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(slot->buf + slot->len, p, n);
+		slot->len += n;
+		p += n;
+		len -= n;
+
+		if (slot->len == io->buffer_size) {
+			hd_io_submit(io, slot);
+			io->cur = (io->cur + 1) % io->depth;
+		}
+	}
+	return io->error;
+}
+
+ssize_t
+hd_io_read(struct hd_io_file* io, void* buf, size_t len) {
+	unsigned char* p = buf;
+	size_t done = 0;
+
+	while ((done < len) && (io->error == 0)) {
+		struct hd_io_slot* slot = &io->slots[io->cur];
+
+		while (slot->busy && (io->error == 0)) {
+			int ret = hd_io_reap(io);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+		if (io->error != 0) {
+			break;
+		}
+
+		size_t n = slot->len - slot->pos;
+		if (n == 0) {
+			if (slot->len < slot->io_len) {
+				/* End of file.*/
+				return done;
+			}
+			if (!io->eof) {
+				hd_io_submit(io, slot);
+			} else {
+				slot->len = 0;
+				slot->io_len = 1;
+			}
+			io->cur = (io->cur + 1) % io->depth;
+			continue;
+		}
+
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(p + done, slot->buf + slot->pos, n);
+		slot->pos += n;
+		done += n;
+	}
+	return (io->error != 0) ? io->error : (ssize_t)done;
+}
+
+int
+hd_io_close(struct hd_io_file* io, int sync) {
+	if (io->writing && (io->slots[io->cur].len > 0) && (io->error == 0)) {
+		hd_io_submit(io, &io->slots[io->cur]);
+	}
+	/* Nothing is submitted anymore, but every request in flight has to be
+	 * reaped before its buffer can be freed.*/
+	while (io->inflight > 0) {
+		int ret = hd_io_reap(io);
+		if ((ret != 0) && (io->error == 0)) {
+			io->error = ret;
+		}
+		if ((ret != 0) && (ret != -EAGAIN) && (ret != -EBUSY)) {
+			break;
+		}
+	}
+
+	int ret = io->error;
+	if (io->writing && io->direct && (ret == 0) &&
+	    (ftruncate(io->fd, io->offset) != 0)) {
+		ret = -errno;
+	}
+	if (io->writing && sync && (ret == 0) && (fsync(io->fd) != 0)) {
+		ret = -errno;
+	}
+	if ((close(io->fd) != 0) && (ret == 0)) {
+		ret = -errno;
+	}
+
+	if (io->inflight == 0) {
+		hd_uring_free(io->ring);
+		free(io->mem);
+	}
+	/* Otherwise the ring can't be waited on anymore and the kernel may
+	 * still use the buffers, so both are leaked rather than freed.*/
+	free(io->slots);
+	free(io);
+	return ret;
+}
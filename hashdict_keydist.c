@@ -0,0 +1,503 @@
+/**
+ * @file hashdict_keydist.c
+ * @brief Judges the hash functions of the library on a set of keys
+ *
+ * Reads keys from a file, one per line, and runs every hash function of
+ * hd_hash_key() over them. Duplicate lines are dropped, they land in the
+ * same bucket whatever the hash. For every table size the keys are spread
+ * over the buckets by the low bits of their hash, like the chained table
+ * does, and reported are:
+ *
+ *   load     keys per bucket
+ *   chi2/df  chi-squared of the bucket loads against an even spread,
+ *            divided by its degrees of freedom, about 1 for a random hash
+ *   z        the same as a standard score, beyond +-3 hardly by chance
+ *   max      entries in the longest chain
+ *   probes   keys compared by the average lookup hit
+ *   ideal    probes of a random hash, 1 + (keys - 1) / (2 * buckets)
+ *
+ * Avalanche is measured on a sample of keys. Every bit of the first
+ * AVALANCHE_BYTES bytes of a key is flipped in turn and the output bits
+ * that change are counted, a good hash changes each with probability 0.5:
+ *
+ *   flip     mean share of the 64 output bits that change
+ *   bias     largest deviation from 0.5 of any bucket index bit, the low
+ *            bits of the largest table size
+ *   sac      largest deviation from 0.5 of any pair of input bit and
+ *            bucket index bit (strict avalanche criterion), 0.5 meaning
+ *            the input bit never or always changes that output bit
+ *
+ * Throughput comes from hashing all keys over and over for a minimum time:
+ *
+ *   ns/key   time per key
+ *   MB/s     key bytes hashed per second
+ *
+ * The default table sizes are the bucket array a dictionary holding the
+ * keys ends up with, and half and double of it.
+ *
+ * Usage: hashdict_keydist [-s sizes] [-r seed] [-a keys] [-t ms] <file|->
+ *
+ *   -s  comma separated table sizes, powers of two
+ *   -r  seed of the seeded hash functions, default 0
+ *   -a  keys sampled for the avalanche test, default 1000
+ *   -t  minimum milliseconds of a throughput run, default 200
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_AVALANCHE_KEYS 1000
+#define DEFAULT_MIN_MS 200
+#define MAX_SIZES 16
+#define MAX_SIZE (1UL << 30)
+#define AVALANCHE_BYTES 32 /**< Leading key bytes whose bits are flipped */
+#define AVALANCHE_MIN_TRIALS 32 /**< Flips an input bit needs for sac */
+
+/**
+ * @brief Keys stored back to back, key i starting at offsets[i]
+ */
+struct keyset {
+	char* arena;
+	size_t* offsets;
+	size_t* lens;
+	size_t n;
+	size_t bytes; /**< Sum of all key lengths */
+	size_t max_len;
+};
+
+/**
+ * @brief How evenly a table size spreads the keys
+ */
+struct spread {
+	double chi2_df;
+	double z;
+	size_t max_chain;
+	double probes;
+};
+
+struct avalanche {
+	double flip;
+	double bias;
+	double sac;
+};
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Appends a key to the keyset
+ */
+static int
+keyset_add(struct keyset* ks, size_t* cap, size_t* arena_cap, const char* key,
+           size_t len) {
+	if (ks->n == *cap) {
+		size_t new_cap = (*cap > 0) ? *cap * 2 : 1024;
+		size_t* offsets = realloc(ks->offsets, new_cap * sizeof(*offsets));
+		if (offsets == NULL) {
+			return -ENOMEM;
+		}
+		ks->offsets = offsets;
+		size_t* lens = realloc(ks->lens, new_cap * sizeof(*lens));
+		if (lens == NULL) {
+			return -ENOMEM;
+		}
+		ks->lens = lens;
+		*cap = new_cap;
+	}
+
+	size_t offset = 0;
+	if (ks->n > 0) {
+		offset = ks->offsets[ks->n - 1] + ks->lens[ks->n - 1] + 1;
+	}
+	if (offset + len + 1 > *arena_cap) {
+		size_t new_cap = (*arena_cap > 0) ? *arena_cap : 64 * 1024;
+		while (offset + len + 1 > new_cap) {
+			new_cap *= 2;
+		}
+		char* arena = realloc(ks->arena, new_cap);
+		if (arena == NULL) {
+			return -ENOMEM;
+		}
+		ks->arena = arena;
+		*arena_cap = new_cap;
+	}
+
+	memcpy(ks->arena + offset, key, len + 1);
+	ks->offsets[ks->n] = offset;
+	ks->lens[ks->n] = len;
+	ks->n++;
+	ks->bytes += len;
+	if (len > ks->max_len) {
+		ks->max_len = len;
+	}
+	return 0;
+}
+
+/**
+ * @brief Reads one key per line, dropping empty lines and duplicates
+ */
+static int
+read_keys(FILE* in, struct keyset* ks, size_t* duplicates) {
+	struct hd_hashdict seen = hd_create();
+	size_t cap = 0;
+	size_t arena_cap = 0;
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	int ret = 0;
+
+	while ((len = getline(&line, &line_cap, in)) >= 0) {
+		while ((len > 0) &&
+		       ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (hd_lookup(&seen, line) != NULL) {
+			(*duplicates)++;
+			continue;
+		}
+		ret = hd_entry_insert(&seen, line, "");
+		if (ret == 0) {
+			ret = keyset_add(ks, &cap, &arena_cap, line, len);
+		}
+		if (ret != 0) {
+			break;
+		}
+	}
+	if ((ret == 0) && ferror(in)) {
+		ret = -EIO;
+	}
+
+	free(line);
+	hd_free(&seen);
+	return ret;
+}
+
+static void
+measure_spread(const uint64_t* hashes, size_t n, size_t size,
+               uint32_t* counts, struct spread* s) {
+	double load = (double)n / size;
+	double sum_sq = 0.0;
+	double probes = 0.0;
+
+	memset(counts, 0, size * sizeof(*counts));
+	for (size_t i = 0; i < n; i++) {
+		counts[hashes[i] & (size - 1)]++;
+	}
+
+	s->max_chain = 0;
+	for (size_t b = 0; b < size; b++) {
+		double c = counts[b];
+
+		sum_sq += c * c;
+		/* The i-th key of a chain takes i comparisons to find.*/
+		probes += c * (c + 1) / 2;
+		if (counts[b] > s->max_chain) {
+			s->max_chain = counts[b];
+		}
+	}
+
+	double chi2 = sum_sq / load - (double)n;
+	double df = (double)size - 1;
+	s->chi2_df = chi2 / df;
+	s->z = (chi2 - df) / sqrt(2 * df);
+	s->probes = probes / n;
+}
+
+static int
+measure_avalanche(enum hd_hash_func func, const struct keyset* ks,
+                  size_t samples, unsigned int bucket_bits, uint64_t seed,
+                  struct avalanche* a) {
+	unsigned long long(*sac)[64] = calloc(AVALANCHE_BYTES * 8, sizeof(*sac));
+	unsigned long long in_trials[AVALANCHE_BYTES * 8] = {0};
+	unsigned long long out[64] = {0};
+	unsigned long long trials = 0;
+	unsigned long long flips = 0;
+	char* buf = malloc(ks->max_len + 1);
+
+	if ((sac == NULL) || (buf == NULL)) {
+		free(sac);
+		free(buf);
+		return -ENOMEM;
+	}
+
+	if (samples > ks->n) {
+		samples = ks->n;
+	}
+	size_t step = ks->n / samples;
+
+	for (size_t s = 0; s < samples; s++) {
+		const char* key = ks->arena + ks->offsets[s * step];
+		size_t len = ks->lens[s * step];
+		size_t bits = 8 * ((len < AVALANCHE_BYTES) ? len : AVALANCHE_BYTES);
+		uint64_t h = hd_hash_key(func, key, len, seed);
+
+		memcpy(buf, key, len + 1);
+		for (size_t bit = 0; bit < bits; bit++) {
+			char mask = (char)(1u << (bit % 8));
+
+			/* Flips that produce a NUL would shorten a djb2 key.*/
+			buf[bit / 8] ^= mask;
+			if (buf[bit / 8] != '\0') {
+				uint64_t diff = h ^ hd_hash_key(func, buf, len, seed);
+
+				trials++;
+				in_trials[bit]++;
+				flips += __builtin_popcountll(diff);
+				while (diff != 0) {
+					unsigned int j = __builtin_ctzll(diff);
+
+					out[j]++;
+					if (j < bucket_bits) {
+						sac[bit][j]++;
+					}
+					diff &= diff - 1;
+				}
+			}
+			buf[bit / 8] ^= mask;
+		}
+	}
+
+	a->flip = 0.0;
+	a->bias = 0.0;
+	a->sac = 0.0;
+	if (trials > 0) {
+		a->flip = (double)flips / (64.0 * trials);
+		for (unsigned int j = 0; j < bucket_bits; j++) {
+			double d = fabs((double)out[j] / trials - 0.5);
+			if (d > a->bias) {
+				a->bias = d;
+			}
+		}
+	}
+	for (size_t bit = 0; bit < AVALANCHE_BYTES * 8; bit++) {
+		if (in_trials[bit] < AVALANCHE_MIN_TRIALS) {
+			continue;
+		}
+		for (unsigned int j = 0; j < bucket_bits; j++) {
+			double d = fabs((double)sac[bit][j] / in_trials[bit] - 0.5);
+			if (d > a->sac) {
+				a->sac = d;
+			}
+		}
+	}
+
+	free(sac);
+	free(buf);
+	return 0;
+}
+
+/**
+ * @brief Hashes all keys until min_ns passed, returns the ns per key
+ */
+static double
+measure_throughput(enum hd_hash_func func, const struct keyset* ks,
+                   uint64_t seed, unsigned long long min_ns, uint64_t* sink) {
+	unsigned long long start = now_ns();
+	unsigned long long elapsed;
+	size_t rounds = 0;
+	uint64_t acc = 0;
+
+	do {
+		for (size_t i = 0; i < ks->n; i++) {
+			acc ^= hd_hash_key(func, ks->arena + ks->offsets[i], ks->lens[i],
+			                   seed);
+		}
+		rounds++;
+		elapsed = now_ns() - start;
+	} while (elapsed < min_ns);
+
+	*sink ^= acc;
+	return (double)elapsed / ((double)rounds * ks->n);
+}
+
+/**
+ * @brief Parses comma separated powers of two, returns their number
+ */
+static int
+parse_sizes(const char* arg, size_t* sizes, size_t max) {
+	size_t count = 0;
+
+	for (const char* p = arg; *p != '\0';) {
+		char* end;
+		size_t size = strtoull(p, &end, 10);
+
+		if ((end == p) || (size < 2) || (size > MAX_SIZE) ||
+		    ((size & (size - 1)) != 0) || (count == max) ||
+		    ((*end != ',') && (*end != '\0'))) {
+			return -1;
+		}
+		sizes[count++] = size;
+		p = end + (*end == ',');
+	}
+	return count;
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr,
+	        "Usage: %s [-s sizes] [-r seed] [-a keys] [-t ms] <file|->\n",
+	        prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	const char* sizes_arg = NULL;
+	size_t avalanche_keys = DEFAULT_AVALANCHE_KEYS;
+	unsigned long long min_ms = DEFAULT_MIN_MS;
+	uint64_t seed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:r:a:t:h")) != -1) {
+		switch (opt) {
+			case 's':
+				sizes_arg = optarg;
+				break;
+			case 'r':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'a':
+				avalanche_keys = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				min_ms = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if ((optind != argc - 1) || (avalanche_keys == 0)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	FILE* in = stdin;
+	if (strcmp(argv[optind], "-") &&
+	    ((in = fopen(argv[optind], "r")) == NULL)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	struct keyset ks = {0};
+	size_t duplicates = 0;
+	int result = read_keys(in, &ks, &duplicates);
+	if (in != stdin) {
+		fclose(in);
+	}
+	if (result != 0) {
+		fprintf(stderr, "Error reading keys: %s\n", strerror(-result));
+		return 1;
+	}
+	if (ks.n == 0) {
+		fprintf(stderr, "No keys in %s\n", argv[optind]);
+		return 1;
+	}
+
+	size_t sizes[MAX_SIZES];
+	int num_sizes;
+	if (sizes_arg != NULL) {
+		num_sizes = parse_sizes(sizes_arg, sizes, MAX_SIZES);
+		if (num_sizes <= 0) {
+			fprintf(stderr, "Invalid sizes: %s\n", sizes_arg);
+			return 2;
+		}
+	} else {
+		/* The dictionary grows once it holds as many entries as buckets.*/
+		size_t size = HASHSIZE;
+		while ((size <= ks.n) && (size < MAX_SIZE / 2)) {
+			size *= 2;
+		}
+		sizes[0] = size / 2;
+		sizes[1] = size;
+		sizes[2] = size * 2;
+		num_sizes = 3;
+	}
+
+	size_t max_size = 0;
+	for (int i = 0; i < num_sizes; i++) {
+		if (sizes[i] > max_size) {
+			max_size = sizes[i];
+		}
+	}
+	unsigned int bucket_bits = __builtin_ctzll(max_size);
+
+	uint64_t* hashes = malloc(ks.n * sizeof(*hashes));
+	uint32_t* counts = malloc(max_size * sizeof(*counts));
+	if ((hashes == NULL) || (counts == NULL)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	printf("%zu keys, %zu duplicates dropped, %.1f bytes on average, "
+	       "seed %llu\n\n",
+	       ks.n, duplicates, (double)ks.bytes / ks.n, (unsigned long long)seed);
+
+	printf("%-10s %10s %8s %8s %8s %6s %7s %7s\n", "hash", "buckets", "load",
+	       "chi2/df", "z", "max", "probes", "ideal");
+	for (int func = 0; func < HD_NUM_HASH_FUNCS; func++) {
+		for (size_t i = 0; i < ks.n; i++) {
+			hashes[i] = hd_hash_key(func, ks.arena + ks.offsets[i], ks.lens[i],
+			                        seed);
+		}
+		for (int i = 0; i < num_sizes; i++) {
+			struct spread s;
+
+			measure_spread(hashes, ks.n, sizes[i], counts, &s);
+			printf("%-10s %10zu %8.2f %8.3f %8.2f %6zu %7.3f %7.3f\n",
+			       hd_hash_name(func), sizes[i], (double)ks.n / sizes[i],
+			       s.chi2_df, s.z, s.max_chain, s.probes,
+			       1.0 + (ks.n - 1) / (2.0 * sizes[i]));
+		}
+	}
+
+	printf("\n%-10s %8s %8s %8s %8s %10s\n", "hash", "flip", "bias", "sac",
+	       "ns/key", "MB/s");
+	uint64_t sink = 0;
+	for (int func = 0; func < HD_NUM_HASH_FUNCS; func++) {
+		struct avalanche a;
+
+		result = measure_avalanche(func, &ks, avalanche_keys, bucket_bits,
+		                           seed, &a);
+		if (result != 0) {
+			fprintf(stderr, "Error measuring avalanche: %s\n",
+			        strerror(-result));
+			return 1;
+		}
+		double ns = measure_throughput(func, &ks, seed, min_ms * 1000000ULL,
+		                               &sink);
+		printf("%-10s %8.4f %8.4f %8.4f %8.2f %10.1f\n", hd_hash_name(func),
+		       a.flip, a.bias, a.sac, ns,
+		       (double)ks.bytes / ks.n / ns * 1000.0);
+	}
+	/* Keeps the throughput loops from being optimized away.*/
+	if (sink == 1) {
+		printf("\n");
+	}
+
+	free(hashes);
+	free(counts);
+	free(ks.arena);
+	free(ks.offsets);
+	free(ks.lens);
+	return 0;
+}
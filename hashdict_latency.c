@@ -0,0 +1,432 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif /* __x86_64__ */
+
+#define HD_LAT_SAMPLE_EVERY 64 /**< Default sample_every */
+#define HD_LAT_CALIBRATE_NS 10000000L /**< TSC calibration period, 10 ms */
+#define HD_LAT_SUB (1u << HD_LAT_SUB_BITS)
+
+/**
+ * @brief Histogram of one operation recorded by one thread
+ *
+ * Only the owning thread writes, with relaxed loads and stores instead of
+ * read-modify-write operations, so recording never waits for another
+ * core. Threads merging it see every counter before or after an update.
+ */
+struct hd_lat_counts {
+	_Atomic unsigned long long count;
+	_Atomic unsigned long long sum_ns;
+	_Atomic unsigned long long min_ns;
+	_Atomic unsigned long long max_ns;
+	_Atomic unsigned long long bins[HD_LAT_BINS];
+};
+
+struct hd_lat_buffer {
+	struct hd_lat_buffer* next;
+	struct hd_latency* latency;
+	unsigned int countdown; /**< Operations to skip before the next sample */
+	_Atomic unsigned int generation; /**< Reset the counts belong to */
+	struct hd_lat_counts ops[HD_LAT_NUM_OPS];
+};
+
+struct hd_latency {
+	struct hd_latency_config config;
+	double ns_per_tick; /**< Converts TSC ticks if use_tsc is set */
+	pthread_key_t key; /**< Buffer of the calling thread */
+	pthread_mutex_t lock; /**< Protects buffers and retired */
+	struct hd_lat_buffer* buffers;
+	_Atomic unsigned int generation; /**< Counts hd_latency_reset() calls */
+	struct hd_latency_snapshot retired; /**< Samples of exited threads */
+};
+
+static unsigned long long
+hd_lat_now(const struct hd_latency* latency) {
+#ifdef __x86_64__
+	if (latency->config.use_tsc) {
+		return __rdtsc();
+	}
+#else /* __x86_64__ */
+	(void)latency;
+#endif /* __x86_64__ */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Bin of a latency, see struct hd_latency_hist
+ */
+static unsigned int
+hd_lat_bin(unsigned long long ns) {
+	if (ns < HD_LAT_SUB) {
+		return ns;
+	}
+
+	unsigned int e = 63 - __builtin_clzll(ns);
+	unsigned int bin = (e - HD_LAT_SUB_BITS + 1) * HD_LAT_SUB +
+	                   ((ns >> (e - HD_LAT_SUB_BITS)) & (HD_LAT_SUB - 1));
+	return (bin < HD_LAT_BINS) ? bin : HD_LAT_BINS - 1;
+}
+
+unsigned long long
+hd_latency_bin_ns(unsigned int bin) {
+	if (bin < HD_LAT_SUB) {
+		return bin;
+	}
+
+	unsigned int e = bin / HD_LAT_SUB + HD_LAT_SUB_BITS - 1;
+	return (unsigned long long)(HD_LAT_SUB + bin % HD_LAT_SUB)
+	       << (e - HD_LAT_SUB_BITS);
+}
+
+/**
+ * @brief Adds the counts of one thread to a merged histogram
+ */
+static void
+hd_lat_merge(struct hd_latency_hist* dst, struct hd_lat_counts* src) {
+	unsigned long long count =
+	    atomic_load_explicit(&src->count, memory_order_relaxed);
+
+	if (count == 0) {
+		return;
+	}
+
+	unsigned long long min_ns =
+	    atomic_load_explicit(&src->min_ns, memory_order_relaxed);
+	unsigned long long max_ns =
+	    atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+
+	if ((dst->count == 0) || (min_ns < dst->min_ns)) {
+		dst->min_ns = min_ns;
+	}
+	if (max_ns > dst->max_ns) {
+		dst->max_ns = max_ns;
+	}
+	dst->count += count;
+	dst->sum_ns += atomic_load_explicit(&src->sum_ns, memory_order_relaxed);
+	for (unsigned int i = 0; i < HD_LAT_BINS; i++) {
+		dst->bins[i] +=
+		    atomic_load_explicit(&src->bins[i], memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Tells whether buf holds samples of the current generation
+ */
+static int
+hd_lat_current(struct hd_latency* latency, struct hd_lat_buffer* buf) {
+	return atomic_load_explicit(&buf->generation, memory_order_acquire) ==
+	       atomic_load_explicit(&latency->generation, memory_order_relaxed);
+}
+
+static void
+hd_lat_buffer_destroy(void* arg) {
+	struct hd_lat_buffer* buf = arg;
+	struct hd_latency* latency = buf->latency;
+
+	pthread_mutex_lock(&latency->lock);
+	for (struct hd_lat_buffer** it = &latency->buffers; *it != NULL;
+	     it = &((*it)->next)) {
+		if (*it == buf) {
+			*it = buf->next;
+			break;
+		}
+	}
+	if (hd_lat_current(latency, buf)) {
+		for (int op = 0; op < HD_LAT_NUM_OPS; op++) {
+			hd_lat_merge(&latency->retired.ops[op], &buf->ops[op]);
+		}
+		latency->retired.threads++;
+	}
+	pthread_mutex_unlock(&latency->lock);
+	free(buf);
+}
+
+/**
+ * @brief Returns the calling thread's buffer, creating it on first use
+ */
+static struct hd_lat_buffer*
+hd_lat_buffer_get(struct hd_latency* latency) {
+	struct hd_lat_buffer* buf = pthread_getspecific(latency->key);
+
+	if (buf != NULL) {
+		return buf;
+	}
+
+	buf = calloc(1, sizeof(*buf));
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	buf->latency = latency;
+	atomic_init(&buf->generation,
+	            atomic_load_explicit(&latency->generation,
+	                                 memory_order_relaxed));
+
+	if (pthread_setspecific(latency->key, buf) != 0) {
+		free(buf);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&latency->lock);
+	buf->next = latency->buffers;
+	latency->buffers = buf;
+	pthread_mutex_unlock(&latency->lock);
+	return buf;
+}
+
+/**
+ * @brief Clears the counts of buf after a reset, called by its owner
+ */
+static void
+hd_lat_buffer_clear(struct hd_lat_buffer* buf, unsigned int generation) {
+	for (int op = 0; op < HD_LAT_NUM_OPS; op++) {
+		struct hd_lat_counts* c = &buf->ops[op];
+
+		atomic_store_explicit(&c->count, 0, memory_order_relaxed);
+		atomic_store_explicit(&c->sum_ns, 0, memory_order_relaxed);
+		atomic_store_explicit(&c->min_ns, 0, memory_order_relaxed);
+		atomic_store_explicit(&c->max_ns, 0, memory_order_relaxed);
+		for (unsigned int i = 0; i < HD_LAT_BINS; i++) {
+			atomic_store_explicit(&c->bins[i], 0, memory_order_relaxed);
+		}
+	}
+	atomic_store_explicit(&buf->generation, generation, memory_order_release);
+}
+
+unsigned long long
+hd_latency_sample(struct hd_latency* latency) {
+	struct hd_lat_buffer* buf = hd_lat_buffer_get(latency);
+
+	if (buf == NULL) {
+		return 0;
+	}
+	if (buf->countdown > 0) {
+		buf->countdown--;
+		return 0;
+	}
+	buf->countdown = latency->config.sample_every - 1;
+	return hd_lat_now(latency);
+}
+
+void
+hd_latency_record(struct hd_latency* latency, enum hd_lat_op op,
+                  unsigned long long start) {
+	unsigned long long now = hd_lat_now(latency);
+	unsigned long long ns = (now > start) ? now - start : 0;
+
+	if (latency->config.use_tsc) {
+		ns = (unsigned long long)(ns * latency->ns_per_tick);
+	}
+
+	struct hd_lat_buffer* buf = hd_lat_buffer_get(latency);
+	if (buf == NULL) {
+		return;
+	}
+
+	unsigned int generation =
+	    atomic_load_explicit(&latency->generation, memory_order_relaxed);
+	if (atomic_load_explicit(&buf->generation, memory_order_relaxed) !=
+	    generation) {
+		hd_lat_buffer_clear(buf, generation);
+	}
+
+	struct hd_lat_counts* c = &buf->ops[op];
+	unsigned long long count =
+	    atomic_load_explicit(&c->count, memory_order_relaxed);
+	unsigned int bin = hd_lat_bin(ns);
+
+	if ((count == 0) ||
+	    (ns < atomic_load_explicit(&c->min_ns, memory_order_relaxed))) {
+		atomic_store_explicit(&c->min_ns, ns, memory_order_relaxed);
+	}
+	if (ns > atomic_load_explicit(&c->max_ns, memory_order_relaxed)) {
+		atomic_store_explicit(&c->max_ns, ns, memory_order_relaxed);
+	}
+	atomic_store_explicit(
+	    &c->sum_ns, atomic_load_explicit(&c->sum_ns, memory_order_relaxed) + ns,
+	    memory_order_relaxed);
+	atomic_store_explicit(
+	    &c->bins[bin],
+	    atomic_load_explicit(&c->bins[bin], memory_order_relaxed) + 1,
+	    memory_order_relaxed);
+	atomic_store_explicit(&c->count, count + 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Measures the length of a TSC tick against CLOCK_MONOTONIC
+ */
+static int
+hd_lat_calibrate(struct hd_latency* latency) {
+#ifdef __x86_64__
+	struct timespec start;
+	struct timespec end;
+	struct timespec period = {.tv_sec = 0, .tv_nsec = HD_LAT_CALIBRATE_NS};
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned long long start_ticks = __rdtsc();
+	nanosleep(&period, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned long long ticks = __rdtsc() - start_ticks;
+
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+	            (end.tv_nsec - start.tv_nsec);
+	if (ticks == 0) {
+		return -ENOTSUP;
+	}
+	latency->ns_per_tick = ns / ticks;
+	return 0;
+#else /* __x86_64__ */
+	(void)latency;
+	return -ENOTSUP;
+#endif /* __x86_64__ */
+}
+
+int
+hd_latency_start(struct hd_hashdict* dict,
+                 const struct hd_latency_config* config) {
+	if ((dict == NULL) || (dict->latency != NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_latency* latency = calloc(1, sizeof(*latency));
+	if (latency == NULL) {
+		return -ENOMEM;
+	}
+
+	if (config != NULL) {
+		latency->config = *config;
+	}
+	if (latency->config.sample_every == 0) {
+		latency->config.sample_every = HD_LAT_SAMPLE_EVERY;
+	}
+	if (latency->config.use_tsc) {
+		int ret = hd_lat_calibrate(latency);
+		if (ret != 0) {
+			free(latency);
+			return ret;
+		}
+	}
+
+	int ret = pthread_key_create(&latency->key, hd_lat_buffer_destroy);
+	if (ret != 0) {
+		free(latency);
+		return -ret;
+	}
+	pthread_mutex_init(&latency->lock, NULL);
+
+	dict->latency = latency;
+	return 0;
+}
+
+int
+hd_latency_stop(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->latency == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_latency* latency = dict->latency;
+
+	/* Buffers of threads still alive are freed here. Deleting the key
+	 * orphans their thread specific values, so the destructor doesn't run
+	 * later.*/
+	pthread_key_delete(latency->key);
+
+	struct hd_lat_buffer* buf = latency->buffers;
+	while (buf != NULL) {
+		struct hd_lat_buffer* next = buf->next;
+		free(buf);
+		buf = next;
+	}
+
+	pthread_mutex_destroy(&latency->lock);
+	free(latency);
+	dict->latency = NULL;
+	return 0;
+}
+
+int
+hd_latency_snapshot(struct hd_hashdict* dict,
+                    struct hd_latency_snapshot* snap) {
+	if ((dict == NULL) || (dict->latency == NULL) || (snap == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_latency* latency = dict->latency;
+
+	pthread_mutex_lock(&latency->lock);
+	*snap = latency->retired;
+	snap->sample_every = latency->config.sample_every;
+	for (struct hd_lat_buffer* buf = latency->buffers; buf != NULL;
+	     buf = buf->next) {
+		/* Threads clear their counts lazily after a reset.*/
+		if (!hd_lat_current(latency, buf)) {
+			continue;
+		}
+		for (int op = 0; op < HD_LAT_NUM_OPS; op++) {
+			hd_lat_merge(&snap->ops[op], &buf->ops[op]);
+		}
+		snap->threads++;
+	}
+	pthread_mutex_unlock(&latency->lock);
+	return 0;
+}
+
+int
+hd_latency_reset(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->latency == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_latency* latency = dict->latency;
+
+	pthread_mutex_lock(&latency->lock);
+	memset(&latency->retired, 0, sizeof(latency->retired));
+	atomic_fetch_add_explicit(&latency->generation, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&latency->lock);
+	return 0;
+}
+
+unsigned long long
+hd_latency_percentile(const struct hd_latency_hist* hist, double percentile) {
+	if ((hist == NULL) || (hist->count == 0)) {
+		return 0;
+	}
+
+	unsigned long long rank =
+	    (unsigned long long)(percentile / 100.0 * hist->count + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+	if (rank > hist->count) {
+		rank = hist->count;
+	}
+
+	unsigned long long seen = 0;
+	unsigned int bin = 0;
+	for (; bin < HD_LAT_BINS - 1; bin++) {
+		seen += hist->bins[bin];
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	unsigned long long lo = hd_latency_bin_ns(bin);
+	unsigned long long ns = lo + (hd_latency_bin_ns(bin + 1) - lo) / 2;
+	if (ns > hist->max_ns) {
+		ns = hist->max_ns;
+	}
+	if (ns < hist->min_ns) {
+		ns = hist->min_ns;
+	}
+	return ns;
+}
@@ -0,0 +1,219 @@
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Block compressor producing the LZ4 block format, so blocks can be
+ * inspected or decoded with stock LZ4 tools. A block is a series of
+ * sequences, each a token byte holding the literal count in its high and
+ * the match length minus 4 in its low nibble, extra length bytes for
+ * counts of 15 or more, the literals and a little endian 16 bit match
+ * offset. The last sequence has literals only. The compressor is greedy
+ * with one candidate per hash slot, which is what makes LZ4 fast.
+ */
+
+#define HD_LZ_HASH_BITS 14
+#define HD_LZ_MIN_MATCH 4
+#define HD_LZ_LAST_LITERALS 5 /**< The last bytes are always literals */
+#define HD_LZ_MF_LIMIT 12 /**< No match starts this close to the end */
+#define HD_LZ_MAX_OFFSET 65535
+
+static inline uint32_t
+hd_lz_read32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int
+hd_lz_hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HD_LZ_HASH_BITS);
+}
+
+/**
+ * @brief Writes the extra length bytes of a count of 15 or more
+ */
+static inline unsigned char*
+hd_lz_put_length(unsigned char* op, size_t len) {
+	for (len -= 15; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/**
+ * @brief Emits one sequence, or returns NULL if it doesn't fit
+ *
+ * A match_len of 0 emits the final literals-only sequence.
+ */
+static unsigned char*
+hd_lz_put_sequence(unsigned char* op, unsigned char* oend,
+                   const unsigned char* literals, size_t lit_len,
+                   size_t offset, size_t match_len) {
+	size_t needed = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+	if (needed > (size_t)(oend - op)) {
+		return NULL;
+	}
+
+	unsigned char* token = op++;
+	*token = (unsigned char)(((lit_len < 15) ? lit_len : 15) << 4);
+	if (lit_len >= 15) {
+		op = hd_lz_put_length(op, lit_len);
+	}
+	memcpy(op, literals, lit_len);
+	op += lit_len;
+
+	if (match_len == 0) {
+		return op;
+	}
+
+	*op++ = (unsigned char)offset;
+	*op++ = (unsigned char)(offset >> 8);
+	match_len -= HD_LZ_MIN_MATCH;
+	*token |= (match_len < 15) ? match_len : 15;
+	if (match_len >= 15) {
+		op = hd_lz_put_length(op, match_len);
+	}
+	return op;
+}
+
+size_t
+hd_lz_bound(size_t len) {
+	return len + len / 255 + 16;
+}
+
+size_t
+hd_lz_compress(const unsigned char* src, size_t len, unsigned char* dst,
+               size_t cap) {
+	uint32_t table[1 << HD_LZ_HASH_BITS];
+	const unsigned char* ip = src;
+	const unsigned char* anchor = src;
+	const unsigned char* end = src + len;
+	unsigned char* op = dst;
+	unsigned char* oend = dst + cap;
+
+	memset(table, 0, sizeof(table));
+
+	if (len > HD_LZ_MF_LIMIT) {
+		const unsigned char* mflimit = end - HD_LZ_MF_LIMIT;
+		const unsigned char* mlimit = end - HD_LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t seq = hd_lz_read32(ip);
+			unsigned int h = hd_lz_hash(seq);
+			const unsigned char* ref = src + table[h];
+
+			table[h] = (uint32_t)(ip - src);
+			if ((ref >= ip) || (ip - ref > HD_LZ_MAX_OFFSET) ||
+			    (hd_lz_read32(ref) != seq)) {
+				ip++;
+				continue;
+			}
+
+			const unsigned char* m = ip + HD_LZ_MIN_MATCH;
+			const unsigned char* r = ref + HD_LZ_MIN_MATCH;
+			while ((m < mlimit) && (*m == *r)) {
+				m++;
+				r++;
+			}
+			while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+				ip--;
+				ref--;
+			}
+
+			op = hd_lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+			                        m - ip);
+			if (op == NULL) {
+				return 0;
+			}
+			ip = m;
+			anchor = ip;
+		}
+	}
+
+	op = hd_lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return (op == NULL) ? 0 : (size_t)(op - dst);
+}
+
+/**
+ * @brief Reads the extra length bytes of a count of 15
+ *
+ * @return const unsigned char* The byte after them, or NULL if the input
+ * ends first
+ */
+static inline const unsigned char*
+hd_lz_get_length(const unsigned char* ip, const unsigned char* iend,
+                 size_t* len) {
+	unsigned int b;
+	do {
+		if (ip >= iend) {
+			return NULL;
+		}
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	return ip;
+}
+
+ssize_t
+hd_lz_decompress(const unsigned char* src, size_t len, unsigned char* dst,
+                 size_t cap) {
+	const unsigned char* ip = src;
+	const unsigned char* iend = src + len;
+	unsigned char* op = dst;
+	unsigned char* oend = dst + cap;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t lit_len = token >> 4;
+
+		if ((lit_len == 15) &&
+		    ((ip = hd_lz_get_length(ip, iend, &lit_len)) == NULL)) {
+			return -EBADMSG;
+		}
+		if ((lit_len > (size_t)(iend - ip)) ||
+		    (lit_len > (size_t)(oend - op))) {
+			return -EBADMSG;
+		}
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -EBADMSG;
+		}
+		size_t offset = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > (size_t)(op - dst))) {
+			return -EBADMSG;
+		}
+
+		size_t match_len = token & 15;
+		if ((match_len == 15) &&
+		    ((ip = hd_lz_get_length(ip, iend, &match_len)) == NULL)) {
+			return -EBADMSG;
+		}
+		match_len += HD_LZ_MIN_MATCH;
+		if (match_len > (size_t)(oend - op)) {
+			return -EBADMSG;
+		}
+
+		const unsigned char* m = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, m, match_len);
+		} else {
+			/* Overlapping matches repeat the last offset bytes.*/
+			for (size_t i = 0; i < match_len; i++) {
+				op[i] = m[i];
+			}
+		}
+		op += match_len;
+	}
+	return op - dst;
+}
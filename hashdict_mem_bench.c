@@ -0,0 +1,400 @@
+/**
+ * @file hashdict_mem_bench.c
+ * @brief Memory footprint per entry of every storage mode
+ *
+ * For every storage mode and key and value size, a forked child fills a
+ * fresh dictionary with generated entries, converts it to the storage mode,
+ * looks every key up once so all pages are touched and reports what the
+ * entries cost. Running in a child keeps the heap of one run from being
+ * reused by the next. The modes are:
+ *
+ *   chained   the default chained hash table
+ *   frozen    after hd_freeze()
+ *   snapshot  a file of hd_snapshot_write() mapped by hd_snapshot_open()
+ *   shm       after hd_shm_create(), with an anonymous region
+ *
+ * All figures are bytes per entry:
+ *
+ *   payload   key and value bytes, without terminators
+ *   requested what the dictionary asked the allocator for, from
+ *             hd_get_stats(), chained only
+ *   usable    what the allocator handed out for that, from
+ *             malloc_usable_size(), chained only
+ *   heap      growth of the heap in use, allocator headers included, from
+ *             mallinfo2() with glibc
+ *   rss       growth of the resident set, mapped file and shared memory
+ *             pages included, from /proc/self/statm
+ *   overhead  rss minus payload
+ *
+ * Usage: hashdict_mem_bench [-n entries] [-s sizes] [-m modes] [-d dir]
+ *
+ *   -n  entries per run, default 1000000
+ *   -s  comma separated key:value lengths, default 8:8,16:64,32:256, keys
+ *       at least KEY_DIGITS bytes long
+ *   -m  comma separated storage modes, default all
+ *   -d  directory for the snapshot files, default /tmp
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _GNU_SOURCE /* mallinfo2(), malloc_trim() */
+
+#include "hashdict.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif /* __GLIBC__ */
+
+#define DEFAULT_ENTRIES 1000000
+#define DEFAULT_SIZES "8:8,16:64,32:256"
+#define DEFAULT_DIR "/tmp"
+#define MAX_SIZES 16
+#define MAX_LEN 4096
+#define KEY_DIGITS 6 /**< Base 36 digits making each key unique */
+
+enum mode {
+	MODE_CHAINED,
+	MODE_FROZEN,
+	MODE_SNAPSHOT,
+	MODE_SHM,
+	NUM_MODES,
+};
+
+static const char* const mode_names[NUM_MODES] = {"chained", "frozen",
+                                                  "snapshot", "shm"};
+
+/**
+ * @brief Memory use at one point of a run
+ */
+struct sample {
+	size_t rss;
+	size_t heap;
+};
+
+/**
+ * @brief Outcome of one run, passed from the child to the parent
+ */
+struct result {
+	int error; /**< 0 or a negative errno value */
+	size_t rss;
+	size_t heap;
+	size_t requested;
+	size_t usable;
+};
+
+static struct sample
+take_sample(void) {
+	struct sample s = {0, 0};
+	unsigned long size;
+	unsigned long resident;
+	FILE* f = fopen("/proc/self/statm", "r");
+
+	if (f != NULL) {
+		if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+			s.rss = resident * (size_t)sysconf(_SC_PAGESIZE);
+		}
+		fclose(f);
+	}
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+	s.heap = mi.uordblks + mi.hblkhd;
+#endif /* __GLIBC_PREREQ(2, 33) */
+#endif /* __GLIBC__ */
+	return s;
+}
+
+/**
+ * @brief Writes a string of len bytes ending in the base 36 digits of i
+ */
+static void
+make_string(char* buf, size_t len, char fill, size_t i) {
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+	memset(buf, fill, len);
+	buf[len] = '\0';
+	for (size_t d = 0; (d < KEY_DIGITS) && (d < len); d++) {
+		buf[len - 1 - d] = digits[i % 36];
+		i /= 36;
+	}
+}
+
+/**
+ * @brief Size of a shared memory region comfortably fitting the entries
+ *
+ * hd_shm_create() allocates the whole region, but pages only count toward
+ * rss once touched, so the headroom doesn't skew the overhead.
+ */
+static size_t
+shm_size(size_t n, size_t key_len, size_t value_len) {
+	return 2 * n * (key_len + value_len + 64) + 16 * n + (1 << 20);
+}
+
+static int
+convert(struct hd_hashdict* dict, enum mode mode, size_t n, size_t key_len,
+        size_t value_len, const char* dir) {
+	char path[MAX_LEN];
+	int ret = 0;
+
+	switch (mode) {
+		case MODE_FROZEN:
+			ret = hd_freeze(dict);
+			break;
+		case MODE_SNAPSHOT:
+			snprintf(path, sizeof(path), "%s/hashdict_mem_bench.%ld", dir,
+			         (long)getpid());
+			ret = hd_snapshot_write(dict, path);
+			hd_free(dict);
+			if (ret == 0) {
+				ret = hd_snapshot_open(dict, path);
+				/* The mapping outlives the name.*/
+				unlink(path);
+			}
+			break;
+		case MODE_SHM:
+			ret = hd_shm_create(dict, NULL, shm_size(n, key_len, value_len));
+			break;
+		default:
+			break;
+	}
+	return ret;
+}
+
+/**
+ * @brief Runs one combination, called in the child
+ */
+static void
+run(enum mode mode, size_t n, size_t key_len, size_t value_len,
+    const char* dir, struct result* res) {
+	struct hd_hashdict dict = hd_create();
+	struct hd_stats stats;
+	char key[MAX_LEN + 1];
+	char value[MAX_LEN + 1];
+
+	memset(res, 0, sizeof(*res));
+	struct sample before = take_sample();
+
+	for (size_t i = 0; (i < n) && (res->error == 0); i++) {
+		make_string(key, key_len, 'k', i);
+		make_string(value, value_len, 'v', i);
+		res->error = hd_entry_insert(&dict, key, value);
+	}
+	if (res->error == 0) {
+		res->error = convert(&dict, mode, n, key_len, value_len, dir);
+	}
+	if (res->error != 0) {
+		return;
+	}
+#ifdef __GLIBC__
+	/* Return the chained storage freed by conversions.*/
+	malloc_trim(0);
+#endif /* __GLIBC__ */
+
+	if ((mode == MODE_CHAINED) && (hd_get_stats(&dict, &stats) == 0)) {
+		res->requested = stats.total_bytes;
+		res->usable = stats.alloc_bytes;
+	}
+	for (size_t i = 0; i < n; i++) {
+		make_string(key, key_len, 'k', i);
+		if (hd_lookup(&dict, key) == NULL) {
+			res->error = -EIO;
+			return;
+		}
+	}
+
+	struct sample after = take_sample();
+	res->rss = (after.rss > before.rss) ? after.rss - before.rss : 0;
+	res->heap = (after.heap > before.heap) ? after.heap - before.heap : 0;
+	hd_free(&dict);
+}
+
+/**
+ * @brief Runs one combination in a forked child
+ */
+static int
+run_forked(enum mode mode, size_t n, size_t key_len, size_t value_len,
+           const char* dir, struct result* res) {
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		return -errno;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		int ret = -errno;
+		close(fds[0]);
+		close(fds[1]);
+		return ret;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		run(mode, n, key_len, value_len, dir, res);
+		_exit(write(fds[1], res, sizeof(*res)) == sizeof(*res) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	ssize_t len = read(fds[0], res, sizeof(*res));
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	return (len == sizeof(*res)) ? 0 : -EPIPE;
+}
+
+/**
+ * @brief Parses a comma separated list of names into indices
+ *
+ * @return int Number of names, -1 for an unknown name or too many
+ */
+static int
+parse_names(const char* arg, const char* const* names, size_t num_names,
+            size_t* indices, size_t max) {
+	int count = 0;
+
+	for (const char* p = arg; *p != '\0';) {
+		size_t len = strcspn(p, ",");
+		size_t i;
+
+		for (i = 0; i < num_names; i++) {
+			if ((strlen(names[i]) == len) && !strncmp(p, names[i], len)) {
+				break;
+			}
+		}
+		if ((i == num_names) || ((size_t)count == max)) {
+			return -1;
+		}
+		indices[count++] = i;
+		p += len + (p[len] == ',');
+	}
+	return count;
+}
+
+/**
+ * @brief Parses comma separated key:value lengths
+ *
+ * @return int Number of pairs, -1 if malformed or out of range
+ */
+static int
+parse_sizes(const char* arg, size_t* key_lens, size_t* value_lens,
+            size_t max) {
+	int count = 0;
+
+	for (const char* p = arg; *p != '\0';) {
+		char* end;
+		size_t key_len = strtoull(p, &end, 10);
+
+		if ((end == p) || (*end != ':') || ((size_t)count == max)) {
+			return -1;
+		}
+		p = end + 1;
+		size_t value_len = strtoull(p, &end, 10);
+		if ((end == p) || ((*end != ',') && (*end != '\0')) ||
+		    (key_len < KEY_DIGITS) || (key_len > MAX_LEN) ||
+		    (value_len < 1) || (value_len > MAX_LEN)) {
+			return -1;
+		}
+		key_lens[count] = key_len;
+		value_lens[count] = value_len;
+		count++;
+		p = end + (*end == ',');
+	}
+	return count;
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr, "Usage: %s [-n entries] [-s sizes] [-m modes] [-d dir]\n",
+	        prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	size_t n = DEFAULT_ENTRIES;
+	const char* sizes_arg = DEFAULT_SIZES;
+	const char* modes_arg = NULL;
+	const char* dir = DEFAULT_DIR;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:m:d:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoull(optarg, NULL, 10);
+				break;
+			case 's':
+				sizes_arg = optarg;
+				break;
+			case 'm':
+				modes_arg = optarg;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	size_t key_lens[MAX_SIZES];
+	size_t value_lens[MAX_SIZES];
+	size_t modes[NUM_MODES];
+	int num_sizes = parse_sizes(sizes_arg, key_lens, value_lens, MAX_SIZES);
+	int num_modes = NUM_MODES;
+
+	if (modes_arg != NULL) {
+		num_modes = parse_names(modes_arg, mode_names, NUM_MODES, modes,
+		                        NUM_MODES);
+	} else {
+		for (int m = 0; m < NUM_MODES; m++) {
+			modes[m] = m;
+		}
+	}
+	if ((optind != argc) || (n == 0) || (num_sizes <= 0) ||
+	    (num_modes <= 0)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	printf("%zu entries per run, bytes per entry\n\n", n);
+	printf("%-9s %5s %5s %8s %9s %8s %8s %8s %8s\n", "mode", "key", "value",
+	       "payload", "requested", "usable", "heap", "rss", "overhead");
+
+	int ret = 0;
+	for (int s = 0; s < num_sizes; s++) {
+		for (int m = 0; m < num_modes; m++) {
+			struct result res;
+			enum mode mode = modes[m];
+			double payload = key_lens[s] + value_lens[s];
+
+			int result = run_forked(mode, n, key_lens[s], value_lens[s], dir,
+			                        &res);
+			if (result == 0) {
+				result = res.error;
+			}
+			if (result != 0) {
+				printf("%-9s %5zu %5zu  failed: %s\n", mode_names[mode],
+				       key_lens[s], value_lens[s], strerror(-result));
+				ret = 1;
+				continue;
+			}
+
+			printf("%-9s %5zu %5zu %8.1f ", mode_names[mode], key_lens[s],
+			       value_lens[s], payload);
+			if (mode == MODE_CHAINED) {
+				printf("%9.1f %8.1f ", (double)res.requested / n,
+				       (double)res.usable / n);
+			} else {
+				printf("%9s %8s ", "-", "-");
+			}
+			printf("%8.1f %8.1f %8.1f\n", (double)res.heap / n,
+			       (double)res.rss / n, (double)res.rss / n - payload);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,471 @@
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Runs fn once for each of the n argument structs in args
+ *
+ * The calling thread takes the first one. Arguments that can't get a thread
+ * of their own are run on the calling thread afterwards, so the work always
+ * completes, just with less parallelism.
+ */
+void
+hd_run_parallel(void* (*fn)(void*), void* args, size_t arg_size,
+                unsigned int n) {
+	pthread_t* threads = malloc(n * sizeof(pthread_t));
+	unsigned char* started = calloc(n, 1);
+
+	for (unsigned int t = 1; (threads != NULL) && (started != NULL) && (t < n);
+	     t++) {
+		started[t] = !pthread_create(&threads[t], NULL, fn,
+		                             (char*)args + t * arg_size);
+	}
+
+	for (unsigned int t = 0; t < n; t++) {
+		if ((t == 0) || (started == NULL) || !started[t]) {
+			fn((char*)args + t * arg_size);
+		}
+	}
+
+	for (unsigned int t = 1; (started != NULL) && (t < n); t++) {
+		if (started[t]) {
+			pthread_join(threads[t], NULL);
+		}
+	}
+
+	free(threads);
+	free(started);
+}
+
+/**
+ * @brief State of one hd_build_parallel() worker
+ *
+ * Workers share the input and the bucket array but each one only ever
+ * writes to the buckets it owns, see hd_build_owner(), so no locking is
+ * needed.
+ */
+struct hd_build_worker {
+	const char* const* keys;
+	const char* const* values;
+	unsigned int* buckets; /**< Bucket index of every input key */
+	unsigned int* order; /**< Input indices grouped by owning worker */
+	struct hd_entry** entries; /**< Bucket array being built */
+	struct hd_build_worker* workers; /**< All workers, to find their groups */
+	unsigned int nthreads;
+	unsigned int t; /**< Index of this worker */
+	unsigned int size;
+	size_t hash_lo; /**< First input index this worker hashes */
+	size_t hash_hi;
+	/** Start of the indices owned by each worker in this worker's slice of
+	 * order, relative to hash_lo, nthreads + 1 entries */
+	unsigned int* starts;
+	unsigned int num_entries;
+	unsigned int collisions;
+	int error;
+};
+
+/**
+ * @brief Returns the worker owning a bucket
+ *
+ * Splits the bucket array into nthreads contiguous ranges of about the same
+ * size.
+ */
+static unsigned int
+hd_build_owner(const struct hd_build_worker* w, unsigned int bucket) {
+	return (unsigned int)((unsigned long long)bucket * w->nthreads / w->size);
+}
+
+/**
+ * @brief Links one input key into its bucket
+ *
+ * Mirrors hd_entry_insert(): entries are appended to the chain and
+ * duplicate keys are rejected with -EINVAL.
+ */
+static int
+hd_build_one(struct hd_build_worker* w, size_t i) {
+	struct hd_entry** entry_ptr = &(w->entries[w->buckets[i]]);
+
+	if (*entry_ptr != NULL) {
+		w->collisions++;
+		while (*entry_ptr != NULL) {
+			if (strcmp((*entry_ptr)->key, w->keys[i]) == 0) {
+				return -EINVAL;
+			}
+			entry_ptr = &((*entry_ptr)->next);
+		}
+	}
+
+	struct hd_entry* entry = malloc(sizeof(struct hd_entry));
+
+	if (entry == NULL) {
+		return -ENOMEM;
+	}
+
+	entry->key = hd_stralloc(w->keys[i]);
+	entry->value = hd_stralloc(w->values[i]);
+
+	if ((entry->key == NULL) || (entry->value == NULL)) {
+		free(entry->key);
+		free(entry->value);
+		free(entry);
+		return -ENOMEM;
+	}
+
+	entry->next = NULL;
+	*entry_ptr = entry;
+	w->num_entries++;
+	return 0;
+}
+
+/**
+ * @brief Phase 1: hash a contiguous slice of the input
+ *
+ * Afterwards the indices of the slice are grouped by the worker owning
+ * their bucket: counted first, then scattered into the same slice of order.
+ * Every group keeps the input order, so phase 2 links the keys of a bucket
+ * in the order hd_entry_insert() would.
+ */
+static void*
+hd_build_worker_hash(void* arg) {
+	struct hd_build_worker* w = arg;
+	unsigned int* starts = w->starts;
+
+	memset(starts, 0, (w->nthreads + 1) * sizeof(*starts));
+	for (size_t i = w->hash_lo; i < w->hash_hi; i++) {
+		if ((w->keys[i] == NULL) || (w->values[i] == NULL)) {
+			w->error = -EINVAL;
+			return NULL;
+		}
+		w->buckets[i] = hd_hash(w->keys[i]) & (w->size - 1);
+		starts[hd_build_owner(w, w->buckets[i]) + 1]++;
+	}
+
+	for (unsigned int t = 0; t < w->nthreads; t++) {
+		starts[t + 1] += starts[t];
+	}
+
+	/* Scatter with a copy of the starts, they are needed in phase 2.*/
+	for (size_t i = w->hash_lo; i < w->hash_hi; i++) {
+		unsigned int owner = hd_build_owner(w, w->buckets[i]);
+		w->order[w->hash_lo + starts[owner]] = (unsigned int)i;
+		starts[owner]++;
+	}
+	for (unsigned int t = w->nthreads; t > 0; t--) {
+		starts[t] = starts[t - 1];
+	}
+	starts[0] = 0;
+	return NULL;
+}
+
+/**
+ * @brief Phase 2: link every key whose bucket this worker owns
+ *
+ * Only visits the indices the workers grouped for this one in phase 1, in
+ * the order of the slices.
+ */
+static void*
+hd_build_worker_link(void* arg) {
+	struct hd_build_worker* w = arg;
+
+	for (unsigned int s = 0; (s < w->nthreads) && (w->error == 0); s++) {
+		const struct hd_build_worker* src = &w->workers[s];
+		const unsigned int* group = &w->order[src->hash_lo];
+
+		for (unsigned int j = src->starts[w->t];
+		     (j < src->starts[w->t + 1]) && (w->error == 0); j++) {
+			w->error = hd_build_one(w, group[j]);
+		}
+	}
+	return NULL;
+}
+
+int
+hd_build_parallel(struct hd_hashdict* dict, const char* const* keys,
+                  const char* const* values, size_t n, unsigned int nthreads) {
+	if ((dict == NULL) || (dict->num_entries != 0) ||
+	    (dict->entries != NULL) || (dict->backend != NULL) ||
+	    (dict->wal != NULL) || (dict->dirty != NULL) ||
+	    (dict->repl != NULL) || ((keys == NULL) && (n > 0)) ||
+	    ((values == NULL) && (n > 0)) || (n > UINT_MAX)) {
+		return -EINVAL;
+	}
+
+	if (nthreads == 0) {
+		nthreads = 1;
+	}
+
+	unsigned int size = hd_table_size(n);
+	if (nthreads > size) {
+		nthreads = size;
+	}
+
+	struct hd_entry** entries = calloc(size, sizeof(struct hd_entry*));
+	unsigned int* buckets = malloc((n ? n : 1) * sizeof(unsigned int));
+	unsigned int* order = malloc((n ? n : 1) * sizeof(unsigned int));
+	unsigned int* starts =
+	    malloc((size_t)nthreads * (nthreads + 1) * sizeof(unsigned int));
+	struct hd_build_worker* workers = calloc(nthreads, sizeof(*workers));
+	int ret = 0;
+
+	if ((entries == NULL) || (buckets == NULL) || (order == NULL) ||
+	    (starts == NULL) || (workers == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (unsigned int t = 0; t < nthreads; t++) {
+		struct hd_build_worker* w = &workers[t];
+		w->keys = keys;
+		w->values = values;
+		w->buckets = buckets;
+		w->order = order;
+		w->entries = entries;
+		w->workers = workers;
+		w->nthreads = nthreads;
+		w->t = t;
+		w->size = size;
+		w->hash_lo = n * t / nthreads;
+		w->hash_hi = n * (t + 1) / nthreads;
+		w->starts = &starts[(size_t)t * (nthreads + 1)];
+	}
+
+	hd_run_parallel(hd_build_worker_hash, workers, sizeof(*workers), nthreads);
+
+	for (unsigned int t = 0; t < nthreads; t++) {
+		if (workers[t].error != 0) {
+			ret = workers[t].error;
+			goto out;
+		}
+	}
+
+	hd_run_parallel(hd_build_worker_link, workers, sizeof(*workers), nthreads);
+
+	struct hd_hashdict built = hd_create();
+	built.entries = entries;
+	built.size = size;
+	unsigned int collisions = 0;
+
+	for (unsigned int t = 0; t < nthreads; t++) {
+		if ((ret == 0) && (workers[t].error != 0)) {
+			ret = workers[t].error;
+		}
+		built.num_entries += workers[t].num_entries;
+		collisions += workers[t].collisions;
+	}
+
+	if (ret != 0) {
+		hd_free(&built);
+		entries = NULL;
+		goto out;
+	}
+
+	/* Only the storage is taken over, the operation counters stay.*/
+	dict->entries = built.entries;
+	dict->size = built.size;
+	dict->num_entries = built.num_entries;
+	if (dict->count_ops) {
+		dict->op_counts[HD_OP_INSERT] += built.num_entries;
+		dict->op_counts[HD_OP_COLLISION] += collisions;
+	}
+	entries = NULL;
+out:
+	free(entries);
+	free(buckets);
+	free(order);
+	free(starts);
+	free(workers);
+	return ret;
+}
+
+/**
+ * @brief State of one hd_free_parallel() worker
+ */
+struct hd_free_worker {
+	struct hd_hashdict* dict;
+	unsigned int nthreads;
+	unsigned int t; /**< Frees the t-th share of the buckets of both arrays */
+	struct hd_hashdict acct; /**< Counters of the entries freed */
+};
+
+static void*
+hd_free_worker_run(void* arg) {
+	struct hd_free_worker* w = arg;
+	struct hd_hashdict* dict = w->dict;
+
+	unsigned int lo = (unsigned long long)dict->size * w->t / w->nthreads;
+	unsigned int hi = (unsigned long long)dict->size * (w->t + 1) / w->nthreads;
+	for (unsigned int i = lo; i < hi; i++) {
+		if ((dict->entries[i] != NULL) && (dict->entries[i] != HD_MOVED)) {
+			hd_free_entry_list(dict->entries[i], &w->acct);
+		}
+	}
+
+	lo = (unsigned long long)dict->next_size * w->t / w->nthreads;
+	hi = (unsigned long long)dict->next_size * (w->t + 1) / w->nthreads;
+	for (unsigned int i = lo; i < hi; i++) {
+		if (dict->next_entries[i] != NULL) {
+			hd_free_entry_list(dict->next_entries[i], &w->acct);
+		}
+	}
+	return NULL;
+}
+
+void
+hd_free_parallel(struct hd_hashdict* dict, unsigned int nthreads) {
+	if (dict == NULL) {
+		return;
+	}
+
+	if (nthreads == 0) {
+		nthreads = 1;
+	}
+
+	struct hd_free_worker* workers =
+	    (dict->backend == NULL) ? calloc(nthreads, sizeof(*workers)) : NULL;
+
+	if (workers == NULL) {
+		hd_free(dict);
+		return;
+	}
+
+	for (unsigned int t = 0; t < nthreads; t++) {
+		workers[t].dict = dict;
+		workers[t].nthreads = nthreads;
+		workers[t].t = t;
+		workers[t].acct = hd_create();
+	}
+
+	hd_run_parallel(hd_free_worker_run, workers, sizeof(*workers), nthreads);
+
+	/* The per worker counters went "negative" by the amount freed, adding
+	 * them up wraps back to the remaining counts.*/
+	for (unsigned int t = 0; t < nthreads; t++) {
+		dict->num_entries += workers[t].acct.num_entries;
+	}
+	free(workers);
+
+	free(dict->entries);
+	free(dict->next_entries);
+	dict->entries = NULL;
+	dict->next_entries = NULL;
+	dict->size = 0;
+	dict->next_size = 0;
+	dict->rehash_idx = 0;
+}
+
+/**
+ * @brief Dictionary queued for the background reclaimer
+ */
+struct hd_reclaim_node {
+	struct hd_reclaim_node* next;
+	struct hd_hashdict dict;
+};
+
+/**
+ * @brief Background reclaimer shared by all dictionaries
+ *
+ * Started on the first call to hd_free_async() and kept running for the
+ * lifetime of the process.
+ */
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_cond_t queued; /**< Signalled when work is queued */
+	pthread_cond_t idle; /**< Signalled when the queue was drained */
+	struct hd_reclaim_node* head;
+	int busy; /**< Reclaimer is freeing a dictionary right now */
+	int running; /**< Reclaimer thread was started successfully */
+} hd_reclaimer = {.once = PTHREAD_ONCE_INIT,
+                  .lock = PTHREAD_MUTEX_INITIALIZER,
+                  .queued = PTHREAD_COND_INITIALIZER,
+                  .idle = PTHREAD_COND_INITIALIZER};
+
+static void*
+hd_reclaimer_run(void* arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&hd_reclaimer.lock);
+	for (;;) {
+		while (hd_reclaimer.head == NULL) {
+			hd_reclaimer.busy = 0;
+			pthread_cond_broadcast(&hd_reclaimer.idle);
+			pthread_cond_wait(&hd_reclaimer.queued, &hd_reclaimer.lock);
+		}
+		struct hd_reclaim_node* node = hd_reclaimer.head;
+		hd_reclaimer.head = node->next;
+		hd_reclaimer.busy = 1;
+		pthread_mutex_unlock(&hd_reclaimer.lock);
+
+		hd_free_parallel(&node->dict, 1);
+		free(node);
+
+		pthread_mutex_lock(&hd_reclaimer.lock);
+	}
+	return NULL;
+}
+
+static void
+hd_reclaimer_start(void) {
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, hd_reclaimer_run, NULL) == 0) {
+		pthread_detach(thread);
+		hd_reclaimer.running = 1;
+	}
+}
+
+void
+hd_free_async(struct hd_hashdict* dict) {
+	if (dict == NULL) {
+		return;
+	}
+
+	pthread_once(&hd_reclaimer.once, hd_reclaimer_start);
+
+	struct hd_reclaim_node* node =
+	    hd_reclaimer.running ? malloc(sizeof(*node)) : NULL;
+
+	if (node == NULL) {
+		hd_free_parallel(dict, 1);
+		return;
+	}
+
+	node->dict = *dict;
+	*dict = hd_create();
+
+	/* Like hd_free(), the attachments, operation counters and latency
+	 * histograms stay with the dictionary. The reclaimer only frees the
+	 * entries.*/
+	dict->wal = node->dict.wal;
+	dict->dirty = node->dict.dirty;
+	dict->repl = node->dict.repl;
+	dict->latency = node->dict.latency;
+	dict->count_ops = node->dict.count_ops;
+	for (int op = 0; op < HD_NUM_OPS; op++) {
+		dict->op_counts[op] = node->dict.op_counts[op];
+	}
+	for (int i = 0; i < HD_HIST_SIZE; i++) {
+		dict->probe_counts[0][i] = node->dict.probe_counts[0][i];
+		dict->probe_counts[1][i] = node->dict.probe_counts[1][i];
+	}
+
+	pthread_mutex_lock(&hd_reclaimer.lock);
+	node->next = hd_reclaimer.head;
+	hd_reclaimer.head = node;
+	hd_reclaimer.busy = 1;
+	pthread_cond_signal(&hd_reclaimer.queued);
+	pthread_mutex_unlock(&hd_reclaimer.lock);
+}
+
+void
+hd_free_async_wait(void) {
+	pthread_mutex_lock(&hd_reclaimer.lock);
+	while (hd_reclaimer.busy) {
+		pthread_cond_wait(&hd_reclaimer.idle, &hd_reclaimer.lock);
+	}
+	pthread_mutex_unlock(&hd_reclaimer.lock);
+}
@@ -0,0 +1,636 @@
+/**
+ * @file hashdict_private.h
+ * @brief Internal helpers shared between the hashdict translation units
+ *
+ * Nothing in here is part of the public API and this header is not
+ * installed.
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#ifndef HASHDICT_PRIVATE_H
+#define HASHDICT_PRIVATE_H
+
+#include "hashdict.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HD_REHASH_STEP 1 /**< Buckets migrated per write while resizing */
+
+/*
+ * USDT probes, compiled in if sys/sdt.h is available. Each has a semaphore
+ * that tracers such as bpftrace or perf raise while attached, so the
+ * probe arguments are only computed then. Without a tracer a probe site is
+ * a nop plus a predicted branch. Probes of provider hashdict:
+ *
+ *   lookup__entry(key, key_len)
+ *   lookup__return(key_len, bucket, steps, result)
+ *   insert__entry, update__entry, remove__entry: like lookup__entry
+ *   insert__return, update__return, remove__return: like lookup__return
+ *   resize__entry(size, new_size, num_entries)
+ *   resize__return(size)
+ *   free__entry(size, num_entries)
+ *   free__return()
+ *
+ * steps is the number of chain entries walked, result is 1 for a hit and 0
+ * for a miss of a lookup, 0 or a negative errno value otherwise. resize
+ * covers the incremental migration, from allocating the grown bucket array
+ * to releasing the old one. For example, with PROG the program or shared
+ * library linking hashdict:
+ *
+ *   bpftrace -e 'usdt:PROG:hashdict:lookup__entry { @start[tid] = nsecs; }
+ *     usdt:PROG:hashdict:lookup__return /@start[tid]/
+ *     { @ns = hist(nsecs - @start[tid]); delete(@start[tid]); }'
+ */
+#ifdef HD_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define HD_TRACE_SEMAPHORE(name)                                             \
+	unsigned short hashdict_##name##_semaphore                               \
+	    __attribute__((unused, section(".probes"), visibility("hidden")))
+#define HD_TRACE_ENABLED(name)                                               \
+	__builtin_expect(hashdict_##name##_semaphore != 0, 0)
+#define HD_TRACE0(name) DTRACE_PROBE(hashdict, name)
+#define HD_TRACE1(name, a) DTRACE_PROBE1(hashdict, name, a)
+#define HD_TRACE2(name, a, b) DTRACE_PROBE2(hashdict, name, a, b)
+#define HD_TRACE3(name, a, b, c) DTRACE_PROBE3(hashdict, name, a, b, c)
+#define HD_TRACE4(name, a, b, c, d) DTRACE_PROBE4(hashdict, name, a, b, c, d)
+#else /* HD_HAVE_SDT */
+/* The arguments are never evaluated, sizeof only keeps them used.*/
+#define HD_TRACE_ENABLED(name) 0
+#define HD_TRACE0(name) ((void)0)
+#define HD_TRACE1(name, a) ((void)sizeof(a))
+#define HD_TRACE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define HD_TRACE3(name, a, b, c) (HD_TRACE2(name, a, b), (void)sizeof(c))
+#define HD_TRACE4(name, a, b, c, d)                                          \
+	(HD_TRACE3(name, a, b, c), (void)sizeof(d))
+#endif /* HD_HAVE_SDT */
+
+/* Stored in buckets of the old array once they were migrated into
+ * next_entries. Only its address is used, it never holds data. */
+extern struct hd_entry hd_moved_marker;
+#define HD_MOVED (&hd_moved_marker)
+
+/**
+ * @brief Entry holding a counter instead of a string value
+ *
+ * Created by hd_add(). entry.value points to hd_counter_marker, which is how
+ * counters are told apart from string entries without growing every entry
+ * by a type field.
+ */
+struct hd_counter {
+	struct hd_entry entry;
+	_Atomic long long value;
+};
+
+extern char hd_counter_marker[];
+#define HD_COUNTER_VALUE (hd_counter_marker)
+#define HD_IS_COUNTER(e) ((e)->value == HD_COUNTER_VALUE)
+
+/**
+ * @brief Read-only view of one key-value pair, see hd_foreach_record()
+ */
+struct hd_record {
+	const char* key;
+	size_t key_len;
+	const char* value; /**< NULL if the entry holds a counter */
+	size_t value_len;
+	long long counter; /**< Counter value if value is NULL */
+	unsigned int bucket; /**< Bucket index within the storage */
+};
+
+/**
+ * @brief Operations of a storage backend
+ *
+ * Backends replace the chained bucket arrays of a dictionary, e.g. with a
+ * mapped snapshot. Most are read-only and leave the write operations NULL,
+ * which makes the public write functions fail with -EROFS. Write
+ * operations get the dictionary, with dict->backend pointing to the
+ * backend, and are only called with valid parameters.
+ */
+struct hd_backend_ops {
+	const char* (*lookup)(struct hd_backend* backend, const char* key);
+	int (*counter_get)(struct hd_backend* backend, const char* key,
+	                   long long* value);
+	int (*foreach)(struct hd_backend* backend,
+	               int (*fn)(const struct hd_record* rec, void* ctx),
+	               void* ctx);
+	void (*free)(struct hd_backend* backend);
+	int (*insert)(struct hd_hashdict* dict, const char* key,
+	              const char* value);
+	int (*update)(struct hd_hashdict* dict, const char* key,
+	              const char* value);
+	int (*remove)(struct hd_hashdict* dict, const char* key);
+	int (*add)(struct hd_hashdict* dict, const char* key, long long delta,
+	           long long* result);
+	size_t (*read_begin)(struct hd_backend* backend);
+	void (*read_end)(struct hd_backend* backend);
+};
+
+/**
+ * @brief Base of every backend, embedded as the first member
+ */
+struct hd_backend {
+	const struct hd_backend_ops* ops;
+};
+
+/**
+ * @brief djb2 hash of key, masked to a bucket index by the caller
+ */
+unsigned long
+hd_hash(const char* key);
+
+/**
+ * @brief Seeded 64 bit MurmurHash64A of len bytes at key
+ */
+uint64_t
+hd_hash64(const char* key, size_t len, uint64_t seed);
+
+/**
+ * @brief Allocates memory for and copies str into it
+ *
+ * @return char* The copy, or NULL if out of memory
+ */
+char*
+hd_stralloc(const char* str);
+
+/**
+ * @brief Frees a chain of entries, accounting for them in dict
+ *
+ * Only dict's counters are touched, so the chain doesn't need to be linked
+ * into dict.
+ */
+void
+hd_free_entry_list(struct hd_entry* entry, struct hd_hashdict* dict);
+
+/**
+ * @brief Calls fn for every entry of dict in bucket order
+ *
+ * fn must not insert or remove entries, but may modify the entry it was
+ * passed.
+ *
+ * @return int 0 once all entries were visited, or the first non-zero value
+ * returned by fn, which stops the iteration
+ */
+int
+hd_foreach_entry(struct hd_hashdict* dict,
+                 int (*fn)(struct hd_entry* entry, void* ctx), void* ctx);
+
+/**
+ * @brief Calls fn for every key-value pair of dict
+ *
+ * Unlike hd_foreach_entry() this works for all storage backends.
+ *
+ * @return int 0 once all pairs were visited, or the first non-zero value
+ * returned by fn, which stops the iteration
+ */
+int
+hd_foreach_record(struct hd_hashdict* dict,
+                  int (*fn)(const struct hd_record* rec, void* ctx),
+                  void* ctx);
+
+/**
+ * @brief Keeps the entries of dict from changing until hd_read_end()
+ *
+ * Only storage shared with other processes can change behind the caller's
+ * back. Callers that need the number of entries to match the records
+ * hd_foreach_record() visits wrap both in this, and must not write to dict
+ * in between.
+ *
+ * @return size_t Number of entries of dict
+ */
+size_t
+hd_read_begin(struct hd_hashdict* dict);
+
+void
+hd_read_end(struct hd_hashdict* dict);
+
+/**
+ * @brief Returns the smallest power of two bucket count holding n entries
+ * at a load factor of at most 1, but never less than HASHSIZE
+ */
+unsigned int
+hd_table_size(size_t n);
+
+/**
+ * @brief Makes sure the bucket array of an empty dictionary fits n entries
+ *
+ * Used by load paths which know the number of entries upfront, so the
+ * array doesn't have to grow while they insert.
+ *
+ * @return int 0 on success, -ENOMEM if out of memory
+ */
+int
+hd_reserve(struct hd_hashdict* dict, size_t n);
+
+/**
+ * @brief Runs fn once for each of the n argument structs in args, on up to
+ * n threads
+ */
+void
+hd_run_parallel(void* (*fn)(void*), void* args, size_t arg_size,
+                unsigned int n);
+
+/**
+ * @brief Largest size hd_lz_compress() can produce from len bytes
+ */
+size_t
+hd_lz_bound(size_t len);
+
+/**
+ * @brief Compresses len bytes of src into an LZ4 format block at dst
+ *
+ * @return size_t Size of the block, 0 if it doesn't fit into cap bytes
+ */
+size_t
+hd_lz_compress(const unsigned char* src, size_t len, unsigned char* dst,
+               size_t cap);
+
+/**
+ * @brief Decompresses an LZ4 format block of len bytes into dst
+ *
+ * Never reads or writes out of bounds, whatever the input.
+ *
+ * @return ssize_t Size of the decompressed data, or -EBADMSG if the block is
+ * corrupt or doesn't fit into cap bytes
+ */
+ssize_t
+hd_lz_decompress(const unsigned char* src, size_t len, unsigned char* dst,
+                 size_t cap);
+
+/**
+ * @brief Updates a CRC-32C (Castagnoli) with len bytes of buf
+ *
+ * Start with crc 0.
+ */
+uint32_t
+hd_crc32c(uint32_t crc, const void* buf, size_t len);
+
+/**
+ * @brief Operator moving a CRC-32C over len more bytes, for
+ * hd_crc32c_combine()
+ */
+uint32_t
+hd_crc32c_shift(size_t len);
+
+/**
+ * @brief CRC-32C of a buffer from the CRC-32C crc1 of its head and crc2 of
+ * its tail
+ *
+ * shift is hd_crc32c_shift() of the length of the tail, so it can be taken
+ * ahead of time.
+ */
+uint32_t
+hd_crc32c_combine(uint32_t crc1, uint32_t crc2, uint32_t shift);
+
+/**
+ * @brief Writes all len bytes of buf to fd, retrying short writes
+ *
+ * @return int 0 on success or a negative errno value
+ */
+int
+hd_write_all(int fd, const void* buf, size_t len);
+
+/**
+ * @brief Reads len bytes into buf, stopping early only at end of file
+ *
+ * @return ssize_t Number of bytes read or a negative errno value
+ */
+ssize_t
+hd_read_full(int fd, void* buf, size_t len);
+
+/**
+ * @brief Like hd_read_full(), but reads at offset with pread()
+ */
+ssize_t
+hd_pread_full(int fd, void* buf, size_t len, off_t offset);
+
+/**
+ * @brief Buffered sequential reader or writer of a file
+ *
+ * Keeps several buffers in flight, through io_uring if available.
+ */
+struct hd_io_file;
+
+/**
+ * @brief Opens path for sequential reading or writing
+ *
+ * @param flags O_RDONLY, or O_WRONLY with any of O_CREAT and O_TRUNC.
+ * O_DIRECT is added if config asks for it and the file system allows it.
+ * @return int 0 on success, -ENOMEM if out of memory or a negative errno
+ * value of a failed open()
+ */
+int
+hd_io_open(struct hd_io_file** io, const char* path, int flags,
+           const struct hd_io_config* config);
+
+/**
+ * @brief Appends len bytes of buf to a file opened for writing
+ *
+ * @return int 0 on success or a negative errno value of a failed write
+ */
+int
+hd_io_write(struct hd_io_file* io, const void* buf, size_t len);
+
+/**
+ * @brief Reads len bytes into buf, stopping early only at end of file
+ *
+ * @return ssize_t Number of bytes read or a negative errno value
+ */
+ssize_t
+hd_io_read(struct hd_io_file* io, void* buf, size_t len);
+
+/**
+ * @brief Completes all writes, fsyncs them if sync is set and closes io
+ *
+ * @return int 0 on success or the first error of any write
+ */
+int
+hd_io_close(struct hd_io_file* io, int sync);
+
+/**
+ * @brief Minimal io_uring instance driven through the raw system calls
+ */
+struct hd_uring;
+
+/**
+ * @brief Sets up a ring with room for entries requests
+ *
+ * @return int 0 on success, -ENOSYS if io_uring isn't available or a
+ * negative errno value of a failed setup
+ */
+int
+hd_uring_create(struct hd_uring** ring, unsigned int entries);
+
+void
+hd_uring_free(struct hd_uring* ring);
+
+/**
+ * @brief Appends buf to fd, linked with an fdatasync if sync is set
+ *
+ * Both are submitted with one system call. fd must be open with O_APPEND.
+ *
+ * @return int 0 on success or a negative errno value
+ */
+int
+hd_uring_append(struct hd_uring* ring, int fd, const void* buf, size_t len,
+                int sync);
+
+/* Encoding helpers for the binary formats (dump, log). Integers are stored
+ * little endian, lengths as LEB128 varints.*/
+
+static inline void
+hd_put_le32(unsigned char* p, uint32_t v) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (unsigned char)(v >> (8 * i));
+	}
+}
+
+static inline void
+hd_put_le64(unsigned char* p, uint64_t v) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char)(v >> (8 * i));
+	}
+}
+
+static inline uint32_t
+hd_get_le32(const unsigned char* p) {
+	uint32_t v = 0;
+	for (int i = 0; i < 4; i++) {
+		v |= (uint32_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+static inline uint64_t
+hd_get_le64(const unsigned char* p) {
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v |= (uint64_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+#define HD_VARINT_MAX 10 /**< Maximum encoded size of a 64 bit varint */
+
+static inline unsigned char*
+hd_put_varint(unsigned char* p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+/**
+ * @brief Decodes a varint at p, not reading at or beyond end
+ *
+ * @return const unsigned char* The byte after the varint, or NULL if it is
+ * truncated or too long
+ */
+static inline const unsigned char*
+hd_get_varint(const unsigned char* p, const unsigned char* end, uint64_t* v) {
+	*v = 0;
+	for (int shift = 0; (p < end) && (shift < 64); shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Kinds of changes recorded in the write-ahead log
+ */
+enum hd_wal_op {
+	HD_WAL_SET = 1, /**< Key now holds value, inserted or updated */
+	HD_WAL_REMOVE = 2, /**< Key was removed */
+	HD_WAL_COUNTER = 3, /**< Key now holds the counter value */
+};
+
+/**
+ * @brief One decoded log record
+ *
+ * key and value point into the buffer the record was decoded from.
+ */
+struct hd_wal_record {
+	uint64_t seq; /**< Position of the record in the log, starting at 1 */
+	enum hd_wal_op op;
+	const char* key;
+	size_t key_len;
+	const char* value; /**< Set for HD_WAL_SET only */
+	size_t value_len;
+	long long counter; /**< Set for HD_WAL_COUNTER only */
+};
+
+#define HD_WAL_RECORD_HEADER_SIZE 8 /**< u32 body_len, u32 crc32c of body */
+#define HD_WAL_MAX_BODY (1u << 30) /**< Larger records are corrupt */
+
+/**
+ * @brief Upper bound of the encoded size of a record
+ */
+static inline size_t
+hd_wal_record_size(size_t key_len, size_t value_len) {
+	return HD_WAL_RECORD_HEADER_SIZE + 1 + 8 + 2 * HD_VARINT_MAX + key_len +
+	       1 + value_len + 1;
+}
+
+/**
+ * @brief Encodes rec into buf, which must hold hd_wal_record_size() bytes
+ *
+ * @return size_t Number of bytes written
+ */
+size_t
+hd_wal_encode(unsigned char* buf, const struct hd_wal_record* rec);
+
+/**
+ * @brief Decodes the record at the start of the len bytes at buf
+ *
+ * @return ssize_t Size of the record, 0 if buf ends within it, or -EBADMSG
+ * if it is corrupt
+ */
+ssize_t
+hd_wal_decode(const unsigned char* buf, size_t len, struct hd_wal_record* rec);
+
+/**
+ * @brief Applies a record to dict, no matter what key currently holds
+ *
+ * Applying a record twice leaves the same dictionary as applying it once.
+ *
+ * @return int 0 on success, -ENOMEM if out of memory
+ */
+int
+hd_wal_apply(struct hd_hashdict* dict, const struct hd_wal_record* rec);
+
+/**
+ * @brief Returns the error that stopped logging, 0 if there is none
+ */
+int
+hd_wal_error(struct hd_wal* wal);
+
+/**
+ * @brief Appends a change to the log, committing it as the policy requires
+ *
+ * @return int 0 on success or a negative errno value of a failed write
+ */
+int
+hd_wal_log(struct hd_wal* wal, enum hd_wal_op op, const char* key,
+           const char* value, long long counter);
+
+/**
+ * @brief Adds delta to an existing counter and logs its new value
+ *
+ * Both happen under the log's lock, so concurrent additions are logged in
+ * the order they were applied.
+ *
+ * @return int 0 on success or a negative errno value of a failed write
+ */
+int
+hd_wal_log_add(struct hd_wal* wal, struct hd_counter* counter,
+               long long delta, long long* value);
+
+/**
+ * @brief Marks key as written since the last delta snapshot
+ *
+ * Called after the change took effect. Safe to call concurrently. If out
+ * of memory, the tracker keeps the error and the next hd_snapshot_delta()
+ * fails with it.
+ */
+void
+hd_dirty_mark(struct hd_dirty* dirty, const char* key);
+
+/**
+ * @brief Appends a change to the change stream
+ *
+ * If the change can't be buffered, the follower is dropped instead of
+ * failing the write.
+ */
+void
+hd_repl_log(struct hd_repl* repl, enum hd_wal_op op, const char* key,
+            const char* value, long long counter);
+
+/**
+ * @brief Adds delta to an existing counter and streams its new value
+ *
+ * Both happen under the stream's lock, so concurrent additions are sent in
+ * the order they were applied. wal, if not NULL, logs the addition as
+ * well.
+ *
+ * @return int 0 on success or a negative errno value if writing the log
+ * failed
+ */
+int
+hd_repl_log_add(struct hd_repl* repl, struct hd_wal* wal,
+                struct hd_counter* counter, long long delta,
+                long long* value);
+
+/**
+ * @brief Counts op if hd_stats_enable() is on
+ */
+static inline void
+hd_count(struct hd_hashdict* dict, enum hd_op op) {
+	if (dict->count_ops) {
+		atomic_fetch_add_explicit(&dict->op_counts[op], 1,
+		                          memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Counts op if ret reports success, returns ret
+ */
+static inline int
+hd_counted(struct hd_hashdict* dict, enum hd_op op, int ret) {
+	if (ret == 0) {
+		hd_count(dict, op);
+	}
+	return ret;
+}
+
+/**
+ * @brief Takes the start time if the calling thread's countdown of latency
+ * ran out
+ *
+ * Every thread counts down in its own buffer of latency, so operations on
+ * other dictionaries don't shift its samples.
+ *
+ * @return unsigned long long The start time, or 0 if the operation isn't
+ * timed
+ */
+unsigned long long
+hd_latency_sample(struct hd_latency* latency);
+
+/**
+ * @brief Adds the time since start to the calling thread's histogram
+ */
+void
+hd_latency_record(struct hd_latency* latency, enum hd_lat_op op,
+                  unsigned long long start);
+
+/**
+ * @brief Starts timing an operation if dict samples latencies
+ */
+static inline unsigned long long
+hd_latency_begin(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->latency == NULL)) {
+		return 0;
+	}
+	return hd_latency_sample(dict->latency);
+}
+
+/**
+ * @brief Records an operation timed by hd_latency_begin()
+ */
+static inline void
+hd_latency_end(struct hd_hashdict* dict, enum hd_lat_op op,
+               unsigned long long start) {
+	if (start != 0) {
+		hd_latency_record(dict->latency, op, start);
+	}
+}
+
+#endif /* HASHDICT_PRIVATE_H */
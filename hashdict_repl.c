@@ -0,0 +1,730 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Change stream layout, all integers little endian. The leader sends
+ * frames, each a header followed by a batch of records:
+ *
+ *   header:  magic[4] "HDRP", u32 payload_len, u64 seq of the leader's last
+ *            record, u64 send time in ns since the epoch, u32 reserved,
+ *            u32 crc32c of the preceding 28 bytes
+ *   payload: log records as written by hd_wal_encode(), numbered from
+ *            1 without gaps
+ *
+ * Frames without records are heartbeats. The leader keeps the encoded
+ * records in a backlog, so a follower reconnecting with the sequence number
+ * of the last record it applied continues where it left off.
+ */
+
+#define HD_REPL_MAGIC "HDRP"
+#define HD_REPL_FRAME_HEADER_SIZE 32
+#define HD_REPL_BACKLOG_SIZE (4 * 1024 * 1024) /**< Default backlog_size */
+#define HD_REPL_MAX_BACKLOG (1u << 30) /**< Frames must fit a u32 */
+#define HD_REPL_FLUSH_WINDOW_NS 1000000ULL /**< Default window, 1 ms */
+#define HD_REPL_HEARTBEAT_NS 100000000ULL /**< Default heartbeat, 100 ms */
+#define HD_REPL_WAKE_SIZE (64 * 1024) /**< Wake the sender early */
+#define HD_REPL_POLL_MS 100 /**< Checks for cancellation while blocked */
+#define HD_REPL_READ_SIZE (64 * 1024)
+
+struct hd_repl {
+	struct hd_repl_config config;
+	pthread_mutex_t lock; /**< Protects everything below */
+	pthread_cond_t wake; /**< Wakes the sender before its window ends */
+	pthread_cond_t drained; /**< Broadcast when the sender finished a
+	                           frame */
+	pthread_t sender;
+	int stop; /**< Tells the sender to flush and exit */
+	int sending; /**< The sender is writing a frame outside the lock */
+	_Atomic int cancel; /**< Aborts a blocked frame, the follower is gone */
+	unsigned char* buf; /**< Backlog of encoded records, oldest first */
+	size_t len;
+	size_t cap;
+	uint64_t first_seq; /**< Sequence number of the first record in buf */
+	uint64_t seq; /**< Sequence number of the last record */
+	int fd; /**< Follower connection, or -1 */
+	int connected; /**< Cleared when the follower is dropped */
+	size_t sent; /**< Bytes of buf sent to the follower */
+	uint64_t sent_seq; /**< Last record sent to the follower */
+	unsigned long long bytes_sent;
+	unsigned long long last_send_ns;
+	int error; /**< Why the last follower was dropped */
+	unsigned char* out; /**< Frame being sent, used by the sender only */
+	size_t out_cap;
+};
+
+struct hd_repl_follower {
+	int fd;
+	unsigned char* buf; /**< Received bytes not yet applied */
+	size_t len;
+	size_t cap;
+	struct hd_repl_follower_stats stats;
+	unsigned long long rate_start_ns; /**< Start of the ops_per_sec window */
+	unsigned long long rate_start_applied;
+};
+
+static unsigned long long
+hd_repl_now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Size of the encoded record starting at p
+ */
+static inline size_t
+hd_repl_record_len(const unsigned char* p) {
+	return HD_WAL_RECORD_HEADER_SIZE + hd_get_le32(p);
+}
+
+/**
+ * @brief Returns the offset of the first record boundary at or after min
+ * in the backlog, counting the records before it in *count
+ */
+static size_t
+hd_repl_skip(const struct hd_repl* repl, size_t min, uint64_t* count) {
+	size_t off = 0;
+
+	*count = 0;
+	while (off < min) {
+		off += hd_repl_record_len(repl->buf + off);
+		(*count)++;
+	}
+	return off;
+}
+
+/**
+ * @brief Returns the offset of the record with sequence number seq, which
+ * has to be in the backlog or be the next one
+ */
+static size_t
+hd_repl_offset(const struct hd_repl* repl, uint64_t seq) {
+	size_t off = 0;
+
+	for (uint64_t s = repl->first_seq; s < seq; s++) {
+		off += hd_repl_record_len(repl->buf + off);
+	}
+	return off;
+}
+
+/**
+ * @brief Drops the follower, called with repl->lock held
+ *
+ * Writers can't wait for a blocked send, so the sender closes the
+ * connection once it notices.
+ */
+static void
+hd_repl_drop(struct hd_repl* repl, int error) {
+	if (repl->connected) {
+		repl->connected = 0;
+		repl->error = error;
+		atomic_store(&repl->cancel, 1);
+		pthread_cond_signal(&repl->wake);
+	}
+}
+
+/**
+ * @brief Discards the oldest records beyond backlog_size that were sent
+ */
+static void
+hd_repl_trim(struct hd_repl* repl) {
+	size_t cut = 0;
+	if (repl->len > repl->config.backlog_size) {
+		cut = repl->len - repl->config.backlog_size;
+	}
+	if ((repl->fd >= 0) && (cut > repl->sent)) {
+		cut = repl->sent;
+	}
+	if (cut == 0) {
+		return;
+	}
+
+	uint64_t count;
+	size_t off = hd_repl_skip(repl, cut, &count);
+
+	memmove(repl->buf, repl->buf + off, repl->len - off);
+	repl->len -= off;
+	repl->first_seq += count;
+	if (repl->fd >= 0) {
+		repl->sent -= off;
+	}
+}
+
+/**
+ * @brief Numbers rec and adds it to the backlog, called with repl->lock
+ * held
+ */
+static void
+hd_repl_append(struct hd_repl* repl, struct hd_wal_record* rec) {
+	size_t needed = hd_wal_record_size(rec->key_len, rec->value_len);
+
+	rec->seq = ++repl->seq;
+
+	if (repl->len + needed > repl->cap) {
+		hd_repl_trim(repl);
+	}
+	if (repl->len + needed > repl->cap) {
+		size_t cap = repl->cap * 2;
+		if (cap < repl->len + needed) {
+			cap = repl->len + needed;
+		}
+
+		unsigned char* grown = realloc(repl->buf, cap);
+		if (grown == NULL) {
+			/* The record is lost, so the backlog can't serve anyone
+			 * asking for it or anything before it.*/
+			hd_repl_drop(repl, -ENOMEM);
+			repl->len = 0;
+			repl->sent = 0;
+			repl->first_seq = repl->seq + 1;
+			return;
+		}
+		repl->buf = grown;
+		repl->cap = cap;
+	}
+
+	repl->len += hd_wal_encode(repl->buf + repl->len, rec);
+
+	if ((repl->fd >= 0) && repl->connected) {
+		size_t unsent = repl->len - repl->sent;
+		if (unsent > repl->config.backlog_size) {
+			/* The follower can't keep up, it has to resync.*/
+			hd_repl_drop(repl, -ENOBUFS);
+		} else if (unsent >= HD_REPL_WAKE_SIZE) {
+			pthread_cond_signal(&repl->wake);
+		}
+	}
+}
+
+void
+hd_repl_log(struct hd_repl* repl, enum hd_wal_op op, const char* key,
+            const char* value, long long counter) {
+	struct hd_wal_record rec = {.op = op,
+	                            .key = key,
+	                            .key_len = strlen(key),
+	                            .value = value,
+	                            .value_len = value ? strlen(value) : 0,
+	                            .counter = counter};
+
+	pthread_mutex_lock(&repl->lock);
+	hd_repl_append(repl, &rec);
+	pthread_mutex_unlock(&repl->lock);
+}
+
+int
+hd_repl_log_add(struct hd_repl* repl, struct hd_wal* wal,
+                struct hd_counter* counter, long long delta,
+                long long* value) {
+	int ret = 0;
+
+	pthread_mutex_lock(&repl->lock);
+
+	if (wal != NULL) {
+		ret = hd_wal_log_add(wal, counter, delta, value);
+	} else {
+		*value = atomic_fetch_add_explicit(&counter->value, delta,
+		                                   memory_order_relaxed) +
+		         delta;
+	}
+
+	struct hd_wal_record rec = {.op = HD_WAL_COUNTER,
+	                            .key = counter->entry.key,
+	                            .key_len = strlen(counter->entry.key),
+	                            .counter = *value};
+	hd_repl_append(repl, &rec);
+
+	pthread_mutex_unlock(&repl->lock);
+	return ret;
+}
+
+/**
+ * @brief Writes a frame to the follower
+ *
+ * Waits for the connection to drain with poll(), so a stalled follower
+ * can be cancelled. Pipes are written PIPE_BUF bytes at a time, which
+ * never blocks once poll() reported them writable.
+ */
+static int
+hd_repl_send(struct hd_repl* repl, int fd, const unsigned char* buf,
+             size_t len) {
+	int is_socket = 1;
+
+	while (len > 0) {
+		struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+		int n = poll(&pfd, 1, HD_REPL_POLL_MS);
+
+		if (atomic_load(&repl->cancel)) {
+			return -ECANCELED;
+		}
+		if ((n < 0) && (errno != EINTR)) {
+			return -errno;
+		}
+		if (n <= 0) {
+			continue;
+		}
+		if (pfd.revents & (POLLERR | POLLHUP)) {
+			/* Writing would raise SIGPIPE on a pipe.*/
+			return -EPIPE;
+		}
+
+		ssize_t written = -1;
+		if (is_socket) {
+			written = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if ((written < 0) && (errno == ENOTSOCK)) {
+				is_socket = 0;
+			}
+		}
+		if (!is_socket) {
+			written = write(fd, buf, (len < PIPE_BUF) ? len : PIPE_BUF);
+		}
+		if (written < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) {
+				continue;
+			}
+			return -errno;
+		}
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sends the unsent part of the backlog, or a heartbeat, as one
+ * frame
+ *
+ * Called with repl->lock held, which is released while the frame is
+ * written.
+ */
+static void
+hd_repl_flush(struct hd_repl* repl) {
+	unsigned long long now = hd_repl_now_ns(CLOCK_REALTIME);
+	size_t payload = repl->len - repl->sent;
+
+	if ((payload == 0) &&
+	    (now - repl->last_send_ns < repl->config.heartbeat_ns)) {
+		return;
+	}
+
+	size_t needed = HD_REPL_FRAME_HEADER_SIZE + payload;
+	if (needed > repl->out_cap) {
+		unsigned char* grown = realloc(repl->out, needed);
+		if (grown == NULL) {
+			hd_repl_drop(repl, -ENOMEM);
+			return;
+		}
+		repl->out = grown;
+		repl->out_cap = needed;
+	}
+
+	unsigned char* hdr = repl->out;
+	memset(hdr, 0, HD_REPL_FRAME_HEADER_SIZE);
+	memcpy(hdr, HD_REPL_MAGIC, 4);
+	hd_put_le32(hdr + 4, payload);
+	hd_put_le64(hdr + 8, repl->seq);
+	hd_put_le64(hdr + 16, now);
+	hd_put_le32(hdr + 28, hd_crc32c(0, hdr, 28));
+	memcpy(repl->out + HD_REPL_FRAME_HEADER_SIZE, repl->buf + repl->sent,
+	       payload);
+
+	/* Records appended meanwhile are after the frame, and trimming keeps
+	 * everything from repl->sent on, so the offsets stay valid.*/
+	uint64_t seq = repl->seq;
+	int fd = repl->fd;
+	repl->sending = 1;
+	pthread_mutex_unlock(&repl->lock);
+
+	int ret = hd_repl_send(repl, fd, repl->out, needed);
+
+	pthread_mutex_lock(&repl->lock);
+	repl->sending = 0;
+	pthread_cond_broadcast(&repl->drained);
+	if (ret != 0) {
+		if (ret != -ECANCELED) {
+			hd_repl_drop(repl, ret);
+		}
+		return;
+	}
+	repl->sent += payload;
+	repl->sent_seq = seq;
+	repl->bytes_sent += needed;
+	repl->last_send_ns = now;
+}
+
+/**
+ * @brief Background thread sending new records once per flush window
+ */
+static void*
+hd_repl_sender(void* arg) {
+	struct hd_repl* repl = arg;
+
+	pthread_mutex_lock(&repl->lock);
+	for (;;) {
+		if (!repl->stop &&
+		    (!repl->connected || (repl->fd < 0) ||
+		     (repl->len - repl->sent < HD_REPL_WAKE_SIZE))) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			unsigned long long ns =
+			    deadline.tv_nsec + repl->config.flush_window_ns;
+			deadline.tv_sec += ns / 1000000000ULL;
+			deadline.tv_nsec = ns % 1000000000ULL;
+			pthread_cond_timedwait(&repl->wake, &repl->lock, &deadline);
+		}
+
+		if ((repl->fd >= 0) && !repl->connected) {
+			close(repl->fd);
+			repl->fd = -1;
+			repl->sent = 0;
+		}
+		if (repl->fd >= 0) {
+			hd_repl_flush(repl);
+		}
+		if (repl->stop &&
+		    ((repl->fd < 0) || !repl->connected ||
+		     (repl->sent == repl->len))) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&repl->lock);
+	return NULL;
+}
+
+int
+hd_repl_start(struct hd_hashdict* dict, uint64_t seq,
+              const struct hd_repl_config* config) {
+	if ((dict == NULL) || (dict->repl != NULL) || (dict->backend != NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_repl* repl = calloc(1, sizeof(*repl));
+	if (repl == NULL) {
+		return -ENOMEM;
+	}
+
+	if (config != NULL) {
+		repl->config = *config;
+	}
+	if (repl->config.backlog_size == 0) {
+		repl->config.backlog_size = HD_REPL_BACKLOG_SIZE;
+	}
+	if (repl->config.flush_window_ns == 0) {
+		repl->config.flush_window_ns = HD_REPL_FLUSH_WINDOW_NS;
+	}
+	if (repl->config.heartbeat_ns == 0) {
+		repl->config.heartbeat_ns = HD_REPL_HEARTBEAT_NS;
+	}
+	if (repl->config.backlog_size > HD_REPL_MAX_BACKLOG) {
+		free(repl);
+		return -EINVAL;
+	}
+
+	repl->cap = 2 * repl->config.backlog_size;
+	repl->buf = malloc(repl->cap);
+	if (repl->buf == NULL) {
+		free(repl);
+		return -ENOMEM;
+	}
+	repl->seq = seq;
+	repl->first_seq = seq + 1;
+	repl->fd = -1;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&repl->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&repl->drained, NULL);
+	pthread_mutex_init(&repl->lock, NULL);
+
+	int ret = pthread_create(&repl->sender, NULL, hd_repl_sender, repl);
+	if (ret != 0) {
+		pthread_mutex_destroy(&repl->lock);
+		pthread_cond_destroy(&repl->drained);
+		pthread_cond_destroy(&repl->wake);
+		free(repl->buf);
+		free(repl);
+		return -ret;
+	}
+
+	dict->repl = repl;
+	return 0;
+}
+
+int
+hd_repl_connect(struct hd_hashdict* dict, int fd, uint64_t seq) {
+	if ((dict == NULL) || (dict->repl == NULL) || (fd < 0)) {
+		return -EINVAL;
+	}
+
+	struct hd_repl* repl = dict->repl;
+
+	pthread_mutex_lock(&repl->lock);
+
+	/* Cancel a frame still blocked on the previous follower.*/
+	atomic_store(&repl->cancel, 1);
+	while (repl->sending) {
+		pthread_cond_wait(&repl->drained, &repl->lock);
+	}
+	atomic_store(&repl->cancel, 0);
+
+	int ret = 0;
+	if ((seq > repl->seq) || (seq + 1 < repl->first_seq)) {
+		ret = -ERANGE;
+		goto out;
+	}
+
+	int new_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (new_fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (repl->fd >= 0) {
+		close(repl->fd);
+	}
+
+	repl->fd = new_fd;
+	repl->connected = 1;
+	repl->error = 0;
+	repl->sent = hd_repl_offset(repl, seq + 1);
+	repl->sent_seq = seq;
+	repl->last_send_ns = 0;
+	pthread_cond_signal(&repl->wake);
+out:
+	pthread_mutex_unlock(&repl->lock);
+	return ret;
+}
+
+int
+hd_repl_stop(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->repl == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_repl* repl = dict->repl;
+
+	pthread_mutex_lock(&repl->lock);
+	repl->stop = 1;
+	pthread_cond_signal(&repl->wake);
+	pthread_mutex_unlock(&repl->lock);
+	pthread_join(repl->sender, NULL);
+
+	int ret = repl->connected ? 0 : repl->error;
+	if (repl->fd >= 0) {
+		close(repl->fd);
+	}
+
+	pthread_mutex_destroy(&repl->lock);
+	pthread_cond_destroy(&repl->drained);
+	pthread_cond_destroy(&repl->wake);
+	free(repl->buf);
+	free(repl->out);
+	free(repl);
+	dict->repl = NULL;
+	return ret;
+}
+
+int
+hd_repl_leader_stats(struct hd_hashdict* dict,
+                     struct hd_repl_leader_stats* stats) {
+	if ((dict == NULL) || (dict->repl == NULL) || (stats == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_repl* repl = dict->repl;
+
+	pthread_mutex_lock(&repl->lock);
+	stats->seq = repl->seq;
+	stats->first_seq = repl->first_seq;
+	stats->sent_seq = repl->sent_seq;
+	stats->backlog_bytes = repl->len;
+	stats->bytes_sent = repl->bytes_sent;
+	stats->connected = repl->connected;
+	stats->error = repl->error;
+	pthread_mutex_unlock(&repl->lock);
+	return 0;
+}
+
+int
+hd_repl_follower_create(struct hd_repl_follower** follower, int fd,
+                        uint64_t seq) {
+	if ((follower == NULL) || (fd < 0)) {
+		return -EINVAL;
+	}
+
+	struct hd_repl_follower* f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		return -ENOMEM;
+	}
+
+	f->cap = HD_REPL_READ_SIZE;
+	f->buf = malloc(f->cap);
+	if (f->buf == NULL) {
+		free(f);
+		return -ENOMEM;
+	}
+
+	f->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (f->fd < 0) {
+		int ret = -errno;
+		free(f->buf);
+		free(f);
+		return ret;
+	}
+
+	f->stats.applied_seq = seq;
+	f->stats.leader_seq = seq;
+	f->rate_start_ns = hd_repl_now_ns(CLOCK_MONOTONIC);
+	*follower = f;
+	return 0;
+}
+
+void
+hd_repl_follower_free(struct hd_repl_follower* follower) {
+	if (follower == NULL) {
+		return;
+	}
+	close(follower->fd);
+	free(follower->buf);
+	free(follower);
+}
+
+/**
+ * @brief Applies the records of one frame
+ *
+ * Records the follower already has are skipped, which happens after
+ * reconnecting with an older sequence number.
+ */
+static int
+hd_repl_apply_batch(struct hd_repl_follower* f, struct hd_hashdict* dict,
+                    const unsigned char* p, size_t len, size_t* applied) {
+	const unsigned char* end = p + len;
+
+	while (p < end) {
+		struct hd_wal_record rec;
+		ssize_t size = hd_wal_decode(p, end - p, &rec);
+
+		if (size <= 0) {
+			return -EBADMSG;
+		}
+		p += size;
+		if (rec.seq <= f->stats.applied_seq) {
+			continue;
+		}
+		if (rec.seq != f->stats.applied_seq + 1) {
+			return -ERANGE;
+		}
+
+		int ret = hd_wal_apply(dict, &rec);
+		if (ret != 0) {
+			return ret;
+		}
+		f->stats.applied_seq = rec.seq;
+		f->stats.applied++;
+		(*applied)++;
+	}
+	return 0;
+}
+
+int
+hd_repl_receive(struct hd_repl_follower* follower, struct hd_hashdict* dict,
+                int timeout_ms) {
+	if ((follower == NULL) || (dict == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_repl_follower* f = follower;
+	struct pollfd pfd = {.fd = f->fd, .events = POLLIN};
+	int n = poll(&pfd, 1, timeout_ms);
+
+	if (n < 0) {
+		return (errno == EINTR) ? 0 : -errno;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	if (f->cap - f->len < HD_REPL_READ_SIZE) {
+		unsigned char* grown = realloc(f->buf, f->len + HD_REPL_READ_SIZE);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		f->buf = grown;
+		f->cap = f->len + HD_REPL_READ_SIZE;
+	}
+
+	ssize_t got = read(f->fd, f->buf + f->len, f->cap - f->len);
+	if (got < 0) {
+		return ((errno == EINTR) || (errno == EAGAIN)) ? 0 : -errno;
+	}
+	if (got == 0) {
+		return -EPIPE;
+	}
+	f->len += got;
+
+	size_t applied = 0;
+	size_t pos = 0;
+	int ret = 0;
+
+	while (f->len - pos >= HD_REPL_FRAME_HEADER_SIZE) {
+		const unsigned char* hdr = f->buf + pos;
+
+		if (memcmp(hdr, HD_REPL_MAGIC, 4) ||
+		    (hd_get_le32(hdr + 28) != hd_crc32c(0, hdr, 28))) {
+			ret = -EBADMSG;
+			break;
+		}
+
+		size_t payload = hd_get_le32(hdr + 4);
+		if (f->len - pos - HD_REPL_FRAME_HEADER_SIZE < payload) {
+			break;
+		}
+
+		ret = hd_repl_apply_batch(f, dict, hdr + HD_REPL_FRAME_HEADER_SIZE,
+		                          payload, &applied);
+		if (ret != 0) {
+			break;
+		}
+
+		unsigned long long sent_ns = hd_get_le64(hdr + 16);
+		unsigned long long now = hd_repl_now_ns(CLOCK_REALTIME);
+		f->stats.leader_seq = hd_get_le64(hdr + 8);
+		f->stats.lag_ns = (now > sent_ns) ? now - sent_ns : 0;
+		f->stats.batches++;
+		pos += HD_REPL_FRAME_HEADER_SIZE + payload;
+	}
+
+	memmove(f->buf, f->buf + pos, f->len - pos);
+	f->len -= pos;
+
+	unsigned long long now = hd_repl_now_ns(CLOCK_MONOTONIC);
+	if (now - f->rate_start_ns >= 1000000000ULL) {
+		f->stats.ops_per_sec =
+		    (double)(f->stats.applied - f->rate_start_applied) * 1e9 /
+		    (double)(now - f->rate_start_ns);
+		f->rate_start_ns = now;
+		f->rate_start_applied = f->stats.applied;
+	}
+
+	return (ret != 0) ? ret : (int)applied;
+}
+
+void
+hd_repl_follower_stats(const struct hd_repl_follower* follower,
+                       struct hd_repl_follower_stats* stats) {
+	*stats = follower->stats;
+}
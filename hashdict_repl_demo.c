@@ -0,0 +1,227 @@
+/**
+ * @file hashdict_repl_demo.c
+ * @brief Replicates a dictionary to a follower process over a socket
+ *
+ * The parent is the leader: it streams its writes with hd_repl_start() and
+ * hd_repl_connect() while inserting, updating, removing and counting. The
+ * forked child is the follower: it tells the leader the last change it has,
+ * then applies the stream with hd_repl_receive() and reports lag and
+ * throughput once per second. When the leader is done, both sides print a
+ * digest of their dictionary, which has to match.
+ *
+ * Usage: hashdict_repl_demo [num_keys] [rounds]
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of keys written if none is given on the command line
+#define DEFAULT_NUM_KEYS 100000
+#define DEFAULT_ROUNDS 20
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief FNV-1a over the values and counters of all keys the demo writes
+ */
+static uint64_t
+digest(struct hd_hashdict* dict, size_t num_keys) {
+	uint64_t h = 14695981039346656037ULL;
+	char key[32];
+
+	for (size_t i = 0; i < num_keys; i++) {
+		snprintf(key, sizeof(key), "key:%zu", i);
+		const char* value = hd_lookup(dict, key);
+		for (const char* p = value ? value : "-"; *p != '\0'; p++) {
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+		}
+
+		long long counter = 0;
+		snprintf(key, sizeof(key), "hits:%zu", i % 1000);
+		hd_counter_get(dict, key, &counter);
+		h = (h ^ (uint64_t)counter) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static int
+follower(int sock, size_t num_keys) {
+	struct hd_hashdict dict = hd_create();
+	struct hd_repl_follower* f;
+	uint64_t seq = 0;
+
+	int result = hd_repl_follower_create(&f, sock, seq);
+	if (result != 0) {
+		fprintf(stderr, "Error creating follower: %s\n", strerror(-result));
+		return 1;
+	}
+
+	/* Tell the leader where to resume, here from the start.*/
+	if (write(sock, &seq, sizeof(seq)) != sizeof(seq)) {
+		perror("write");
+		return 1;
+	}
+
+	unsigned long long start = now_ns();
+	unsigned long long last_report = start;
+	struct hd_repl_follower_stats stats;
+
+	while ((result = hd_repl_receive(f, &dict, 1000)) >= 0) {
+		unsigned long long now = now_ns();
+		if (now - last_report < 1000000000ULL) {
+			continue;
+		}
+		hd_repl_follower_stats(f, &stats);
+		printf("follower: seq %" PRIu64 "/%" PRIu64
+		       ", lag %.3f ms, %.0f ops/s\n",
+		       stats.applied_seq, stats.leader_seq, stats.lag_ns / 1e6,
+		       stats.ops_per_sec);
+		last_report = now;
+	}
+	if (result != -EPIPE) {
+		fprintf(stderr, "Error receiving: %s\n", strerror(-result));
+		return 1;
+	}
+
+	hd_repl_follower_stats(f, &stats);
+	double secs = (now_ns() - start) / 1e9;
+	printf("follower: applied %llu changes in %llu batches, %.0f ops/s\n",
+	       stats.applied, stats.batches, stats.applied / secs);
+
+	uint64_t h = digest(&dict, num_keys);
+	printf("follower: %u entries, digest %016" PRIx64 "\n", dict.num_entries,
+	       h);
+	hd_repl_follower_free(f);
+	hd_free(&dict);
+
+	/* Report the digest back, so the leader can compare.*/
+	return (write(sock, &h, sizeof(h)) == sizeof(h)) ? 0 : 1;
+}
+
+static int
+leader(int sock, size_t num_keys, int rounds) {
+	struct hd_hashdict dict = hd_create();
+	struct hd_repl_leader_stats stats;
+	uint64_t seq;
+	char key[32];
+	char value[64];
+
+	int result = hd_repl_start(&dict, 0, NULL);
+	if ((result == 0) &&
+	    (read(sock, &seq, sizeof(seq)) != sizeof(seq))) {
+		result = -EPROTO;
+	}
+	if (result == 0) {
+		result = hd_repl_connect(&dict, sock, seq);
+	}
+	if (result != 0) {
+		fprintf(stderr, "Error starting leader: %s\n", strerror(-result));
+		return 1;
+	}
+
+	unsigned long long start = now_ns();
+	for (size_t i = 0; i < num_keys; i++) {
+		snprintf(key, sizeof(key), "key:%zu", i);
+		snprintf(value, sizeof(value), "value:%zu", i);
+		hd_entry_insert(&dict, key, value);
+	}
+	for (int round = 0; round < rounds; round++) {
+		for (size_t i = 0; i < num_keys; i++) {
+			snprintf(key, sizeof(key), "hits:%zu", i % 1000);
+			hd_incr(&dict, key, 1);
+			if (i % 7 == (size_t)round % 7) {
+				snprintf(key, sizeof(key), "key:%zu", i);
+				snprintf(value, sizeof(value), "value:%zu:%d", i, round);
+				hd_entry_update(&dict, key, value);
+			}
+		}
+		hd_repl_leader_stats(&dict, &stats);
+		printf("leader:   round %d, seq %" PRIu64 ", sent %" PRIu64
+		       ", %.1f MiB sent\n",
+		       round, stats.seq, stats.sent_seq,
+		       stats.bytes_sent / (1024.0 * 1024.0));
+	}
+	for (size_t i = 0; i < num_keys; i += 3) {
+		snprintf(key, sizeof(key), "key:%zu", i);
+		hd_entry_remove(&dict, key);
+	}
+	double secs = (now_ns() - start) / 1e9;
+
+	hd_repl_leader_stats(&dict, &stats);
+	printf("leader:   %" PRIu64 " changes in %.2f s, %.0f ops/s\n", stats.seq,
+	       secs, stats.seq / secs);
+
+	result = hd_repl_stop(&dict);
+	if (result != 0) {
+		fprintf(stderr, "Follower dropped: %s\n", strerror(-result));
+	}
+	/* The follower sees the end of the stream and answers.*/
+	shutdown(sock, SHUT_WR);
+
+	uint64_t h = digest(&dict, num_keys);
+	uint64_t follower_h = 0;
+	printf("leader:   %u entries, digest %016" PRIx64 "\n", dict.num_entries,
+	       h);
+	if (read(sock, &follower_h, sizeof(follower_h)) != sizeof(follower_h)) {
+		follower_h = ~h;
+	}
+	printf("%s\n", (follower_h == h) ? "Replica matches" : "Replica differs");
+	hd_free(&dict);
+	return (follower_h == h) ? 0 : 1;
+}
+
+int
+main(int argc, char* argv[]) {
+	size_t num_keys = DEFAULT_NUM_KEYS;
+	int rounds = DEFAULT_ROUNDS;
+	int sv[2];
+
+	if (argc > 1) {
+		num_keys = strtoull(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		rounds = atoi(argv[2]);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		exit(follower(sv[1], num_keys));
+	}
+
+	close(sv[1]);
+	int ret = leader(sv[0], num_keys, rounds);
+	int status;
+	waitpid(pid, &status, 0);
+	close(sv[0]);
+	return (ret == 0) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)
+	           ? 0
+	           : 1;
+}
@@ -0,0 +1,598 @@
+/**
+ * @file hashdict_replay.c
+ * @brief Replays a recorded trace of operations against a dictionary
+ *
+ * The trace is a text file with one operation per line, fields separated
+ * by tabs:
+ *
+ *   get   <key>            hd_lookup()
+ *   set   <key> <value>    hd_entry_update(), hd_entry_insert() if missing
+ *   ins   <key> <value>    hd_entry_insert()
+ *   upd   <key> <value>    hd_entry_update()
+ *   del   <key>            hd_entry_remove()
+ *   incr  <key> <delta>    hd_incr()
+ *
+ * Keys and values are escaped like the TSV of hd_export(): \t, \n, \r and
+ * \\ stand for tab, newline, carriage return and backslash. Empty lines
+ * and lines starting with # are skipped.
+ *
+ * The trace is mapped copy-on-write and parsed in place before the clock
+ * starts, so replaying costs no reads and no copies of keys. Records are
+ * split over the threads by the hash of their key, which keeps the order
+ * of the operations on every key. With more than one thread the dictionary
+ * is guarded by an rwlock: get, and incr of existing counters, take it
+ * shared, all other operations exclusive.
+ *
+ * Without -r the trace is replayed at full speed. With -r every thread
+ * replays its share at an even pace, sleeping until PACE_SPIN_NS before an
+ * operation is due and spinning from there, since sleeps wake up late. A
+ * paced thread therefore wants a core of its own.
+ * How late operations started against their schedule is reported as lag,
+ * a replay that can't keep up shows as operations late by more than the
+ * interval between two. Latency percentiles are sampled by
+ * hd_latency_start() and cover the dictionary operation only, not the wait
+ * for the lock. incr isn't timed.
+ *
+ * Usage: hashdict_replay [-t threads] [-r ops_per_sec] [-l sample_every]
+ *                        [-d dump] <trace>
+ *
+ *   -t  replaying threads, default 1
+ *   -r  operations per second over all threads, default full speed
+ *   -l  time every n-th operation, default 64
+ *   -d  load this dump of hd_dump_file() before replaying
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS 1
+#define DEFAULT_SAMPLE_EVERY 64
+#define MAX_THREADS 256
+#define PACE_SPIN_NS 100000 /**< Paced threads spin the last 100 us */
+
+enum replay_op {
+	OP_GET,
+	OP_SET,
+	OP_INS,
+	OP_UPD,
+	OP_DEL,
+	OP_INCR,
+	NUM_OPS,
+};
+
+static const char* const op_names[NUM_OPS] = {"get", "set", "ins",
+                                              "upd", "del", "incr"};
+
+/** Operations that take a value */
+static const int op_has_value[NUM_OPS] = {0, 1, 1, 1, 0, 1};
+
+static const char* const lat_names[HD_LAT_NUM_OPS] = {
+    "hit", "miss", "insert", "update", "remove"};
+
+/**
+ * @brief One parsed line of the trace, pointing into the mapping
+ */
+struct record {
+	const char* key;
+	const char* value;
+	long long delta;
+	enum replay_op op;
+};
+
+struct replay {
+	struct hd_hashdict dict;
+	pthread_rwlock_t lock;
+	int locked; /**< More than one thread replays */
+	unsigned long long start; /**< Replay start, CLOCK_MONOTONIC ns */
+	double interval_ns; /**< Pace of every thread, 0 for full speed */
+};
+
+struct worker {
+	pthread_t thread;
+	struct replay* r;
+	const struct record* records;
+	size_t n;
+	unsigned long long done[NUM_OPS]; /**< Operations that succeeded */
+	unsigned long long failed[NUM_OPS]; /**< Misses and rejected writes */
+	unsigned long long late; /**< Operations started more than one
+	                            interval behind schedule */
+	unsigned long long lag_sum_ns;
+	unsigned long long lag_max_ns;
+};
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Undoes the escapes of hd_export() in place, returns s
+ */
+static char*
+unescape(char* s) {
+	char* out = s;
+
+	for (const char* p = s; *p != '\0'; p++) {
+		if ((*p != '\\') || (p[1] == '\0')) {
+			*out++ = *p;
+			continue;
+		}
+		switch (*++p) {
+			case 't':
+				*out++ = '\t';
+				break;
+			case 'n':
+				*out++ = '\n';
+				break;
+			case 'r':
+				*out++ = '\r';
+				break;
+			default:
+				*out++ = *p;
+				break;
+		}
+	}
+	*out = '\0';
+	return s;
+}
+
+/**
+ * @brief Parses one NUL terminated line into rec
+ *
+ * @return int 1 for a record, 0 for a line to skip, -1 if malformed
+ */
+static int
+parse_line(char* line, struct record* rec) {
+	char* fields[3] = {line, NULL, NULL};
+	int num_fields = 1;
+	size_t len = strlen(line);
+
+	if ((len > 0) && (line[len - 1] == '\r')) {
+		line[--len] = '\0';
+	}
+	if ((len == 0) || (line[0] == '#')) {
+		return 0;
+	}
+
+	for (char* p = line; *p != '\0'; p++) {
+		if (*p == '\t') {
+			if (num_fields == 3) {
+				return -1;
+			}
+			*p = '\0';
+			fields[num_fields++] = p + 1;
+		}
+	}
+
+	int op = 0;
+	while ((op < NUM_OPS) && strcmp(fields[0], op_names[op])) {
+		op++;
+	}
+	if ((op == NUM_OPS) || (num_fields != 2 + op_has_value[op])) {
+		return -1;
+	}
+
+	rec->op = op;
+	rec->key = unescape(fields[1]);
+	rec->value = NULL;
+	rec->delta = 0;
+	if (op == OP_INCR) {
+		char* end;
+
+		errno = 0;
+		rec->delta = strtoll(fields[2], &end, 10);
+		if ((end == fields[2]) || (*end != '\0') || (errno != 0)) {
+			return -1;
+		}
+	} else if (op_has_value[op]) {
+		rec->value = unescape(fields[2]);
+	}
+	return 1;
+}
+
+/**
+ * @brief Maps the trace and parses it into records
+ *
+ * The mapping is private and writable: parsing terminates fields in place
+ * and only the pages it touches get copied. A last line without newline is
+ * copied to *tail to make room for its terminator.
+ */
+static int
+load_trace(const char* path, char** map, size_t* map_size, char** tail,
+           struct record** records, size_t* n) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0) {
+		return -errno;
+	}
+	if (fstat(fd, &st) != 0) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return -ENODATA;
+	}
+
+	*map_size = st.st_size;
+	*map = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*map == MAP_FAILED) {
+		return -errno;
+	}
+	posix_madvise(*map, *map_size, POSIX_MADV_SEQUENTIAL);
+
+	/* One record per newline at most, plus a last line without one.*/
+	size_t max_records = 1;
+	for (const char* p = *map; (p = memchr(p, '\n', *map + *map_size - p));
+	     p++) {
+		max_records++;
+	}
+	*records = malloc(max_records * sizeof(**records));
+	if (*records == NULL) {
+		return -ENOMEM;
+	}
+
+	char* end = *map + *map_size;
+	size_t line_no = 0;
+	*n = 0;
+	for (char* line = *map; line < end;) {
+		char* eol = memchr(line, '\n', end - line);
+		char* next;
+
+		if (eol != NULL) {
+			*eol = '\0';
+			next = eol + 1;
+		} else {
+			*tail = malloc(end - line + 1);
+			if (*tail == NULL) {
+				return -ENOMEM;
+			}
+			memcpy(*tail, line, end - line);
+			(*tail)[end - line] = '\0';
+			line = *tail;
+			next = end;
+		}
+
+		line_no++;
+		int ret = parse_line(line, &(*records)[*n]);
+		if (ret < 0) {
+			fprintf(stderr, "%s:%zu: malformed record\n", path, line_no);
+			return -EBADMSG;
+		}
+		*n += ret;
+		line = next;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sorts the records by thread, keeping their order within a thread
+ */
+static int
+partition(struct record* records, size_t n, struct worker* workers,
+          unsigned int threads) {
+	struct record* sorted = malloc(n * sizeof(*sorted));
+	unsigned char* owner = malloc(n);
+	size_t offsets[MAX_THREADS] = {0};
+
+	if ((sorted == NULL) || (owner == NULL)) {
+		free(sorted);
+		free(owner);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		owner[i] = hd_hash_key(HD_HASH_MURMUR64, records[i].key,
+		                       strlen(records[i].key), 0) %
+		           threads;
+		workers[owner[i]].n++;
+	}
+	for (unsigned int t = 1; t < threads; t++) {
+		offsets[t] = offsets[t - 1] + workers[t - 1].n;
+	}
+	for (unsigned int t = 0; t < threads; t++) {
+		workers[t].records = records + offsets[t];
+	}
+	for (size_t i = 0; i < n; i++) {
+		sorted[offsets[owner[i]]++] = records[i];
+	}
+
+	memcpy(records, sorted, n * sizeof(*records));
+	free(sorted);
+	free(owner);
+	return 0;
+}
+
+/**
+ * @brief Runs one record, returns whether it succeeded
+ */
+static int
+run_record(struct replay* r, const struct record* rec) {
+	struct hd_hashdict* dict = &r->dict;
+	long long counter;
+	int ok;
+
+	if ((rec->op == OP_GET) || (rec->op == OP_INCR)) {
+		if (r->locked) {
+			pthread_rwlock_rdlock(&r->lock);
+		}
+		if (rec->op == OP_GET) {
+			ok = (hd_lookup(dict, rec->key) != NULL);
+		} else {
+			/* Adding to an existing counter may run next to lookups, no
+			 * remove can get in between while the lock is held.*/
+			ok = (hd_counter_get(dict, rec->key, &counter) == 0) &&
+			     (hd_incr(dict, rec->key, rec->delta) == 0);
+		}
+		if (r->locked) {
+			pthread_rwlock_unlock(&r->lock);
+		}
+		if (ok || (rec->op == OP_GET)) {
+			return ok;
+		}
+	}
+
+	if (r->locked) {
+		pthread_rwlock_wrlock(&r->lock);
+	}
+	switch (rec->op) {
+		case OP_SET:
+			ok = (hd_entry_update(dict, rec->key, rec->value) == 0) ||
+			     (hd_entry_insert(dict, rec->key, rec->value) == 0);
+			break;
+		case OP_INS:
+			ok = (hd_entry_insert(dict, rec->key, rec->value) == 0);
+			break;
+		case OP_UPD:
+			ok = (hd_entry_update(dict, rec->key, rec->value) == 0);
+			break;
+		case OP_DEL:
+			ok = (hd_entry_remove(dict, rec->key) == 0);
+			break;
+		default:
+			ok = (hd_incr(dict, rec->key, rec->delta) == 0);
+			break;
+	}
+	if (r->locked) {
+		pthread_rwlock_unlock(&r->lock);
+	}
+	return ok;
+}
+
+static void*
+worker_run(void* arg) {
+	struct worker* w = arg;
+	struct replay* r = w->r;
+
+	for (size_t i = 0; i < w->n; i++) {
+		const struct record* rec = &w->records[i];
+
+		if (r->interval_ns > 0) {
+			unsigned long long due =
+			    r->start + (unsigned long long)(i * r->interval_ns);
+			unsigned long long now = now_ns();
+
+			if (now < due) {
+				if (due - now > PACE_SPIN_NS) {
+					unsigned long long wake = due - PACE_SPIN_NS;
+					struct timespec ts = {.tv_sec = wake / 1000000000ULL,
+					                      .tv_nsec = wake % 1000000000ULL};
+					clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+				}
+				while (now_ns() < due) {
+				}
+			} else {
+				unsigned long long lag = now - due;
+
+				w->lag_sum_ns += lag;
+				if (lag > w->lag_max_ns) {
+					w->lag_max_ns = lag;
+				}
+				if (lag > r->interval_ns) {
+					w->late++;
+				}
+			}
+		}
+
+		if (run_record(r, rec)) {
+			w->done[rec->op]++;
+		} else {
+			w->failed[rec->op]++;
+		}
+	}
+	return NULL;
+}
+
+static void
+print_latency(struct hd_hashdict* dict) {
+	struct hd_latency_snapshot* snap = malloc(sizeof(*snap));
+
+	if ((snap == NULL) || (hd_latency_snapshot(dict, snap) != 0)) {
+		free(snap);
+		return;
+	}
+
+	printf("\nLatency in ns, one in %u operations timed\n",
+	       snap->sample_every);
+	printf("%-8s %10s %8s %8s %8s %8s %10s\n", "op", "samples", "mean",
+	       "p50", "p99", "p99.9", "max");
+	for (int op = 0; op < HD_LAT_NUM_OPS; op++) {
+		const struct hd_latency_hist* h = &snap->ops[op];
+
+		if (h->count == 0) {
+			continue;
+		}
+		printf("%-8s %10llu %8llu %8llu %8llu %8llu %10llu\n", lat_names[op],
+		       h->count, h->sum_ns / h->count,
+		       hd_latency_percentile(h, 50.0), hd_latency_percentile(h, 99.0),
+		       hd_latency_percentile(h, 99.9), h->max_ns);
+	}
+	free(snap);
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr,
+	        "Usage: %s [-t threads] [-r ops_per_sec] [-l sample_every]\n"
+	        "       [-d dump] <trace>\n",
+	        prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	unsigned int threads = DEFAULT_THREADS;
+	double rate = 0.0;
+	unsigned int sample_every = DEFAULT_SAMPLE_EVERY;
+	const char* dump_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:l:d:h")) != -1) {
+		switch (opt) {
+			case 't':
+				threads = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				rate = strtod(optarg, NULL);
+				break;
+			case 'l':
+				sample_every = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				dump_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if ((optind != argc - 1) || (threads == 0) || (threads > MAX_THREADS) ||
+	    (rate < 0.0) || (sample_every == 0)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	const char* trace_path = argv[optind];
+	char* map = NULL;
+	size_t map_size = 0;
+	char* tail = NULL;
+	struct record* records = NULL;
+	size_t n = 0;
+
+	unsigned long long parse_start = now_ns();
+	int result =
+	    load_trace(trace_path, &map, &map_size, &tail, &records, &n);
+	if (result != 0) {
+		fprintf(stderr, "Error reading %s: %s\n", trace_path,
+		        strerror(-result));
+		return 1;
+	}
+
+	struct worker* workers = calloc(threads, sizeof(*workers));
+	if ((workers == NULL) || (partition(records, n, workers, threads) != 0)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	double parse_secs = (now_ns() - parse_start) / 1e9;
+
+	struct replay r = {.dict = hd_create(), .locked = (threads > 1)};
+	if (dump_path != NULL) {
+		result = hd_load_file(&r.dict, dump_path, NULL);
+		if (result != 0) {
+			fprintf(stderr, "Error loading %s: %s\n", dump_path,
+			        strerror(-result));
+			return 1;
+		}
+	}
+	struct hd_latency_config lat_config = {.sample_every = sample_every};
+	result = hd_latency_start(&r.dict, &lat_config);
+	if (result != 0) {
+		fprintf(stderr, "Error starting latency sampling: %s\n",
+		        strerror(-result));
+		return 1;
+	}
+	pthread_rwlock_init(&r.lock, NULL);
+	if (rate > 0.0) {
+		r.interval_ns = 1e9 * threads / rate;
+	}
+
+	printf("%zu records in %.1f MiB parsed in %.3f s, %u entries loaded\n", n,
+	       map_size / (1024.0 * 1024.0), parse_secs, r.dict.num_entries);
+
+	r.start = now_ns();
+	for (unsigned int t = 0; t < threads; t++) {
+		workers[t].r = &r;
+		if (pthread_create(&workers[t].thread, NULL, worker_run,
+		                   &workers[t]) != 0) {
+			fprintf(stderr, "Error creating thread %u\n", t);
+			return 1;
+		}
+	}
+
+	unsigned long long done[NUM_OPS] = {0};
+	unsigned long long failed[NUM_OPS] = {0};
+	unsigned long long late = 0;
+	unsigned long long lag_sum_ns = 0;
+	unsigned long long lag_max_ns = 0;
+	for (unsigned int t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		for (int op = 0; op < NUM_OPS; op++) {
+			done[op] += workers[t].done[op];
+			failed[op] += workers[t].failed[op];
+		}
+		late += workers[t].late;
+		lag_sum_ns += workers[t].lag_sum_ns;
+		if (workers[t].lag_max_ns > lag_max_ns) {
+			lag_max_ns = workers[t].lag_max_ns;
+		}
+	}
+	double secs = (now_ns() - r.start) / 1e9;
+
+	if (rate > 0.0) {
+		printf("Replayed on %u threads at %.0f ops/s: %.3f s, %.0f ops/s\n",
+		       threads, rate, secs, n / secs);
+		printf("Lag behind schedule: mean %.1f us, max %.1f us, %llu "
+		       "operations late by more than one interval\n",
+		       lag_sum_ns / 1e3 / n, lag_max_ns / 1e3, late);
+	} else {
+		printf("Replayed on %u threads at full speed: %.3f s, %.0f ops/s\n",
+		       threads, secs, n / secs);
+	}
+
+	printf("\n%-8s %12s %12s\n", "op", "ok", "failed");
+	for (int op = 0; op < NUM_OPS; op++) {
+		if (done[op] + failed[op] > 0) {
+			printf("%-8s %12llu %12llu\n", op_names[op], done[op],
+			       failed[op]);
+		}
+	}
+	print_latency(&r.dict);
+	printf("\n%u entries after replay\n", r.dict.num_entries);
+
+	hd_latency_stop(&r.dict);
+	hd_free(&r.dict);
+	pthread_rwlock_destroy(&r.lock);
+	free(workers);
+	free(records);
+	free(tail);
+	munmap(map, map_size);
+	return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file hashdict_resize_bench.c
+ * @brief Insert latency benchmark while the bucket array grows
+ *
+ * Inserts a large number of keys one by one and times every insert. Samples
+ * are split into inserts that happened while the dictionary was migrating
+ * buckets into a grown array and inserts in steady state, and the latency
+ * percentiles of both groups are printed side by side.
+ *
+ * Usage: hashdict_resize_bench [num_entries]
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Number of entries to insert if none is given on the command line
+#define DEFAULT_NUM_ENTRIES 1000000
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+cmp_ull(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns the p-th percentile of a sorted sample array
+ */
+static unsigned long long
+percentile(const unsigned long long* sorted, size_t n, double p) {
+	if (n == 0) {
+		return 0;
+	}
+	size_t idx = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+	return sorted[idx];
+}
+
+static void
+print_row(const char* name, unsigned long long* samples, size_t n) {
+	qsort(samples, n, sizeof(*samples), cmp_ull);
+	printf("%-10s %10zu %10llu %10llu %10llu %10llu\n", name, n,
+	       percentile(samples, n, 50.0), percentile(samples, n, 99.0),
+	       percentile(samples, n, 99.9), n ? samples[n - 1] : 0);
+}
+
+int
+main(int argc, char* argv[]) {
+	size_t num_entries = DEFAULT_NUM_ENTRIES;
+	if (argc > 1) {
+		num_entries = strtoull(argv[1], NULL, 10);
+	}
+
+	unsigned long long* steady = malloc(num_entries * sizeof(*steady));
+	unsigned long long* growing = malloc(num_entries * sizeof(*growing));
+	if ((steady == NULL) || (growing == NULL)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	size_t num_steady = 0;
+	size_t num_growing = 0;
+
+	struct hd_hashdict dict = hd_create();
+	char key_buffer[32];
+
+	for (size_t i = 0; i < num_entries; i++) {
+		snprintf(key_buffer, sizeof(key_buffer), "key-%zu", i);
+
+		int was_growing = dict.next_entries != NULL;
+		unsigned long long start = now_ns();
+		int result = hd_entry_insert(&dict, key_buffer, "value");
+		unsigned long long elapsed = now_ns() - start;
+
+		if (result != 0) {
+			fprintf(stderr, "Error inserting entry %zu: %s\n", i,
+			        strerror(-result));
+			return 1;
+		}
+
+		if (was_growing || (dict.next_entries != NULL)) {
+			growing[num_growing++] = elapsed;
+		} else {
+			steady[num_steady++] = elapsed;
+		}
+	}
+
+	printf("Inserted %zu entries into %u buckets\n\n", num_entries,
+	       dict.size + dict.next_size);
+	printf("%-10s %10s %10s %10s %10s %10s\n", "phase", "samples", "p50 ns",
+	       "p99 ns", "p99.9 ns", "max ns");
+	print_row("steady", steady, num_steady);
+	print_row("growing", growing, num_growing);
+
+	unsigned long long steady_p999 = percentile(steady, num_steady, 99.9);
+	if (steady_p999 > 0) {
+		printf("\np99.9 growing/steady: %.2f\n",
+		       (double)percentile(growing, num_growing, 99.9) /
+		           (double)steady_p999);
+	}
+
+	hd_free(&dict);
+	free(steady);
+	free(growing);
+	return 0;
+}
@@ -0,0 +1,696 @@
+#define _GNU_SOURCE /* memfd_create() */
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Region layout, all offsets are relative to the start of the region so
+ * every process can map it at a different address:
+ *
+ *   struct hd_shm_header
+ *   blocks handed out by hd_shm_alloc(), the bucket array and the entries
+ *
+ * The bucket array holds the offset of the first entry of every bucket, an
+ * offset of 0 ends a chain. Every entry is a struct hd_shm_entry followed by
+ * the NUL terminated key and either the NUL terminated value or, for
+ * counters, an 8 byte aligned int64_t. Blocks are rounded up to one of
+ * HD_SHM_NUM_CLASSES sizes, at most a quarter larger than requested, and
+ * freed blocks are kept on a free list per size. Nothing is ever returned
+ * to the kernel.
+ */
+
+#define HD_SHM_MAGIC "HDSHM\0\0"
+#define HD_SHM_VERSION 1
+#define HD_SHM_COUNTER UINT32_MAX /**< value_len of counters */
+#define HD_SHM_ALIGN 16
+#define HD_SHM_NUM_CLASSES 160
+#define HD_SHM_MAX_BLOCK (1ULL << 40)
+
+struct hd_shm_header {
+	char magic[8]; /**< Written last, once the region is ready */
+	uint32_t version;
+	uint32_t num_buckets; /**< Power of two */
+	uint64_t size; /**< Size of the region */
+	pthread_rwlock_t lock; /**< Process-shared, protects everything below */
+	uint64_t buckets; /**< Offset of the bucket array */
+	uint64_t used; /**< Bytes handed out from the start of the region */
+	uint64_t free_lists[HD_SHM_NUM_CLASSES];
+	uint64_t num_entries;
+};
+
+struct hd_shm_entry {
+	uint64_t next; /**< Offset of the next entry in the bucket, or 0 */
+	uint32_t hash; /**< hd_hash() of the key, truncated */
+	uint32_t key_len;
+	uint32_t value_len; /**< HD_SHM_COUNTER for counters */
+	uint32_t block_size; /**< Size of the block holding the entry */
+};
+
+/**
+ * @brief Backend serving a dictionary from a shared memory region
+ */
+struct hd_shm {
+	struct hd_backend backend;
+	int fd;
+	unsigned char* base;
+	struct hd_shm_header* hdr;
+};
+
+static inline struct hd_shm_entry*
+hd_shm_entry(struct hd_shm* shm, uint64_t offset) {
+	return (struct hd_shm_entry*)(shm->base + offset);
+}
+
+static inline uint64_t*
+hd_shm_buckets(struct hd_shm* shm) {
+	return (uint64_t*)(shm->base + shm->hdr->buckets);
+}
+
+static inline char*
+hd_shm_key(struct hd_shm_entry* e) {
+	return (char*)(e + 1);
+}
+
+/**
+ * @brief Offset of the value or counter of an entry from the entry start
+ */
+static inline size_t
+hd_shm_value_offset(uint32_t key_len, int counter) {
+	size_t offset = sizeof(struct hd_shm_entry) + key_len + 1;
+	return counter ? (offset + 7) & ~(size_t)7 : offset;
+}
+
+static inline _Atomic long long*
+hd_shm_counter(struct hd_shm_entry* e) {
+	return (_Atomic long long*)((unsigned char*)e +
+	                            hd_shm_value_offset(e->key_len, 1));
+}
+
+/**
+ * @brief Size class of a block of size bytes
+ *
+ * Up to 256 bytes classes are 16 bytes apart, above that every power of two
+ * is split into four classes.
+ *
+ * @param block_size Receives size rounded up to its class
+ */
+static unsigned int
+hd_shm_class(uint64_t size, uint64_t* block_size) {
+	if (size <= 256) {
+		*block_size = size ? (size + 15) & ~(uint64_t)15 : 16;
+		return *block_size / 16 - 1;
+	}
+
+	unsigned int k = 63 - __builtin_clzll(size - 1);
+	uint64_t step = 1ULL << (k - 2);
+	*block_size = (size + step - 1) & ~(step - 1);
+	return 16 + (k - 8) * 4 + (unsigned int)(*block_size / step - 5);
+}
+
+/**
+ * @brief Allocates a block of at least size bytes, called with the write
+ * lock held
+ *
+ * @return uint64_t Offset of the block, 0 if the region is full
+ */
+static uint64_t
+hd_shm_alloc(struct hd_shm* shm, uint64_t size, uint64_t* block_size) {
+	struct hd_shm_header* hdr = shm->hdr;
+
+	if (size > HD_SHM_MAX_BLOCK) {
+		return 0;
+	}
+
+	unsigned int c = hd_shm_class(size, block_size);
+	uint64_t offset = hdr->free_lists[c];
+
+	if (offset != 0) {
+		memcpy(&hdr->free_lists[c], shm->base + offset, sizeof(uint64_t));
+		return offset;
+	}
+	if (*block_size > hdr->size - hdr->used) {
+		return 0;
+	}
+	offset = hdr->used;
+	hdr->used += *block_size;
+	return offset;
+}
+
+static void
+hd_shm_release(struct hd_shm* shm, uint64_t offset, uint64_t block_size) {
+	uint64_t rounded;
+	unsigned int c = hd_shm_class(block_size, &rounded);
+
+	memcpy(shm->base + offset, &shm->hdr->free_lists[c], sizeof(uint64_t));
+	shm->hdr->free_lists[c] = offset;
+}
+
+/**
+ * @brief Finds key, called with the lock held
+ *
+ * @param link If not NULL, receives the location holding the offset of
+ * the entry, for unlinking it
+ * @return uint64_t Offset of the entry, 0 if the key doesn't exist
+ */
+static uint64_t
+hd_shm_find(struct hd_shm* shm, const char* key, uint32_t hash,
+            uint64_t** link) {
+	uint64_t* next = &hd_shm_buckets(shm)[hash & (shm->hdr->num_buckets - 1)];
+
+	while (*next != 0) {
+		struct hd_shm_entry* e = hd_shm_entry(shm, *next);
+		if ((e->hash == hash) && !strcmp(hd_shm_key(e), key)) {
+			if (link != NULL) {
+				*link = next;
+			}
+			return *next;
+		}
+		next = &e->next;
+	}
+	return 0;
+}
+
+/**
+ * @brief Doubles the bucket array once the load factor reaches 1
+ *
+ * Called with the write lock held. All entries are relinked at once, other
+ * processes are blocked by the lock anyway. If the region has no room for
+ * the larger array, chains just get longer.
+ */
+static void
+hd_shm_maybe_grow(struct hd_shm* shm) {
+	struct hd_shm_header* hdr = shm->hdr;
+
+	if ((hdr->num_entries < hdr->num_buckets) ||
+	    (hdr->num_buckets >= (1u << 31))) {
+		return;
+	}
+
+	uint32_t num_buckets = hdr->num_buckets * 2;
+	uint64_t block_size;
+	uint64_t offset =
+	    hd_shm_alloc(shm, num_buckets * sizeof(uint64_t), &block_size);
+	if (offset == 0) {
+		return;
+	}
+
+	uint64_t* old = hd_shm_buckets(shm);
+	uint64_t* buckets = (uint64_t*)(shm->base + offset);
+	memset(buckets, 0, num_buckets * sizeof(uint64_t));
+
+	for (uint32_t i = 0; i < hdr->num_buckets; i++) {
+		uint64_t next = old[i];
+		while (next != 0) {
+			struct hd_shm_entry* e = hd_shm_entry(shm, next);
+			uint64_t* bucket = &buckets[e->hash & (num_buckets - 1)];
+			uint64_t current = next;
+
+			next = e->next;
+			e->next = *bucket;
+			*bucket = current;
+		}
+	}
+
+	hd_shm_release(shm, hdr->buckets, hdr->num_buckets * sizeof(uint64_t));
+	hdr->buckets = offset;
+	hdr->num_buckets = num_buckets;
+}
+
+/**
+ * @brief Creates an entry and links it, called with the write lock held
+ *
+ * @param value Value of a string entry, or NULL for a counter
+ */
+static int
+hd_shm_link(struct hd_shm* shm, const char* key, uint32_t hash,
+            const char* value, long long counter) {
+	size_t key_len = strlen(key);
+	size_t value_len = value ? strlen(value) : 0;
+
+	size_t size = value ? hd_shm_value_offset(key_len, 0) + value_len + 1
+	                    : hd_shm_value_offset(key_len, 1) + sizeof(int64_t);
+	if (size > UINT32_MAX) {
+		return -EFBIG;
+	}
+
+	uint64_t block_size;
+	uint64_t offset = hd_shm_alloc(shm, size, &block_size);
+	if (offset == 0) {
+		return -ENOSPC;
+	}
+
+	struct hd_shm_entry* e = hd_shm_entry(shm, offset);
+	e->hash = hash;
+	e->key_len = (uint32_t)key_len;
+	e->block_size = (uint32_t)block_size;
+	memcpy(hd_shm_key(e), key, key_len + 1);
+	if (value != NULL) {
+		e->value_len = (uint32_t)value_len;
+		memcpy(hd_shm_key(e) + key_len + 1, value, value_len + 1);
+	} else {
+		e->value_len = HD_SHM_COUNTER;
+		atomic_init(hd_shm_counter(e), counter);
+	}
+
+	uint64_t* bucket = &hd_shm_buckets(shm)[hash & (shm->hdr->num_buckets - 1)];
+	e->next = *bucket;
+	*bucket = offset;
+	shm->hdr->num_entries++;
+	hd_shm_maybe_grow(shm);
+	return 0;
+}
+
+static void
+hd_shm_rdlock(struct hd_shm* shm) {
+	pthread_rwlock_rdlock(&shm->hdr->lock);
+}
+
+static void
+hd_shm_wrlock(struct hd_shm* shm) {
+	pthread_rwlock_wrlock(&shm->hdr->lock);
+}
+
+/**
+ * @brief Releases the lock, refreshing dict->num_entries if dict is given
+ */
+static void
+hd_shm_unlock(struct hd_shm* shm, struct hd_hashdict* dict) {
+	if (dict != NULL) {
+		dict->num_entries = (unsigned int)shm->hdr->num_entries;
+	}
+	pthread_rwlock_unlock(&shm->hdr->lock);
+}
+
+static const char*
+hd_shm_lookup(struct hd_backend* backend, const char* key) {
+	struct hd_shm* shm = (struct hd_shm*)backend;
+	const char* value = NULL;
+
+	hd_shm_rdlock(shm);
+	uint64_t offset = hd_shm_find(shm, key, (uint32_t)hd_hash(key), NULL);
+	if (offset != 0) {
+		struct hd_shm_entry* e = hd_shm_entry(shm, offset);
+		if (e->value_len != HD_SHM_COUNTER) {
+			value = hd_shm_key(e) + e->key_len + 1;
+		}
+	}
+	hd_shm_unlock(shm, NULL);
+	return value;
+}
+
+static int
+hd_shm_counter_get(struct hd_backend* backend, const char* key,
+                   long long* value) {
+	struct hd_shm* shm = (struct hd_shm*)backend;
+	int ret = -EINVAL;
+
+	hd_shm_rdlock(shm);
+	uint64_t offset = hd_shm_find(shm, key, (uint32_t)hd_hash(key), NULL);
+	if (offset != 0) {
+		struct hd_shm_entry* e = hd_shm_entry(shm, offset);
+		if (e->value_len == HD_SHM_COUNTER) {
+			*value = atomic_load_explicit(hd_shm_counter(e),
+			                              memory_order_relaxed);
+			ret = 0;
+		}
+	}
+	hd_shm_unlock(shm, NULL);
+	return ret;
+}
+
+static int
+hd_shm_foreach(struct hd_backend* backend,
+               int (*fn)(const struct hd_record* rec, void* ctx),
+               void* ctx) {
+	struct hd_shm* shm = (struct hd_shm*)backend;
+	int ret = 0;
+
+	hd_shm_rdlock(shm);
+	uint64_t* buckets = hd_shm_buckets(shm);
+	for (uint32_t i = 0; (ret == 0) && (i < shm->hdr->num_buckets); i++) {
+		for (uint64_t next = buckets[i]; (ret == 0) && (next != 0);) {
+			struct hd_shm_entry* e = hd_shm_entry(shm, next);
+			int counter = (e->value_len == HD_SHM_COUNTER);
+			struct hd_record rec = {
+			    .key = hd_shm_key(e),
+			    .key_len = e->key_len,
+			    .value = counter ? NULL : hd_shm_key(e) + e->key_len + 1,
+			    .value_len = counter ? 0 : e->value_len,
+			    .counter = counter ? atomic_load_explicit(
+			                             hd_shm_counter(e),
+			                             memory_order_relaxed)
+			                       : 0,
+			    .bucket = i};
+
+			next = e->next;
+			ret = fn(&rec, ctx);
+		}
+	}
+	hd_shm_unlock(shm, NULL);
+	return ret;
+}
+
+static void
+hd_shm_free(struct hd_backend* backend) {
+	struct hd_shm* shm = (struct hd_shm*)backend;
+
+	munmap(shm->base, shm->hdr->size);
+	close(shm->fd);
+	free(shm);
+}
+
+static int
+hd_shm_insert(struct hd_hashdict* dict, const char* key, const char* value) {
+	struct hd_shm* shm = (struct hd_shm*)dict->backend;
+	uint32_t hash = (uint32_t)hd_hash(key);
+	int ret = -EINVAL;
+
+	hd_shm_wrlock(shm);
+	if (hd_shm_find(shm, key, hash, NULL) == 0) {
+		ret = hd_shm_link(shm, key, hash, value, 0);
+	}
+	hd_shm_unlock(shm, dict);
+	return ret;
+}
+
+static int
+hd_shm_update(struct hd_hashdict* dict, const char* key, const char* value) {
+	struct hd_shm* shm = (struct hd_shm*)dict->backend;
+	uint32_t hash = (uint32_t)hd_hash(key);
+	uint64_t* link;
+	int ret = -EINVAL;
+
+	hd_shm_wrlock(shm);
+	uint64_t offset = hd_shm_find(shm, key, hash, &link);
+	struct hd_shm_entry* e = offset ? hd_shm_entry(shm, offset) : NULL;
+
+	if ((e != NULL) && (e->value_len != HD_SHM_COUNTER)) {
+		size_t value_len = strlen(value);
+		size_t size = hd_shm_value_offset(e->key_len, 0) + value_len + 1;
+
+		if (size > UINT32_MAX) {
+			ret = -EFBIG;
+		} else if (size <= e->block_size) {
+			/* The new value fits into the block, no need to move.*/
+			memcpy(hd_shm_key(e) + e->key_len + 1, value, value_len + 1);
+			e->value_len = (uint32_t)value_len;
+			ret = 0;
+		} else {
+			/* Unlinking first lets hd_shm_link() put the new entry at the
+			 * head of the same chain.*/
+			*link = e->next;
+			shm->hdr->num_entries--;
+			ret = hd_shm_link(shm, key, hash, value, 0);
+			if (ret == 0) {
+				hd_shm_release(shm, offset, e->block_size);
+			} else {
+				*link = offset;
+				shm->hdr->num_entries++;
+			}
+		}
+	}
+	hd_shm_unlock(shm, dict);
+	return ret;
+}
+
+static int
+hd_shm_remove(struct hd_hashdict* dict, const char* key) {
+	struct hd_shm* shm = (struct hd_shm*)dict->backend;
+	uint64_t* link;
+	int ret = -EINVAL;
+
+	hd_shm_wrlock(shm);
+	uint64_t offset = hd_shm_find(shm, key, (uint32_t)hd_hash(key), &link);
+	if (offset != 0) {
+		struct hd_shm_entry* e = hd_shm_entry(shm, offset);
+		*link = e->next;
+		shm->hdr->num_entries--;
+		hd_shm_release(shm, offset, e->block_size);
+		ret = 0;
+	}
+	hd_shm_unlock(shm, dict);
+	return ret;
+}
+
+static int
+hd_shm_add(struct hd_hashdict* dict, const char* key, long long delta,
+           long long* result) {
+	struct hd_shm* shm = (struct hd_shm*)dict->backend;
+	uint32_t hash = (uint32_t)hd_hash(key);
+	long long value = delta;
+	int write_locked = 0;
+	int ret = 0;
+
+	/* Adding to an existing counter leaves the table untouched, so the
+	 * read lock is enough and processes add concurrently.*/
+	hd_shm_rdlock(shm);
+	uint64_t offset = hd_shm_find(shm, key, hash, NULL);
+	if (offset == 0) {
+		/* Creating the counter needs the write lock, the key may have been
+		 * added by someone else in between.*/
+		hd_shm_unlock(shm, NULL);
+		hd_shm_wrlock(shm);
+		write_locked = 1;
+		offset = hd_shm_find(shm, key, hash, NULL);
+		if (offset == 0) {
+			ret = hd_shm_link(shm, key, hash, NULL, delta);
+		}
+	}
+	if (offset != 0) {
+		struct hd_shm_entry* e = hd_shm_entry(shm, offset);
+		if (e->value_len != HD_SHM_COUNTER) {
+			ret = -EINVAL;
+		} else {
+			value = atomic_fetch_add_explicit(hd_shm_counter(e), delta,
+			                                  memory_order_relaxed) +
+			        delta;
+		}
+	}
+	hd_shm_unlock(shm, write_locked ? dict : NULL);
+
+	if ((ret == 0) && (result != NULL)) {
+		*result = value;
+	}
+	return ret;
+}
+
+static size_t
+hd_shm_read_begin(struct hd_backend* backend) {
+	struct hd_shm* shm = (struct hd_shm*)backend;
+
+	hd_shm_rdlock(shm);
+	return shm->hdr->num_entries;
+}
+
+static void
+hd_shm_read_end(struct hd_backend* backend) {
+	hd_shm_unlock((struct hd_shm*)backend, NULL);
+}
+
+static const struct hd_backend_ops hd_shm_ops = {
+    .lookup = hd_shm_lookup,
+    .counter_get = hd_shm_counter_get,
+    .foreach = hd_shm_foreach,
+    .free = hd_shm_free,
+    .insert = hd_shm_insert,
+    .update = hd_shm_update,
+    .remove = hd_shm_remove,
+    .add = hd_shm_add,
+    .read_begin = hd_shm_read_begin,
+    .read_end = hd_shm_read_end,
+};
+
+static int
+hd_shm_copy_record(const struct hd_record* rec, void* ctx) {
+	return hd_shm_link(ctx, rec->key, (uint32_t)hd_hash(rec->key), rec->value,
+	                   rec->counter);
+}
+
+/**
+ * @brief Maps the region at fd and checks its header
+ */
+static int
+hd_shm_map(struct hd_hashdict* dict, int fd) {
+	struct hd_shm_header hdr;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		return -errno;
+	}
+	if ((st.st_size < (off_t)sizeof(hdr)) ||
+	    (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) ||
+	    memcmp(hdr.magic, HD_SHM_MAGIC, 8) ||
+	    (hdr.version != HD_SHM_VERSION) || (hdr.size != (uint64_t)st.st_size)) {
+		return -EINVAL;
+	}
+
+	struct hd_shm* shm = calloc(1, sizeof(*shm));
+	if (shm == NULL) {
+		return -ENOMEM;
+	}
+
+	shm->base = mmap(NULL, hdr.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm->base == MAP_FAILED) {
+		int ret = -errno;
+		free(shm);
+		return ret;
+	}
+
+	shm->backend.ops = &hd_shm_ops;
+	shm->fd = fd;
+	shm->hdr = (struct hd_shm_header*)shm->base;
+	dict->backend = &shm->backend;
+	dict->num_entries = (unsigned int)hdr.num_entries;
+	return 0;
+}
+
+int
+hd_shm_create(struct hd_hashdict* dict, const char* name, size_t size) {
+	if ((dict == NULL) || (dict->backend != NULL) || (dict->wal != NULL) ||
+	    (dict->dirty != NULL) || (dict->repl != NULL) ||
+	    (size < sizeof(struct hd_shm_header) + HD_SHM_ALIGN)) {
+		return -EINVAL;
+	}
+
+	int fd = (name != NULL)
+	             ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)
+	             : memfd_create("hashdict", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	struct hd_shm shm = {.fd = fd};
+	int ret = 0;
+
+	/* Back the whole region now, a store into an unbacked page of a full
+	 * tmpfs raises SIGBUS instead of failing.*/
+	ret = -posix_fallocate(fd, 0, size);
+	if (ret != 0) {
+		goto err;
+	}
+
+	shm.base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm.base == MAP_FAILED) {
+		ret = -errno;
+		goto err;
+	}
+	shm.hdr = (struct hd_shm_header*)shm.base;
+
+	/* The region reads as zeroes, only the non-zero fields are set.
+	 * hd_foreach_record() and hd_lookup() take the read lock again inside
+	 * hd_read_begin(), which is safe as long as waiting writers don't hold
+	 * off readers.*/
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_READER_NP);
+	ret = -pthread_rwlock_init(&shm.hdr->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (ret != 0) {
+		goto err_map;
+	}
+
+	shm.hdr->version = HD_SHM_VERSION;
+	shm.hdr->size = size;
+	shm.hdr->used = (sizeof(struct hd_shm_header) + HD_SHM_ALIGN - 1) &
+	                ~(uint64_t)(HD_SHM_ALIGN - 1);
+
+	uint64_t block_size;
+	shm.hdr->num_buckets = hd_table_size(dict->num_entries);
+	shm.hdr->buckets = hd_shm_alloc(
+	    &shm, shm.hdr->num_buckets * sizeof(uint64_t), &block_size);
+	if (shm.hdr->buckets == 0) {
+		ret = -ENOSPC;
+		goto err_lock;
+	}
+
+	/* Nobody else can use the region before its magic is written, so the
+	 * records are copied without taking the lock.*/
+	ret = hd_foreach_record(dict, hd_shm_copy_record, &shm);
+	if (ret != 0) {
+		goto err_lock;
+	}
+
+	atomic_thread_fence(memory_order_release);
+	memcpy(shm.hdr->magic, HD_SHM_MAGIC, 8);
+	munmap(shm.base, size);
+
+	struct hd_hashdict shared = hd_create();
+	ret = hd_shm_map(&shared, fd);
+	if (ret != 0) {
+		goto err;
+	}
+
+	/* The records were copied, the old storage can go.*/
+	hd_free_parallel(dict, 1);
+	dict->backend = shared.backend;
+	dict->num_entries = shared.num_entries;
+	return 0;
+
+err_lock:
+	pthread_rwlock_destroy(&shm.hdr->lock);
+err_map:
+	munmap(shm.base, size);
+err:
+	close(fd);
+	if (name != NULL) {
+		shm_unlink(name);
+	}
+	return ret;
+}
+
+int
+hd_shm_open(struct hd_hashdict* dict, const char* name) {
+	if ((dict == NULL) || (name == NULL) || (dict->num_entries != 0) ||
+	    (dict->backend != NULL) || (dict->wal != NULL)) {
+		return -EINVAL;
+	}
+
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	int ret = hd_shm_map(dict, fd);
+	if (ret != 0) {
+		close(fd);
+	}
+	return ret;
+}
+
+int
+hd_shm_attach(struct hd_hashdict* dict, int fd) {
+	if ((dict == NULL) || (fd < 0) || (dict->num_entries != 0) ||
+	    (dict->backend != NULL) || (dict->wal != NULL)) {
+		return -EINVAL;
+	}
+
+	int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own_fd < 0) {
+		return -errno;
+	}
+
+	int ret = hd_shm_map(dict, own_fd);
+	if (ret != 0) {
+		close(own_fd);
+	}
+	return ret;
+}
+
+int
+hd_shm_fd(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->backend == NULL) ||
+	    (dict->backend->ops != &hd_shm_ops)) {
+		return -EINVAL;
+	}
+	return ((struct hd_shm*)dict->backend)->fd;
+}
@@ -0,0 +1,644 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Snapshot file layout, all offsets are relative to the start of the file:
+ *
+ *   struct hd_snapshot_header
+ *   uint64_t bucket offsets[num_buckets + 1]
+ *   records of bucket 0, records of bucket 1, ...
+ *
+ * The records of bucket b span [offsets[b], offsets[b + 1]). Every record is
+ * a struct hd_snapshot_record followed by the NUL terminated key and either
+ * the NUL terminated value or, for counters, an int64_t. Records and the
+ * counter are 8 byte aligned. Integers are stored in host byte order.
+ */
+
+#define HD_SNAPSHOT_MAGIC "HDSNAP\0"
+#define HD_SNAPSHOT_VERSION 1
+#define HD_SNAPSHOT_BYTE_ORDER 0x01020304
+#define HD_SNAPSHOT_COUNTER UINT32_MAX /**< value_len of counter records */
+
+struct hd_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /**< HD_SNAPSHOT_BYTE_ORDER as written */
+	uint64_t num_entries;
+	uint64_t num_buckets; /**< Power of two */
+	uint64_t file_size;
+};
+
+struct hd_snapshot_record {
+	uint32_t key_len;
+	uint32_t value_len; /**< HD_SNAPSHOT_COUNTER for counters */
+	uint32_t hash; /**< Low bits of hd_hash(), checked before the key */
+	uint32_t reserved;
+};
+
+/**
+ * @brief Backend serving lookups from a mapped snapshot file
+ */
+struct hd_snapshot {
+	struct hd_backend backend;
+	const unsigned char* map;
+	size_t size;
+	uint64_t num_buckets;
+	const uint64_t* offsets;
+	uint64_t records; /**< Offset of the first record, after the offsets */
+};
+
+#define HD_ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+static uint64_t
+hd_snapshot_value_size(const struct hd_record* rec) {
+	return (rec->value == NULL) ? sizeof(int64_t) : rec->value_len + 1;
+}
+
+static uint64_t
+hd_snapshot_record_size(const struct hd_record* rec) {
+	return sizeof(struct hd_snapshot_record) + HD_ALIGN8(rec->key_len + 1) +
+	       HD_ALIGN8(hd_snapshot_value_size(rec));
+}
+
+/**
+ * @brief State of hd_snapshot_write() shared by both passes
+ */
+struct hd_snapshot_writer {
+	uint64_t mask;
+	uint64_t* cursor; /**< Pass 1: bytes per bucket, pass 2: write offset */
+	unsigned char* map;
+};
+
+static int
+hd_snapshot_size_record(const struct hd_record* rec, void* ctx) {
+	struct hd_snapshot_writer* w = ctx;
+	w->cursor[hd_hash(rec->key) & w->mask] += hd_snapshot_record_size(rec);
+	return 0;
+}
+
+static int
+hd_snapshot_write_record(const struct hd_record* rec, void* ctx) {
+	struct hd_snapshot_writer* w = ctx;
+	unsigned long hash = hd_hash(rec->key);
+	uint64_t* cursor = &(w->cursor[hash & w->mask]);
+	unsigned char* p = w->map + *cursor;
+
+	struct hd_snapshot_record hdr = {
+	    .key_len = rec->key_len,
+	    .value_len = (rec->value == NULL) ? HD_SNAPSHOT_COUNTER
+	                                      : (uint32_t)rec->value_len,
+	    .hash = (uint32_t)hash,
+	    .reserved = 0};
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+
+	memcpy(p, rec->key, rec->key_len + 1);
+	p += HD_ALIGN8(rec->key_len + 1);
+
+	if (rec->value == NULL) {
+		int64_t counter = rec->counter;
+		memcpy(p, &counter, sizeof(counter));
+	} else {
+		memcpy(p, rec->value, rec->value_len + 1);
+	}
+
+	*cursor += hd_snapshot_record_size(rec);
+	return 0;
+}
+
+/**
+ * @brief Rejects records the format can't represent
+ */
+static int
+hd_snapshot_check_record(const struct hd_record* rec, void* ctx) {
+	(void)ctx;
+	if ((rec->key_len >= UINT32_MAX) ||
+	    ((rec->value != NULL) && (rec->value_len >= HD_SNAPSHOT_COUNTER))) {
+		return -EFBIG;
+	}
+	return 0;
+}
+
+/**
+ * @brief Writes the snapshot of dict, which holds num_entries entries
+ */
+static int
+hd_snapshot_write_entries(struct hd_hashdict* dict, size_t num_entries,
+                          const char* path) {
+	int ret = hd_foreach_record(dict, hd_snapshot_check_record, NULL);
+	if (ret != 0) {
+		return ret;
+	}
+
+	uint64_t num_buckets = hd_table_size(num_entries);
+	struct hd_snapshot_writer w = {.mask = num_buckets - 1, .map = NULL};
+
+	w.cursor = calloc(num_buckets + 1, sizeof(uint64_t));
+	if (w.cursor == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Pass 1: size every bucket, then turn the sizes into offsets.*/
+	hd_foreach_record(dict, hd_snapshot_size_record, &w);
+
+	uint64_t offset = sizeof(struct hd_snapshot_header) +
+	                  (num_buckets + 1) * sizeof(uint64_t);
+	for (uint64_t b = 0; b <= num_buckets; b++) {
+		uint64_t bucket_size = w.cursor[b];
+		w.cursor[b] = offset;
+		offset += bucket_size;
+	}
+	uint64_t file_size = offset;
+
+	/* Write into a temporary file first so readers never see a partially
+	 * written snapshot under path.*/
+	size_t tmp_len = strlen(path) + sizeof(".tmp");
+	char* tmp_path = malloc(tmp_len);
+	if (tmp_path == NULL) {
+		free(w.cursor);
+		return -ENOMEM;
+	}
+	snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+	int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* Reserve the blocks up front, a store into a hole of a shared mapping
+	 * raises SIGBUS when the file system is full.*/
+	ret = -posix_fallocate(fd, 0, file_size);
+	if (ret != 0) {
+		goto out_close;
+	}
+
+	w.map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (w.map == MAP_FAILED) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	struct hd_snapshot_header hdr = {.magic = HD_SNAPSHOT_MAGIC,
+	                                 .version = HD_SNAPSHOT_VERSION,
+	                                 .byte_order = HD_SNAPSHOT_BYTE_ORDER,
+	                                 .num_entries = num_entries,
+	                                 .num_buckets = num_buckets,
+	                                 .file_size = file_size};
+	memcpy(w.map, &hdr, sizeof(hdr));
+	memcpy(w.map + sizeof(hdr), w.cursor,
+	       (num_buckets + 1) * sizeof(uint64_t));
+
+	/* Pass 2: place every record at its bucket's write offset.*/
+	hd_foreach_record(dict, hd_snapshot_write_record, &w);
+
+	if (msync(w.map, file_size, MS_SYNC) != 0) {
+		ret = -errno;
+	}
+	munmap(w.map, file_size);
+
+	if ((ret == 0) && (fsync(fd) != 0)) {
+		ret = -errno;
+	}
+out_close:
+	if ((close(fd) != 0) && (ret == 0)) {
+		ret = -errno;
+	}
+	if ((ret == 0) && (rename(tmp_path, path) != 0)) {
+		ret = -errno;
+	}
+	if (ret != 0) {
+		unlink(tmp_path);
+	}
+out:
+	free(tmp_path);
+	free(w.cursor);
+	return ret;
+}
+
+int
+hd_snapshot_write(struct hd_hashdict* dict, const char* path) {
+	if ((dict == NULL) || (path == NULL)) {
+		return -EINVAL;
+	}
+
+	size_t num_entries = hd_read_begin(dict);
+	int ret = hd_snapshot_write_entries(dict, num_entries, path);
+	hd_read_end(dict);
+	return ret;
+}
+
+static uint64_t
+hd_snapshot_record_len(const struct hd_snapshot_record* rec) {
+	uint64_t value_size = (rec->value_len == HD_SNAPSHOT_COUNTER)
+	                          ? sizeof(int64_t)
+	                          : (uint64_t)rec->value_len + 1;
+	return sizeof(*rec) + HD_ALIGN8((uint64_t)rec->key_len + 1) +
+	       HD_ALIGN8(value_size);
+}
+
+static const char*
+hd_snapshot_record_key(const struct hd_snapshot_record* rec) {
+	return (const char*)(rec + 1);
+}
+
+static const void*
+hd_snapshot_record_value(const struct hd_snapshot_record* rec) {
+	return hd_snapshot_record_key(rec) + HD_ALIGN8((uint64_t)rec->key_len + 1);
+}
+
+/**
+ * @brief Returns the records of bucket b as [*offset, *end)
+ *
+ * @return int 0 on success, -EIO if the range doesn't lie within the
+ * records section of the mapping or isn't 8 byte aligned
+ */
+static int
+hd_snapshot_bucket(const struct hd_snapshot* snap, uint64_t b,
+                   uint64_t* offset, uint64_t* end) {
+	*offset = snap->offsets[b];
+	*end = snap->offsets[b + 1];
+
+	if ((*offset < snap->records) || (*offset > *end) ||
+	    (*end > snap->size) || (*offset & 7)) {
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * @brief Returns the record at offset if it lies completely before end
+ *
+ * The key and string value of the record must be NUL terminated where
+ * their lengths say, so callers can hand them out as C strings.
+ */
+static const struct hd_snapshot_record*
+hd_snapshot_record_at(const struct hd_snapshot* snap, uint64_t offset,
+                      uint64_t end) {
+	if ((offset > end) || (end - offset < sizeof(struct hd_snapshot_record))) {
+		return NULL;
+	}
+
+	const struct hd_snapshot_record* rec =
+	    (const struct hd_snapshot_record*)(snap->map + offset);
+
+	if (end - offset < hd_snapshot_record_len(rec)) {
+		return NULL;
+	}
+	if (hd_snapshot_record_key(rec)[rec->key_len] != '\0') {
+		return NULL;
+	}
+	if ((rec->value_len != HD_SNAPSHOT_COUNTER) &&
+	    (((const char*)hd_snapshot_record_value(rec))[rec->value_len] !=
+	     '\0')) {
+		return NULL;
+	}
+	return rec;
+}
+
+/**
+ * @brief Finds the record of key in the mapping
+ *
+ * Offsets are checked against the mapping before they are followed, so a
+ * corrupt file makes lookups fail instead of crashing.
+ */
+static const struct hd_snapshot_record*
+hd_snapshot_find(const struct hd_snapshot* snap, const char* key) {
+	unsigned long hash = hd_hash(key);
+	uint64_t b = hash & (snap->num_buckets - 1);
+	uint64_t offset;
+	uint64_t end;
+	size_t key_len = strlen(key);
+
+	if (hd_snapshot_bucket(snap, b, &offset, &end) != 0) {
+		return NULL;
+	}
+
+	while (offset < end) {
+		const struct hd_snapshot_record* rec =
+		    hd_snapshot_record_at(snap, offset, end);
+		if (rec == NULL) {
+			return NULL;
+		}
+		if ((rec->hash == (uint32_t)hash) && (rec->key_len == key_len) &&
+		    (memcmp(hd_snapshot_record_key(rec), key, key_len) == 0)) {
+			return rec;
+		}
+		offset += hd_snapshot_record_len(rec);
+	}
+	return NULL;
+}
+
+static const char*
+hd_snapshot_lookup(struct hd_backend* backend, const char* key) {
+	const struct hd_snapshot_record* rec =
+	    hd_snapshot_find((struct hd_snapshot*)backend, key);
+
+	if ((rec == NULL) || (rec->value_len == HD_SNAPSHOT_COUNTER)) {
+		return NULL;
+	}
+	return hd_snapshot_record_value(rec);
+}
+
+static int
+hd_snapshot_counter_get(struct hd_backend* backend, const char* key,
+                        long long* value) {
+	const struct hd_snapshot_record* rec =
+	    hd_snapshot_find((struct hd_snapshot*)backend, key);
+
+	if ((rec == NULL) || (rec->value_len != HD_SNAPSHOT_COUNTER)) {
+		return -EINVAL;
+	}
+
+	int64_t counter;
+	memcpy(&counter, hd_snapshot_record_value(rec), sizeof(counter));
+	*value = counter;
+	return 0;
+}
+
+static int
+hd_snapshot_foreach(struct hd_backend* backend,
+                    int (*fn)(const struct hd_record* rec, void* ctx),
+                    void* ctx) {
+	struct hd_snapshot* snap = (struct hd_snapshot*)backend;
+
+	for (uint64_t b = 0; b < snap->num_buckets; b++) {
+		uint64_t offset;
+		uint64_t end;
+
+		if (hd_snapshot_bucket(snap, b, &offset, &end) != 0) {
+			return -EIO;
+		}
+
+		while (offset < end) {
+			const struct hd_snapshot_record* srec =
+			    hd_snapshot_record_at(snap, offset, end);
+			if (srec == NULL) {
+				return -EIO;
+			}
+
+			struct hd_record rec = {.key = hd_snapshot_record_key(srec),
+			                        .key_len = srec->key_len,
+			                        .value = NULL,
+			                        .value_len = 0,
+			                        .counter = 0,
+			                        .bucket = (unsigned int)b};
+			if (srec->value_len == HD_SNAPSHOT_COUNTER) {
+				int64_t counter;
+				memcpy(&counter, hd_snapshot_record_value(srec),
+				       sizeof(counter));
+				rec.counter = counter;
+			} else {
+				rec.value = hd_snapshot_record_value(srec);
+				rec.value_len = srec->value_len;
+			}
+
+			int ret = fn(&rec, ctx);
+			if (ret != 0) {
+				return ret;
+			}
+			offset += hd_snapshot_record_len(srec);
+		}
+	}
+	return 0;
+}
+
+static void
+hd_snapshot_free(struct hd_backend* backend) {
+	struct hd_snapshot* snap = (struct hd_snapshot*)backend;
+
+	munmap((void*)snap->map, snap->size);
+	free(snap);
+}
+
+static const struct hd_backend_ops hd_snapshot_ops = {
+    .lookup = hd_snapshot_lookup,
+    .counter_get = hd_snapshot_counter_get,
+    .foreach = hd_snapshot_foreach,
+    .free = hd_snapshot_free,
+};
+
+int
+hd_snapshot_open(struct hd_hashdict* dict, const char* path) {
+	if ((dict == NULL) || (path == NULL) || (dict->entries != NULL) ||
+	    (dict->backend != NULL)) {
+		return -EINVAL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	/* The header and at least the two offsets of a single bucket.*/
+	if ((uint64_t)st.st_size <
+	    sizeof(struct hd_snapshot_header) + 2 * sizeof(uint64_t)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	/* MAP_SHARED so every process opening the same snapshot uses the same
+	 * page cache pages.*/
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int ret = (map == MAP_FAILED) ? -errno : 0;
+	close(fd);
+	if (ret != 0) {
+		return ret;
+	}
+
+	struct hd_snapshot_header hdr;
+	memcpy(&hdr, map, sizeof(hdr));
+
+	if ((memcmp(hdr.magic, HD_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) ||
+	    (hdr.version != HD_SNAPSHOT_VERSION) ||
+	    (hdr.byte_order != HD_SNAPSHOT_BYTE_ORDER) ||
+	    (hdr.file_size != (uint64_t)st.st_size) || (hdr.num_buckets == 0) ||
+	    (hdr.num_buckets & (hdr.num_buckets - 1)) ||
+	    (hdr.num_entries > UINT_MAX) ||
+	    (hdr.num_buckets > (hdr.file_size - sizeof(hdr)) / sizeof(uint64_t) -
+	                           1)) {
+		munmap(map, st.st_size);
+		return -EINVAL;
+	}
+
+	struct hd_snapshot* snap = malloc(sizeof(*snap));
+	if (snap == NULL) {
+		munmap(map, st.st_size);
+		return -ENOMEM;
+	}
+
+	/* Lookups touch few, scattered pages, readahead would only waste
+	 * memory.*/
+	posix_madvise(map, st.st_size, POSIX_MADV_RANDOM);
+
+	snap->backend.ops = &hd_snapshot_ops;
+	snap->map = map;
+	snap->size = st.st_size;
+	snap->num_buckets = hdr.num_buckets;
+	snap->offsets = (const uint64_t*)(snap->map + sizeof(hdr));
+	snap->records = sizeof(hdr) + (hdr.num_buckets + 1) * sizeof(uint64_t);
+
+	dict->backend = &snap->backend;
+	dict->num_entries = hdr.num_entries;
+	return 0;
+}
+
+struct hd_snapshot_job {
+	pid_t pid;
+	int fd; /**< Read end of the pipe carrying the child's report */
+	unsigned long long pause_ns;
+};
+
+static unsigned long long
+hd_snapshot_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the memory of the calling process that isn't shared with
+ * another process, 0 if /proc isn't available
+ *
+ * Right after fork() all pages are shared, every page copied on write by
+ * either process shows up here afterwards.
+ */
+static unsigned long long
+hd_snapshot_private_bytes(void) {
+	FILE* f = fopen("/proc/self/smaps_rollup", "r");
+	unsigned long long total = 0;
+	char line[128];
+
+	if (f == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long long kb;
+		if (sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+			total += kb * 1024;
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+/**
+ * @brief Body of the child process forked by hd_snapshot_background()
+ */
+static void
+hd_snapshot_child(struct hd_hashdict* dict, const char* path, int fd,
+                  unsigned long long start_ns) {
+	struct hd_snapshot_report report = {0};
+	unsigned long long private_bytes = hd_snapshot_private_bytes();
+
+	report.status = hd_snapshot_write(dict, path);
+	report.duration_ns = hd_snapshot_now_ns() - start_ns;
+
+	unsigned long long end_bytes = hd_snapshot_private_bytes();
+	if (end_bytes > private_bytes) {
+		report.cow_bytes = end_bytes - private_bytes;
+	}
+
+	hd_write_all(fd, &report, sizeof(report));
+	_exit(0);
+}
+
+int
+hd_snapshot_background(struct hd_hashdict* dict, const char* path,
+                       struct hd_snapshot_job** job) {
+	if ((dict == NULL) || (path == NULL) || (job == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_snapshot_job* j = malloc(sizeof(*j));
+	if (j == NULL) {
+		return -ENOMEM;
+	}
+
+	int fds[2];
+	if (pipe(fds) != 0) {
+		int ret = -errno;
+		free(j);
+		return ret;
+	}
+
+	unsigned long long start_ns = hd_snapshot_now_ns();
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		close(fds[0]);
+		hd_snapshot_child(dict, path, fds[1], start_ns);
+	}
+
+	int ret = (pid < 0) ? -errno : 0;
+	close(fds[1]);
+	if (ret != 0) {
+		close(fds[0]);
+		free(j);
+		return ret;
+	}
+
+	j->pid = pid;
+	j->fd = fds[0];
+	j->pause_ns = hd_snapshot_now_ns() - start_ns;
+	*job = j;
+	return 0;
+}
+
+int
+hd_snapshot_wait(struct hd_snapshot_job* job,
+                 struct hd_snapshot_report* report) {
+	if (job == NULL) {
+		return -EINVAL;
+	}
+
+	struct hd_snapshot_report r = {0};
+	ssize_t n = hd_read_full(job->fd, &r, sizeof(r));
+	int ret = 0;
+	int wstatus;
+
+	close(job->fd);
+	while (waitpid(job->pid, &wstatus, 0) < 0) {
+		if (errno != EINTR) {
+			ret = -errno;
+			break;
+		}
+	}
+
+	if ((ret == 0) && (n != sizeof(r))) {
+		/* The child died before it could report, e.g. killed by the OOM
+		 * killer.*/
+		ret = -ECHILD;
+	}
+	if (ret != 0) {
+		r.status = ret;
+	}
+	r.pause_ns = job->pause_ns;
+
+	if (report != NULL) {
+		*report = r;
+	}
+	free(job);
+	return r.status;
+}
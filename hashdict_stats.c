@@ -0,0 +1,239 @@
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif /* __GLIBC__ */
+
+#define HD_HIST_JSON_SIZE 4096 /**< Fits hd_histogram_dump() output */
+
+/**
+ * @brief Adds the bytes of one record of a storage backend
+ */
+static int
+hd_stats_record(const struct hd_record* rec, void* ctx) {
+	struct hd_stats* stats = ctx;
+
+	stats->entries++;
+	stats->key_bytes += rec->key_len + 1;
+	if (rec->value != NULL) {
+		stats->value_bytes += rec->value_len + 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Bytes the allocator reserved for an allocation, 0 if unknown
+ */
+static size_t
+hd_usable_size(void* ptr) {
+#ifdef __GLIBC__
+	return (ptr != NULL) ? malloc_usable_size(ptr) : 0;
+#else /* __GLIBC__ */
+	(void)ptr;
+	return 0;
+#endif /* __GLIBC__ */
+}
+
+/**
+ * @brief Adds the entries of one chain
+ */
+static void
+hd_stats_chain(struct hd_stats* stats, const struct hd_entry* entry) {
+	size_t len = 0;
+
+	if (entry == HD_MOVED) {
+		return;
+	}
+	for (; entry != NULL; entry = entry->next) {
+		len++;
+		stats->key_bytes += strlen(entry->key) + 1;
+		stats->alloc_bytes += hd_usable_size((void*)entry) +
+		                      hd_usable_size(entry->key);
+		if (HD_IS_COUNTER(entry)) {
+			stats->entry_bytes += sizeof(struct hd_counter);
+		} else {
+			stats->entry_bytes += sizeof(struct hd_entry);
+			stats->value_bytes += strlen(entry->value) + 1;
+			stats->alloc_bytes += hd_usable_size(entry->value);
+		}
+	}
+	if (len > 0) {
+		stats->used_buckets++;
+		stats->entries += len;
+	}
+	if (len > stats->max_chain) {
+		stats->max_chain = len;
+	}
+}
+
+int
+hd_get_stats(struct hd_hashdict* dict, struct hd_stats* stats) {
+	if ((dict == NULL) || (stats == NULL)) {
+		return -EINVAL;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (dict->backend != NULL) {
+		hd_read_begin(dict);
+		int ret = hd_foreach_record(dict, hd_stats_record, stats);
+		hd_read_end(dict);
+		if (ret != 0) {
+			return ret;
+		}
+	} else {
+		for (unsigned int i = 0; i < dict->size; i++) {
+			hd_stats_chain(stats, dict->entries[i]);
+		}
+		for (unsigned int i = 0; i < dict->next_size; i++) {
+			hd_stats_chain(stats, dict->next_entries[i]);
+		}
+		stats->buckets = (size_t)dict->size + dict->next_size;
+		stats->bucket_bytes = stats->buckets * sizeof(struct hd_entry*);
+		stats->alloc_bytes += hd_usable_size(dict->entries) +
+		                      hd_usable_size(dict->next_entries);
+		stats->growing = (dict->next_entries != NULL);
+	}
+
+	if (stats->buckets > 0) {
+		stats->load_factor = (double)stats->entries / stats->buckets;
+	}
+	if (stats->used_buckets > 0) {
+		stats->mean_chain = (double)stats->entries / stats->used_buckets;
+	}
+	stats->total_bytes = stats->entry_bytes + stats->key_bytes +
+	                     stats->value_bytes + stats->bucket_bytes;
+
+	stats->counting = dict->count_ops;
+	for (int op = 0; op < HD_NUM_OPS; op++) {
+		stats->ops[op] =
+		    atomic_load_explicit(&dict->op_counts[op], memory_order_relaxed);
+	}
+	return 0;
+}
+
+int
+hd_stats_enable(struct hd_hashdict* dict, int enable) {
+	if (dict == NULL) {
+		return -EINVAL;
+	}
+	dict->count_ops = (enable != 0);
+	return 0;
+}
+
+int
+hd_stats_reset(struct hd_hashdict* dict) {
+	if (dict == NULL) {
+		return -EINVAL;
+	}
+	for (int op = 0; op < HD_NUM_OPS; op++) {
+		atomic_store_explicit(&dict->op_counts[op], 0, memory_order_relaxed);
+	}
+	for (int i = 0; i < HD_HIST_SIZE; i++) {
+		atomic_store_explicit(&dict->probe_counts[0][i], 0,
+		                      memory_order_relaxed);
+		atomic_store_explicit(&dict->probe_counts[1][i], 0,
+		                      memory_order_relaxed);
+	}
+	return 0;
+}
+
+/**
+ * @brief Adds the chains of a bucket array to the histogram
+ */
+static void
+hd_histogram_chains(struct hd_histogram* hist, struct hd_entry** entries,
+                    unsigned int size) {
+	for (unsigned int i = 0; i < size; i++) {
+		size_t len = 0;
+
+		if (entries[i] != HD_MOVED) {
+			for (struct hd_entry* e = entries[i]; e != NULL; e = e->next) {
+				len++;
+			}
+		}
+		hist->chains[(len < HD_HIST_SIZE) ? len : HD_HIST_SIZE - 1]++;
+		hist->entries += len;
+		if (len > hist->max_chain) {
+			hist->max_chain = len;
+		}
+	}
+}
+
+int
+hd_histogram(struct hd_hashdict* dict, struct hd_histogram* hist) {
+	if ((dict == NULL) || (hist == NULL)) {
+		return -EINVAL;
+	}
+
+	memset(hist, 0, sizeof(*hist));
+	hist->sample_every = HD_PROBE_SAMPLE;
+
+	if (dict->backend != NULL) {
+		hist->entries = hd_read_begin(dict);
+		hd_read_end(dict);
+		return 0;
+	}
+
+	/* Buckets already migrated while growing hold the forwarding marker
+	 * and count as empty, which they are for lookups.*/
+	hd_histogram_chains(hist, dict->entries, dict->size);
+	hd_histogram_chains(hist, dict->next_entries, dict->next_size);
+	hist->buckets = (size_t)dict->size + dict->next_size;
+	if (hist->buckets > 0) {
+		hist->load_factor = (double)hist->entries / hist->buckets;
+	}
+
+	for (int i = 0; i < HD_HIST_SIZE; i++) {
+		hist->probes_hit[i] = atomic_load_explicit(&dict->probe_counts[0][i],
+		                                           memory_order_relaxed);
+		hist->probes_miss[i] = atomic_load_explicit(
+		    &dict->probe_counts[1][i], memory_order_relaxed);
+	}
+	return 0;
+}
+
+/**
+ * @brief Appends a JSON array of HD_HIST_SIZE bins to buf
+ */
+static size_t
+hd_histogram_json_bins(char* buf, size_t len, const char* name,
+                       const unsigned long long* bins) {
+	len += snprintf(buf + len, HD_HIST_JSON_SIZE - len, ",\"%s\":[", name);
+	for (int i = 0; i < HD_HIST_SIZE; i++) {
+		len += snprintf(buf + len, HD_HIST_JSON_SIZE - len, "%s%llu",
+		                (i > 0) ? "," : "", bins[i]);
+	}
+	len += snprintf(buf + len, HD_HIST_JSON_SIZE - len, "]");
+	return len;
+}
+
+int
+hd_histogram_dump(const struct hd_histogram* hist, int fd) {
+	if ((hist == NULL) || (fd < 0)) {
+		return -EINVAL;
+	}
+
+	char buf[HD_HIST_JSON_SIZE];
+	unsigned long long chains[HD_HIST_SIZE];
+	size_t len;
+
+	for (int i = 0; i < HD_HIST_SIZE; i++) {
+		chains[i] = hist->chains[i];
+	}
+
+	len = snprintf(buf, sizeof(buf),
+	               "{\"entries\":%zu,\"buckets\":%zu,\"load_factor\":%.6f,"
+	               "\"max_chain\":%zu,\"sample_every\":%u",
+	               hist->entries, hist->buckets, hist->load_factor,
+	               hist->max_chain, hist->sample_every);
+	len = hd_histogram_json_bins(buf, len, "chains", chains);
+	len = hd_histogram_json_bins(buf, len, "probes_hit", hist->probes_hit);
+	len = hd_histogram_json_bins(buf, len, "probes_miss", hist->probes_miss);
+	len += snprintf(buf + len, sizeof(buf) - len, "}\n");
+
+	return hd_write_all(fd, buf, len);
+}
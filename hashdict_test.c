@@ -0,0 +1,495 @@
+/**
+ * @file hashdict_test.c
+ * @brief Round trip and corruption tests of the storage formats
+ *
+ * Every test writes a dictionary to a file in a temporary directory, reads
+ * it back and compares, then damages the file and checks that reading it
+ * fails cleanly instead of crashing or returning garbage. Frozen
+ * dictionaries are checked the same way in memory, incremental resizing
+ * against a reference set. Run by ctest, one test per format.
+ *
+ * Usage: hashdict_test <dump|snapshot|wal|frozen|resize>
+ *
+ * Copyright (c) 2025 Karsten Weikamp. All rights reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Number of string entries, every fourth key also gets a counter
+#define NUM_ENTRIES 5000
+
+#define CHECK(cond)                                                            \
+	do {                                                                       \
+		if (!(cond)) {                                                         \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,   \
+			        #cond);                                                    \
+			return 1;                                                          \
+		}                                                                      \
+	} while (0)
+
+static char tmp_dir[] = "/tmp/hashdict_test.XXXXXX";
+
+#define PATH_SIZE (sizeof(tmp_dir) + 32)
+
+/**
+ * @brief Writes the path of file name in the temporary directory to path
+ */
+static void
+tmp_path(char* path, const char* name) {
+	snprintf(path, PATH_SIZE, "%s/%s", tmp_dir, name);
+}
+
+/**
+ * @brief Fills dict with NUM_ENTRIES strings and a counter for every fourth
+ */
+static int
+fill(struct hd_hashdict* dict) {
+	char key[32];
+	char value[64];
+
+	for (int i = 0; i < NUM_ENTRIES; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		snprintf(value, sizeof(value), "value%d-%0*d", i, i % 40, 0);
+		CHECK(hd_entry_insert(dict, key, value) == 0);
+		if (i % 4 == 0) {
+			snprintf(key, sizeof(key), "counter%d", i);
+			CHECK(hd_add(dict, key, -i, NULL) == 0);
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Checks that dict holds exactly what fill() inserted
+ */
+static int
+verify(struct hd_hashdict* dict) {
+	char key[32];
+	char value[64];
+	long long counter;
+
+	CHECK(dict->num_entries == NUM_ENTRIES + (NUM_ENTRIES + 3) / 4);
+	for (int i = 0; i < NUM_ENTRIES; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		snprintf(value, sizeof(value), "value%d-%0*d", i, i % 40, 0);
+		const char* found = hd_lookup(dict, key);
+		CHECK((found != NULL) && (strcmp(found, value) == 0));
+		if (i % 4 == 0) {
+			snprintf(key, sizeof(key), "counter%d", i);
+			CHECK(hd_counter_get(dict, key, &counter) == 0);
+			CHECK(counter == -i);
+		}
+	}
+	CHECK(hd_lookup(dict, "missing") == NULL);
+	return 0;
+}
+
+static off_t
+file_size(const char* path) {
+	struct stat st;
+	return (stat(path, &st) == 0) ? st.st_size : -1;
+}
+
+/**
+ * @brief Flips every bit of the byte at offset
+ */
+static int
+flip_byte(const char* path, off_t offset) {
+	int fd = open(path, O_RDWR);
+	unsigned char byte;
+
+	CHECK(fd >= 0);
+	CHECK(pread(fd, &byte, 1, offset) == 1);
+	byte = ~byte;
+	CHECK(pwrite(fd, &byte, 1, offset) == 1);
+	close(fd);
+	return 0;
+}
+
+/**
+ * @brief hd_dump()/hd_load() and hd_dump_file()/hd_load_file() round trips
+ */
+static int
+test_dump(void) {
+	struct hd_hashdict dict = hd_create();
+	char path[PATH_SIZE];
+
+	tmp_path(path, "stream.dump");
+
+	CHECK(fill(&dict) == 0);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	CHECK(fd >= 0);
+	CHECK(hd_dump(&dict, fd) == 0);
+	close(fd);
+
+	struct hd_hashdict loaded = hd_create();
+	fd = open(path, O_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(hd_load(&loaded, fd) == 0);
+	close(fd);
+	CHECK(verify(&loaded) == 0);
+	hd_free(&loaded);
+
+	/* A damaged block fails its checksum and nothing is kept.*/
+	CHECK(flip_byte(path, file_size(path) / 2) == 0);
+	fd = open(path, O_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(hd_load(&loaded, fd) == -EBADMSG);
+	close(fd);
+	CHECK(loaded.num_entries == 0);
+
+	/* Compressed blocks, loaded sequentially and in parallel.*/
+	struct hd_io_config config = {.compress = 1};
+	tmp_path(path, "compressed.dump");
+	CHECK(hd_dump_file(&dict, path, &config) == 0);
+	for (unsigned int threads = 1; threads <= 4; threads += 3) {
+		config.threads = threads;
+		CHECK(hd_load_file(&loaded, path, &config) == 0);
+		CHECK(verify(&loaded) == 0);
+		hd_free(&loaded);
+	}
+
+	/* A truncated file is rejected as well.*/
+	CHECK(truncate(path, file_size(path) - 7) == 0);
+	CHECK(hd_load_file(&loaded, path, NULL) == -EBADMSG);
+	CHECK(loaded.num_entries == 0);
+
+	hd_free(&dict);
+	return 0;
+}
+
+/**
+ * @brief Header of a snapshot file, as written by hd_snapshot_write()
+ */
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t num_entries;
+	uint64_t num_buckets;
+	uint64_t file_size;
+	uint64_t offsets[2];
+};
+
+/**
+ * @brief hd_snapshot_write()/hd_snapshot_open() and damaged snapshots
+ */
+static int
+test_snapshot(void) {
+	struct hd_hashdict dict = hd_create();
+	char path[PATH_SIZE];
+
+	tmp_path(path, "dict.snap");
+
+	CHECK(fill(&dict) == 0);
+	CHECK(hd_snapshot_write(&dict, path) == 0);
+	hd_free(&dict);
+
+	CHECK(hd_snapshot_open(&dict, path) == 0);
+	CHECK(verify(&dict) == 0);
+	CHECK(hd_entry_insert(&dict, "new", "value") == -EROFS);
+	hd_free(&dict);
+
+	/* The size in the header no longer matches.*/
+	off_t size = file_size(path);
+	CHECK(truncate(path, size - 8) == 0);
+	CHECK(hd_snapshot_open(&dict, path) == -EINVAL);
+
+	/* Records overwritten with garbage, lookups must fail but not crash.*/
+	CHECK(truncate(path, size) == 0);
+	for (off_t offset = size / 2; offset < size; offset += 5) {
+		CHECK(flip_byte(path, offset) == 0);
+	}
+	CHECK(hd_snapshot_open(&dict, path) == 0);
+	for (int i = 0; i < NUM_ENTRIES; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "key%d", i);
+		(void)hd_lookup(&dict, key);
+	}
+	hd_free(&dict);
+
+	/* Headers claiming more buckets than the file holds.*/
+	struct snapshot_header hdr;
+	int fd = open(path, O_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(read(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+	close(fd);
+
+	const size_t lens[] = {sizeof(hdr) - sizeof(hdr.offsets), sizeof(hdr)};
+	tmp_path(path, "crafted.snap");
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		hdr.num_buckets = 1ULL << 40;
+		hdr.file_size = lens[i];
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		CHECK(fd >= 0);
+		CHECK(write(fd, &hdr, lens[i]) == (ssize_t)lens[i]);
+		close(fd);
+		CHECK(hd_snapshot_open(&dict, path) == -EINVAL);
+	}
+
+	/* A single bucket pointing outside the records.*/
+	hdr.num_buckets = 1;
+	hdr.file_size = sizeof(hdr);
+	hdr.offsets[0] = 0;
+	hdr.offsets[1] = sizeof(hdr);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	CHECK(fd >= 0);
+	CHECK(write(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+	close(fd);
+	CHECK(hd_snapshot_open(&dict, path) == 0);
+	CHECK(hd_lookup(&dict, "key0") == NULL);
+	hd_free(&dict);
+	return 0;
+}
+
+/**
+ * @brief Write-ahead log replay, torn tails and appending after them
+ */
+static int
+test_wal(void) {
+	struct hd_hashdict dict = hd_create();
+	struct hd_wal_config config = {.sync = HD_WAL_SYNC_ALWAYS,
+	                               .commit_window_ns = 0};
+	char wal[PATH_SIZE];
+	char dump[PATH_SIZE];
+	char key[32];
+
+	tmp_path(wal, "dict.wal");
+	tmp_path(dump, "checkpoint.dump");
+
+	/* Writes undone again must replay to the same result.*/
+	CHECK(hd_wal_open(&dict, wal, &config) == 0);
+	CHECK(fill(&dict) == 0);
+	for (int i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "extra%d", i);
+		CHECK(hd_entry_insert(&dict, key, "x") == 0);
+		CHECK(hd_entry_update(&dict, key, "y") == 0);
+		CHECK(hd_entry_remove(&dict, key) == 0);
+	}
+	CHECK(hd_add(&dict, "counter0", 5, NULL) == 0);
+	CHECK(hd_add(&dict, "counter0", -5, NULL) == 0);
+	CHECK(hd_wal_close(&dict) == 0);
+	hd_free(&dict);
+
+	CHECK(hd_recover(&dict, NULL, wal) == 0);
+	CHECK(verify(&dict) == 0);
+
+	/* A record torn by a crash ends the log.*/
+	off_t complete = file_size(wal);
+	CHECK(hd_wal_open(&dict, wal, &config) == 0);
+	CHECK(hd_entry_insert(&dict, "torn", "value") == 0);
+	CHECK(hd_wal_close(&dict) == 0);
+	hd_free(&dict);
+	CHECK(file_size(wal) > complete + 3);
+	CHECK(truncate(wal, file_size(wal) - 3) == 0);
+
+	CHECK(hd_recover(&dict, NULL, wal) == 0);
+	CHECK(verify(&dict) == 0);
+	CHECK(hd_lookup(&dict, "torn") == NULL);
+
+	/* Reopening cuts the torn tail off before appending.*/
+	CHECK(hd_wal_open(&dict, wal, &config) == 0);
+	CHECK(file_size(wal) == complete);
+	CHECK(hd_entry_insert(&dict, "after", "value") == 0);
+	CHECK(hd_wal_close(&dict) == 0);
+	hd_free(&dict);
+
+	CHECK(hd_recover(&dict, NULL, wal) == 0);
+	CHECK(hd_lookup(&dict, "torn") == NULL);
+	CHECK((hd_lookup(&dict, "after") != NULL) &&
+	      (strcmp(hd_lookup(&dict, "after"), "value") == 0));
+	CHECK(hd_entry_remove(&dict, "after") == 0);
+	CHECK(verify(&dict) == 0);
+	hd_free(&dict);
+
+	/* A checkpoint empties the log, recovery reads the dump first.*/
+	CHECK(fill(&dict) == 0);
+	CHECK(hd_wal_open(&dict, wal, &config) == 0);
+	CHECK(hd_wal_checkpoint(&dict, dump) == 0);
+	CHECK(hd_entry_insert(&dict, "after", "value") == 0);
+	CHECK(hd_wal_close(&dict) == 0);
+	hd_free(&dict);
+
+	CHECK(hd_recover(&dict, dump, wal) == 0);
+	CHECK(hd_entry_remove(&dict, "after") == 0);
+	CHECK(verify(&dict) == 0);
+	hd_free(&dict);
+	return 0;
+}
+
+/**
+ * @brief hd_freeze() keeps every entry and rejects keys it never saw
+ */
+static int
+test_frozen(void) {
+	struct hd_hashdict dict = hd_create();
+	char key[32];
+
+	char path[PATH_SIZE];
+
+	CHECK(fill(&dict) == 0);
+	CHECK(hd_freeze(&dict) == 0);
+	CHECK(verify(&dict) == 0);
+	CHECK(hd_entry_insert(&dict, "new", "value") == -EROFS);
+
+	/* Writing a snapshot visits every record in slot order.*/
+	tmp_path(path, "frozen.snap");
+	CHECK(hd_snapshot_write(&dict, path) == 0);
+	hd_free(&dict);
+	CHECK(hd_snapshot_open(&dict, path) == 0);
+	CHECK(verify(&dict) == 0);
+	hd_free(&dict);
+
+	/* Absent keys land on arbitrary positions, including the few no key
+	 * took, so both need to be large enough to hit those.*/
+	for (int i = 0; i < 20 * NUM_ENTRIES; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(hd_entry_insert(&dict, key, "value") == 0);
+	}
+	CHECK(hd_freeze(&dict) == 0);
+	for (int i = 0; i < 200 * NUM_ENTRIES; i++) {
+		long long counter;
+		snprintf(key, sizeof(key), "absent%d", i);
+		CHECK(hd_lookup(&dict, key) == NULL);
+		CHECK(hd_counter_get(&dict, key, &counter) == -EINVAL);
+	}
+	hd_free(&dict);
+
+	CHECK(hd_freeze(&dict) == 0);
+	CHECK(hd_lookup(&dict, "key0") == NULL);
+	hd_free(&dict);
+	return 0;
+}
+
+/**
+ * @brief Random inserts, removes, updates and lookups across several
+ * growths agree with a reference set
+ *
+ * Versions of the keys key0 to key(4 NUM_ENTRIES - 1) are kept on the side,
+ * 0 for absent keys. Inserts win more often than removes, so the table
+ * doubles several times and many operations run while buckets are still
+ * being migrated.
+ */
+static int
+test_resize(void) {
+	static unsigned int versions[4 * NUM_ENTRIES];
+	struct hd_hashdict dict = hd_create();
+	uint64_t state = 1;
+	unsigned int present = 0;
+	unsigned int growths = 0;
+	unsigned int migrating = 0;
+	char key[32];
+	char value[32];
+
+	for (int n = 0; n < 100 * NUM_ENTRIES; n++) {
+		/* xorshift64, fixed seed so failures repeat.*/
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		unsigned int i = (state >> 8) % (4 * NUM_ENTRIES);
+		unsigned int op = (state >> 40) % 8;
+		unsigned int size = dict.size;
+
+		snprintf(key, sizeof(key), "key%u", i);
+		if (op < 3) {
+			if (versions[i] == 0) {
+				snprintf(value, sizeof(value), "%u.1", i);
+				CHECK(hd_entry_insert(&dict, key, value) == 0);
+				versions[i] = 1;
+				present++;
+			}
+		} else if (op < 5) {
+			CHECK(hd_entry_remove(&dict, key) ==
+			      ((versions[i] != 0) ? 0 : -EINVAL));
+			present -= (versions[i] != 0);
+			versions[i] = 0;
+		} else if (op < 6) {
+			snprintf(value, sizeof(value), "%u.%u", i, versions[i] + 1);
+			CHECK(hd_entry_update(&dict, key, value) ==
+			      ((versions[i] != 0) ? 0 : -EINVAL));
+			versions[i] += (versions[i] != 0);
+		} else {
+			const char* found = hd_lookup(&dict, key);
+			if (versions[i] == 0) {
+				CHECK(found == NULL);
+			} else {
+				snprintf(value, sizeof(value), "%u.%u", i, versions[i]);
+				CHECK((found != NULL) && (strcmp(found, value) == 0));
+			}
+		}
+
+		CHECK(dict.num_entries == present);
+		growths += (size != 0) && (dict.size > size);
+		migrating += (dict.next_entries != NULL);
+	}
+	CHECK(growths >= 3);
+	CHECK(migrating > 0);
+
+	for (unsigned int i = 0; i < 4 * NUM_ENTRIES; i++) {
+		const char* found;
+		snprintf(key, sizeof(key), "key%u", i);
+		found = hd_lookup(&dict, key);
+		if (versions[i] == 0) {
+			CHECK(found == NULL);
+		} else {
+			snprintf(value, sizeof(value), "%u.%u", i, versions[i]);
+			CHECK((found != NULL) && (strcmp(found, value) == 0));
+		}
+	}
+	hd_free(&dict);
+	return 0;
+}
+
+static const struct {
+	const char* name;
+	int (*run)(void);
+} tests[] = {
+    {"dump", test_dump},
+    {"snapshot", test_snapshot},
+    {"wal", test_wal},
+    {"frozen", test_frozen},
+    {"resize", test_resize},
+};
+
+int
+main(int argc, char** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <test>\n", argv[0]);
+		return 2;
+	}
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (strcmp(argv[1], tests[i].name) != 0) {
+			continue;
+		}
+		if (mkdtemp(tmp_dir) == NULL) {
+			perror("mkdtemp");
+			return 1;
+		}
+
+		int result = tests[i].run();
+
+		char cmd[sizeof(tmp_dir) + 16];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp_dir);
+		if (system(cmd) != 0) {
+			fprintf(stderr, "Could not remove %s\n", tmp_dir);
+		}
+		return result;
+	}
+
+	fprintf(stderr, "Unknown test %s\n", argv[1]);
+	return 2;
+}
@@ -0,0 +1,844 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashdict_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Log layout, all integers little endian:
+ *
+ *   header:  magic[8], u32 version, u32 crc32c of the preceding 12 bytes
+ *   records: u32 body_len, u32 crc32c of body, body
+ *
+ * A body is u8 op, u64 seq, varint key_len, key, '\0' followed by
+ * varint value_len, value, '\0' for HD_WAL_SET or a zigzag varint for
+ * HD_WAL_COUNTER. Records are only ever appended, so a crash can at most
+ * leave one torn record at the end, which then fails its checksum.
+ */
+
+#define HD_WAL_MAGIC "HDWAL\0\0"
+#define HD_WAL_VERSION 1
+#define HD_WAL_HEADER_SIZE 16
+#define HD_WAL_BUFFER_SIZE (64 * 1024) /**< Default buffer_size */
+#define HD_WAL_COMMIT_WINDOW_NS 10000000ULL /**< Default window, 10 ms */
+#define HD_WAL_READ_SIZE (1024 * 1024) /**< Read size while replaying */
+
+struct hd_wal {
+	int fd;
+	struct hd_wal_config config;
+	pthread_mutex_t lock; /**< Protects everything below */
+	pthread_cond_t wake; /**< Wakes the flusher before its window ends */
+	pthread_cond_t drained; /**< Broadcast when the flusher took or wrote a
+	                           buffer */
+	pthread_t flusher;
+	struct hd_uring* ring; /**< Submits writes and syncs, or NULL */
+	int has_flusher; /**< Group commit runs in flusher */
+	int stop; /**< Tells the flusher to exit */
+	int flushing; /**< The flusher is writing the former buffer */
+	unsigned char* buf; /**< Records not yet written */
+	size_t len;
+	size_t cap;
+	unsigned char* spare; /**< Swapped with buf by the flusher */
+	size_t spare_cap;
+	uint64_t seq; /**< Sequence number of the last record */
+	int unsynced; /**< Records were written since the last fsync */
+	_Atomic int error; /**< First failed write, stops logging */
+};
+
+/**
+ * @brief Encodes the body of rec at body
+ *
+ * @return size_t Length of the body
+ */
+static size_t
+hd_wal_encode_body(unsigned char* body, const struct hd_wal_record* rec) {
+	unsigned char* p = body;
+
+	*p++ = (unsigned char)rec->op;
+	hd_put_le64(p, rec->seq);
+	p += 8;
+	p = hd_put_varint(p, rec->key_len);
+	memcpy(p, rec->key, rec->key_len);
+	p += rec->key_len;
+	*p++ = '\0';
+
+	if (rec->op == HD_WAL_SET) {
+		p = hd_put_varint(p, rec->value_len);
+		memcpy(p, rec->value, rec->value_len);
+		p += rec->value_len;
+		*p++ = '\0';
+	} else if (rec->op == HD_WAL_COUNTER) {
+		uint64_t v = rec->counter;
+		p = hd_put_varint(p, (v << 1) ^ (uint64_t)(rec->counter >> 63));
+	}
+	return p - body;
+}
+
+size_t
+hd_wal_encode(unsigned char* buf, const struct hd_wal_record* rec) {
+	unsigned char* body = buf + HD_WAL_RECORD_HEADER_SIZE;
+	size_t body_len = hd_wal_encode_body(body, rec);
+
+	hd_put_le32(buf, (uint32_t)body_len);
+	hd_put_le32(buf + 4, hd_crc32c(0, body, body_len));
+	return HD_WAL_RECORD_HEADER_SIZE + body_len;
+}
+
+ssize_t
+hd_wal_decode(const unsigned char* buf, size_t len,
+              struct hd_wal_record* rec) {
+	if (len < HD_WAL_RECORD_HEADER_SIZE) {
+		return 0;
+	}
+
+	uint32_t body_len = hd_get_le32(buf);
+	if (body_len > HD_WAL_MAX_BODY) {
+		return -EBADMSG;
+	}
+	if (len - HD_WAL_RECORD_HEADER_SIZE < body_len) {
+		return 0;
+	}
+
+	const unsigned char* p = buf + HD_WAL_RECORD_HEADER_SIZE;
+	const unsigned char* end = p + body_len;
+
+	if ((body_len < 9) ||
+	    (hd_get_le32(buf + 4) != hd_crc32c(0, p, body_len))) {
+		return -EBADMSG;
+	}
+
+	rec->op = *p++;
+	rec->seq = hd_get_le64(p);
+	p += 8;
+
+	uint64_t v;
+	p = hd_get_varint(p, end, &v);
+	if ((p == NULL) || (v >= (uint64_t)(end - p)) || p[v]) {
+		return -EBADMSG;
+	}
+	rec->key = (const char*)p;
+	rec->key_len = v;
+	p += v + 1;
+
+	rec->value = NULL;
+	rec->value_len = 0;
+	rec->counter = 0;
+
+	switch (rec->op) {
+		case HD_WAL_SET:
+			p = hd_get_varint(p, end, &v);
+			if ((p == NULL) || (v >= (uint64_t)(end - p)) || p[v]) {
+				return -EBADMSG;
+			}
+			rec->value = (const char*)p;
+			rec->value_len = v;
+			p += v + 1;
+			break;
+		case HD_WAL_COUNTER:
+			p = hd_get_varint(p, end, &v);
+			if (p == NULL) {
+				return -EBADMSG;
+			}
+			rec->counter = (long long)(v >> 1) ^ -(long long)(v & 1);
+			break;
+		case HD_WAL_REMOVE:
+			break;
+		default:
+			return -EBADMSG;
+	}
+
+	if (p != end) {
+		return -EBADMSG;
+	}
+	return HD_WAL_RECORD_HEADER_SIZE + body_len;
+}
+
+int
+hd_wal_apply(struct hd_hashdict* dict, const struct hd_wal_record* rec) {
+	long long current;
+	int is_counter = (hd_counter_get(dict, rec->key, &current) == 0);
+	int ret;
+
+	switch (rec->op) {
+		case HD_WAL_SET:
+			if (hd_lookup(dict, rec->key) != NULL) {
+				return hd_entry_update(dict, rec->key, rec->value);
+			}
+			if (is_counter) {
+				hd_entry_remove(dict, rec->key);
+			}
+			return hd_entry_insert(dict, rec->key, rec->value);
+		case HD_WAL_REMOVE:
+			ret = hd_entry_remove(dict, rec->key);
+			return (ret == -EINVAL) ? 0 : ret;
+		case HD_WAL_COUNTER:
+			if (is_counter) {
+				/* Computed unsigned, counters wrap like the additions that
+				 * produced them.*/
+				return hd_add(dict, rec->key,
+				              (long long)((unsigned long long)rec->counter -
+				                          (unsigned long long)current),
+				              NULL);
+			}
+			if (hd_lookup(dict, rec->key) != NULL) {
+				hd_entry_remove(dict, rec->key);
+			}
+			return hd_add(dict, rec->key, rec->counter, NULL);
+	}
+	return -EBADMSG;
+}
+
+/**
+ * @brief Reads the log at fd from the start, applying records to dict
+ *
+ * Stops at the first record that is torn or fails its checksum.
+ *
+ * @param dict Dictionary to apply the records to, or NULL to only scan
+ * @param valid_end Receives the offset after the last intact record, 0 if
+ * the file is empty or holds a torn header
+ * @param last_seq Receives the sequence number of the last intact record
+ */
+static int
+hd_wal_scan(int fd, struct hd_hashdict* dict, off_t* valid_end,
+            uint64_t* last_seq) {
+	unsigned char hdr[HD_WAL_HEADER_SIZE];
+
+	*valid_end = 0;
+	*last_seq = 0;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		return -errno;
+	}
+
+	ssize_t n = hd_read_full(fd, hdr, sizeof(hdr));
+	if (n < 0) {
+		return n;
+	}
+	if (n < (ssize_t)sizeof(hdr)) {
+		/* Creating the log was interrupted before its header was
+		 * complete.*/
+		return memcmp(hdr, HD_WAL_MAGIC, (n < 8) ? n : 8) ? -EBADMSG : 0;
+	}
+	if (memcmp(hdr, HD_WAL_MAGIC, 8) ||
+	    (hd_get_le32(hdr + 12) != hd_crc32c(0, hdr, 12))) {
+		return -EBADMSG;
+	}
+	if (hd_get_le32(hdr + 8) != HD_WAL_VERSION) {
+		return -ENOTSUP;
+	}
+
+	size_t cap = HD_WAL_READ_SIZE;
+	unsigned char* buf = malloc(cap);
+	size_t len = 0;
+	size_t pos = 0;
+	off_t offset = HD_WAL_HEADER_SIZE;
+	int eof = 0;
+	int ret = 0;
+
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+
+	for (;;) {
+		struct hd_wal_record rec;
+		ssize_t size = hd_wal_decode(buf + pos, len - pos, &rec);
+
+		if (size < 0) {
+			break;
+		}
+
+		if (size > 0) {
+			if ((dict != NULL) && ((ret = hd_wal_apply(dict, &rec)) != 0)) {
+				break;
+			}
+			*last_seq = rec.seq;
+			pos += size;
+			offset += size;
+			continue;
+		}
+
+		if (eof) {
+			break;
+		}
+
+		/* Move the partial record to the front and read more, growing the
+		 * buffer if the record doesn't fit.*/
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+		pos = 0;
+
+		size_t needed = len + HD_WAL_READ_SIZE;
+		if (len >= HD_WAL_RECORD_HEADER_SIZE) {
+			size_t record = HD_WAL_RECORD_HEADER_SIZE + hd_get_le32(buf);
+			if (record > needed) {
+				needed = record;
+			}
+		}
+		if (needed > cap) {
+			unsigned char* grown = realloc(buf, needed);
+			if (grown == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+			buf = grown;
+			cap = needed;
+		}
+
+		n = hd_read_full(fd, buf + len, cap - len);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		eof = ((size_t)n < cap - len);
+		len += n;
+	}
+
+	free(buf);
+	*valid_end = offset;
+	return ret;
+}
+
+/**
+ * @brief Waits until the flusher is done writing its buffer
+ *
+ * Called with wal->lock held, before writing to the file from any other
+ * thread, so records stay in order.
+ */
+static void
+hd_wal_wait_flusher(struct hd_wal* wal) {
+	while (wal->flushing) {
+		pthread_cond_wait(&wal->drained, &wal->lock);
+	}
+}
+
+static void
+hd_wal_set_error(struct hd_wal* wal, int ret) {
+	if ((ret != 0) && (wal->error == 0)) {
+		wal->error = ret;
+	}
+}
+
+/**
+ * @brief Writes the buffered records, then forces them to disk if sync is
+ * set
+ *
+ * Called with wal->lock held. The first failure is kept in wal->error.
+ */
+static int
+hd_wal_commit(struct hd_wal* wal, int sync) {
+	int ret = 0;
+
+	hd_wal_wait_flusher(wal);
+
+	if ((wal->len > 0) && (wal->ring != NULL)) {
+		ret = hd_uring_append(wal->ring, wal->fd, wal->buf, wal->len, sync);
+		wal->len = 0;
+		wal->unsynced = !sync;
+	} else if (wal->len > 0) {
+		ret = hd_write_all(wal->fd, wal->buf, wal->len);
+		wal->len = 0;
+		wal->unsynced = 1;
+	}
+	if ((ret == 0) && sync && wal->unsynced) {
+		if (fdatasync(wal->fd) != 0) {
+			ret = -errno;
+		} else {
+			wal->unsynced = 0;
+		}
+	}
+
+	hd_wal_set_error(wal, ret);
+	return ret;
+}
+
+/**
+ * @brief Background thread committing the buffer once per window
+ *
+ * The filled buffer is swapped with an empty one under the lock and written
+ * outside of it, so writers keep appending while the flusher waits for the
+ * disk. Writers only wake the flusher early when the buffer is full.
+ */
+static void*
+hd_wal_flusher(void* arg) {
+	struct hd_wal* wal = arg;
+	int sync = (wal->config.sync == HD_WAL_SYNC_GROUP);
+
+	pthread_mutex_lock(&wal->lock);
+	while (!wal->stop) {
+		if ((wal->len < wal->config.buffer_size) || (wal->error != 0)) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			unsigned long long ns =
+			    deadline.tv_nsec + wal->config.commit_window_ns;
+			deadline.tv_sec += ns / 1000000000ULL;
+			deadline.tv_nsec = ns % 1000000000ULL;
+			pthread_cond_timedwait(&wal->wake, &wal->lock, &deadline);
+		}
+		if ((wal->len == 0) || (wal->error != 0)) {
+			continue;
+		}
+
+		unsigned char* buf = wal->buf;
+		size_t len = wal->len;
+		size_t cap = wal->cap;
+
+		wal->buf = wal->spare;
+		wal->cap = wal->spare_cap;
+		wal->len = 0;
+		wal->flushing = 1;
+		pthread_cond_broadcast(&wal->drained);
+		pthread_mutex_unlock(&wal->lock);
+
+		int ret;
+		if (wal->ring != NULL) {
+			ret = hd_uring_append(wal->ring, wal->fd, buf, len, sync);
+		} else {
+			ret = hd_write_all(wal->fd, buf, len);
+			if ((ret == 0) && sync && (fdatasync(wal->fd) != 0)) {
+				ret = -errno;
+			}
+		}
+
+		pthread_mutex_lock(&wal->lock);
+		wal->spare = buf;
+		wal->spare_cap = cap;
+		wal->unsynced = !sync;
+		wal->flushing = 0;
+		hd_wal_set_error(wal, ret);
+		pthread_cond_broadcast(&wal->drained);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return NULL;
+}
+
+/**
+ * @brief Makes room for needed more bytes in the buffer, called with
+ * wal->lock held
+ */
+static int
+hd_wal_reserve(struct hd_wal* wal, size_t needed) {
+	int ret;
+
+	while (((ret = wal->error) == 0) && (wal->len + needed > wal->cap)) {
+		if (wal->len == 0) {
+			/* Only records larger than the whole buffer get here.*/
+			unsigned char* grown = realloc(wal->buf, needed);
+			if (grown == NULL) {
+				return -ENOMEM;
+			}
+			wal->buf = grown;
+			wal->cap = needed;
+		} else if (wal->has_flusher) {
+			/* The disk can't keep up, wait for the flusher to take the
+			 * buffer instead of growing it without bounds.*/
+			pthread_cond_signal(&wal->wake);
+			pthread_cond_wait(&wal->drained, &wal->lock);
+		} else if ((ret = hd_wal_commit(wal, 0)) != 0) {
+			return ret;
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Commits or schedules the records just buffered, called with
+ * wal->lock held
+ */
+static int
+hd_wal_appended(struct hd_wal* wal) {
+	if (!wal->has_flusher) {
+		return hd_wal_commit(wal, wal->config.sync != HD_WAL_SYNC_NONE);
+	}
+	if (wal->len >= wal->config.buffer_size) {
+		pthread_cond_signal(&wal->wake);
+	}
+	return 0;
+}
+
+/**
+ * @brief Buffers rec as the next record, called with wal->lock held
+ */
+static int
+hd_wal_append(struct hd_wal* wal, struct hd_wal_record* rec) {
+	int ret =
+	    hd_wal_reserve(wal, hd_wal_record_size(rec->key_len, rec->value_len));
+	if (ret != 0) {
+		return ret;
+	}
+
+	rec->seq = ++wal->seq;
+	wal->len += hd_wal_encode(wal->buf + wal->len, rec);
+	return hd_wal_appended(wal);
+}
+
+/**
+ * @brief Per-thread buffer records are encoded into before taking the lock
+ */
+struct hd_wal_scratch {
+	size_t cap;
+	unsigned char buf[];
+};
+
+static pthread_key_t hd_wal_scratch_key;
+static pthread_once_t hd_wal_scratch_once = PTHREAD_ONCE_INIT;
+static int hd_wal_scratch_ok;
+
+static void
+hd_wal_scratch_init(void) {
+	hd_wal_scratch_ok = (pthread_key_create(&hd_wal_scratch_key, free) == 0);
+}
+
+/**
+ * @brief Returns the calling thread's scratch buffer of at least size
+ * bytes, or NULL if it can't be allocated
+ */
+static struct hd_wal_scratch*
+hd_wal_scratch_get(size_t size) {
+	pthread_once(&hd_wal_scratch_once, hd_wal_scratch_init);
+	if (!hd_wal_scratch_ok) {
+		return NULL;
+	}
+
+	struct hd_wal_scratch* scratch = pthread_getspecific(hd_wal_scratch_key);
+	if ((scratch != NULL) && (scratch->cap >= size)) {
+		return scratch;
+	}
+
+	size_t cap = (scratch != NULL) ? 2 * scratch->cap : 256;
+	if (cap < size) {
+		cap = size;
+	}
+	struct hd_wal_scratch* grown = realloc(scratch, sizeof(*grown) + cap);
+	if (grown == NULL) {
+		return NULL;
+	}
+	grown->cap = cap;
+	if (pthread_setspecific(hd_wal_scratch_key, grown) != 0) {
+		free(grown);
+		return NULL;
+	}
+	return grown;
+}
+
+int
+hd_wal_error(struct hd_wal* wal) {
+	return atomic_load_explicit(&wal->error, memory_order_relaxed);
+}
+
+int
+hd_wal_log(struct hd_wal* wal, enum hd_wal_op op, const char* key,
+           const char* value, long long counter) {
+	struct hd_wal_record rec = {.op = op,
+	                            .key = key,
+	                            .key_len = strlen(key),
+	                            .value = value,
+	                            .value_len = value ? strlen(value) : 0,
+	                            .counter = counter};
+	int ret;
+
+	struct hd_wal_scratch* scratch =
+	    hd_wal_scratch_get(hd_wal_record_size(rec.key_len, rec.value_len));
+	if (scratch == NULL) {
+		pthread_mutex_lock(&wal->lock);
+		ret = hd_wal_append(wal, &rec);
+		pthread_mutex_unlock(&wal->lock);
+		return ret;
+	}
+
+	/* Encode and checksum everything but the sequence number before taking
+	 * the lock, under it only the op and sequence number are checksummed
+	 * and the record is copied into the buffer.*/
+	unsigned char* body = scratch->buf + HD_WAL_RECORD_HEADER_SIZE;
+	size_t body_len = hd_wal_encode_body(body, &rec);
+	size_t tail_len = body_len - 1 - 8;
+	uint32_t tail_crc = hd_crc32c(0, body + 1 + 8, tail_len);
+	uint32_t shift = hd_crc32c_shift(tail_len);
+	size_t len = HD_WAL_RECORD_HEADER_SIZE + body_len;
+
+	hd_put_le32(scratch->buf, (uint32_t)body_len);
+
+	pthread_mutex_lock(&wal->lock);
+	ret = hd_wal_reserve(wal, len);
+	if (ret == 0) {
+		hd_put_le64(body + 1, ++wal->seq);
+		hd_put_le32(scratch->buf + 4,
+		            hd_crc32c_combine(hd_crc32c(0, body, 1 + 8), tail_crc,
+		                              shift));
+		memcpy(wal->buf + wal->len, scratch->buf, len);
+		wal->len += len;
+		ret = hd_wal_appended(wal);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return ret;
+}
+
+int
+hd_wal_log_add(struct hd_wal* wal, struct hd_counter* counter,
+               long long delta, long long* value) {
+	pthread_mutex_lock(&wal->lock);
+
+	*value = atomic_fetch_add_explicit(&counter->value, delta,
+	                                   memory_order_relaxed) +
+	         delta;
+
+	struct hd_wal_record rec = {.op = HD_WAL_COUNTER,
+	                            .key = counter->entry.key,
+	                            .key_len = strlen(counter->entry.key),
+	                            .counter = *value};
+	int ret = hd_wal_append(wal, &rec);
+
+	pthread_mutex_unlock(&wal->lock);
+	return ret;
+}
+
+int
+hd_wal_open(struct hd_hashdict* dict, const char* path,
+            const struct hd_wal_config* config) {
+	if ((dict == NULL) || (path == NULL) || (dict->wal != NULL) ||
+	    (dict->backend != NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_wal* wal = calloc(1, sizeof(*wal));
+	if (wal == NULL) {
+		return -ENOMEM;
+	}
+
+	if (config != NULL) {
+		wal->config = *config;
+	} else {
+		wal->config.sync = HD_WAL_SYNC_GROUP;
+		wal->config.commit_window_ns = HD_WAL_COMMIT_WINDOW_NS;
+	}
+	if (wal->config.buffer_size == 0) {
+		wal->config.buffer_size = HD_WAL_BUFFER_SIZE;
+	}
+
+	wal->cap = wal->config.buffer_size;
+	wal->spare_cap = wal->config.buffer_size;
+	wal->buf = malloc(wal->cap);
+	wal->spare = malloc(wal->spare_cap);
+	if ((wal->buf == NULL) || (wal->spare == NULL)) {
+		free(wal->buf);
+		free(wal->spare);
+		free(wal);
+		return -ENOMEM;
+	}
+
+	int ret = 0;
+	wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (wal->fd < 0) {
+		ret = -errno;
+		goto err_open;
+	}
+
+	off_t valid_end;
+	ret = hd_wal_scan(wal->fd, NULL, &valid_end, &wal->seq);
+	if (ret != 0) {
+		goto err_scan;
+	}
+
+	off_t file_size = lseek(wal->fd, 0, SEEK_END);
+	if (file_size < 0) {
+		ret = -errno;
+		goto err_scan;
+	}
+
+	if (valid_end == 0) {
+		unsigned char hdr[HD_WAL_HEADER_SIZE] = {0};
+		memcpy(hdr, HD_WAL_MAGIC, 8);
+		hd_put_le32(hdr + 8, HD_WAL_VERSION);
+		hd_put_le32(hdr + 12, hd_crc32c(0, hdr, 12));
+
+		if ((ftruncate(wal->fd, 0) != 0) || (fsync(wal->fd) != 0)) {
+			ret = -errno;
+			goto err_scan;
+		}
+		ret = hd_write_all(wal->fd, hdr, sizeof(hdr));
+		if ((ret == 0) && (fsync(wal->fd) != 0)) {
+			ret = -errno;
+		}
+	} else if (valid_end < file_size) {
+		/* Cut off the torn record a crash left behind, or records
+		 * appended after it would never be replayed.*/
+		if ((ftruncate(wal->fd, valid_end) != 0) ||
+		    (fsync(wal->fd) != 0)) {
+			ret = -errno;
+		}
+	}
+	if (ret != 0) {
+		goto err_scan;
+	}
+
+	/* One write linked with one fsync is all the log ever has in flight.*/
+	if (!wal->config.io.no_uring && (hd_uring_create(&wal->ring, 2) != 0)) {
+		wal->ring = NULL;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->wake, &attr);
+	pthread_cond_init(&wal->drained, NULL);
+	pthread_condattr_destroy(&attr);
+
+	if ((wal->config.sync != HD_WAL_SYNC_ALWAYS) &&
+	    (wal->config.commit_window_ns > 0)) {
+		ret = -pthread_create(&wal->flusher, NULL, hd_wal_flusher, wal);
+		if (ret != 0) {
+			goto err_thread;
+		}
+		wal->has_flusher = 1;
+	}
+
+	dict->wal = wal;
+	return 0;
+
+err_thread:
+	hd_uring_free(wal->ring);
+	pthread_cond_destroy(&wal->drained);
+	pthread_cond_destroy(&wal->wake);
+	pthread_mutex_destroy(&wal->lock);
+err_scan:
+	close(wal->fd);
+err_open:
+	free(wal->buf);
+	free(wal->spare);
+	free(wal);
+	return ret;
+}
+
+int
+hd_wal_sync(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->wal == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_wal* wal = dict->wal;
+
+	pthread_mutex_lock(&wal->lock);
+	int ret = wal->error;
+	if (ret == 0) {
+		ret = hd_wal_commit(wal, 1);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return ret;
+}
+
+int
+hd_wal_close(struct hd_hashdict* dict) {
+	if ((dict == NULL) || (dict->wal == NULL)) {
+		return -EINVAL;
+	}
+
+	struct hd_wal* wal = dict->wal;
+
+	if (wal->has_flusher) {
+		pthread_mutex_lock(&wal->lock);
+		wal->stop = 1;
+		pthread_cond_signal(&wal->wake);
+		pthread_mutex_unlock(&wal->lock);
+		pthread_join(wal->flusher, NULL);
+	}
+
+	int ret = hd_wal_sync(dict);
+
+	if ((close(wal->fd) != 0) && (ret == 0)) {
+		ret = -errno;
+	}
+	hd_uring_free(wal->ring);
+	pthread_cond_destroy(&wal->drained);
+	pthread_cond_destroy(&wal->wake);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal->buf);
+	free(wal->spare);
+	free(wal);
+	dict->wal = NULL;
+	return ret;
+}
+
+int
+hd_wal_checkpoint(struct hd_hashdict* dict, const char* dump_path) {
+	if ((dict == NULL) || (dump_path == NULL) || (dict->wal == NULL)) {
+		return -EINVAL;
+	}
+
+	int ret = hd_dump_file(dict, dump_path, &dict->wal->config.io);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* Everything logged so far, buffered or not, is part of the dump now.
+	 * This also clears a previous write error, as no change is missing
+	 * anymore.*/
+	struct hd_wal* wal = dict->wal;
+
+	pthread_mutex_lock(&wal->lock);
+	hd_wal_wait_flusher(wal);
+	wal->len = 0;
+	wal->unsynced = 0;
+	if ((ftruncate(wal->fd, HD_WAL_HEADER_SIZE) != 0) ||
+	    (fdatasync(wal->fd) != 0)) {
+		ret = -errno;
+		wal->error = ret;
+	} else {
+		wal->error = 0;
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return ret;
+}
+
+int
+hd_wal_replay(struct hd_hashdict* dict, const char* path) {
+	if ((dict == NULL) || (path == NULL) || (dict->wal != NULL)) {
+		return -EINVAL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	off_t valid_end;
+	uint64_t last_seq;
+	int ret = hd_wal_scan(fd, dict, &valid_end, &last_seq);
+
+	close(fd);
+	return ret;
+}
+
+int
+hd_recover(struct hd_hashdict* dict, const char* dump_path,
+           const char* wal_path) {
+	if ((dict == NULL) || (dict->num_entries != 0) ||
+	    (dict->backend != NULL) || (dict->wal != NULL)) {
+		return -EINVAL;
+	}
+
+	int ret = 0;
+
+	if (dump_path != NULL) {
+		ret = hd_load_file(dict, dump_path, NULL);
+		if (ret == -ENOENT) {
+			ret = 0;
+		}
+	}
+
+	if ((ret == 0) && (wal_path != NULL)) {
+		ret = hd_wal_replay(dict, wal_path);
+		if (ret == -ENOENT) {
+			ret = 0;
+		}
+		if (ret != 0) {
+			hd_free_parallel(dict, 1);
+		}
+	}
+	return ret;
+}